@@ -0,0 +1,453 @@
+/*
+Built-in storage backends for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+#include "backend.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+#ifndef O_FSYNC
+#define O_FSYNC 0
+#endif
+
+static const struct _BACKEND_TYPE
+{
+    const char *name;
+    dllopen_proc open;
+} backend_types[] = {
+    { "stripe", stripe_open },
+    { "mirror", mirror_open },
+    { "erasure", erasure_open },
+    { "overlay", overlay_open },
+    { "null", null_open },
+    { "pattern", pattern_open },
+    { "model", model_open },
+};
+
+dllopen_proc
+backend_find(const char *spec)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(backend_types) / sizeof(*backend_types); i++)
+    {
+        size_t len = strlen(backend_types[i].name);
+
+        if (_strnicmp(spec, backend_types[i].name, len) == 0 &&
+            (spec[len] == ':' || spec[len] == ','))
+            return backend_types[i].open;
+    }
+
+    return NULL;
+}
+
+int
+backend_open(PDEVIO_BACKEND backend, const char *spec, int read_only)
+{
+    dllopen_proc open_proc = backend_find(spec);
+
+    if (open_proc == NULL)
+        open_proc = file_open;
+
+    backend->size = 0;
+
+    backend->handle = open_proc(spec, read_only, &backend->read,
+        &backend->write, &backend->close, &backend->size);
+
+    if (backend->handle == NULL || backend->handle == (void*)-1)
+    {
+        backend->handle = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+backend_close(PDEVIO_BACKEND backend)
+{
+    int rc = 0;
+
+    if (backend->handle != NULL)
+        rc = backend->close(backend->handle);
+
+    backend->handle = NULL;
+
+    return rc;
+}
+
+int
+backend_open_members(const char *list, int read_only,
+    PDEVIO_BACKEND members, int max_members)
+{
+    size_t delimiter_length = strlen(MULTI_CONTAINER_DELIMITER);
+    char *list_copy = _strdup(list);
+    char *member = list_copy;
+    int count = 0;
+
+    if (list_copy == NULL)
+        return 0;
+
+    while (member != NULL)
+    {
+        char *next = strstr(member, MULTI_CONTAINER_DELIMITER);
+
+        if (next != NULL)
+        {
+            *next = 0;
+            next += delimiter_length;
+        }
+
+        if (count >= max_members)
+        {
+            fprintf(stderr, "Too many members, max %i supported.\n",
+                max_members);
+
+            backend_close_members(members, count);
+            free(list_copy);
+            return 0;
+        }
+
+        if (!backend_open(members + count, member, read_only))
+        {
+            fprintf(stderr, "Failed to open member '%s': %s\n",
+                member, strerror(errno));
+
+            backend_close_members(members, count);
+            free(list_copy);
+            return 0;
+        }
+
+        ++count;
+
+        member = next;
+    }
+
+    free(list_copy);
+
+    return count;
+}
+
+void
+backend_close_members(PDEVIO_BACKEND members, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        backend_close(members + i);
+}
+
+const char *
+backend_parameters(const char *spec, char *options, size_t options_size)
+{
+    const char *params = strchr(spec, ':');
+    const char *opts = strchr(spec, ',');
+
+    if (params == NULL)
+        params = spec + strlen(spec);
+
+    if (options_size > 0)
+        *options = 0;
+
+    if (opts != NULL && opts < params && options_size > 0)
+    {
+        size_t len = params - opts - 1;
+
+        if (len >= options_size)
+            len = options_size - 1;
+
+        memcpy(options, opts + 1, len);
+        options[len] = 0;
+    }
+
+    if (*params == ':')
+        ++params;
+
+    return params;
+}
+
+int
+backend_get_option(const char *options, const char *name,
+    char *value, size_t value_size)
+{
+    size_t name_length = strlen(name);
+    const char *opt = options;
+
+    while (opt != NULL && *opt != 0)
+    {
+        const char *next = strchr(opt, ',');
+        size_t opt_length = next != NULL ? (size_t)(next - opt) : strlen(opt);
+
+        if (opt_length >= name_length &&
+            _strnicmp(opt, name, name_length) == 0 &&
+            (opt_length == name_length || opt[name_length] == '='))
+        {
+            size_t len = 0;
+
+            if (opt_length > name_length)
+                len = opt_length - name_length - 1;
+
+            if (value_size > 0)
+            {
+                if (len >= value_size)
+                    len = value_size - 1;
+
+                memcpy(value, opt + opt_length - len, len);
+                value[len] = 0;
+            }
+
+            return 1;
+        }
+
+        opt = next != NULL ? next + 1 : NULL;
+    }
+
+    return 0;
+}
+
+int
+backend_parse_size(const char *str, off_t_64 *size)
+{
+    uint64_t value = 0;
+    const char *suf;
+    int n = 0;
+
+    if (sscanf(str, ULL_FMT "%n", &value, &n) != 1)
+        return 0;
+
+    suf = str + n;
+
+    switch (*suf)
+    {
+    case 'T':
+        value <<= 10;
+    case 'G':
+        value <<= 10;
+    case 'M':
+        value <<= 10;
+    case 'K':
+        value <<= 10;
+    case 'B':
+        ++suf;
+        break;
+    case 't':
+        value *= 1000;
+    case 'g':
+        value *= 1000;
+    case 'm':
+        value *= 1000;
+    case 'k':
+        value *= 1000;
+    case 'b':
+        ++suf;
+        break;
+    }
+
+    if (*suf != 0)
+        return 0;
+
+    *size = (off_t_64)value;
+
+    return 1;
+}
+
+int
+backend_clip_range(off_t_64 offset, safeio_size_t *size, off_t_64 image_size)
+{
+    if (offset < 0 || offset > image_size)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if ((off_t_64)*size > image_size - offset)
+        *size = (safeio_size_t)(image_size - offset);
+
+    return 1;
+}
+
+uint64_t
+backend_time_usec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+uint64_t
+backend_time_nsec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000000 /
+        frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Plain image file or device, used for members of combined backends.
+// Short transfers are continued until the whole size is done, end of file
+// is reached or an error occurs.
+
+safeio_ssize_t __cdecl
+file_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t sizedone = 0;
+
+    while (sizedone < size)
+    {
+        safeio_ssize_t readdone = pread(*(int*)handle,
+            (char*)buf + sizedone, size - sizedone,
+            offset + (off_t_64)sizedone);
+
+        if (readdone == -1)
+            return -1;
+
+        if (readdone == 0)
+            break;
+
+        sizedone += (safeio_size_t)readdone;
+    }
+
+    return (safeio_ssize_t)sizedone;
+}
+
+safeio_ssize_t __cdecl
+file_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t sizedone = 0;
+
+    while (sizedone < size)
+    {
+        safeio_ssize_t writedone = pwrite(*(int*)handle,
+            (char*)buf + sizedone, size - sizedone,
+            offset + (off_t_64)sizedone);
+
+        if (writedone == -1)
+            return -1;
+
+        if (writedone == 0)
+            break;
+
+        sizedone += (safeio_size_t)writedone;
+    }
+
+    return (safeio_ssize_t)sizedone;
+}
+
+int __cdecl
+file_close(void *handle)
+{
+    int rc = _close(*(int*)handle);
+
+    free(handle);
+
+    return rc;
+}
+
+void * __cdecl
+file_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    int *handle = (int*)malloc(sizeof(int));
+
+    if (handle == NULL)
+        return NULL;
+
+    if (read_only)
+        *handle = _open(file, O_BINARY | O_DIRECT | O_FSYNC | O_RDONLY);
+    else
+        *handle = _open(file, O_BINARY | O_DIRECT | O_FSYNC | O_RDWR);
+
+    if (*handle == -1)
+    {
+        free(handle);
+        return NULL;
+    }
+
+    *dllread = file_read;
+    *dllwrite = file_write;
+    *dllclose = file_close;
+
+    if (size != NULL)
+    {
+        off_t_64 file_size = _lseeki64(*handle, 0, SEEK_END);
+
+        if (file_size != -1)
+            *size = file_size;
+    }
+
+    return handle;
+}
@@ -0,0 +1,115 @@
+/*
+Built-in storage backends for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_BACKEND_
+#define _INC_BACKEND_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Built-in backends implement the same interface as custom DLL files,
+    // see dllopen_proc in devio.h. They are selected by a prefix in the
+    // diskdev parameter:
+    //
+    // type[,option=value[,option=value...]]:parameters
+    //
+    // Backends that combine several images, such as stripe sets, take a
+    // list of member specifications separated by MULTI_CONTAINER_DELIMITER
+    // as parameters. Each member can be an image file, a device or another
+    // built-in backend.
+
+#define DEVIO_MAX_MEMBERS       64
+
+    typedef struct _DEVIO_BACKEND
+    {
+        void *handle;
+        dllread_proc read;
+        dllwrite_proc write;
+        dllclose_proc close;
+        off_t_64 size;
+    } DEVIO_BACKEND, *PDEVIO_BACKEND;
+
+    // Returns open procedure for built-in backend selected by prefix of
+    // spec, or NULL if spec does not name a built-in backend.
+    dllopen_proc backend_find(const char *spec);
+
+    // Opens a built-in backend, or an image file or device if spec does not
+    // name a built-in backend. Returns zero on failure.
+    int backend_open(PDEVIO_BACKEND backend, const char *spec, int read_only);
+
+    int backend_close(PDEVIO_BACKEND backend);
+
+    // Opens each member in a MULTI_CONTAINER_DELIMITER separated list.
+    // Returns number of opened members, or zero on failure in which case
+    // any members already opened are closed again.
+    int backend_open_members(const char *list, int read_only,
+        PDEVIO_BACKEND members, int max_members);
+
+    void backend_close_members(PDEVIO_BACKEND members, int count);
+
+    // Splits "type,options:parameters". Copies options part, if any, to
+    // options buffer and returns pointer to parameters part within spec.
+    const char *backend_parameters(const char *spec, char *options,
+        size_t options_size);
+
+    // Finds name=value in a comma separated option string. Returns zero if
+    // not found. A name without value yields an empty string.
+    int backend_get_option(const char *options, const char *name,
+        char *value, size_t value_size);
+
+    // Parses a number with optional K/M/G/T (powers of 1024) or k/m/g/t
+    // (powers of 1000) suffix. Returns zero on syntax error.
+    int backend_parse_size(const char *str, off_t_64 *size);
+
+    // Checks that a request at offset starts within an image of image_size
+    // bytes, and limits size to end of image. Returns zero with errno set
+    // to EINVAL for negative offsets and offsets beyond end of image, which
+    // backends must not turn into member, block or bitmap indexes.
+    int backend_clip_range(off_t_64 offset, safeio_size_t *size,
+        off_t_64 image_size);
+
+    // Monotonic clock in microseconds, for latency measurements.
+    uint64_t backend_time_usec();
+
+    // Same clock in nanoseconds, as used by metrics and trace.
+    uint64_t backend_time_nsec();
+
+    dllopen_decl file_open;
+    dllopen_decl stripe_open;
+    dllopen_decl mirror_open;
+    dllopen_decl erasure_open;
+    dllopen_decl overlay_open;
+    dllopen_decl null_open;
+    dllopen_decl pattern_open;
+    dllopen_decl model_open;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_BACKEND_
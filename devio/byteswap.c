@@ -0,0 +1,249 @@
+/*
+Byte-swap routines for images stored with swapped 16-bit words.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "devio_types.h"
+#include "cpufeature.h"
+#include "byteswap.h"
+
+static void
+byteswap16_tail(uint8_t *ptr, safeio_size_t size)
+{
+    uint8_t *end = ptr + (size & ~(safeio_size_t)1);
+
+    for (; ptr < end; ptr += 2)
+    {
+        uint8_t b1 = ptr[1];
+        ptr[1] = ptr[0];
+        ptr[0] = b1;
+    }
+}
+
+// Portable version, swaps four words at a time in a 64-bit register.
+static void __cdecl
+byteswap16_generic(void *buffer, safeio_size_t size)
+{
+    uint8_t *ptr = (uint8_t*)buffer;
+    uint8_t *end = ptr + (size & ~(safeio_size_t)7);
+
+    for (; ptr < end; ptr += 8)
+    {
+        uint64_t w;
+
+        memcpy(&w, ptr, sizeof(w));
+        w = ((w & 0x00FF00FF00FF00FFULL) << 8) |
+            ((w >> 8) & 0x00FF00FF00FF00FFULL);
+        memcpy(ptr, &w, sizeof(w));
+    }
+
+    byteswap16_tail(ptr, size & 7);
+}
+
+#ifdef CPU_X86
+
+static CPU_TARGET("ssse3") void __cdecl
+byteswap16_ssse3(void *buffer, safeio_size_t size)
+{
+    const __m128i mask = _mm_set_epi8(
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+
+    uint8_t *ptr = (uint8_t*)buffer;
+    uint8_t *end = ptr + (size & ~(safeio_size_t)63);
+
+    for (; ptr < end; ptr += 64)
+    {
+        __m128i v0 = _mm_loadu_si128((__m128i*)ptr);
+        __m128i v1 = _mm_loadu_si128((__m128i*)(ptr + 16));
+        __m128i v2 = _mm_loadu_si128((__m128i*)(ptr + 32));
+        __m128i v3 = _mm_loadu_si128((__m128i*)(ptr + 48));
+
+        _mm_storeu_si128((__m128i*)ptr, _mm_shuffle_epi8(v0, mask));
+        _mm_storeu_si128((__m128i*)(ptr + 16), _mm_shuffle_epi8(v1, mask));
+        _mm_storeu_si128((__m128i*)(ptr + 32), _mm_shuffle_epi8(v2, mask));
+        _mm_storeu_si128((__m128i*)(ptr + 48), _mm_shuffle_epi8(v3, mask));
+    }
+
+    end = ptr + ((size & 63) & ~(safeio_size_t)15);
+
+    for (; ptr < end; ptr += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)ptr);
+
+        _mm_storeu_si128((__m128i*)ptr, _mm_shuffle_epi8(v, mask));
+    }
+
+    byteswap16_generic(ptr, size & 15);
+}
+
+#ifdef CPU_AVX2
+
+static CPU_TARGET("avx2") void __cdecl
+byteswap16_avx2(void *buffer, safeio_size_t size)
+{
+    const __m256i mask = _mm256_set_epi8(
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+
+    uint8_t *ptr = (uint8_t*)buffer;
+    uint8_t *end = ptr + (size & ~(safeio_size_t)127);
+
+    for (; ptr < end; ptr += 128)
+    {
+        __m256i v0 = _mm256_loadu_si256((__m256i*)ptr);
+        __m256i v1 = _mm256_loadu_si256((__m256i*)(ptr + 32));
+        __m256i v2 = _mm256_loadu_si256((__m256i*)(ptr + 64));
+        __m256i v3 = _mm256_loadu_si256((__m256i*)(ptr + 96));
+
+        _mm256_storeu_si256((__m256i*)ptr, _mm256_shuffle_epi8(v0, mask));
+        _mm256_storeu_si256((__m256i*)(ptr + 32), _mm256_shuffle_epi8(v1, mask));
+        _mm256_storeu_si256((__m256i*)(ptr + 64), _mm256_shuffle_epi8(v2, mask));
+        _mm256_storeu_si256((__m256i*)(ptr + 96), _mm256_shuffle_epi8(v3, mask));
+    }
+
+    end = ptr + ((size & 127) & ~(safeio_size_t)31);
+
+    for (; ptr < end; ptr += 32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*)ptr);
+
+        _mm256_storeu_si256((__m256i*)ptr, _mm256_shuffle_epi8(v, mask));
+    }
+
+    _mm256_zeroupper();
+
+    byteswap16_generic(ptr, size & 31);
+}
+
+#endif
+
+#endif
+
+#ifdef CPU_NEON
+
+static void __cdecl
+byteswap16_neon(void *buffer, safeio_size_t size)
+{
+    uint8_t *ptr = (uint8_t*)buffer;
+    uint8_t *end = ptr + (size & ~(safeio_size_t)63);
+
+    for (; ptr < end; ptr += 64)
+    {
+        uint8x16_t v0 = vld1q_u8(ptr);
+        uint8x16_t v1 = vld1q_u8(ptr + 16);
+        uint8x16_t v2 = vld1q_u8(ptr + 32);
+        uint8x16_t v3 = vld1q_u8(ptr + 48);
+
+        vst1q_u8(ptr, vrev16q_u8(v0));
+        vst1q_u8(ptr + 16, vrev16q_u8(v1));
+        vst1q_u8(ptr + 32, vrev16q_u8(v2));
+        vst1q_u8(ptr + 48, vrev16q_u8(v3));
+    }
+
+    end = ptr + ((size & 63) & ~(safeio_size_t)15);
+
+    for (; ptr < end; ptr += 16)
+    {
+        vst1q_u8(ptr, vrev16q_u8(vld1q_u8(ptr)));
+    }
+
+    byteswap16_generic(ptr, size & 15);
+}
+
+#endif
+
+static int
+cpu_has_always()
+{
+    return 1;
+}
+
+// Ordered from slowest to fastest
+static const struct _BYTESWAP16_IMPL
+{
+    const char *name;
+    byteswap16_proc proc;
+    int(*supported)();
+} byteswap16_impls[] = {
+    { "generic", byteswap16_generic, cpu_has_always },
+#ifdef CPU_X86
+    { "ssse3", byteswap16_ssse3, cpu_has_ssse3 },
+#ifdef CPU_AVX2
+    { "avx2", byteswap16_avx2, cpu_has_avx2 },
+#endif
+#endif
+#ifdef CPU_NEON
+    { "neon", byteswap16_neon, cpu_has_always },
+#endif
+};
+
+int
+byteswap16_get_impl(int index, const char **name, byteswap16_proc *proc)
+{
+    size_t i;
+
+    for (i = 0;
+        i < sizeof(byteswap16_impls) / sizeof(*byteswap16_impls);
+        i++)
+    {
+        if (!byteswap16_impls[i].supported())
+            continue;
+
+        if (index-- == 0)
+        {
+            *name = byteswap16_impls[i].name;
+            *proc = byteswap16_impls[i].proc;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void __cdecl
+byteswap16_resolve(void *buffer, safeio_size_t size)
+{
+    byteswap16_proc best = byteswap16_generic;
+    byteswap16_proc proc;
+    const char *name;
+    int i;
+
+    for (i = 0; byteswap16_get_impl(i, &name, &proc); i++)
+        best = proc;
+
+    byteswap16_buffer = best;
+
+    best(buffer, size);
+}
+
+byteswap16_proc byteswap16_buffer = byteswap16_resolve;
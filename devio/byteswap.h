@@ -0,0 +1,52 @@
+/*
+Byte-swap routines for images stored with swapped 16-bit words.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_BYTESWAP_
+#define _INC_BYTESWAP_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef void (__cdecl byteswap16_decl)(void *buffer, safeio_size_t size);
+
+    typedef byteswap16_decl *byteswap16_proc;
+
+    // Swaps bytes in each 16-bit word of buffer. A trailing odd byte is left
+    // untouched. Points to the fastest implementation supported by the
+    // processor, selected on first call.
+    extern byteswap16_proc byteswap16_buffer;
+
+    // Enumerates implementations supported by the current processor, for
+    // benchmarking and diagnostics. Returns zero when index is out of range.
+    int byteswap16_get_impl(int index, const char **name, byteswap16_proc *proc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_BYTESWAP_
@@ -0,0 +1,696 @@
+/*
+Changed block tracking for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+#include "backend.h"
+#include "cbt.h"
+
+#define DEF_BLOCK_SIZE          (64 << 10)
+
+#define CBT_MAGIC               "DEVIOCBT"
+#define CBT_VERSION             1
+#define CBT_MAP_OFFSET          4096
+
+// --cbt[=trackfile][,block=blocksize][,port=controlport]
+//
+// The tracking file holds a generation number for each block of the image,
+// the generation in which the block was last changed by a write, zero or
+// unmap request. Zero means not changed since tracking started. A backup
+// starts a new generation and then reads the image. Next backup lists
+// blocks changed in that generation or later, and reads only those.
+//
+// Before a block is first changed in a generation, its new generation
+// number is written and flushed to the tracking file. A crash may leave a
+// block marked as changed without the change itself reaching the image,
+// but never the other way round.
+//
+// With port=controlport, IMDPROXY_REQ_CHANGED_BLOCKS requests are also
+// served on that tcp port, one connection at a time. devio serves a single
+// client on its main connection, so this is how backups list changes and
+// start generations while a driver holds the image.
+//
+// Tracking file layout:
+//
+// 0                    CBT_HEADER
+// CBT_MAP_OFFSET       32 bit generation number for each block
+
+#pragma pack(push, 1)
+typedef struct _CBT_HEADER
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t image_size;
+    uint64_t generation;
+} CBT_HEADER, *PCBT_HEADER;
+#pragma pack(pop)
+
+int cbt_enabled = 0;
+
+static int cbt_fd = -1;
+static CBT_HEADER header;
+static off_t_64 base_offset;
+static off_t_64 block_size;
+static off_t_64 blocks;
+static uint32_t *map = NULL;
+
+#ifdef _WIN32
+
+#define cbt_lock()
+#define cbt_unlock()
+
+#else
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SOCKET control_sd = INVALID_SOCKET;
+static SOCKET control_client = INVALID_SOCKET;
+static pthread_t control_thread;
+static int control_running = 0;
+static int closing = 0;
+
+#define cbt_lock()              pthread_mutex_lock(&lock)
+#define cbt_unlock()            pthread_mutex_unlock(&lock)
+
+#endif
+
+static int
+cbt_sync()
+{
+#ifdef _WIN32
+    return FlushFileBuffers((HANDLE)_get_osfhandle(cbt_fd)) ? 0 : -1;
+#else
+    return fsync(cbt_fd);
+#endif
+}
+
+static int
+save_header()
+{
+    if (pwrite(cbt_fd, &header, sizeof(header), 0) !=
+        (safeio_ssize_t)sizeof(header) || cbt_sync() != 0)
+        return errno != 0 ? errno : EIO;
+
+    return 0;
+}
+
+int
+cbt_mark(off_t_64 offset, off_t_64 size)
+{
+    uint32_t generation;
+    off_t_64 first;
+    off_t_64 last;
+    safeio_size_t len;
+
+    if (size <= 0)
+        return 1;
+
+    offset -= base_offset;
+
+    cbt_lock();
+
+    generation = (uint32_t)header.generation;
+
+    first = offset / block_size;
+    last = (offset + size - 1) / block_size;
+
+    if (first < 0)
+        first = 0;
+
+    if (last >= blocks)
+        last = blocks - 1;
+
+    // Usually, blocks are already marked in current generation
+    while (first <= last && map[first] == generation)
+        ++first;
+
+    while (last >= first && map[last] == generation)
+        --last;
+
+    if (first > last)
+    {
+        cbt_unlock();
+        return 1;
+    }
+
+    len = (safeio_size_t)((last - first + 1) * sizeof(uint32_t));
+
+    for (offset = first; offset <= last; offset++)
+        map[offset] = generation;
+
+    if (pwrite(cbt_fd, map + first, len,
+        CBT_MAP_OFFSET + first * (off_t_64)sizeof(uint32_t)) !=
+        (safeio_ssize_t)len || cbt_sync() != 0)
+    {
+        fprintf(stderr, "Error saving changed block tracking data: %s\n",
+            strerror(errno));
+
+        // Changes cannot be tracked, fail request rather than losing track
+        if (errno == 0)
+            errno = EIO;
+
+        cbt_unlock();
+        return 0;
+    }
+
+    cbt_unlock();
+
+    return 1;
+}
+
+uint64_t
+cbt_generation()
+{
+    uint64_t generation;
+
+    cbt_lock();
+    generation = header.generation;
+    cbt_unlock();
+
+    return generation;
+}
+
+int
+cbt_new_generation(uint64_t *generation)
+{
+    int rc;
+
+    cbt_lock();
+
+    if (header.generation >= 0xFFFFFFFF)
+    {
+        cbt_unlock();
+        return ENOSPC;
+    }
+
+    ++header.generation;
+
+    rc = save_header();
+
+    if (rc != 0)
+        --header.generation;
+    else
+        *generation = header.generation;
+
+    cbt_unlock();
+
+    return rc;
+}
+
+int
+cbt_list(uint64_t generation, off_t_64 *offset, off_t_64 end,
+    uint64_t *extents, int max_extents)
+{
+    off_t_64 image_size = (off_t_64)header.image_size;
+    off_t_64 block = *offset / block_size;
+    int count = 0;
+
+    if (end > image_size)
+        end = image_size;
+
+    cbt_lock();
+
+    for (; block * block_size < end; block++)
+    {
+        off_t_64 start;
+        off_t_64 stop;
+
+        if (map[block] < generation)
+            continue;
+
+        start = block * block_size;
+        if (start < *offset)
+            start = *offset;
+
+        while (block + 1 < blocks && (block + 1) * block_size < end &&
+            map[block + 1] >= generation)
+            ++block;
+
+        stop = (block + 1) * block_size;
+        if (stop > end)
+            stop = end;
+
+        if (count == max_extents)
+        {
+            cbt_unlock();
+            *offset = start;
+            return count;
+        }
+
+        extents[count * 2] = (uint64_t)start;
+        extents[count * 2 + 1] = (uint64_t)(stop - start);
+        ++count;
+    }
+
+    cbt_unlock();
+
+    *offset = end > *offset ? end : *offset;
+
+    return count;
+}
+
+int
+cbt_control(PIMDPROXY_CBT_REQ req, PIMDPROXY_CBT_RESP resp,
+    uint64_t *extents, int max_extents)
+{
+    int count = 0;
+
+    switch (req->operation_code)
+    {
+    case CbtQuery:
+    {
+        off_t_64 offset = (off_t_64)req->offset;
+        off_t_64 end = req->length == 0 ?
+            (off_t_64)header.image_size :
+            (off_t_64)(req->offset + req->length);
+
+        count = cbt_list(req->generation, &offset, end, extents,
+            max_extents);
+
+        resp->next_offset = (ULONGLONG)offset;
+        resp->length = count * sizeof(IMDPROXY_CBT_EXTENT);
+        break;
+    }
+
+    case CbtNewGeneration:
+        resp->errorno = cbt_new_generation(&req->generation);
+
+        if (resp->errorno == 0)
+            printf("Started changed block tracking generation " ULL_FMT
+                ".\n", req->generation);
+        break;
+
+    default:
+        resp->errorno = EINVAL;
+    }
+
+    resp->generation = cbt_generation();
+
+    return count;
+}
+
+#ifndef _WIN32
+
+static void
+control_serve(SOCKET sd)
+{
+    uint64_t extents[512];
+
+    for (;;)
+    {
+        ULONGLONG req;
+
+        if (!safe_read(sd, &req, sizeof(req)) || req == IMDPROXY_REQ_CLOSE)
+            break;
+
+        if (req == IMDPROXY_REQ_INFO)
+        {
+            IMDPROXY_INFO_RESP info;
+
+            info.file_size = header.image_size;
+            info.req_alignment = 1;
+            info.flags = IMDPROXY_FLAG_RO | IMDPROXY_FLAG_SUPPORTS_CBT;
+
+            if (!safe_write(sd, &info, sizeof(info)))
+                break;
+        }
+        else if (req == IMDPROXY_REQ_CHANGED_BLOCKS)
+        {
+            IMDPROXY_CBT_REQ req_block;
+            IMDPROXY_CBT_RESP resp_block = { 0 };
+            int count;
+
+            if (!safe_read(sd, &req_block.operation_code,
+                sizeof(req_block) - sizeof(req_block.request_code)))
+                break;
+
+            count = cbt_control(&req_block, &resp_block, extents,
+                (int)(sizeof(extents) / sizeof(*extents) / 2));
+
+            if (!safe_write(sd, &resp_block, sizeof(resp_block)) ||
+                (count > 0 && !safe_write(sd, extents,
+                    (safeio_size_t)resp_block.length)))
+                break;
+        }
+        else
+        {
+            ULONGLONG resp = ENODEV;
+
+            if (!safe_write(sd, &resp, sizeof(resp)))
+                break;
+        }
+    }
+}
+
+static void *
+cbt_control_thread(void *arg)
+{
+    for (;;)
+    {
+        struct sockaddr_in saddr;
+        socklen_t len = sizeof(saddr);
+        SOCKET sd = accept(control_sd, (struct sockaddr*)&saddr, &len);
+        int i;
+
+        if (sd == INVALID_SOCKET)
+        {
+            if (closing)
+                break;
+
+            continue;
+        }
+
+        // Lets cbt_close() interrupt the connection
+        cbt_lock();
+
+        if (closing)
+        {
+            cbt_unlock();
+            closesocket(sd);
+            break;
+        }
+
+        control_client = sd;
+
+        cbt_unlock();
+
+        printf("Changed block tracking: Connection from %s:%u.\n",
+            inet_ntoa(saddr.sin_addr), (unsigned int)ntohs(saddr.sin_port));
+
+        i = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (const char*)&i, sizeof i);
+
+        control_serve(sd);
+
+        cbt_lock();
+        control_client = INVALID_SOCKET;
+        cbt_unlock();
+
+        closesocket(sd);
+
+        printf("Changed block tracking: Connection closed.\n");
+    }
+
+    return NULL;
+}
+
+static int
+control_start(u_short port)
+{
+    struct sockaddr_in saddr = { 0 };
+    int reuse = 1;
+
+    control_sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (control_sd == INVALID_SOCKET)
+    {
+        fprintf(stderr, "Changed block tracking: socket() failed: %s\n",
+            strerror(errno));
+        return 0;
+    }
+
+    setsockopt(control_sd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse,
+        sizeof reuse);
+
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    saddr.sin_port = htons(port);
+
+    if (bind(control_sd, (struct sockaddr*)&saddr, sizeof saddr) == -1 ||
+        listen(control_sd, 1) == -1)
+    {
+        fprintf(stderr, "Changed block tracking: Cannot listen on port %u: "
+            "%s\n", (unsigned int)port, strerror(errno));
+        closesocket(control_sd);
+        control_sd = INVALID_SOCKET;
+        return 0;
+    }
+
+    if (pthread_create(&control_thread, NULL, cbt_control_thread, NULL) != 0)
+    {
+        closesocket(control_sd);
+        control_sd = INVALID_SOCKET;
+        return 0;
+    }
+
+    control_running = 1;
+
+    printf("Changed block tracking requests accepted on port %u.\n",
+        (unsigned int)port);
+
+    return 1;
+}
+
+#endif
+
+int
+cbt_init(const char *spec, const char *default_file,
+    off_t_64 offset, off_t_64 size)
+{
+    char options[256];
+    char file[260];
+    char value[64];
+    const char *opts = spec != NULL ? strchr(spec, ',') : NULL;
+    size_t file_len;
+    safeio_size_t map_size;
+    off_t_64 file_size;
+
+    if (spec == NULL)
+        spec = "";
+
+    file_len = opts != NULL ? (size_t)(opts - spec) : strlen(spec);
+
+    if (file_len == 0)
+    {
+        if (default_file == NULL)
+        {
+            fprintf(stderr, "Changed block tracking file name needed for "
+                "this image.\n");
+            return 0;
+        }
+
+        file_len = strlen(default_file);
+
+        if (file_len + 4 >= sizeof(file))
+        {
+            fprintf(stderr, "Invalid changed block tracking file name.\n");
+            return 0;
+        }
+
+        memcpy(file, default_file, file_len);
+        strcpy(file + file_len, ".cbt");
+    }
+    else
+    {
+        if (file_len >= sizeof(file))
+        {
+            fprintf(stderr, "Invalid changed block tracking file name.\n");
+            return 0;
+        }
+
+        memcpy(file, spec, file_len);
+        file[file_len] = 0;
+    }
+
+    options[0] = 0;
+    if (opts != NULL)
+    {
+        strncpy(options, opts + 1, sizeof(options) - 1);
+        options[sizeof(options) - 1] = 0;
+    }
+
+    if (size <= 0)
+    {
+        fprintf(stderr, "Changed block tracking needs a known image size.\n");
+        return 0;
+    }
+
+    base_offset = offset;
+    block_size = DEF_BLOCK_SIZE;
+
+    if (backend_get_option(options, "block", value, sizeof(value)) &&
+        (!backend_parse_size(value, &block_size) || block_size < 512 ||
+            (block_size & (block_size - 1)) != 0))
+    {
+        fprintf(stderr, "Invalid changed block tracking block size: '%s'\n",
+            value);
+        return 0;
+    }
+
+    cbt_fd = _open(file, O_BINARY | O_RDWR | O_CREAT, 0644);
+
+    if (cbt_fd == -1)
+    {
+        fprintf(stderr, "Cannot open changed block tracking file '%s': %s\n",
+            file, strerror(errno));
+        return 0;
+    }
+
+    file_size = _lseeki64(cbt_fd, 0, SEEK_END);
+
+    if (file_size > 0)
+    {
+        if (pread(cbt_fd, &header, sizeof(header), 0) !=
+            (safeio_ssize_t)sizeof(header) ||
+            memcmp(header.magic, CBT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != CBT_VERSION ||
+            header.block_size < 512)
+        {
+            fprintf(stderr, "'%s' is not a valid changed block tracking "
+                "file.\n", file);
+            return 0;
+        }
+
+        // Changes made while image was used without tracking cannot be
+        // listed. Delete tracking file and take a full backup after that.
+        if ((off_t_64)header.image_size != size)
+        {
+            fprintf(stderr, "Changed block tracking file '%s' was created "
+                "for an image of " ULL_FMT " bytes, image is " SLL_FMT
+                " bytes.\n", file, header.image_size, (int64_t)size);
+            return 0;
+        }
+
+        block_size = header.block_size;
+    }
+    else
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CBT_MAGIC, sizeof(header.magic));
+        header.version = CBT_VERSION;
+        header.block_size = (uint32_t)block_size;
+        header.image_size = (uint64_t)size;
+        header.generation = 1;
+    }
+
+    blocks = (size + block_size - 1) / block_size;
+    map_size = (safeio_size_t)(blocks * sizeof(uint32_t));
+
+    map = (uint32_t*)calloc((size_t)blocks, sizeof(uint32_t));
+
+    if (map == NULL)
+    {
+        fprintf(stderr, "Cannot allocate changed block tracking map.\n");
+        return 0;
+    }
+
+    if (file_size <= 0)
+    {
+        if (pwrite(cbt_fd, map, map_size, CBT_MAP_OFFSET) !=
+            (safeio_ssize_t)map_size || save_header() != 0)
+        {
+            fprintf(stderr, "Cannot write changed block tracking file "
+                "'%s': %s\n", file, strerror(errno));
+            return 0;
+        }
+    }
+    else if (pread(cbt_fd, map, map_size, CBT_MAP_OFFSET) !=
+        (safeio_ssize_t)map_size)
+    {
+        fprintf(stderr, "Cannot read changed block tracking file '%s'.\n",
+            file);
+        return 0;
+    }
+
+    cbt_enabled = 1;
+
+    printf("Tracking changed blocks in '%s', block size " SLL_FMT
+        " bytes, generation " ULL_FMT ".\n", file, (int64_t)block_size,
+        header.generation);
+
+#ifdef _WIN32
+    if (backend_get_option(options, "port", value, sizeof(value)))
+        fprintf(stderr, "Changed block tracking port not supported on "
+            "Windows.\n");
+#else
+    if (backend_get_option(options, "port", value, sizeof(value)) &&
+        !control_start((u_short)strtoul(value, NULL, 0)))
+        return 0;
+#endif
+
+    return 1;
+}
+
+void
+cbt_close()
+{
+    if (!cbt_enabled)
+        return;
+
+#ifndef _WIN32
+    cbt_lock();
+    closing = 1;
+
+    if (control_client != INVALID_SOCKET)
+        shutdown(control_client, SHUT_RDWR);
+
+    cbt_unlock();
+
+    if (control_running)
+    {
+        shutdown(control_sd, SHUT_RDWR);
+        pthread_join(control_thread, NULL);
+        closesocket(control_sd);
+        control_sd = INVALID_SOCKET;
+        control_running = 0;
+    }
+#endif
+
+    cbt_sync();
+    _close(cbt_fd);
+    cbt_fd = -1;
+
+    free(map);
+    map = NULL;
+
+    cbt_enabled = 0;
+}
@@ -0,0 +1,72 @@
+/*
+Changed block tracking for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_CBT_
+#define _INC_CBT_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern int cbt_enabled;
+
+    // Opens or creates tracking file according to
+    // [trackfile][,block=blocksize][,port=controlport] for an image of size bytes starting at
+    // base_offset. If trackfile is not given, default_file with .cbt
+    // appended is used, unless default_file is NULL.
+    // Returns zero on failure.
+    int cbt_init(const char *spec, const char *default_file,
+        off_t_64 base_offset, off_t_64 size);
+
+    // Records that a range is about to be changed. The change is saved in
+    // tracking file before this returns. Returns zero on failure.
+    int cbt_mark(off_t_64 offset, off_t_64 size);
+
+    uint64_t cbt_generation();
+
+    // Starts a new generation. Returns zero on success or an errno code.
+    int cbt_new_generation(uint64_t *generation);
+
+    // Lists extents in [*offset, end) changed in generation or later, as
+    // offset/length pairs in extents. Returns number of extents stored and
+    // advances *offset to where listing should continue, or to end.
+    int cbt_list(uint64_t generation, off_t_64 *offset, off_t_64 end,
+        uint64_t *extents, int max_extents);
+
+    // Runs an IMDPROXY_REQ_CHANGED_BLOCKS operation, from main connection
+    // or control port, and fills in resp. Returns number of extents stored
+    // in extents, as for cbt_list().
+    int cbt_control(PIMDPROXY_CBT_REQ req, PIMDPROXY_CBT_RESP resp,
+        uint64_t *extents, int max_extents);
+
+    void cbt_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_CBT_
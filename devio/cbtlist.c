@@ -0,0 +1,315 @@
+/*
+Lists blocks changed in images served by devio with changed block tracking.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+
+static SOCKET
+connect_server(const char *server)
+{
+    struct addrinfo hints = { 0 };
+    struct addrinfo *result;
+    struct addrinfo *ai;
+    char host[256] = "127.0.0.1";
+    const char *port = strrchr(server, ':');
+    SOCKET sd = INVALID_SOCKET;
+    int rc;
+
+    if (port != NULL)
+    {
+        size_t len = port - server;
+
+        if (len >= sizeof(host))
+            len = sizeof(host) - 1;
+
+        memcpy(host, server, len);
+        host[len] = 0;
+        ++port;
+    }
+    else
+        port = server;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(host, port, &hints, &result);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "%s: %s\n", server, gai_strerror(rc));
+        return INVALID_SOCKET;
+    }
+
+    for (ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+        if (sd == INVALID_SOCKET)
+            continue;
+
+        if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        closesocket(sd);
+        sd = INVALID_SOCKET;
+    }
+
+    freeaddrinfo(result);
+
+    if (sd == INVALID_SOCKET)
+        fprintf(stderr, "Cannot connect to %s: %s\n", server,
+            strerror(errno));
+
+    return sd;
+}
+
+static int
+cbt_call(SOCKET sd, PIMDPROXY_CBT_REQ req, PIMDPROXY_CBT_RESP resp)
+{
+    req->request_code = IMDPROXY_REQ_CHANGED_BLOCKS;
+
+    if (!safe_write(sd, req, sizeof(*req)) ||
+        !safe_read(sd, resp, sizeof(*resp)))
+    {
+        fprintf(stderr, "Connection to server lost.\n");
+        return 0;
+    }
+
+    if (resp->errorno != 0)
+    {
+        fprintf(stderr, "Server error: %s\n", strerror((int)resp->errorno));
+        return 0;
+    }
+
+    return 1;
+}
+
+// Lists extents with data in them, used instead of changed blocks when all
+// data is requested. Holes and zero extents are left out.
+static int
+list_allocated(SOCKET sd, ULONGLONG size, ULONGLONG *total)
+{
+    IMDPROXY_ALLOCATION_REQ req = { 0 };
+    IMDPROXY_ALLOCATION_RESP resp = { 0 };
+    IMDPROXY_ALLOCATION_EXTENT extents[256];
+
+    req.request_code = IMDPROXY_REQ_GET_ALLOCATION;
+
+    do
+    {
+        ULONGLONG count;
+        ULONGLONG i;
+
+        req.length = size - req.offset;
+
+        if (!safe_write(sd, &req, sizeof(req)) ||
+            !safe_read(sd, &resp, sizeof(resp)))
+        {
+            fprintf(stderr, "Connection to server lost.\n");
+            return 0;
+        }
+
+        if (resp.errorno != 0)
+        {
+            fprintf(stderr, "Server error: %s\n",
+                strerror((int)resp.errorno));
+            return 0;
+        }
+
+        count = resp.length / sizeof(*extents);
+
+        if (resp.length > sizeof(extents) ||
+            !safe_read(sd, extents, (safeio_size_t)resp.length))
+        {
+            fprintf(stderr, "Invalid response from server.\n");
+            return 0;
+        }
+
+        for (i = 0; i < count; i++)
+            if (extents[i].state == AllocationMapped)
+            {
+                printf(ULL_FMT " " ULL_FMT "\n", extents[i].offset,
+                    extents[i].length);
+                *total += extents[i].length;
+            }
+
+        req.offset = resp.next_offset;
+
+    } while (req.offset < size && resp.length > 0);
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    IMDPROXY_CBT_REQ req = { 0 };
+    IMDPROXY_CBT_RESP resp = { 0 };
+    IMDPROXY_CBT_EXTENT extents[512];
+    IMDPROXY_INFO_RESP info = { 0 };
+    ULONGLONG info_req = IMDPROXY_REQ_INFO;
+    ULONGLONG close_req = IMDPROXY_REQ_CLOSE;
+    ULONGLONG total = 0;
+    int new_generation = 0;
+    int all_data;
+    SOCKET sd;
+
+    if (argc >= 2 && strcmp(argv[1], "-n") == 0)
+    {
+        new_generation = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2 || argc > 3 || (new_generation && argc > 2))
+    {
+        fprintf(stderr,
+            "cbtlist - devio changed block listing ver " DEVIO_VERSION "\n"
+            "\n"
+            "Usage:\n"
+            "cbtlist [host:]port\n"
+            "        Print current generation of changed block tracking.\n"
+            "\n"
+            "cbtlist -n [host:]port\n"
+            "        Start new generation and print its number. Take a backup\n"
+            "        after this and save the number for next incremental backup.\n"
+            "\n"
+            "cbtlist [host:]port generation\n"
+            "        List extents changed in generation or later, one line with\n"
+            "        offset and length in bytes for each. Generation 0 lists all\n"
+            "        data in image, leaving out unallocated ranges if server can\n"
+            "        tell where they are.\n"
+            "\n"
+            "port is either the control port given with --cbt=...,port=n to\n"
+            "devio, which can be used while a driver is connected, or the main\n"
+            "devio port when no other client is connected.\n");
+        return -1;
+    }
+
+    sd = connect_server(argv[1]);
+
+    if (sd == INVALID_SOCKET)
+        return 1;
+
+    if (!safe_write(sd, &info_req, sizeof(info_req)) ||
+        !safe_read(sd, &info, sizeof(info)))
+    {
+        fprintf(stderr, "Connection to server lost.\n");
+        return 1;
+    }
+
+    all_data = argc > 2 && strtoull(argv[2], NULL, 0) == 0;
+
+    if ((info.flags & IMDPROXY_FLAG_SUPPORTS_CBT) == 0 &&
+        !(all_data && (info.flags & IMDPROXY_FLAG_SUPPORTS_ALLOCATION)))
+    {
+        fprintf(stderr, "Server does not track changed blocks.\n");
+        return 1;
+    }
+
+    if (argc < 3)
+    {
+        req.operation_code = new_generation ? CbtNewGeneration : CbtQuery;
+
+        // Empty range, just to get current generation
+        req.offset = info.file_size;
+        req.length = 0;
+
+        if (!cbt_call(sd, &req, &resp))
+            return 1;
+
+        printf(ULL_FMT "\n", resp.generation);
+    }
+    else if (all_data && (info.flags & IMDPROXY_FLAG_SUPPORTS_ALLOCATION))
+    {
+        if (!list_allocated(sd, info.file_size, &total))
+            return 1;
+
+        fprintf(stderr, ULL_FMT " of " ULL_FMT " bytes allocated.\n", total,
+            info.file_size);
+    }
+    else
+    {
+        req.operation_code = CbtQuery;
+        req.generation = strtoull(argv[2], NULL, 0);
+        req.offset = 0;
+
+        do
+        {
+            ULONGLONG count;
+            ULONGLONG i;
+
+            req.length = info.file_size - req.offset;
+
+            if (!cbt_call(sd, &req, &resp))
+                return 1;
+
+            count = resp.length / sizeof(*extents);
+
+            if (resp.length > sizeof(extents) ||
+                !safe_read(sd, extents, (safeio_size_t)resp.length))
+            {
+                fprintf(stderr, "Invalid response from server.\n");
+                return 1;
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                printf(ULL_FMT " " ULL_FMT "\n", extents[i].offset,
+                    extents[i].length);
+                total += extents[i].length;
+            }
+
+            req.offset = resp.next_offset;
+
+        } while (req.offset < info.file_size && resp.length > 0);
+
+        fprintf(stderr, ULL_FMT " of " ULL_FMT " bytes changed, current "
+            "generation " ULL_FMT ".\n", total, info.file_size,
+            resp.generation);
+    }
+
+    safe_write(sd, &close_req, sizeof(close_req));
+    closesocket(sd);
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+Processor feature detection for devio data kernels.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+#endif
+
+#include "cpufeature.h"
+
+#if defined(CPU_X86) && defined(__GNUC__)
+#include <cpuid.h>
+#endif
+
+#if defined(CPU_ARM_CRC32) && defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#ifdef CPU_X86
+
+static void
+cpu_id(unsigned int leaf, unsigned int regs[4])
+{
+#if defined(__GNUC__)
+    if (__get_cpuid_max(0, NULL) < leaf)
+    {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+        return;
+    }
+
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#else
+    int info[4];
+
+    __cpuid(info, 0);
+
+    if ((unsigned int)info[0] < leaf)
+    {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+        return;
+    }
+
+    __cpuidex(info, (int)leaf, 0);
+
+    regs[0] = (unsigned int)info[0];
+    regs[1] = (unsigned int)info[1];
+    regs[2] = (unsigned int)info[2];
+    regs[3] = (unsigned int)info[3];
+#endif
+}
+
+// Processor and operating system must both support AVX state
+static int
+cpu_has_avx_state()
+{
+    unsigned int regs[4];
+
+    cpu_id(1, regs);
+
+    if ((regs[2] & (1 << 27)) == 0)
+        return 0;
+
+#if defined(__GNUC__)
+    {
+        unsigned int eax, edx;
+
+        __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+        return (eax & 6) == 6;
+    }
+#else
+    return (_xgetbv(0) & 6) == 6;
+#endif
+}
+
+int
+cpu_has_ssse3()
+{
+    unsigned int regs[4];
+
+    cpu_id(1, regs);
+
+    return (regs[2] & (1 << 9)) != 0;
+}
+
+int
+cpu_has_sse42()
+{
+    unsigned int regs[4];
+
+    cpu_id(1, regs);
+
+    return (regs[2] & (1 << 20)) != 0;
+}
+
+int
+cpu_has_avx2()
+{
+    unsigned int regs[4];
+
+    if (!cpu_has_avx_state())
+        return 0;
+
+    cpu_id(7, regs);
+
+    return (regs[1] & (1 << 5)) != 0;
+}
+
+int
+cpu_has_gfni()
+{
+    unsigned int regs[4];
+
+    cpu_id(7, regs);
+
+    return (regs[2] & (1 << 8)) != 0;
+}
+
+#else
+
+int
+cpu_has_ssse3()
+{
+    return 0;
+}
+
+int
+cpu_has_sse42()
+{
+    return 0;
+}
+
+int
+cpu_has_avx2()
+{
+    return 0;
+}
+
+int
+cpu_has_gfni()
+{
+    return 0;
+}
+
+#endif
+
+int
+cpu_has_arm_crc32()
+{
+#if defined(CPU_ARM_CRC32) && defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#elif defined(CPU_ARM_CRC32) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(CPU_ARM_CRC32) && defined(__APPLE__)
+    return 1;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,106 @@
+/*
+Processor feature detection for devio data kernels.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_CPUFEATURE_
+#define _INC_CPUFEATURE_
+
+// CPU_X86 and CPU_NEON are defined when vector kernels for those
+// architectures can be built. CPU_AVX2 and CPU_GFNI are defined when the
+// compiler can generate those instructions in functions marked with
+// CPU_TARGET, for use after checking processor support at run time.
+// CPU_ARM_CRC32 is defined likewise for functions marked with
+// CPU_TARGET_CRC32.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+
+#define CPU_X86
+
+#include <immintrin.h>
+
+#if defined(__GNUC__)
+#define CPU_TARGET(x) __attribute__((target(x)))
+#define CPU_AVX2
+#if __GNUC__ >= 8 || defined(__clang__)
+#define CPU_GFNI
+#endif
+#elif defined(_MSC_VER) && _MSC_VER >= 1800
+#define CPU_TARGET(x)
+#define CPU_AVX2
+#if _MSC_VER >= 1920
+#define CPU_GFNI
+#endif
+#else
+#define CPU_TARGET(x)
+#endif
+
+#elif defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON) || defined(_M_ARM)
+
+#define CPU_NEON
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define CPU_NEON64
+#endif
+
+#if defined(_M_ARM64)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+
+// ARMv8 CRC32 instructions, optional in ARMv8.0
+#if defined(__aarch64__) && (__GNUC__ >= 10 || defined(__clang__))
+#define CPU_ARM_CRC32
+#include <arm_acle.h>
+#if defined(__clang__)
+#define CPU_TARGET_CRC32 __attribute__((target("crc")))
+#else
+#define CPU_TARGET_CRC32 __attribute__((target("+crc")))
+#endif
+#elif defined(_M_ARM64)
+#define CPU_ARM_CRC32
+#define CPU_TARGET_CRC32
+#endif
+
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Return non-zero if both processor and operating system support the
+    // instruction set extension. Always zero on other architectures.
+    int cpu_has_ssse3();
+    int cpu_has_sse42();
+    int cpu_has_avx2();
+    int cpu_has_gfni();
+    int cpu_has_arm_crc32();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_CPUFEATURE_
@@ -0,0 +1,371 @@
+/*
+CRC32C (Castagnoli) checksums for devio payload integrity.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "devio_types.h"
+#include "cpufeature.h"
+#include "crc32c.h"
+
+#define CRC32C_POLY     0x82F63B78
+
+// Length of each of the three streams the hardware implementation runs
+// in parallel. The crc32 instruction has a latency of three cycles but
+// can start a new one every cycle, so independent streams are needed to
+// keep it busy. Partial results are combined with shift tables below.
+// Shorter lanes are used for the rest of the data, typically all of it
+// for 4 KB requests.
+#define CRC32C_LANE     4096
+#define CRC32C_LANE_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+
+#ifdef CPU_X86
+
+typedef struct _CRC32C_LANE_SHIFT
+{
+    safeio_size_t lane;
+    uint32_t shift1[4][256];    // Multiplies by x^(8 * lane)
+    uint32_t shift2[4][256];    // Multiplies by x^(16 * lane)
+} CRC32C_LANE_SHIFT, *PCRC32C_LANE_SHIFT;
+
+static CRC32C_LANE_SHIFT crc32c_lane_long;
+static CRC32C_LANE_SHIFT crc32c_lane_short;
+
+// Multiplies two polynomials modulo the CRC polynomial, in the reflected
+// bit order where the most significant bit holds the x^0 term.
+static uint32_t
+crc32c_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    for (; m != 0; m >>= 1)
+    {
+        if (a & m)
+            p ^= b;
+
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// Runs size zero bytes through a raw CRC register, which multiplies it by
+// x^(8 * size).
+static uint32_t
+crc32c_shift(uint32_t crc, safeio_size_t size)
+{
+    while (size-- > 0)
+        crc = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+
+    return crc;
+}
+
+static void
+crc32c_shift_tables(uint32_t table[4][256], safeio_size_t size)
+{
+    uint32_t factor = crc32c_shift((uint32_t)1 << 31, size);
+    int k, i;
+
+    for (k = 0; k < 4; k++)
+        for (i = 0; i < 256; i++)
+            table[k][i] = crc32c_multiply((uint32_t)i << (8 * k), factor);
+}
+
+static uint32_t
+crc32c_apply_shift(const uint32_t table[4][256], uint32_t crc)
+{
+    return table[0][crc & 0xFF] ^
+        table[1][(crc >> 8) & 0xFF] ^
+        table[2][(crc >> 16) & 0xFF] ^
+        table[3][crc >> 24];
+}
+
+#endif
+
+void
+crc32c_init()
+{
+    int i, k;
+
+    if (crc32c_table[0][1] != 0)
+        return;
+
+    for (i = 0; i < 256; i++)
+    {
+        uint32_t crc = (uint32_t)i;
+
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+
+        crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+            crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+
+#ifdef CPU_X86
+    crc32c_lane_long.lane = CRC32C_LANE;
+    crc32c_shift_tables(crc32c_lane_long.shift1, CRC32C_LANE);
+    crc32c_shift_tables(crc32c_lane_long.shift2, 2 * CRC32C_LANE);
+    crc32c_lane_short.lane = CRC32C_LANE_SHORT;
+    crc32c_shift_tables(crc32c_lane_short.shift1, CRC32C_LANE_SHORT);
+    crc32c_shift_tables(crc32c_lane_short.shift2, 2 * CRC32C_LANE_SHORT);
+#endif
+}
+
+// Slicing-by-8, processes eight bytes per step with one table each.
+static uint32_t __cdecl
+crc32c_generic(uint32_t crc, const void *data, safeio_size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+
+    crc = ~crc;
+
+    for (; size > 0 && ((uintptr_t)p & 7) != 0; size--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint32_t low = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+
+        crc = crc32c_table[7][low & 0xFF] ^
+            crc32c_table[6][(low >> 8) & 0xFF] ^
+            crc32c_table[5][(low >> 16) & 0xFF] ^
+            crc32c_table[4][low >> 24] ^
+            crc32c_table[3][p[4]] ^
+            crc32c_table[2][p[5]] ^
+            crc32c_table[1][p[6]] ^
+            crc32c_table[0][p[7]];
+    }
+
+    for (; size > 0; size--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+
+    return ~crc;
+}
+
+#ifdef CPU_X86
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#define crc32c_word_t           uint64_t
+#define crc32c_hw_word(c, w)    ((uint32_t)_mm_crc32_u64((c), (w)))
+
+#else
+
+#define crc32c_word_t           uint32_t
+#define crc32c_hw_word(c, w)    _mm_crc32_u32((c), (w))
+
+#endif
+
+static CPU_TARGET("sse4.2") uint32_t
+crc32c_sse42_bytes(uint32_t crc, const uint8_t *p, safeio_size_t size)
+{
+    for (; size > 0; size--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+// Processes three interleaved lanes at a time while enough data remains.
+// Data must be aligned to crc32c_word_t.
+static CPU_TARGET("sse4.2") uint32_t
+crc32c_sse42_lanes(uint32_t crc, const uint8_t **data, safeio_size_t *size,
+    PCRC32C_LANE_SHIFT shift)
+{
+    const uint8_t *p = *data;
+    safeio_size_t lane = shift->lane;
+
+    for (; *size >= 3 * lane; *size -= 3 * lane)
+    {
+        const uint8_t *end = p + lane;
+        uint32_t crc1 = 0;
+        uint32_t crc2 = 0;
+
+        for (; p < end; p += sizeof(crc32c_word_t))
+        {
+            crc = crc32c_hw_word(crc, *(const crc32c_word_t*)p);
+            crc1 = crc32c_hw_word(crc1, *(const crc32c_word_t*)(p + lane));
+            crc2 = crc32c_hw_word(crc2,
+                *(const crc32c_word_t*)(p + 2 * lane));
+        }
+
+        crc = crc32c_apply_shift(shift->shift2, crc) ^
+            crc32c_apply_shift(shift->shift1, crc1) ^
+            crc2;
+
+        p += 2 * lane;
+    }
+
+    *data = p;
+
+    return crc;
+}
+
+static CPU_TARGET("sse4.2") uint32_t __cdecl
+crc32c_sse42(uint32_t crc, const void *data, safeio_size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    safeio_size_t head = (0 - (uintptr_t)p) & (sizeof(crc32c_word_t) - 1);
+
+    crc = ~crc;
+
+    if (head > size)
+        head = size;
+
+    crc = crc32c_sse42_bytes(crc, p, head);
+    p += head;
+    size -= head;
+
+    crc = crc32c_sse42_lanes(crc, &p, &size, &crc32c_lane_long);
+    crc = crc32c_sse42_lanes(crc, &p, &size, &crc32c_lane_short);
+
+    for (; size >= sizeof(crc32c_word_t); size -= sizeof(crc32c_word_t))
+    {
+        crc = crc32c_hw_word(crc, *(const crc32c_word_t*)p);
+        p += sizeof(crc32c_word_t);
+    }
+
+    return ~crc32c_sse42_bytes(crc, p, size);
+}
+
+#endif
+
+#ifdef CPU_ARM_CRC32
+
+static CPU_TARGET_CRC32 uint32_t __cdecl
+crc32c_armv8(uint32_t crc, const void *data, safeio_size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+
+    crc = ~crc;
+
+    for (; size > 0 && ((uintptr_t)p & 7) != 0; size--)
+        crc = __crc32cb(crc, *p++);
+
+    for (; size >= 32; size -= 32, p += 32)
+    {
+        uint64_t w[4];
+
+        memcpy(w, p, sizeof(w));
+
+        crc = __crc32cd(crc, w[0]);
+        crc = __crc32cd(crc, w[1]);
+        crc = __crc32cd(crc, w[2]);
+        crc = __crc32cd(crc, w[3]);
+    }
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t w;
+
+        memcpy(&w, p, sizeof(w));
+        crc = __crc32cd(crc, w);
+    }
+
+    for (; size > 0; size--)
+        crc = __crc32cb(crc, *p++);
+
+    return ~crc;
+}
+
+#endif
+
+static int
+cpu_has_always()
+{
+    return 1;
+}
+
+// Ordered from slowest to fastest
+static const struct _CRC32C_IMPL
+{
+    const char *name;
+    crc32c_proc proc;
+    int(*supported)();
+} crc32c_impls[] = {
+    { "generic", crc32c_generic, cpu_has_always },
+#ifdef CPU_X86
+    { "sse42", crc32c_sse42, cpu_has_sse42 },
+#endif
+#ifdef CPU_ARM_CRC32
+    { "armv8", crc32c_armv8, cpu_has_arm_crc32 },
+#endif
+};
+
+int
+crc32c_get_impl(int index, const char **name, crc32c_proc *proc)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(crc32c_impls) / sizeof(*crc32c_impls); i++)
+    {
+        if (!crc32c_impls[i].supported())
+            continue;
+
+        if (index-- == 0)
+        {
+            *name = crc32c_impls[i].name;
+            *proc = crc32c_impls[i].proc;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t __cdecl
+crc32c_resolve(uint32_t crc, const void *data, safeio_size_t size)
+{
+    crc32c_proc best = crc32c_generic;
+    crc32c_proc proc;
+    const char *name;
+    int i;
+
+    crc32c_init();
+
+    for (i = 0; crc32c_get_impl(i, &name, &proc); i++)
+        best = proc;
+
+    crc32c = best;
+
+    return best(crc, data, size);
+}
+
+crc32c_proc crc32c = crc32c_resolve;
@@ -0,0 +1,64 @@
+/*
+CRC32C (Castagnoli) checksums for devio payload integrity.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_CRC32C_
+#define _INC_CRC32C_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // CRC-32C as used by iSCSI, SCTP and ext4: reflected polynomial
+    // 0x82F63B78, initial value and final XOR 0xFFFFFFFF. Check value for
+    // the ASCII string "123456789" is 0xE3069283.
+
+    // Builds lookup tables for the generic implementation. Must be called
+    // before any implementation returned by crc32c_get_impl is used. Safe
+    // to call more than once.
+    void crc32c_init();
+
+    typedef uint32_t (__cdecl crc32c_decl)(uint32_t crc, const void *data,
+        safeio_size_t size);
+
+    typedef crc32c_decl *crc32c_proc;
+
+    // Returns CRC-32C of data continued from crc, which is zero to start a
+    // new checksum or the result of a previous call for data that directly
+    // precedes this data. Points to the fastest implementation supported
+    // by the processor, selected on first call.
+    extern crc32c_proc crc32c;
+
+    // Enumerates implementations supported by the current processor, for
+    // benchmarking and diagnostics. Returns zero when index is out of range.
+    int crc32c_get_impl(int index, const char **name, crc32c_proc *proc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_CRC32C_
@@ -0,0 +1,189 @@
+/*
+Credit based flow control for devio connections.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "credits.h"
+
+#define DEF_REQUESTS            64
+#define MAX_REQUESTS            65536
+#define DEF_LATENCY_MSEC        100
+
+// --credits=[requests][,bytes=n][,latency=msec]
+//
+// requests Largest request window, 64 by default.
+// bytes    Byte window, size of the request buffer by default.
+// latency  Target time in msec to serve a full window, 100 by default,
+//          zero to always grant the largest window.
+//
+// By Little's law, a client with a window of n requests sees latency of
+// about n times the time the server is busy per request. The request window
+// is therefore the latency target divided by a moving average of busy time
+// per request, so a slow or contended image makes clients hold requests
+// back rather than queue them at the server. The byte window is fixed and
+// caps memory needed for requests in flight.
+
+int credits_enabled = 0;
+
+static ULONGLONG max_requests = DEF_REQUESTS;
+static ULONGLONG max_bytes = 0;
+static uint64_t latency_nsec = (uint64_t)DEF_LATENCY_MSEC * 1000000;
+
+// Moving average of busy time per request, with weight 1/8 for new samples
+static uint64_t busy_avg_nsec = 0;
+
+static uint64_t grants = 0;
+static ULONGLONG min_window = 0;
+static uint64_t shed = 0;
+
+int
+credits_init(const char *spec, safeio_size_t buffer_size)
+{
+    const char *opts = strchr(spec, ',');
+    char value[32];
+
+    if (*spec != 0 && *spec != ',')
+        max_requests = strtoul(spec, NULL, 0);
+
+    if (max_requests < 1 || max_requests > MAX_REQUESTS)
+    {
+        fprintf(stderr, "Credit request window must be 1 - %i.\n",
+            MAX_REQUESTS);
+        return 0;
+    }
+
+    max_bytes = buffer_size;
+
+    if (opts != NULL)
+    {
+        off_t_64 size;
+
+        if (backend_get_option(opts + 1, "bytes", value, sizeof(value)))
+        {
+            if (!backend_parse_size(value, &size) || size <= 0)
+            {
+                fprintf(stderr, "Invalid credit byte window: '%s'\n",
+                    value);
+                return 0;
+            }
+
+            max_bytes = size;
+        }
+
+        if (backend_get_option(opts + 1, "latency", value, sizeof(value)))
+            latency_nsec = (uint64_t)strtoul(value, NULL, 0) * 1000000;
+    }
+
+    min_window = max_requests;
+    credits_enabled = 1;
+
+    printf("Granting credits for up to " ULL_FMT " requests and " ULL_FMT
+        " bytes, latency target " ULL_FMT " msec.\n",
+        max_requests, max_bytes, (ULONGLONG)(latency_nsec / 1000000));
+
+    return 1;
+}
+
+void
+credits_grant(PIMDPROXY_CREDITS credits)
+{
+    ULONGLONG window = max_requests;
+
+    if (latency_nsec != 0 && busy_avg_nsec != 0 &&
+        latency_nsec / busy_avg_nsec < window)
+    {
+        window = latency_nsec / busy_avg_nsec;
+
+        if (window < 1)
+            window = 1;
+    }
+
+    credits->requests = window;
+    credits->bytes = max_bytes;
+
+    ++grants;
+
+    if (window < min_window)
+        min_window = window;
+}
+
+void
+credits_served(uint64_t busy_nsec, int requests)
+{
+    uint64_t sample;
+
+    if (!credits_enabled || requests < 1)
+        return;
+
+    sample = busy_nsec / requests;
+
+    if (busy_avg_nsec == 0)
+        busy_avg_nsec = sample;
+    else
+        busy_avg_nsec = busy_avg_nsec - busy_avg_nsec / 8 + sample / 8;
+}
+
+int
+credits_admit(int outstanding, ULONGLONG outstanding_bytes, ULONGLONG length)
+{
+    if (!credits_enabled || outstanding == 0)
+        return 1;
+
+    if ((ULONGLONG)outstanding < max_requests &&
+        outstanding_bytes + length <= max_bytes)
+        return 1;
+
+    ++shed;
+
+    return 0;
+}
+
+void
+credits_close()
+{
+    if (grants == 0)
+        return;
+
+    printf("Credits: " ULL_FMT " grants, smallest window " ULL_FMT
+        " requests, average busy time %.1f usec per request, " ULL_FMT
+        " requests shed.\n",
+        (ULONGLONG)grants, min_window, busy_avg_nsec / 1e3, (ULONGLONG)shed);
+}
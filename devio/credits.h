@@ -0,0 +1,67 @@
+/*
+Credit based flow control for devio connections.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_CREDITS_
+#define _INC_CREDITS_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Window of outstanding read and write requests and bytes granted to
+    // clients that enable IMDPROXY_OPTION_CREDITS. The request window
+    // shrinks when requests take long to serve, so that a full window is
+    // served within the latency target.
+
+    extern int credits_enabled;
+
+    // Starts granting credits according to [requests][,bytes=n]
+    // [,latency=msec]. Returns zero on failure.
+    int credits_init(const char *spec, safeio_size_t buffer_size);
+
+    // Current window.
+    void credits_grant(PIMDPROXY_CREDITS credits);
+
+    // Records time in nsec the server was busy serving a number of
+    // requests, which sets the window.
+    void credits_served(uint64_t busy_nsec, int requests);
+
+    // Whether a request of length bytes may start with outstanding requests
+    // and bytes already received before it. Requests beyond the largest
+    // window are shed.
+    int credits_admit(int outstanding, ULONGLONG outstanding_bytes,
+        ULONGLONG length);
+
+    // Prints statistics.
+    void credits_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_CREDITS_
@@ -0,0 +1,847 @@
+/*
+In-process benchmark of devio image translation layers.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "histogram.h"
+
+// Runs the same image setup as devio, with devio.c built with
+// DEVIO_NO_MAIN, and then drives logical_read() and logical_write()
+// directly instead of serving a client. Each test case runs in a child
+// process, since devio keeps image state in globals.
+
+int devio_main(int argc, char **argv);
+extern int (*devio_comm)(char *comm_device);
+extern IMDPROXY_INFO_RESP devio_info;
+extern off_t_64 image_offset;
+safeio_ssize_t logical_read(char *io_ptr, safeio_size_t size,
+    off_t_64 offset);
+safeio_ssize_t logical_write(char *io_ptr, safeio_size_t size,
+    off_t_64 offset);
+int image_allocation(off_t_64 offset, off_t_64 end, off_t_64 *run_end);
+
+#ifndef O_SYNC
+#define O_SYNC 0
+#endif
+
+#define DEF_IMAGE_SIZE      (64 << 20)
+#define DEF_BLOCK_SIZE      4096
+#define DEF_SECONDS         1.0
+#define FILL_BLOCK_SIZE     (1 << 20)
+#define PARTITION_OFFSET    (1 << 20)
+#define VHD_BLOCK_SIZE      (2 << 20)
+#define VHD_BAT_OFFSET      1536
+
+static ULONGLONG image_size = DEF_IMAGE_SIZE;
+static safeio_size_t bench_block_size = DEF_BLOCK_SIZE;
+static double bench_seconds = DEF_SECONDS;
+static const char *bench_case = NULL;
+static int saved_stdout = -1;
+static int null_stdout = -1;
+
+// Called in test case process when image is open
+static int bench_run(ULONGLONG size);
+static int (*case_run)(ULONGLONG size) = bench_run;
+static const char *vhd_path = NULL;
+
+// Direct pread/pwrite on raw image, without devio, as baseline
+static int baseline_fd = -1;
+
+static uint64_t
+now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 2685821657736338717ULL;
+}
+
+static void
+fill_random(char *data, size_t size, uint64_t *state)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= size; i += 8)
+    {
+        uint64_t x = next_random(state);
+        memcpy(data + i, &x, 8);
+    }
+
+    for (; i < size; i++)
+        data[i] = (char)next_random(state);
+}
+
+static int
+parse_size(const char *str, ULONGLONG *size)
+{
+    char *suffix;
+    ULONGLONG value = strtoull(str, &suffix, 0);
+
+    switch (*suffix)
+    {
+    case 'T': case 't':
+        value <<= 10;
+    case 'G': case 'g':
+        value <<= 10;
+    case 'M': case 'm':
+        value <<= 10;
+    case 'K': case 'k':
+        value <<= 10;
+        ++suffix;
+    }
+
+    if (suffix == str || *suffix != 0)
+        return 0;
+
+    *size = value;
+
+    return 1;
+}
+
+static safeio_ssize_t
+bench_read(char *buf, safeio_size_t size, off_t_64 offset)
+{
+    if (baseline_fd != -1)
+        return pread(baseline_fd, buf, size, offset);
+
+    return logical_read(buf, size, image_offset + offset);
+}
+
+static safeio_ssize_t
+bench_write(char *buf, safeio_size_t size, off_t_64 offset)
+{
+    if (baseline_fd != -1)
+        return pwrite(baseline_fd, buf, size, offset);
+
+    return logical_write(buf, size, image_offset + offset);
+}
+
+typedef enum _BENCH_OP
+{
+    OpFill,
+    OpSeqRead,
+    OpRandRead,
+    OpRandWrite
+} BENCH_OP;
+
+static const char *bench_op_names[] = {
+    "fill", "seqread", "randread", "randwrite"
+};
+
+static int
+bench_op(BENCH_OP op, char *buf, ULONGLONG size)
+{
+    HISTOGRAM latency;
+    safeio_size_t block = op == OpFill ? FILL_BLOCK_SIZE : bench_block_size;
+    ULONGLONG blocks = size / block;
+    ULONGLONG next = 0;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint64_t start = now_nsec();
+    uint64_t deadline = start + (uint64_t)(bench_seconds * 1e9);
+    double seconds;
+
+    if (blocks == 0)
+        return 1;
+
+    histogram_init(&latency);
+
+    fill_random(buf, block, &state);
+
+    for (;;)
+    {
+        ULONGLONG index;
+        uint64_t op_start;
+        safeio_ssize_t done;
+
+        if (op == OpFill)
+        {
+            if (next == blocks)
+                break;
+
+            index = next++;
+        }
+        else if (op == OpSeqRead)
+        {
+            index = next;
+            next = (next + 1) % blocks;
+        }
+        else
+            index = next_random(&state) % blocks;
+
+        // Change write data so that it is not all the same
+        if (op != OpSeqRead && op != OpRandRead)
+            *(ULONGLONG*)buf = index;
+
+        op_start = now_nsec();
+
+        if (op == OpSeqRead || op == OpRandRead)
+            done = bench_read(buf, block, (off_t_64)(index * block));
+        else
+            done = bench_write(buf, block, (off_t_64)(index * block));
+
+        histogram_add(&latency, now_nsec() - op_start);
+
+        if (done != (safeio_ssize_t)block)
+        {
+            fprintf(stderr, "%s %s: I/O error at " ULL_FMT ": %s\n",
+                bench_case, bench_op_names[op], index * block,
+                done == -1 ? strerror(errno) : "Short transfer");
+            return 0;
+        }
+
+        if (op != OpFill && op_start >= deadline)
+            break;
+    }
+
+    seconds = (now_nsec() - start) / 1e9;
+
+    printf("%-10s %-10s %8u %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+        bench_case, bench_op_names[op], (unsigned int)block,
+        latency.count / seconds,
+        latency.count * (double)block / seconds / 1e6,
+        histogram_mean(&latency) / 1e3,
+        histogram_percentile(&latency, 50) / 1e3,
+        histogram_percentile(&latency, 99) / 1e3);
+
+    return 1;
+}
+
+static int
+bench_run(ULONGLONG size)
+{
+    char *buf = (char*)malloc(FILL_BLOCK_SIZE);
+    int rc;
+
+    if (buf == NULL)
+    {
+        perror("malloc()");
+        return 2;
+    }
+
+    rc = bench_op(OpFill, buf, size) &&
+        bench_op(OpSeqRead, buf, size) &&
+        bench_op(OpRandRead, buf, size) &&
+        bench_op(OpRandWrite, buf, size);
+
+    free(buf);
+
+    fflush(stdout);
+
+    return rc ? 0 : 1;
+}
+
+// Called by devio_main() when image is open, instead of serving clients
+static int
+bench_comm(char *comm_device)
+{
+    int rc;
+
+    // Results go to real stdout, devio messages do not
+    if (saved_stdout != -1)
+    {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+    }
+
+    rc = case_run(devio_info.file_size);
+
+    if (null_stdout != -1)
+        dup2(null_stdout, STDOUT_FILENO);
+
+    return rc;
+}
+
+static int
+write_file(const char *path, const void *data, size_t size, off_t_64 offset)
+{
+    int fd = open(path, O_WRONLY | O_CREAT, 0600);
+
+    if (fd == -1 || pwrite(fd, data, size, offset) != (ssize_t)size)
+    {
+        fprintf(stderr, "Cannot write '%s': %s\n", path, strerror(errno));
+
+        if (fd != -1)
+            close(fd);
+
+        return 0;
+    }
+
+    close(fd);
+
+    return 1;
+}
+
+// Image file with random data, optionally after an area at start
+static int
+create_image(const char *path, off_t_64 start, ULONGLONG size)
+{
+    char *chunk = (char*)malloc(FILL_BLOCK_SIZE);
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    ULONGLONG pos;
+    int fd;
+
+    if (chunk == NULL)
+        return 0;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot create '%s': %s\n", path, strerror(errno));
+        free(chunk);
+        return 0;
+    }
+
+    for (pos = 0; pos < size; pos += FILL_BLOCK_SIZE)
+    {
+        size_t len = size - pos < FILL_BLOCK_SIZE ?
+            (size_t)(size - pos) : FILL_BLOCK_SIZE;
+
+        fill_random(chunk, len, &state);
+
+        if (pwrite(fd, chunk, len, start + pos) != (ssize_t)len)
+        {
+            fprintf(stderr, "Cannot write '%s': %s\n", path,
+                strerror(errno));
+            close(fd);
+            free(chunk);
+            return 0;
+        }
+    }
+
+    close(fd);
+    free(chunk);
+
+    return 1;
+}
+
+// Raw image with an MBR and one partition starting at PARTITION_OFFSET
+static int
+create_partitioned(const char *path, ULONGLONG size)
+{
+    unsigned char mbr[512] = { 0 };
+    unsigned char *entry = mbr + 0x1BE;
+    uint32_t first = PARTITION_OFFSET >> 9;
+    uint32_t sectors = (uint32_t)(size >> 9);
+
+    if (!create_image(path, PARTITION_OFFSET, size))
+        return 0;
+
+    entry[4] = 0x83;
+    memcpy(entry + 8, &first, 4);
+    memcpy(entry + 12, &sectors, 4);
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+
+    return write_file(path, mbr, sizeof(mbr), 0);
+}
+
+static void
+put_be32(unsigned char *p, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(p, &value, 4);
+}
+
+static void
+put_be64(unsigned char *p, uint64_t value)
+{
+    put_be32(p, (uint32_t)(value >> 32));
+    put_be32(p + 4, (uint32_t)value);
+}
+
+static void
+vhd_checksum(unsigned char *data, size_t size, size_t checksum_offset)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        sum += data[i];
+
+    put_be32(data + checksum_offset, ~sum);
+}
+
+// Empty dynamically expanding VHD, blocks are allocated by fill test
+static int
+create_vhd(const char *path, ULONGLONG size)
+{
+    unsigned char footer[512] = { 0 };
+    unsigned char header[1024] = { 0 };
+    uint32_t entries = (uint32_t)((size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE);
+    size_t bat_size = ((size_t)entries * 4 + 511) & ~(size_t)511;
+    unsigned char *bat = (unsigned char*)malloc(bat_size);
+    int fd;
+    int rc;
+
+    if (bat == NULL)
+        return 0;
+
+    memcpy(footer, "conectix", 8);
+    put_be32(footer + 8, 2);
+    put_be32(footer + 12, 0x10000);
+    put_be64(footer + 16, 512);
+    memcpy(footer + 28, "dvio", 4);
+    put_be64(footer + 40, size);
+    put_be64(footer + 48, size);
+    put_be32(footer + 60, 3);
+    vhd_checksum(footer, sizeof(footer), 64);
+
+    memcpy(header, "cxsparse", 8);
+    put_be64(header + 8, (uint64_t)-1);
+    put_be64(header + 16, 512 + sizeof(header));
+    put_be32(header + 24, 0x10000);
+    put_be32(header + 28, entries);
+    put_be32(header + 32, VHD_BLOCK_SIZE);
+    vhd_checksum(header, sizeof(header), 36);
+
+    memset(bat, 0xFF, bat_size);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot create '%s': %s\n", path, strerror(errno));
+        free(bat);
+        return 0;
+    }
+
+    rc = pwrite(fd, footer, sizeof(footer), 0) == sizeof(footer) &&
+        pwrite(fd, header, sizeof(header), 512) == sizeof(header) &&
+        pwrite(fd, bat, bat_size, VHD_BAT_OFFSET) == (ssize_t)bat_size &&
+        pwrite(fd, footer, sizeof(footer), VHD_BAT_OFFSET + bat_size) ==
+        sizeof(footer);
+
+    if (!rc)
+        fprintf(stderr, "Cannot write '%s': %s\n", path, strerror(errno));
+
+    close(fd);
+    free(bat);
+
+    return rc;
+}
+
+// Writes that start and end within bitmap bytes, in first block of a new
+// VHD image. Sector bitmap must have bits set for exactly these sectors.
+static const struct
+{
+    safeio_size_t offset;
+    safeio_size_t size;
+} vhd_alloc_writes[] = {
+    { 2048, 4096 },         // Sectors 4-11, over first byte boundary
+    { 3584, 1024 },         // Sectors 7-8
+    { 10240, 1024 },        // Sectors 20-21, within one byte
+    { 16384 - 512, 8704 }   // Sectors 31-47, over two byte boundaries
+};
+
+// Checks sector bitmap and allocation state after writes to a new VHD
+static int
+vhd_alloc_check(ULONGLONG size)
+{
+    unsigned char expected[VHD_BLOCK_SIZE >> 9 >> 3] = { 0 };
+    unsigned char bitmap[sizeof(expected)];
+    char data[8704];
+    char check[sizeof(data)];
+    unsigned char entry[4];
+    off_t_64 run_end;
+    size_t i;
+    size_t sector;
+    int fd;
+    int rc;
+
+    if (size < 2 * VHD_BLOCK_SIZE)
+    {
+        fprintf(stderr, "%s: Image too small.\n", bench_case);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(vhd_alloc_writes) / sizeof(*vhd_alloc_writes); i++)
+    {
+        safeio_size_t offset = vhd_alloc_writes[i].offset;
+        safeio_size_t len = vhd_alloc_writes[i].size;
+
+        memset(data, (int)(i + 1), len);
+
+        if (logical_write(data, len, image_offset + offset) !=
+            (safeio_ssize_t)len ||
+            logical_read(check, len, image_offset + offset) !=
+            (safeio_ssize_t)len ||
+            memcmp(data, check, len) != 0)
+        {
+            fprintf(stderr, "%s: Write at %u not read back.\n", bench_case,
+                (unsigned int)offset);
+            return 1;
+        }
+
+        for (sector = offset >> 9; sector <= (offset + len - 1) >> 9; sector++)
+            expected[sector >> 3] |= (unsigned char)(0x80 >> (sector & 7));
+    }
+
+    if (image_allocation(image_offset, image_offset + size, &run_end) !=
+        AllocationMapped || run_end != image_offset + VHD_BLOCK_SIZE ||
+        image_allocation(image_offset + VHD_BLOCK_SIZE, image_offset + size,
+            &run_end) != AllocationUnmapped)
+    {
+        fprintf(stderr, "%s: Wrong allocation state.\n", bench_case);
+        return 1;
+    }
+
+    fd = open(vhd_path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot open '%s': %s\n", vhd_path, strerror(errno));
+        return 1;
+    }
+
+    rc = pread(fd, entry, sizeof(entry), VHD_BAT_OFFSET) == sizeof(entry) &&
+        pread(fd, bitmap, sizeof(bitmap),
+            (off_t_64)ntohl(*(uint32_t*)entry) << 9) == sizeof(bitmap);
+
+    close(fd);
+
+    if (!rc || memcmp(bitmap, expected, sizeof(bitmap)) != 0)
+    {
+        fprintf(stderr, "%s: Wrong sector bitmap.\n", bench_case);
+        return 1;
+    }
+
+    printf("%-10s %-10s passed\n", bench_case, "bitmap");
+    fflush(stdout);
+
+    return 0;
+}
+
+// Runs devio setup for image spec in a child process, with benchmark
+// instead of client communication.
+static int
+run_case(const char *name, const char *spec, const char *partition,
+    int verbose)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+
+    pid = fork();
+
+    if (pid == -1)
+    {
+        perror("fork()");
+        return 0;
+    }
+
+    if (pid == 0)
+    {
+        char *args[5];
+
+        args[0] = "devio";
+        args[1] = "bench";
+        args[2] = (char*)spec;
+        args[3] = (char*)partition;
+        args[4] = NULL;
+
+        bench_case = name;
+        devio_comm = bench_comm;
+
+        if (strcmp(name, "vhdalloc") == 0)
+        {
+            case_run = vhd_alloc_check;
+            vhd_path = spec;
+        }
+
+        if (!verbose)
+        {
+            null_stdout = open("/dev/null", O_WRONLY);
+
+            if (null_stdout != -1)
+            {
+                saved_stdout = dup(STDOUT_FILENO);
+                dup2(null_stdout, STDOUT_FILENO);
+            }
+        }
+
+        exit(devio_main(4, args));
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "Test case %s failed.\n", name);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+run_baseline(const char *path)
+{
+    int rc;
+
+    // Same open flags as devio uses for image files
+    baseline_fd = open(path, O_RDWR | O_SYNC);
+
+    if (baseline_fd == -1)
+    {
+        fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    bench_case = "pread";
+
+    rc = bench_run(image_size) == 0;
+
+    close(baseline_fd);
+    baseline_fd = -1;
+
+    return rc;
+}
+
+static int
+selected(int argc, char **argv, const char *name)
+{
+    int i;
+
+    if (argc == 0)
+        return 1;
+
+    for (i = 0; i < argc; i++)
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *case_names[] = {
+        "pread", "raw", "partition", "vhd", "vhdalloc", "stripe", "overlay"
+    };
+    const char *dir = getenv("TMPDIR");
+    char raw[512], part[512], vhd[512], member1[512], member2[512];
+    char delta[512], spec[2048];
+    ULONGLONG value;
+    int verbose = 0;
+    int failed = 0;
+    int keep = 0;
+    int usage = 0;
+    int opt;
+    size_t c;
+
+    if (dir == NULL)
+        dir = "/tmp";
+
+    while ((opt = getopt(argc, argv, "s:b:t:d:kv")) != -1)
+        switch (opt)
+        {
+        case 's':
+            if (!parse_size(optarg, &image_size) ||
+                image_size < FILL_BLOCK_SIZE)
+                usage = 1;
+            break;
+
+        case 'b':
+            if (!parse_size(optarg, &value) || value == 0 ||
+                value > FILL_BLOCK_SIZE)
+                usage = 1;
+            bench_block_size = (safeio_size_t)value;
+            break;
+
+        case 't':
+            bench_seconds = strtod(optarg, NULL);
+            break;
+
+        case 'd':
+            dir = optarg;
+            break;
+
+        case 'k':
+            keep = 1;
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        default:
+            usage = 1;
+        }
+
+    for (c = optind; c < (size_t)argc; c++)
+    {
+        size_t i;
+
+        for (i = 0; i < sizeof(case_names) / sizeof(*case_names); i++)
+            if (strcmp(argv[c], case_names[i]) == 0)
+                break;
+
+        if (i == sizeof(case_names) / sizeof(*case_names))
+            usage = 1;
+    }
+
+    if (usage || bench_seconds <= 0)
+    {
+        fprintf(stderr,
+            "devbench - devio image layer benchmark ver " DEVIO_VERSION "\n"
+            "\n"
+            "Usage:\n"
+            "devbench [-s size] [-b blocksize] [-t seconds] [-d directory] [-k] [-v]\n"
+            "         [case...]\n"
+            "\n"
+            "Creates synthetic images and measures devio read and write paths\n"
+            "directly, without client communication. Cases are:\n"
+            "\n"
+            "pread      pread/pwrite on raw image without devio, as baseline.\n"
+            "raw        Raw image file.\n"
+            "partition  Partition in an image with a master boot record.\n"
+            "vhd        Dynamically expanding VHD image, blocks allocated by fill.\n"
+            "vhdalloc   Checks VHD sector bitmap and allocation after small writes.\n"
+            "stripe     Built-in stripe backend with two members.\n"
+            "overlay    Built-in overlay backend with raw image as base.\n"
+            "\n"
+            "Default is all cases, %i MB images, %i byte blocks, %.1f s per test.\n"
+            "Images are created in TMPDIR or /tmp and removed unless -k is given.\n"
+            "-v shows devio messages.\n",
+            DEF_IMAGE_SIZE >> 20, DEF_BLOCK_SIZE, DEF_SECONDS);
+        return -1;
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    snprintf(raw, sizeof(raw), "%s/devbench.%i.raw", dir, (int)getpid());
+    snprintf(part, sizeof(part), "%s/devbench.%i.part", dir, (int)getpid());
+    snprintf(vhd, sizeof(vhd), "%s/devbench.%i.vhd", dir, (int)getpid());
+    snprintf(member1, sizeof(member1), "%s/devbench.%i.m1", dir,
+        (int)getpid());
+    snprintf(member2, sizeof(member2), "%s/devbench.%i.m2", dir,
+        (int)getpid());
+    snprintf(delta, sizeof(delta), "%s/devbench.%i.delta", dir,
+        (int)getpid());
+
+    printf("%-10s %-10s %8s %10s %9s %9s %9s %9s\n",
+        "case", "test", "block", "IOPS", "MB/s", "avg usec", "p50 usec",
+        "p99 usec");
+
+    if (selected(argc, argv, "pread") || selected(argc, argv, "raw") ||
+        selected(argc, argv, "overlay"))
+        if (!create_image(raw, 0, image_size))
+            return 1;
+
+    if (selected(argc, argv, "pread"))
+        failed |= !run_baseline(raw);
+
+    if (selected(argc, argv, "raw"))
+        failed |= !run_case("raw", raw, "0", verbose);
+
+    if (selected(argc, argv, "partition"))
+    {
+        if (create_partitioned(part, image_size))
+            failed |= !run_case("partition", part, "1", verbose);
+        else
+            failed = 1;
+    }
+
+    if (selected(argc, argv, "vhd"))
+    {
+        if (create_vhd(vhd, image_size))
+            failed |= !run_case("vhd", vhd, "0", verbose);
+        else
+            failed = 1;
+    }
+
+    if (selected(argc, argv, "vhdalloc"))
+    {
+        if (create_vhd(vhd, image_size))
+            failed |= !run_case("vhdalloc", vhd, "0", verbose);
+        else
+            failed = 1;
+    }
+
+    if (selected(argc, argv, "stripe"))
+    {
+        if (create_image(member1, 0, image_size / 2) &&
+            create_image(member2, 0, image_size / 2))
+        {
+            snprintf(spec, sizeof(spec), "stripe:%s" MULTI_CONTAINER_DELIMITER
+                "%s", member1, member2);
+            failed |= !run_case("stripe", spec, "0", verbose);
+        }
+        else
+            failed = 1;
+    }
+
+    if (selected(argc, argv, "overlay"))
+    {
+        unlink(delta);
+        snprintf(spec, sizeof(spec), "overlay,delta=%s:%s", delta, raw);
+        failed |= !run_case("overlay", spec, "0", verbose);
+    }
+
+    if (!keep)
+    {
+        unlink(raw);
+        unlink(part);
+        unlink(vhd);
+        unlink(member1);
+        unlink(member2);
+        unlink(delta);
+    }
+
+    return failed;
+}
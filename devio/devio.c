@@ -178,11 +178,14 @@ OVERLAPPED drv_request_io;
 
 #include <syslog.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
 
 #endif
 
@@ -190,11 +193,30 @@ OVERLAPPED drv_request_io;
 #include "devio_types.h"
 #include "safeio.h"
 #include "devio.h"
+#include "byteswap.h"
+#include "backend.h"
+#include "snapshot.h"
+#include "cbt.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "qos.h"
+#include "credits.h"
+#include "placement.h"
+#include "parallel.h"
+#include "lz.h"
+#include "crc32c.h"
 
 #ifndef O_DIRECT
 #define O_DIRECT 0
 #endif
 
+// Defined with _GNU_SOURCE only in glibc headers
+#if defined(__linux__) && !defined(SEEK_DATA)
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
 #ifndef O_FSYNC
 #define O_FSYNC 0
 #endif
@@ -215,7 +237,7 @@ int64_t GetBigEndian64(int8_t *storage)
     int64_t number = 0;
     for (i = 0; i < sizeof(int64_t); i++)
     {
-        number |= (int64_t)storage[i] << ((sizeof(int64_t) - i - 1) << 3);
+        number |= (int64_t)(uint8_t)storage[i] << ((sizeof(int64_t) - i - 1) << 3);
     }
     return number;
 }
@@ -247,6 +269,42 @@ char dll_mode = 0;
 char drv_mode = 0;
 char vhd_mode = 0;
 char auto_vhd_detect = 1;
+char byteswap_mode = 0;
+
+const char *snapshot_spec = NULL;
+const char *cbt_spec = NULL;
+char cbt_mode = 0;
+const char *metrics_spec = NULL;
+char metrics_mode = 0;
+const char *trace_spec = NULL;
+const char *qos_spec = NULL;
+const char *sched_spec = NULL;
+const char *credits_spec = NULL;
+const char *placement_spec = NULL;
+const char *workers_spec = NULL;
+
+// Options enabled by client with IMDPROXY_REQ_SET_OPTIONS
+ULONGLONG conn_options = 0;
+
+// Compressed payloads, and statistics for them
+char *lz_buf = NULL;
+safeio_size_t lz_buf_size = 0;
+uint64_t lz_read_bytes = 0;
+uint64_t lz_read_stored = 0;
+uint64_t lz_write_bytes = 0;
+uint64_t lz_write_stored = 0;
+uint64_t lz_usec = 0;
+
+// Write requests rejected because of checksum mismatch
+uint64_t crc32c_errors = 0;
+
+// Range in unmap and zero requests, same layout as DEVICE_DATA_SET_RANGE
+// sent by drivers.
+typedef struct _DEVIO_RANGE
+{
+    int64_t offset;
+    uint64_t length;
+} DEVIO_RANGE, *PDEVIO_RANGE;
 
 struct _VHD_INFO
 {
@@ -389,8 +447,8 @@ int alloc_drv_buffer()
         buffer_size = detected_buffer_size;
         if (buf2 != NULL)
         {
-            free(buf2);
-            buf2 = (char*)malloc(buffer_size);
+            placement_free(buf2);
+            buf2 = (char*)placement_alloc(buffer_size);
             if (buf2 == NULL)
             {
                 syslog(LOG_ERR, "malloc() failed: %m\n");
@@ -619,7 +677,7 @@ buf_realloc(ULONGLONG new_size)
         {
             memcpy(shm_view, existing_shm_view, IMDPROXY_HEADER_SIZE);
             UnmapViewOfFile(existing_shm_view);
-            free(existing_buf2);
+            placement_free(existing_buf2);
         }
         else
         {
@@ -632,27 +690,95 @@ buf_realloc(ULONGLONG new_size)
     else
 #endif
     {
-        char *new_buf = (char*)malloc(buffer_size);
-        char *new_buf2 = (char*)malloc(buffer_size);
+        char *new_buf = (char*)placement_alloc(buffer_size);
+        char *new_buf2 = (char*)placement_alloc(buffer_size);
         if (new_buf == NULL || new_buf2 == NULL)
         {
             syslog(LOG_ERR, "Failed allocating new buffer: %m\n");
 
-            if (new_buf != NULL)
-                free(new_buf);
-            if (new_buf2 != NULL)
-                free(new_buf2);
+            placement_free(new_buf);
+            placement_free(new_buf2);
         }
         else
         {
-            free(buf);
+            placement_free(buf);
             buf = new_buf;
-            free(buf2);
+            placement_free(buf2);
             buf2 = new_buf2;
         }
     }
 }
 
+// Socket and pipe connections are framed through receive and send buffers.
+// Headers of several pipelined requests are parsed out of one receive, and
+// response headers and small payloads are collected until comm_flush() or
+// sent together with a following large payload in one gathered write.
+
+#define COMM_BUF_SIZE           (64 << 10)
+#define COMM_COPY_SIZE          (16 << 10)
+
+char comm_rbuf[COMM_BUF_SIZE];
+safeio_size_t comm_rpos = 0;
+safeio_size_t comm_rend = 0;
+
+char comm_wbuf[COMM_BUF_SIZE];
+safeio_size_t comm_wlen = 0;
+
+uint64_t comm_messages = 0;
+uint64_t comm_receives = 0;
+uint64_t comm_sends = 0;
+
+// Receives at least size bytes in receive buffer. Without wait, only data
+// the connection already has is received, which is only supported for
+// sockets on Unix.
+static int
+comm_fill(safeio_size_t size, int wait)
+{
+    if (comm_rpos > 0)
+    {
+        memmove(comm_rbuf, comm_rbuf + comm_rpos, comm_rend - comm_rpos);
+        comm_rend -= comm_rpos;
+        comm_rpos = 0;
+    }
+
+    while (comm_rend < size)
+    {
+        safeio_ssize_t done;
+
+        if (wait)
+            done = safe_read_some(sd, comm_rbuf + comm_rend,
+                COMM_BUF_SIZE - comm_rend);
+        else
+#ifdef _WIN32
+            return 0;
+#else
+            done = recv(sd, comm_rbuf + comm_rend, COMM_BUF_SIZE - comm_rend,
+                MSG_DONTWAIT);
+#endif
+
+        if (done <= 0)
+            return 0;
+
+        comm_rend += (safeio_size_t)done;
+        ++comm_receives;
+    }
+
+    return 1;
+}
+
+// Copies next size bytes without consuming them, at most COMM_BUF_SIZE.
+int
+comm_peek(void *io_ptr, safeio_size_t size, int wait)
+{
+    if (shm_mode || drv_mode ||
+        (comm_rend - comm_rpos < size && !comm_fill(size, wait)))
+        return 0;
+
+    memcpy(io_ptr, comm_rbuf + comm_rpos, size);
+
+    return 1;
+}
+
 int
 comm_flush()
 {
@@ -660,6 +786,15 @@ comm_flush()
         return shm_flush();
     else if (drv_mode)
         return drv_flush();
+    else if (comm_wlen > 0)
+    {
+        safeio_size_t size = comm_wlen;
+
+        comm_wlen = 0;
+        ++comm_sends;
+
+        return safe_write(sd, comm_wbuf, size);
+    }
     else
         return 1;
 }
@@ -667,19 +802,71 @@ comm_flush()
 int
 comm_read(void *io_ptr, safeio_size_t size)
 {
+    safeio_size_t avail;
+
     if (shm_mode || drv_mode)
         return shm_read(io_ptr, size);
-    else
+
+    ++comm_messages;
+
+    avail = comm_rend - comm_rpos;
+
+    if (avail >= size)
+    {
+        memcpy(io_ptr, comm_rbuf + comm_rpos, size);
+        comm_rpos += size;
+        return 1;
+    }
+
+    memcpy(io_ptr, comm_rbuf + comm_rpos, avail);
+    io_ptr = (char*)io_ptr + avail;
+    size -= avail;
+    comm_rpos = comm_rend = 0;
+
+    // Large payloads are received directly
+    if (size >= COMM_BUF_SIZE)
         return safe_read(sd, io_ptr, size);
+
+    if (!comm_fill(size, 1))
+        return 0;
+
+    memcpy(io_ptr, comm_rbuf, size);
+    comm_rpos = size;
+
+    return 1;
 }
 
 int
 comm_write(const void *io_ptr, safeio_size_t size)
 {
+    safeio_size_t buffered;
+
     if (shm_mode || drv_mode)
         return shm_write(io_ptr, size);
-    else
-        return safe_write(sd, io_ptr, size);
+
+    if (size <= COMM_COPY_SIZE && size <= COMM_BUF_SIZE - comm_wlen)
+    {
+        memcpy(comm_wbuf + comm_wlen, io_ptr, size);
+        comm_wlen += size;
+        return 1;
+    }
+
+    buffered = comm_wlen;
+    comm_wlen = 0;
+    ++comm_sends;
+
+    return safe_write_pair(sd, comm_wbuf, buffered, io_ptr, size);
+}
+
+void
+print_comm_stats()
+{
+    if (comm_messages == 0 || shm_mode || drv_mode)
+        return;
+
+    printf("Framing: " ULL_FMT " messages in " ULL_FMT " receives, "
+        ULL_FMT " sends.\n", (ULONGLONG)comm_messages,
+        (ULONGLONG)comm_receives, (ULONGLONG)comm_sends);
 }
 
 int
@@ -757,6 +944,9 @@ vhd_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
         return (safeio_ssize_t)-1;
     }
 
+    devio_probe2(vhd__block__lookup, block_number,
+        block_offset != 0xFFFFFFFF);
+
     memset(io_ptr, 0, size);
 
     if (block_offset == 0xFFFFFFFF)
@@ -803,6 +993,10 @@ vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
     safeio_ssize_t writedone;
     off_t_64 bitmap_offset;
     safeio_size_t bitmap_datasize;
+    safeio_size_t first_sector;
+    safeio_size_t last_sector;
+    unsigned int first_mask;
+    unsigned int last_mask;
     safeio_size_t first_size_nqwords;
 
     dbglog((LOG_ERR, "vhd_write: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
@@ -833,6 +1027,9 @@ vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
         return (safeio_ssize_t)-1;
     }
 
+    devio_probe2(vhd__block__lookup, block_number,
+        block_offset != 0xFFFFFFFF);
+
     // Alocate a new block if not already defined
     if (block_offset == 0xFFFFFFFF)
     {
@@ -934,6 +1131,8 @@ vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
         }
 
         free(new_block_buf);
+
+        devio_probe2(vhd__block__alloc, block_number, block_offset_bytes);
     }
 
     // Calculate where actual data should be written
@@ -946,15 +1145,42 @@ vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
     if (writedone == -1)
         return (safeio_ssize_t)-1;
 
-    // Calculate where and how many bytes in allocation bitmap we need to update
+    // Calculate where and how many bytes in allocation bitmap we need to
+    // update, from byte with bit for first sector written to byte with bit
+    // for last sector written
+    first_sector = in_block_offset >> sector_shift;
+    last_sector = (in_block_offset + first_size - 1) >> sector_shift;
+
     bitmap_offset = ((off_t_64)block_offset << sector_shift) +
-        (in_block_offset >> sector_shift >> 3);
+        (first_sector >> 3);
+
+    bitmap_datasize = (last_sector >> 3) - (first_sector >> 3) + 1;
+
+    readdone = physical_read(buf2, bitmap_datasize, bitmap_offset);
+    if (readdone != (safeio_ssize_t)bitmap_datasize)
+    {
+        syslog(LOG_ERR, "vhd_write: Error reading block bitmap: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return (safeio_ssize_t)-1;
+    }
 
-    bitmap_datasize =
-        (((first_size + sector_size - 1) >> sector_shift) + 7) >> 3;
+    // Set bits as 'allocated'. Bit for first sector in a byte is the most
+    // significant bit, bits for sectors not written in first and last byte
+    // are kept as they are.
+    first_mask = 0xFF >> (first_sector & 7);
+    last_mask = (0xFF << (7 - (last_sector & 7))) & 0xFF;
 
-    // Set bits as 'allocated'
-    memset(buf2, 0xFF, bitmap_datasize);
+    if (bitmap_datasize == 1)
+        buf2[0] |= (char)(first_mask & last_mask);
+    else
+    {
+        buf2[0] |= (char)first_mask;
+        memset(buf2 + 1, 0xFF, bitmap_datasize - 2);
+        buf2[bitmap_datasize - 1] |= (char)last_mask;
+    }
 
     // Update allocation bitmap
     readdone = physical_write(buf2, bitmap_datasize, bitmap_offset);
@@ -982,8 +1208,8 @@ vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
     return writedone;
 }
 
-safeio_ssize_t
-logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+static safeio_ssize_t
+image_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
 {
     if (vhd_mode)
         return vhd_read(io_ptr, size, offset);
@@ -991,8 +1217,8 @@ logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
         return physical_read(io_ptr, size, offset);
 }
 
-safeio_ssize_t
-logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+static safeio_ssize_t
+image_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
 {
     if (vhd_mode)
         return vhd_write(io_ptr, size, offset);
@@ -1000,73 +1226,2073 @@ logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
         return physical_write(io_ptr, size, offset);
 }
 
-int
-read_data()
+// Finds allocation state at offset in VHD image from block allocation table,
+// and sets *run_end to end of that block. Sector bitmaps are not used, since
+// vhd_read returns block contents for all sectors of an allocated block and
+// images written by earlier versions may have bits missing in the bitmap.
+static int
+vhd_allocation(off_t_64 offset, off_t_64 end, off_t_64 *run_end)
 {
-    IMDPROXY_READ_REQ req_block = { 0 };
-    IMDPROXY_READ_RESP resp_block = { 0 };
-    safeio_size_t size;
-    safeio_ssize_t readdone;
+    off_t_64 block_number = offset >> block_shift;
+    off_t_64 block_end = (block_number << block_shift) + block_size;
+    uint32_t block_offset;
 
-    if (!comm_read(&req_block.offset,
-        sizeof(req_block) - sizeof(req_block.request_code)))
+    if (block_end > end)
+        block_end = end;
+
+    *run_end = block_end;
+
+    if (physical_read(&block_offset, sizeof(block_offset),
+        table_offset + (block_number << 2)) != sizeof(block_offset))
+        return -1;
+
+    return block_offset == 0xFFFFFFFF ? AllocationUnmapped : AllocationMapped;
+}
+
+// Finds allocation state at offset in image file from holes in file, and
+// sets *run_end to where that state ends.
+static int
+file_allocation(off_t_64 offset, off_t_64 end, off_t_64 *run_end)
+{
+#ifdef _WIN32
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER range;
+    DWORD dw;
+
+    query.FileOffset.QuadPart = offset;
+    query.Length.QuadPart = end - offset;
+
+    *run_end = end;
+
+    if (!DeviceIoControl((HANDLE)_get_osfhandle(image_fd),
+        FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+        &range, sizeof(range), &dw, NULL) &&
+        GetLastError() != ERROR_MORE_DATA)
+        return AllocationMapped;
+
+    if (dw < sizeof(range))
+        return AllocationUnmapped;
+
+    if (range.FileOffset.QuadPart > offset)
     {
-        syslog(LOG_ERR, "Error reading request header.\n");
-        return 0;
+        *run_end = range.FileOffset.QuadPart;
+        return AllocationUnmapped;
     }
 
-    if (req_block.length > buffer_size) // we will need larger buffer to complete this request
+    if (range.FileOffset.QuadPart + range.Length.QuadPart < end)
+        *run_end = range.FileOffset.QuadPart + range.Length.QuadPart;
+
+    return AllocationMapped;
+#elif defined(SEEK_DATA)
+    off_t_64 data = lseek(image_fd, offset, SEEK_DATA);
+    off_t_64 hole;
+
+    *run_end = end;
+
+    if (data == -1)
+        return errno == ENXIO ? AllocationUnmapped : AllocationMapped;
+
+    if (data > offset)
     {
-        buf_realloc(req_block.length);
+        if (data < end)
+            *run_end = data;
+
+        return AllocationUnmapped;
     }
 
-    size = (safeio_size_t)
-        (req_block.length < buffer_size ? req_block.length : buffer_size);
+    hole = lseek(image_fd, offset, SEEK_HOLE);
 
-    dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + "
-        ULL_FMT " = " ULL_FMT ".\n",
-        req_block.length, req_block.offset, image_offset,
-        req_block.offset + image_offset));
+    if (hole > offset && hole < end)
+        *run_end = hole;
 
-    memset(buf, 0, size);
+    return AllocationMapped;
+#else
+    *run_end = end;
 
-    readdone =
-        logical_read(buf, (safeio_size_t)size, (off_t_64)(image_offset + req_block.offset));
+    return AllocationMapped;
+#endif
+}
 
-    if (readdone == -1)
+// Returns allocation state at offset, or -1 on error, and sets *run_end to
+// where that state ends, limited to end. Image data that cannot be examined
+// is reported as mapped.
+int
+image_allocation(off_t_64 offset, off_t_64 end, off_t_64 *run_end)
+{
+    // Data may be stored outside image while snapshots are kept
+    if (snapshot_enabled)
     {
-        resp_block.errorno = errno;
-        resp_block.length = 0;
-        syslog(LOG_ERR, "Device read: %m\n");
+        *run_end = end;
+        return AllocationMapped;
     }
-    else
-    {
-        resp_block.errorno = 0;
-        resp_block.length = size;
 
-        if (req_block.length != readdone)
-        {
-            syslog(LOG_ERR,
-                "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
-                (int64_t)(image_offset + req_block.offset), (int64_t)readdone, req_block.length);
-        }
+    if (vhd_mode)
+        return vhd_allocation(offset, end, run_end);
+
+    if (dll_mode)
+    {
+        *run_end = end;
+        return AllocationMapped;
     }
 
-    dbglog((LOG_ERR, "read done reporting/sending " ULL_FMT " bytes.\n",
-        resp_block.length));
+    return file_allocation(offset, end, run_end);
+}
 
-    if (!comm_write(&resp_block, sizeof resp_block))
+safeio_ssize_t
+logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_ssize_t readdone;
+
+    if (snapshot_enabled)
+        readdone = snapshot_read(0, io_ptr, size, offset);
+    else
+        readdone = image_read(io_ptr, size, offset);
+
+    if (byteswap_mode && readdone > 0)
+        byteswap16_buffer(io_ptr, (safeio_size_t)readdone);
+
+    return readdone;
+}
+
+// Note that in byte-swap mode, data at io_ptr is swapped in place.
+safeio_ssize_t
+logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    if (cbt_enabled && !cbt_mark(offset, size))
+        return -1;
+
+    if (byteswap_mode)
+        byteswap16_buffer(io_ptr, size);
+
+    if (snapshot_enabled)
+        return snapshot_write(io_ptr, size, offset);
+    else
+        return image_write(io_ptr, size, offset);
+}
+
+static int
+lz_buf_alloc(safeio_size_t size)
+{
+    safeio_size_t new_size = LZ_COMPRESS_BOUND(size);
+    char *new_buf;
+
+    if (new_size <= lz_buf_size)
+        return 1;
+
+    new_buf = (char*)realloc(lz_buf, new_size);
+
+    if (new_buf == NULL)
+        return 0;
+
+    lz_buf = new_buf;
+    lz_buf_size = new_size;
+
+    return 1;
+}
+
+// Sends read data, compressed if that saves at least 1/32 of size.
+int
+send_payload(const char *data, safeio_size_t size)
+{
+    IMDPROXY_PAYLOAD_HEADER header;
+    safeio_size_t packed = 0;
+    uint64_t start = backend_time_usec();
+
+    if (size >= 64 && lz_buf_alloc(size))
+        packed = lz_compress(data, size, lz_buf, size - size / 32);
+
+    lz_usec += backend_time_usec() - start;
+
+    header.stored_length = packed != 0 ? packed : size;
+
+    lz_read_bytes += size;
+    lz_read_stored += header.stored_length;
+
+    if (!comm_write(&header, sizeof header))
+        return 0;
+
+    if (packed != 0)
+        return comm_write(lz_buf, packed);
+    else
+        return comm_write(data, size);
+}
+
+// Receives write data, which may be compressed.
+int
+receive_payload(char *data, safeio_size_t size)
+{
+    IMDPROXY_PAYLOAD_HEADER header;
+    uint64_t start;
+    safeio_ssize_t unpacked;
+
+    if (!comm_read(&header, sizeof header))
+        return 0;
+
+    lz_write_bytes += size;
+    lz_write_stored += header.stored_length;
+
+    if (header.stored_length == size)
+        return comm_read(data, size);
+
+    if (header.stored_length > LZ_COMPRESS_BOUND((ULONGLONG)size) ||
+        !lz_buf_alloc(size) ||
+        !comm_read(lz_buf, (safeio_size_t)header.stored_length))
+        return 0;
+
+    start = backend_time_usec();
+
+    unpacked = lz_decompress(lz_buf, (safeio_size_t)header.stored_length,
+        data, size);
+
+    lz_usec += backend_time_usec() - start;
+
+    if (unpacked != (safeio_ssize_t)size)
     {
-        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        syslog(LOG_ERR, "Invalid compressed data in write request.\n");
         return 0;
     }
 
-    if (resp_block.errorno == 0)
-        if (!comm_write(buf, (safeio_size_t)resp_block.length))
-        {
-            syslog(LOG_ERR, "Error sending read response to caller.\n");
-            return 0;
-        }
+    return 1;
+}
+
+int
+send_trailer(const char *data, safeio_size_t size)
+{
+    IMDPROXY_PAYLOAD_TRAILER trailer;
+
+    trailer.crc32c = crc32c(0, data, size);
+
+    return comm_write(&trailer, sizeof trailer);
+}
+
+// Receives checksum for write data. Returns -1 if it could not be
+// received, zero if it does not match.
+int
+receive_trailer(const char *data, safeio_size_t size)
+{
+    IMDPROXY_PAYLOAD_TRAILER trailer;
+
+    if (!comm_read(&trailer, sizeof trailer))
+        return -1;
+
+    if (trailer.crc32c == crc32c(0, data, size))
+        return 1;
+
+    ++crc32c_errors;
+
+    return 0;
+}
+
+void
+print_payload_stats()
+{
+    if (crc32c_errors != 0)
+        printf("CRC32C: " ULL_FMT " write requests rejected.\n",
+            (ULONGLONG)crc32c_errors);
+
+    if (lz_read_bytes == 0 && lz_write_bytes == 0)
+        return;
+
+    printf("Compression: Read " ULL_FMT " bytes, sent " ULL_FMT " (%.1f %%). "
+        "Written " ULL_FMT " bytes, received " ULL_FMT " (%.1f %%).\n"
+        "Compression CPU time %.3f s, %.1f MB/s.\n",
+        (ULONGLONG)lz_read_bytes, (ULONGLONG)lz_read_stored,
+        lz_read_bytes != 0 ? 100.0 * lz_read_stored / lz_read_bytes : 0.0,
+        (ULONGLONG)lz_write_bytes, (ULONGLONG)lz_write_stored,
+        lz_write_bytes != 0 ? 100.0 * lz_write_stored / lz_write_bytes : 0.0,
+        lz_usec / 1e6,
+        lz_usec != 0 ?
+        (double)(lz_read_bytes + lz_write_bytes) / lz_usec : 0.0);
+}
+
+// Window for the client after options and read and write responses, if
+// enabled on the connection.
+int
+send_credits()
+{
+    IMDPROXY_CREDITS credits;
+
+    if (!(conn_options & IMDPROXY_OPTION_CREDITS))
+        return 1;
+
+    credits_grant(&credits);
+
+    return comm_write(&credits, sizeof credits);
+}
+
+int
+set_options()
+{
+    IMDPROXY_OPTIONS_REQ req_block = { 0 };
+    IMDPROXY_OPTIONS_RESP resp_block = { 0 };
+
+    if (!comm_read(&req_block.options,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    if ((req_block.options & IMDPROXY_OPTION_COMPRESSION) &&
+        lz_buf_alloc(buffer_size))
+        resp_block.options |= IMDPROXY_OPTION_COMPRESSION;
+
+    if (req_block.options & IMDPROXY_OPTION_CRC32C)
+        resp_block.options |= IMDPROXY_OPTION_CRC32C;
+
+    if ((req_block.options & IMDPROXY_OPTION_CREDITS) && credits_enabled &&
+        !shm_mode && !drv_mode)
+        resp_block.options |= IMDPROXY_OPTION_CREDITS;
+
+    conn_options = resp_block.options;
+
+    if (conn_options & IMDPROXY_OPTION_COMPRESSION)
+        puts("Compressing data on this connection.");
+
+    if (conn_options & IMDPROXY_OPTION_CRC32C)
+        puts("Checksumming data on this connection.");
+
+    if (conn_options & IMDPROXY_OPTION_CREDITS)
+        puts("Granting credits on this connection.");
+
+    if (!comm_write(&resp_block, sizeof resp_block) || !send_credits())
+    {
+        syslog(LOG_ERR, "Error sending options response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Streaming of large read and write requests through a few fixed size chunk
+// buffers. An I/O thread reads or writes image data a few chunks ahead of
+// the connection thread sending or receiving them, and the request buffer
+// is not grown for these requests. Used for requests larger than a chunk,
+// except on shared memory connections, with compressed payloads that are
+// only sent complete, and for writes with checksums that have to match
+// before anything is written.
+
+#define STREAM_CHUNK_SIZE       (1 << 20)
+#define STREAM_CHUNKS           4
+
+typedef enum _STREAM_STATE
+{
+    StreamIdle,
+    StreamQueued,           // Waiting for or served by I/O thread
+    StreamDone
+} STREAM_STATE;
+
+typedef struct _STREAM_CHUNK
+{
+    char *data;
+    safeio_size_t size;
+    off_t_64 offset;
+    int is_write;
+    volatile STREAM_STATE state;
+    safeio_ssize_t result;
+    int errorno;
+} STREAM_CHUNK, *PSTREAM_CHUNK;
+
+// Chunks are submitted and served in ring order
+STREAM_CHUNK stream_chunks[STREAM_CHUNKS];
+int stream_head = 0;
+int stream_ready = 0;       // 1 when set up, -1 when not possible
+
+uint64_t stream_requests = 0;
+uint64_t stream_bytes = 0;
+
+#ifndef _WIN32
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stream_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t stream_done = PTHREAD_COND_INITIALIZER;
+int stream_threaded = 0;
+#endif
+
+static void
+stream_serve(PSTREAM_CHUNK chunk)
+{
+    if (chunk->is_write)
+        chunk->result = logical_write(chunk->data, chunk->size,
+            chunk->offset);
+    else
+    {
+        memset(chunk->data, 0, chunk->size);
+        chunk->result = logical_read(chunk->data, chunk->size,
+            chunk->offset);
+    }
+
+    chunk->errorno = chunk->result == -1 ? errno : 0;
+}
+
+#ifndef _WIN32
+static void *
+stream_io_thread(void *param)
+{
+    int next = 0;
+
+    (void)param;
+
+    placement_pin_thread();
+
+    for (;;)
+    {
+        PSTREAM_CHUNK chunk = stream_chunks + next;
+
+        pthread_mutex_lock(&stream_lock);
+
+        while (chunk->state != StreamQueued)
+            pthread_cond_wait(&stream_queued, &stream_lock);
+
+        pthread_mutex_unlock(&stream_lock);
+
+        stream_serve(chunk);
+
+        pthread_mutex_lock(&stream_lock);
+        chunk->state = StreamDone;
+        pthread_cond_signal(&stream_done);
+        pthread_mutex_unlock(&stream_lock);
+
+        next = (next + 1) % STREAM_CHUNKS;
+    }
+
+    return NULL;
+}
+#endif
+
+// Allocates chunk buffers and starts I/O thread on first use. Without the
+// thread, chunks are served directly when submitted.
+static int
+stream_init()
+{
+    char *data;
+    int i;
+
+    if (stream_ready != 0)
+        return stream_ready > 0;
+
+    stream_ready = -1;
+
+    data = (char*)placement_alloc((size_t)STREAM_CHUNK_SIZE * STREAM_CHUNKS);
+
+    if (data == NULL)
+    {
+        syslog(LOG_ERR, "Cannot allocate stream buffers: %m\n");
+        return 0;
+    }
+
+    for (i = 0; i < STREAM_CHUNKS; i++)
+        stream_chunks[i].data = data + (size_t)STREAM_CHUNK_SIZE * i;
+
+#ifndef _WIN32
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, stream_io_thread, NULL) == 0)
+        {
+            pthread_detach(thread);
+            stream_threaded = 1;
+        }
+        else
+            syslog(LOG_ERR, "Cannot start stream I/O thread: %m\n");
+    }
+#endif
+
+    stream_ready = 1;
+
+    return 1;
+}
+
+static int
+stream_possible(ULONGLONG request_code, ULONGLONG length)
+{
+    if (shm_mode || drv_mode || length <= STREAM_CHUNK_SIZE ||
+        (conn_options & IMDPROXY_OPTION_COMPRESSION) ||
+        (request_code == IMDPROXY_REQ_WRITE &&
+            (conn_options & IMDPROXY_OPTION_CRC32C)))
+        return 0;
+
+    return stream_init();
+}
+
+// Whether a read or write request with code already received will be
+// streamed, looking at rest of its header without consuming it.
+static int
+stream_pending(ULONGLONG request_code)
+{
+    IMDPROXY_READ_REQ req_block;
+
+    if (!comm_peek(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code), 1))
+        return 0;
+
+    return stream_possible(request_code, req_block.length);
+}
+
+// Queues next chunk in ring.
+static PSTREAM_CHUNK
+stream_submit(int is_write, safeio_size_t size, off_t_64 offset)
+{
+    PSTREAM_CHUNK chunk = stream_chunks + stream_head;
+
+    stream_head = (stream_head + 1) % STREAM_CHUNKS;
+
+    chunk->is_write = is_write;
+    chunk->size = size;
+    chunk->offset = offset;
+
+#ifndef _WIN32
+    if (stream_threaded)
+    {
+        pthread_mutex_lock(&stream_lock);
+        chunk->state = StreamQueued;
+        pthread_cond_signal(&stream_queued);
+        pthread_mutex_unlock(&stream_lock);
+
+        return chunk;
+    }
+#endif
+
+    stream_serve(chunk);
+    chunk->state = StreamDone;
+
+    return chunk;
+}
+
+static void
+stream_wait(PSTREAM_CHUNK chunk)
+{
+#ifndef _WIN32
+    if (stream_threaded)
+    {
+        pthread_mutex_lock(&stream_lock);
+
+        while (chunk->state == StreamQueued)
+            pthread_cond_wait(&stream_done, &stream_lock);
+
+        pthread_mutex_unlock(&stream_lock);
+    }
+#endif
+
+    chunk->state = StreamIdle;
+}
+
+// Waits for chunks still queued when a request ends early.
+static void
+stream_drain(int first, int count)
+{
+    while (count-- > 0)
+    {
+        stream_wait(stream_chunks + first);
+        first = (first + 1) % STREAM_CHUNKS;
+    }
+}
+
+int
+stream_read(PIMDPROXY_READ_REQ req_block)
+{
+    IMDPROXY_READ_RESP resp_block = { 0 };
+    IMDPROXY_PAYLOAD_TRAILER trailer = { 0 };
+    off_t_64 offset = (off_t_64)(image_offset + req_block->offset);
+    ULONGLONG submitted = 0;
+    ULONGLONG sent = 0;
+    uint32_t crc = 0;
+    int oldest = stream_head;
+    int queued = 0;
+
+    ++stream_requests;
+
+    qos_admit(req_block->length);
+
+    metrics_backend_start();
+    devio_probe3(backend__submit, IMDPROXY_REQ_READ, req_block->offset,
+        req_block->length);
+
+    while (queued < STREAM_CHUNKS && submitted < req_block->length)
+    {
+        safeio_size_t size = (safeio_size_t)
+            (req_block->length - submitted < STREAM_CHUNK_SIZE ?
+                req_block->length - submitted : STREAM_CHUNK_SIZE);
+
+        stream_submit(0, size, offset + submitted);
+        submitted += size;
+        ++queued;
+    }
+
+    // Errors can only be reported before the response is sent
+    stream_wait(stream_chunks + oldest);
+    stream_chunks[oldest].state = StreamDone;
+
+    if (stream_chunks[oldest].result == -1)
+    {
+        stream_drain(oldest, queued);
+
+        resp_block.errorno = stream_chunks[oldest].errorno;
+        errno = (int)resp_block.errorno;
+        syslog(LOG_ERR, "Device read: %m\n");
+    }
+    else
+        resp_block.length = req_block->length;
+
+    if (!comm_write(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        if (resp_block.errorno == 0)
+            stream_drain(oldest, queued);
+
+        return 0;
+    }
+
+    while (sent < resp_block.length)
+    {
+        PSTREAM_CHUNK chunk = stream_chunks + oldest;
+
+        stream_wait(chunk);
+        --queued;
+
+        if (chunk->result == -1)
+        {
+            errno = chunk->errorno;
+            syslog(LOG_ERR, "Device read at " SLL_FMT ": %m, closing "
+                "connection.\n", (int64_t)chunk->offset);
+
+            stream_drain((oldest + 1) % STREAM_CHUNKS, queued);
+            return 0;
+        }
+
+        if ((safeio_size_t)chunk->result != chunk->size)
+        {
+            syslog(LOG_ERR,
+                "Partial read at " SLL_FMT ": Got " SLL_FMT ", req %u.\n",
+                (int64_t)chunk->offset, (int64_t)chunk->result,
+                (unsigned int)chunk->size);
+        }
+
+        if (!comm_write(chunk->data, chunk->size))
+        {
+            syslog(LOG_ERR, "Error sending read response to caller.\n");
+
+            stream_drain((oldest + 1) % STREAM_CHUNKS, queued);
+            return 0;
+        }
+
+        if (conn_options & IMDPROXY_OPTION_CRC32C)
+            crc = crc32c(crc, chunk->data, chunk->size);
+
+        sent += chunk->size;
+        oldest = (oldest + 1) % STREAM_CHUNKS;
+
+        if (submitted < req_block->length)
+        {
+            safeio_size_t size = (safeio_size_t)
+                (req_block->length - submitted < STREAM_CHUNK_SIZE ?
+                    req_block->length - submitted : STREAM_CHUNK_SIZE);
+
+            stream_submit(0, size, offset + submitted);
+            submitted += size;
+            ++queued;
+        }
+    }
+
+    stream_bytes += sent;
+
+    metrics_backend_end(resp_block.length, resp_block.errorno);
+    trace_request_io(req_block->offset, req_block->length,
+        resp_block.errorno);
+    devio_probe3(backend__complete, IMDPROXY_REQ_READ, resp_block.length,
+        resp_block.errorno);
+
+    trailer.crc32c = crc;
+
+    if ((resp_block.errorno == 0 &&
+        (conn_options & IMDPROXY_OPTION_CRC32C) &&
+        !comm_write(&trailer, sizeof trailer)) ||
+        !send_credits())
+    {
+        syslog(LOG_ERR, "Error sending read response to caller.\n");
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+stream_write(PIMDPROXY_WRITE_REQ req_block)
+{
+    IMDPROXY_WRITE_RESP resp_block = { 0 };
+    off_t_64 offset = (off_t_64)(image_offset + req_block->offset);
+    ULONGLONG received = 0;
+    int oldest = stream_head;
+    int queued = 0;
+    int stopped = 0;
+
+    ++stream_requests;
+
+    qos_admit(req_block->length);
+
+    metrics_backend_start();
+    devio_probe3(backend__submit, IMDPROXY_REQ_WRITE, req_block->offset,
+        req_block->length);
+
+    if (devio_info.flags & IMDPROXY_FLAG_RO)
+    {
+        resp_block.errorno = EBADF;
+        stopped = 1;
+        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+    }
+
+    while (received < req_block->length || queued > 0)
+    {
+        PSTREAM_CHUNK chunk = stream_chunks + oldest;
+        safeio_size_t size;
+
+        // Results are collected in order, length done is what was written
+        // before first failure
+        if (queued == STREAM_CHUNKS || (queued > 0 &&
+            received == req_block->length))
+        {
+            stream_wait(chunk);
+            --queued;
+            oldest = (oldest + 1) % STREAM_CHUNKS;
+
+            if (stopped)
+                continue;
+
+            if (chunk->result == -1)
+            {
+                resp_block.errorno = chunk->errorno;
+                stopped = 1;
+                errno = chunk->errorno;
+                syslog(LOG_ERR, "Device write at " SLL_FMT ": %m\n",
+                    (int64_t)chunk->offset);
+                continue;
+            }
+
+            resp_block.length += chunk->result;
+
+            if ((safeio_size_t)chunk->result != chunk->size)
+            {
+                stopped = 1;
+                syslog(LOG_ERR, "Partial write at " SLL_FMT ": Got " SLL_FMT
+                    ", req %u.\n", (int64_t)chunk->offset,
+                    (int64_t)chunk->result, (unsigned int)chunk->size);
+            }
+
+            continue;
+        }
+
+        // Data after a failure is received and dropped, into a chunk that
+        // is not queued
+        chunk = stream_chunks + stream_head;
+        size = (safeio_size_t)
+            (req_block->length - received < STREAM_CHUNK_SIZE ?
+                req_block->length - received : STREAM_CHUNK_SIZE);
+
+        if (!comm_read(chunk->data, size))
+        {
+            syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+            stream_drain(oldest, queued);
+            return 0;
+        }
+
+        if (!stopped)
+        {
+            stream_submit(1, size, offset + received);
+            ++queued;
+        }
+
+        received += size;
+    }
+
+    stream_bytes += received;
+
+    metrics_backend_end(resp_block.errorno == 0 ? resp_block.length : 0,
+        resp_block.errorno);
+    trace_request_io(req_block->offset, req_block->length,
+        resp_block.errorno);
+    devio_probe3(backend__complete, IMDPROXY_REQ_WRITE,
+        resp_block.errorno == 0 ? resp_block.length : 0, resp_block.errorno);
+
+    if (!comm_write(&resp_block, sizeof resp_block) || !send_credits())
+    {
+        syslog(LOG_ERR, "Error sending write response to caller.\n");
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+print_stream_stats()
+{
+    if (stream_requests == 0)
+        return;
+
+    printf("Streaming: " ULL_FMT " requests, " ULL_FMT " bytes through %i "
+        "chunks of %i bytes.\n",
+        (ULONGLONG)stream_requests, (ULONGLONG)stream_bytes, STREAM_CHUNKS,
+        STREAM_CHUNK_SIZE);
+}
+
+int
+read_data()
+{
+    IMDPROXY_READ_REQ req_block = { 0 };
+    IMDPROXY_READ_RESP resp_block = { 0 };
+    safeio_size_t size;
+    safeio_ssize_t readdone;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    if (stream_possible(IMDPROXY_REQ_READ, req_block.length))
+        return stream_read(&req_block);
+
+    if (req_block.length > buffer_size) // we will need larger buffer to complete this request
+    {
+        buf_realloc(req_block.length);
+    }
+
+    size = (safeio_size_t)
+        (req_block.length < buffer_size ? req_block.length : buffer_size);
+
+    dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + "
+        ULL_FMT " = " ULL_FMT ".\n",
+        req_block.length, req_block.offset, image_offset,
+        req_block.offset + image_offset));
+
+    qos_admit(size);
+
+    metrics_backend_start();
+    devio_probe3(backend__submit, IMDPROXY_REQ_READ, req_block.offset,
+        req_block.length);
+
+    memset(buf, 0, size);
+
+    readdone =
+        logical_read(buf, (safeio_size_t)size, (off_t_64)(image_offset + req_block.offset));
+
+    if (readdone == -1)
+    {
+        resp_block.errorno = errno;
+        resp_block.length = 0;
+        syslog(LOG_ERR, "Device read: %m\n");
+    }
+    else
+    {
+        resp_block.errorno = 0;
+        resp_block.length = size;
+
+        if (req_block.length != readdone)
+        {
+            syslog(LOG_ERR,
+                "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
+                (int64_t)(image_offset + req_block.offset), (int64_t)readdone, req_block.length);
+        }
+    }
+
+    metrics_backend_end(resp_block.length, resp_block.errorno);
+    trace_request_io(req_block.offset, req_block.length, resp_block.errorno);
+    devio_probe3(backend__complete, IMDPROXY_REQ_READ, resp_block.length,
+        resp_block.errorno);
+
+    dbglog((LOG_ERR, "read done reporting/sending " ULL_FMT " bytes.\n",
+        resp_block.length));
+
+    if (!comm_write(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
+    }
+
+    if (resp_block.errorno == 0)
+        if (((conn_options & IMDPROXY_OPTION_COMPRESSION) ?
+            !send_payload(buf, (safeio_size_t)resp_block.length) :
+            !comm_write(buf, (safeio_size_t)resp_block.length)) ||
+            ((conn_options & IMDPROXY_OPTION_CRC32C) &&
+                !send_trailer(buf, (safeio_size_t)resp_block.length)))
+        {
+            syslog(LOG_ERR, "Error sending read response to caller.\n");
+            return 0;
+        }
+
+    if (!send_credits())
+    {
+        syslog(LOG_ERR, "Error sending read response to caller.\n");
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+#define ZERO_DETECT_SIZE    4096
+#define MAX_ZERO_EXTENTS    1024
+
+static int
+is_zero(const char *data, safeio_size_t size)
+{
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Like read_data(), but zero ranges are sent as extents in the response
+// header instead of as data. Unallocated ranges are not read at all, and
+// data read from image is checked for zero blocks of ZERO_DETECT_SIZE.
+int
+read_sparse_data()
+{
+    static IMDPROXY_ZERO_EXTENT extents[MAX_ZERO_EXTENTS];
+    IMDPROXY_READ_REQ req_block = { 0 };
+    IMDPROXY_SPARSE_READ_RESP resp_block = { 0 };
+    IMDPROXY_PAYLOAD_TRAILER trailer = { 0 };
+    safeio_size_t size;
+    safeio_size_t pos;
+    safeio_size_t data_end = 0;
+    off_t_64 offset;
+    int count = 0;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    if (req_block.length > buffer_size)
+    {
+        buf_realloc(req_block.length);
+    }
+
+    size = (safeio_size_t)
+        (req_block.length < buffer_size ? req_block.length : buffer_size);
+
+    offset = (off_t_64)(image_offset + req_block.offset);
+
+    qos_admit(size);
+
+    metrics_backend_start();
+    devio_probe3(backend__submit, IMDPROXY_REQ_READ_SPARSE, req_block.offset,
+        req_block.length);
+
+    for (pos = 0; pos < size;)
+    {
+        off_t_64 run_end;
+        safeio_size_t run_size;
+        int state = image_allocation(offset + pos, offset + size, &run_end);
+
+        if (state == -1)
+        {
+            state = AllocationMapped;
+            run_end = offset + size;
+        }
+
+        run_size = (safeio_size_t)(run_end - offset - pos);
+
+        if (state == AllocationMapped)
+        {
+            safeio_ssize_t readdone =
+                logical_read(buf + pos, run_size, offset + pos);
+
+            if (readdone == -1)
+            {
+                resp_block.errorno = errno;
+                syslog(LOG_ERR, "Device read: %m\n");
+                break;
+            }
+
+            if (readdone < (safeio_ssize_t)run_size)
+                memset(buf + pos + readdone, 0, run_size - readdone);
+        }
+        else
+            memset(buf + pos, 0, run_size);
+
+        pos += run_size;
+    }
+
+    metrics_backend_end(resp_block.errorno == 0 ? size : 0,
+        resp_block.errorno);
+    trace_request_io(req_block.offset, req_block.length, resp_block.errorno);
+    devio_probe3(backend__complete, IMDPROXY_REQ_READ_SPARSE,
+        resp_block.errorno == 0 ? size : 0, resp_block.errorno);
+
+    if (resp_block.errorno == 0 && (conn_options & IMDPROXY_OPTION_CRC32C))
+        trailer.crc32c = crc32c(0, buf, size);
+
+    // Zero blocks become extents, remaining data is moved together in buf
+    for (pos = 0; resp_block.errorno == 0 && pos < size;)
+    {
+        safeio_size_t chunk = ZERO_DETECT_SIZE - pos % ZERO_DETECT_SIZE;
+
+        if (chunk > size - pos)
+            chunk = size - pos;
+
+        if (is_zero(buf + pos, chunk) &&
+            (count < MAX_ZERO_EXTENTS ||
+                extents[count - 1].offset + extents[count - 1].length == pos))
+        {
+            if (count > 0 &&
+                extents[count - 1].offset + extents[count - 1].length == pos)
+                extents[count - 1].length += chunk;
+            else
+            {
+                extents[count].offset = pos;
+                extents[count].length = chunk;
+                ++count;
+            }
+        }
+        else
+        {
+            if (data_end != pos)
+                memmove(buf + data_end, buf + pos, chunk);
+
+            data_end += chunk;
+        }
+
+        pos += chunk;
+    }
+
+    if (resp_block.errorno == 0)
+    {
+        resp_block.length = size;
+        resp_block.zero_extents = count;
+        resp_block.data_length = data_end;
+    }
+
+    if (!comm_write(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
+    }
+
+    if (resp_block.errorno == 0)
+        if ((count > 0 &&
+            !comm_write(extents, count * (safeio_size_t)sizeof(*extents))) ||
+            (data_end > 0 && !comm_write(buf, data_end)) ||
+            ((conn_options & IMDPROXY_OPTION_CRC32C) &&
+                !comm_write(&trailer, sizeof trailer)))
+        {
+            syslog(LOG_ERR, "Error sending read response to caller.\n");
+            return 0;
+        }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+write_data()
+{
+    IMDPROXY_WRITE_REQ req_block = { 0 };
+    IMDPROXY_WRITE_RESP resp_block = { 0 };
+    int crc_ok = 1;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    dbglog((LOG_ERR, "write request " ULL_FMT " bytes at " ULL_FMT " + "
+        ULL_FMT " = " ULL_FMT ".\n",
+        req_block.length, req_block.offset, image_offset,
+        req_block.offset + image_offset));
+
+    if (stream_possible(IMDPROXY_REQ_WRITE, req_block.length))
+        return stream_write(&req_block);
+
+    if (req_block.length > buffer_size)
+    {
+        syslog(LOG_ERR, "Too big block write requested: %u bytes.\n",
+            (int)req_block.length);
+        return 0;
+    }
+
+    if ((conn_options & IMDPROXY_OPTION_COMPRESSION) ?
+        !receive_payload(buf, (safeio_size_t)req_block.length) :
+        !comm_read(buf, (safeio_size_t)req_block.length))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        return 0;
+    }
+
+    if (conn_options & IMDPROXY_OPTION_CRC32C)
+        crc_ok = receive_trailer(buf, (safeio_size_t)req_block.length);
+
+    if (crc_ok == -1)
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        return 0;
+    }
+
+    qos_admit(req_block.length);
+
+    metrics_backend_start();
+    devio_probe3(backend__submit, IMDPROXY_REQ_WRITE, req_block.offset,
+        req_block.length);
+
+    if (crc_ok == 0)
+    {
+        resp_block.errorno = EIO;
+        resp_block.length = 0;
+        syslog(LOG_ERR, "Checksum mismatch in write request at " ULL_FMT
+            ", " ULL_FMT " bytes.\n",
+            image_offset + req_block.offset, req_block.length);
+    }
+    else if (devio_info.flags & IMDPROXY_FLAG_RO)
+    {
+        resp_block.errorno = EBADF;
+        resp_block.length = 0;
+        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+    }
+    else
+    {
+        safeio_ssize_t writedone = logical_write(buf, (safeio_size_t)req_block.length,
+            (off_t_64)(image_offset + req_block.offset));
+        if (writedone == -1)
+        {
+            resp_block.errorno = errno;
+            resp_block.length = writedone;
+#ifdef _WIN32
+            perror("Device write");
+#else
+            syslog(LOG_ERR, "Device write: %m\n");
+#endif
+        }
+        else
+        {
+            resp_block.errorno = 0;
+            resp_block.length = writedone;
+        }
+
+        if (req_block.length != resp_block.length)
+        {
+            if (writedone < 0)
+            {
+                syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req " ULL_FMT ".\n",
+                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
+            }
+            else
+            {
+                syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " ULL_FMT ", req " ULL_FMT ".\n",
+                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
+            }
+        }
+
+        dbglog((LOG_ERR, "write done reporting/sending " ULL_FMT " bytes.\n",
+            resp_block.length));
+    }
+
+    metrics_backend_end(resp_block.errorno == 0 ? resp_block.length : 0,
+        resp_block.errorno);
+    trace_request_io(req_block.offset, req_block.length, resp_block.errorno);
+    devio_probe3(backend__complete, IMDPROXY_REQ_WRITE,
+        resp_block.errorno == 0 ? resp_block.length : 0, resp_block.errorno);
+
+    if (!comm_write(&resp_block, sizeof resp_block) || !send_credits())
+    {
+        syslog(LOG_ERR, "Error sending write response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Scheduling of pipelined read and write requests, enabled with --sched.
+// Requests already waiting on the connection are read as a batch, sorted by
+// offset and run with adjacent or overlapping ranges merged into single
+// preadv()/pwritev() calls. Responses are still sent in arrival order.
+//
+// A batch ends before any request that is not a read or write, or that
+// overlaps a batched request where either is a write, so that reordering
+// never changes results. All requests in a batch complete before the next
+// batch is read. Within a batch, the oldest request not yet done is run
+// first once it has waited longer than the deadline.
+
+#define SCHED_DEF_DEPTH         32
+#define SCHED_MAX_DEPTH         1024
+#define SCHED_DEF_DEADLINE      10
+
+#ifndef IOV_MAX
+#define IOV_MAX                 16
+#endif
+
+typedef struct _SCHED_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG offset;
+    ULONGLONG length;
+    safeio_size_t size;     // Bytes of data at data, less than length only
+                            // for reads larger than buffer
+    char *data;             // Part of buf
+    ULONGLONG errorno;
+    ULONGLONG done_length;  // Length in response
+    uint64_t received;      // backend_time_nsec()
+    uint64_t backend_start;
+    uint64_t backend_end;
+    int group;              // Index in sched_groups, -1 when already failed
+    int done;
+} SCHED_REQ, *PSCHED_REQ;
+
+int sched_depth = 0;
+uint64_t sched_deadline_nsec = 0;
+
+// Current batch in arrival order, index into it in offset order, and
+// start of each merge group in offset order.
+PSCHED_REQ sched_queue = NULL;
+int *sched_order = NULL;
+int *sched_groups = NULL;
+
+uint64_t sched_batches = 0;
+uint64_t sched_requests_total = 0;
+uint64_t sched_io_calls = 0;
+uint64_t sched_merged = 0;
+uint64_t sched_promoted = 0;
+
+// Parses [depth][,deadline=msec]
+int
+sched_init(const char *spec)
+{
+    const char *opts = strchr(spec, ',');
+    char value[32];
+
+    sched_depth = SCHED_DEF_DEPTH;
+    sched_deadline_nsec = (uint64_t)SCHED_DEF_DEADLINE * 1000000;
+
+    if (*spec != 0 && *spec != ',')
+        sched_depth = (int)strtol(spec, NULL, 0);
+
+    if (sched_depth < 1 || sched_depth > SCHED_MAX_DEPTH)
+    {
+        fprintf(stderr, "Scheduling depth must be 1 - %i.\n",
+            SCHED_MAX_DEPTH);
+        return 0;
+    }
+
+    if (opts != NULL &&
+        backend_get_option(opts + 1, "deadline", value, sizeof(value)))
+        sched_deadline_nsec = (uint64_t)strtoul(value, NULL, 0) * 1000000;
+
+    sched_queue = (PSCHED_REQ)calloc(sched_depth, sizeof(*sched_queue));
+    sched_order = (int*)calloc(sched_depth, sizeof(*sched_order));
+    sched_groups = (int*)calloc(sched_depth + 1, sizeof(*sched_groups));
+
+    if (sched_queue == NULL || sched_order == NULL || sched_groups == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 0;
+    }
+
+    printf("Scheduling up to %i pipelined requests, deadline " ULL_FMT
+        " msec.\n", sched_depth, (ULONGLONG)(sched_deadline_nsec / 1000000));
+
+    return 1;
+}
+
+void
+print_sched_stats()
+{
+    if (sched_batches == 0)
+        return;
+
+    printf("Scheduling: " ULL_FMT " requests in " ULL_FMT " batches, "
+        "%.1f per batch. " ULL_FMT " requests merged, " ULL_FMT
+        " I/O calls, " ULL_FMT " run early by deadline.\n",
+        (ULONGLONG)sched_requests_total, (ULONGLONG)sched_batches,
+        (double)sched_requests_total / sched_batches,
+        (ULONGLONG)sched_merged, (ULONGLONG)sched_io_calls,
+        (ULONGLONG)sched_promoted);
+}
+
+// Peeks at header of next request if it has already arrived in full, without
+// waiting.
+static int
+sched_peek(PIMDPROXY_READ_REQ next)
+{
+    return comm_peek(next, sizeof(*next), 0);
+}
+
+// Whether a request may join the batch without changing results.
+static int
+sched_fits(int count, safeio_size_t used, PIMDPROXY_READ_REQ next)
+{
+    int i;
+
+    if (count >= sched_depth ||
+        (next->request_code != IMDPROXY_REQ_READ &&
+            next->request_code != IMDPROXY_REQ_WRITE) ||
+        next->length > buffer_size - used)
+        return 0;
+
+    for (i = 0; i < count; i++)
+    {
+        PSCHED_REQ req = sched_queue + i;
+
+        if ((req->request_code == IMDPROXY_REQ_WRITE ||
+            next->request_code == IMDPROXY_REQ_WRITE) &&
+            next->offset < req->offset + req->length &&
+            req->offset < next->offset + next->length)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Reads rest of request with code already received, to position index in
+// batch. Returns zero if the connection cannot continue.
+static int
+sched_receive(int index, ULONGLONG request_code, safeio_size_t used)
+{
+    PSCHED_REQ req = sched_queue + index;
+    IMDPROXY_READ_REQ req_block;
+    int crc_ok = 1;
+    int admitted;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    memset(req, 0, sizeof(*req));
+    req->request_code = request_code;
+    req->offset = req_block.offset;
+    req->length = req_block.length;
+    req->received = backend_time_nsec();
+
+    // Requests in batch are all outstanding at the client. Clients that
+    // have not enabled credits do not know the window.
+    admitted = !(conn_options & IMDPROXY_OPTION_CREDITS) ||
+        credits_admit(index, used, req->length);
+
+    if (request_code == IMDPROXY_REQ_READ)
+    {
+        if (!admitted)
+        {
+            req->errorno = EBUSY;
+            req->done = 1;
+            return 1;
+        }
+
+        // Only first request in a batch can be larger than buffer
+        if (req->length > buffer_size)
+            buf_realloc(req->length);
+
+        req->size = (safeio_size_t)
+            (req->length < buffer_size ? req->length : buffer_size);
+        req->data = buf + used;
+
+        return 1;
+    }
+
+    if (req->length > buffer_size)
+    {
+        syslog(LOG_ERR, "Too big block write requested: %u bytes.\n",
+            (int)req->length);
+        return 0;
+    }
+
+    req->size = (safeio_size_t)req->length;
+    req->data = buf + used;
+
+    if ((conn_options & IMDPROXY_OPTION_COMPRESSION) ?
+        !receive_payload(req->data, req->size) :
+        !comm_read(req->data, req->size))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
+    }
+
+    if (conn_options & IMDPROXY_OPTION_CRC32C)
+        crc_ok = receive_trailer(req->data, req->size);
+
+    if (crc_ok == -1)
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
+    }
+
+    if (crc_ok == 0)
+    {
+        req->errorno = EIO;
+        req->done = 1;
+        syslog(LOG_ERR, "Checksum mismatch in write request at " ULL_FMT
+            ", " ULL_FMT " bytes.\n",
+            image_offset + req->offset, req->length);
+    }
+    else if (!admitted)
+    {
+        req->errorno = EBUSY;
+        req->done = 1;
+    }
+    else if (devio_info.flags & IMDPROXY_FLAG_RO)
+    {
+        req->errorno = EBADF;
+        req->done = 1;
+        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+    }
+
+    return 1;
+}
+
+static int
+sched_compare(const void *a, const void *b)
+{
+    const SCHED_REQ *req_a = sched_queue + *(const int*)a;
+    const SCHED_REQ *req_b = sched_queue + *(const int*)b;
+
+    // Requests that already failed last, outside any group
+    if (req_a->done != req_b->done)
+        return req_a->done - req_b->done;
+
+    if (req_a->offset != req_b->offset)
+        return req_a->offset < req_b->offset ? -1 : 1;
+
+    // Keep arrival order for equal offsets
+    return *(const int*)a - *(const int*)b;
+}
+
+// Sorts batch by offset and splits it in groups of same request type and
+// touching ranges. Returns number of groups.
+static int
+sched_plan(int count)
+{
+    int groups = 0;
+    ULONGLONG group_end = 0;
+    int group_iov = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        sched_order[i] = i;
+
+    qsort(sched_order, count, sizeof(*sched_order), sched_compare);
+
+    for (i = 0; i < count; i++)
+    {
+        PSCHED_REQ req = sched_queue + sched_order[i];
+        PSCHED_REQ prev = groups > 0 ?
+            sched_queue + sched_order[sched_groups[groups] - 1] : NULL;
+
+        if (req->done)
+        {
+            req->group = -1;
+            continue;
+        }
+
+        // Overlap only happens between reads, see sched_fits()
+        if (prev == NULL || prev->request_code != req->request_code ||
+            req->offset > group_end || group_iov >= IOV_MAX)
+        {
+            sched_groups[groups++] = i;
+            group_end = 0;
+            group_iov = 0;
+        }
+
+        req->group = groups - 1;
+        sched_groups[groups] = i + 1;
+
+        if (req->offset + req->size > group_end)
+        {
+            group_end = req->offset + req->size;
+            ++group_iov;
+        }
+    }
+
+    return groups;
+}
+
+static void
+sched_read_done(PSCHED_REQ req, safeio_ssize_t readdone)
+{
+    if (readdone == -1)
+    {
+        req->errorno = errno;
+        req->done_length = 0;
+        syslog(LOG_ERR, "Device read: %m\n");
+    }
+    else
+    {
+        req->errorno = 0;
+        req->done_length = req->size;
+
+        if (req->length != (ULONGLONG)readdone)
+        {
+            syslog(LOG_ERR,
+                "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
+                (int64_t)(image_offset + req->offset), (int64_t)readdone,
+                req->length);
+        }
+    }
+}
+
+static void
+sched_write_done(PSCHED_REQ req, safeio_ssize_t writedone)
+{
+    if (writedone == -1)
+    {
+        req->errorno = errno;
+        req->done_length = 0;
+        syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req "
+            ULL_FMT ".\n",
+            req->errorno, image_offset + req->offset, req->length);
+    }
+    else
+    {
+        req->errorno = 0;
+        req->done_length = writedone;
+
+        if (req->length != (ULONGLONG)writedone)
+        {
+            syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " SLL_FMT
+                ", req " ULL_FMT ".\n",
+                image_offset + req->offset, (int64_t)writedone, req->length);
+        }
+    }
+}
+
+// Runs a group as one vectored call on plain image files. Ranges of
+// overlapping reads are read once and copied. Returns number of bytes done
+// from start of group, requests beyond that are run one by one.
+static safeio_ssize_t
+sched_vector_io(int first, int last)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct iovec iov[IOV_MAX];
+    PSCHED_REQ req = sched_queue + sched_order[first];
+    ULONGLONG group_offset = req->offset;
+    ULONGLONG group_end = group_offset;
+    int is_write = req->request_code == IMDPROXY_REQ_WRITE;
+    int iovcnt = 0;
+    ssize_t done;
+    int i;
+
+    if (dll_mode || vhd_mode || snapshot_enabled || last - first < 2)
+        return 0;
+
+    for (i = first; i < last; i++)
+    {
+        char *data;
+        size_t size;
+
+        req = sched_queue + sched_order[i];
+
+        if (req->offset + req->size <= group_end)
+            continue;
+
+        data = req->data + (group_end - req->offset);
+        size = (size_t)(req->offset + req->size - group_end);
+
+        // Consecutive requests are often consecutive in buf as well
+        if (iovcnt > 0 &&
+            (char*)iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == data)
+            iov[iovcnt - 1].iov_len += size;
+        else
+        {
+            iov[iovcnt].iov_base = data;
+            iov[iovcnt].iov_len = size;
+            ++iovcnt;
+        }
+
+        group_end = req->offset + req->size;
+    }
+
+    if (is_write)
+    {
+        if (cbt_enabled &&
+            !cbt_mark((off_t_64)(image_offset + group_offset),
+                (safeio_size_t)(group_end - group_offset)))
+            return 0;
+
+        if (byteswap_mode)
+            for (i = first; i < last; i++)
+            {
+                req = sched_queue + sched_order[i];
+                byteswap16_buffer(req->data, req->size);
+            }
+
+        done = pwritev(image_fd, iov, iovcnt,
+            (off_t)(image_offset + group_offset));
+    }
+    else
+        done = preadv(image_fd, iov, iovcnt,
+            (off_t)(image_offset + group_offset));
+
+    ++sched_io_calls;
+    sched_merged += last - first;
+
+    if (done < 0)
+        done = 0;
+
+    if (is_write)
+    {
+        // Data is already swapped and tracked, rest is written unmerged
+        for (i = first; i < last; i++)
+        {
+            req = sched_queue + sched_order[i];
+
+            if (req->offset + req->size > group_offset + done)
+            {
+                sched_write_done(req, image_write(req->data, req->size,
+                    (off_t_64)(image_offset + req->offset)));
+                ++sched_io_calls;
+            }
+            else
+                sched_write_done(req, req->size);
+        }
+
+        return (safeio_ssize_t)(group_end - group_offset);
+    }
+
+    // Head of range may have been read into earlier requests only. Those
+    // start at lower or same offset, so the one reaching furthest holds all
+    // of it.
+    for (i = first; i < last; i++)
+    {
+        PSCHED_REQ source = NULL;
+        int j;
+
+        req = sched_queue + sched_order[i];
+
+        for (j = first; j < i; j++)
+        {
+            PSCHED_REQ prev = sched_queue + sched_order[j];
+
+            if (source == NULL ||
+                prev->offset + prev->size > source->offset + source->size)
+                source = prev;
+        }
+
+        if (source != NULL && source->offset + source->size > req->offset)
+        {
+            ULONGLONG copy_end = source->offset + source->size;
+
+            if (copy_end > req->offset + req->size)
+                copy_end = req->offset + req->size;
+
+            memcpy(req->data, source->data + (req->offset - source->offset),
+                (size_t)(copy_end - req->offset));
+        }
+    }
+
+    // Requests partly beyond a short read are read again one by one
+    for (i = first; i < last; i++)
+    {
+        req = sched_queue + sched_order[i];
+
+        if (req->offset + req->size > group_offset + done)
+            continue;
+
+        if (byteswap_mode)
+            byteswap16_buffer(req->data, req->size);
+
+        sched_read_done(req, req->size);
+    }
+
+    return done;
+#endif
+}
+
+static void
+sched_run_group(int group)
+{
+    int first = sched_groups[group];
+    int last = sched_groups[group + 1];
+    uint64_t start;
+    uint64_t end;
+    safeio_ssize_t done;
+    int i;
+
+    for (i = first; i < last; i++)
+    {
+        PSCHED_REQ req = sched_queue + sched_order[i];
+
+        qos_admit(req->size);
+
+        if (req->request_code == IMDPROXY_REQ_READ)
+            memset(req->data, 0, req->size);
+
+        devio_probe3(backend__submit, req->request_code, req->offset,
+            req->length);
+    }
+
+    start = backend_time_nsec();
+
+    done = sched_vector_io(first, last);
+
+    for (i = first; i < last; i++)
+    {
+        PSCHED_REQ req = sched_queue + sched_order[i];
+
+        if (req->offset + req->size <= sched_queue[sched_order[first]].offset +
+            done)
+            continue;
+
+        if (req->request_code == IMDPROXY_REQ_READ)
+            sched_read_done(req, logical_read(req->data, req->size,
+                (off_t_64)(image_offset + req->offset)));
+        else
+            sched_write_done(req, logical_write(req->data, req->size,
+                (off_t_64)(image_offset + req->offset)));
+
+        ++sched_io_calls;
+    }
+
+    end = backend_time_nsec();
+
+    for (i = first; i < last; i++)
+    {
+        PSCHED_REQ req = sched_queue + sched_order[i];
+
+        req->backend_start = start;
+        req->backend_end = end;
+        req->done = 1;
+
+        devio_probe3(backend__complete, req->request_code,
+            req->errorno == 0 ? req->done_length : 0, req->errorno);
+    }
+}
+
+static int
+sched_respond(PSCHED_REQ req)
+{
+    IMDPROXY_READ_RESP resp_block;
+    uint64_t bytes = req->errorno == 0 ? req->done_length : 0;
+
+    resp_block.errorno = req->errorno;
+    resp_block.length = req->done_length;
+
+    if (!comm_write(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
+    }
+
+    if (req->request_code == IMDPROXY_REQ_READ && req->errorno == 0)
+        if (((conn_options & IMDPROXY_OPTION_COMPRESSION) ?
+            !send_payload(req->data, (safeio_size_t)req->done_length) :
+            !comm_write(req->data, (safeio_size_t)req->done_length)) ||
+            ((conn_options & IMDPROXY_OPTION_CRC32C) &&
+                !send_trailer(req->data, (safeio_size_t)req->done_length)))
+        {
+            syslog(LOG_ERR, "Error sending read response to caller.\n");
+            return 0;
+        }
+
+    if (!send_credits())
+    {
+        syslog(LOG_ERR, "Error sending response to caller.\n");
+        return 0;
+    }
+
+    metrics_request_record(req->request_code, req->received,
+        req->backend_start, req->backend_end, bytes, req->errorno);
+    trace_request_record(req->request_code, req->received, req->offset,
+        req->length, req->errorno);
+    devio_probe1(response__sent, req->request_code);
+
+    return 1;
+}
+
+// Handles a read or write request, and any further ones already waiting
+// that can be scheduled together with it.
+int
+sched_requests(ULONGLONG request_code)
+{
+    IMDPROXY_READ_REQ next;
+    safeio_size_t used;
+    int count = 0;
+    int groups;
+    int responded = 0;
+    int group = 0;
+
+    devio_probe1(request__receive, request_code);
+
+    if (!sched_receive(0, request_code, 0))
+        return 0;
+
+    used = sched_queue->size;
+    count = 1;
+
+    while (sched_peek(&next) && sched_fits(count, used, &next))
+    {
+        if (!comm_read(&next.request_code, sizeof(next.request_code)))
+            return 0;
+
+        devio_probe1(request__receive, next.request_code);
+
+        if (!sched_receive(count, next.request_code, used))
+            return 0;
+
+        used += sched_queue[count].size;
+        ++count;
+    }
+
+    ++sched_batches;
+    sched_requests_total += count;
+
+    groups = sched_plan(count);
+
+    while (responded < count)
+    {
+        PSCHED_REQ oldest = sched_queue + responded;
+
+        if (!oldest->done)
+        {
+            // Next group in offset order, or the one with the oldest request
+            // if it is overdue
+            while (group < groups &&
+                sched_queue[sched_order[sched_groups[group]]].done)
+                ++group;
+
+            if (oldest->group >= 0 && oldest->group != group &&
+                backend_time_nsec() - oldest->received > sched_deadline_nsec)
+            {
+                sched_run_group(oldest->group);
+                ++sched_promoted;
+            }
+            else
+                sched_run_group(group);
+        }
+
+        while (responded < count && sched_queue[responded].done)
+            if (!sched_respond(sched_queue + responded++))
+                return 0;
+
+        if (!comm_flush())
+        {
+            syslog(LOG_ERR, "Error flushing comm data: %m\n");
+            return 0;
+        }
+    }
+
+    credits_served(backend_time_nsec() - sched_queue->received, count);
+
+    return 1;
+}
+
+// Zero requests write this buffer repeatedly, allocated at first request and
+// kept for following ones.
+#define ZERO_BUF_SIZE           (1 << 20)
+
+static char *zero_buf = NULL;
+
+// Unmap ranges are only recorded by changed block tracking. Data in them is
+// kept, which is valid since unmap is a hint to the storage.
+int
+unmap_or_zero_data(ULONGLONG req)
+{
+    IMDPROXY_ZERO_REQ req_block = { 0 };
+    IMDPROXY_ZERO_RESP resp_block = { 0 };
+    PDEVIO_RANGE ranges = (PDEVIO_RANGE)buf;
+    size_t items;
+    size_t i;
+
+    if (!comm_read(&req_block.length,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    if (req_block.length > buffer_size)
+    {
+        syslog(LOG_ERR, "Too big unmap or zero request: %u bytes.\n",
+            (int)req_block.length);
+        return 0;
+    }
+
+    if (!comm_read(buf, (safeio_size_t)req_block.length))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        return 0;
+    }
+
+    items = (size_t)(req_block.length / sizeof(DEVIO_RANGE));
+
+    qos_admit(0);
+
+    metrics_backend_start();
+    devio_probe3(backend__submit, req, items > 0 ? ranges[0].offset : 0,
+        items > 0 ? ranges[0].length : 0);
+
+    if (devio_info.flags & IMDPROXY_FLAG_RO)
+        resp_block.errorno = EBADF;
+
+    for (i = 0; i < items && resp_block.errorno == 0; i++)
+    {
+        off_t_64 offset = image_offset + ranges[i].offset;
+        uint64_t length = ranges[i].length;
+
+        if (req == IMDPROXY_REQ_UNMAP)
+        {
+            if (cbt_enabled && !cbt_mark(offset, (off_t_64)length))
+                resp_block.errorno = errno;
+
+            continue;
+        }
+
+        if (zero_buf == NULL)
+        {
+            zero_buf = (char*)calloc(1, ZERO_BUF_SIZE);
+
+            if (zero_buf == NULL)
+            {
+                resp_block.errorno = ENOMEM;
+                break;
+            }
+        }
+
+        while (length > 0)
+        {
+            safeio_size_t size = length < ZERO_BUF_SIZE ?
+                (safeio_size_t)length : ZERO_BUF_SIZE;
+
+            if (logical_write(zero_buf, size, offset) !=
+                (safeio_ssize_t)size)
+            {
+                resp_block.errorno = errno != 0 ? errno : ENOSPC;
+                break;
+            }
+
+            offset += size;
+            length -= size;
+        }
+    }
+
+    metrics_backend_end(0, resp_block.errorno);
+    devio_probe3(backend__complete, req, 0, resp_block.errorno);
+
+    if (trace_enabled)
+    {
+        ULONGLONG length = 0;
+
+        for (i = 0; i < items; i++)
+            length += ranges[i].length;
+
+        trace_request_io(items > 0 ? ranges[0].offset : 0, length,
+            resp_block.errorno);
+    }
+
+    if (resp_block.errorno != 0)
+        syslog(LOG_ERR, "%s request failed: %s\n",
+            req == IMDPROXY_REQ_UNMAP ? "Unmap" : "Zero",
+            strerror((int)resp_block.errorno));
+
+    if (!comm_write(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Error sending response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+get_allocation()
+{
+    IMDPROXY_ALLOCATION_REQ req_block = { 0 };
+    IMDPROXY_ALLOCATION_RESP resp_block = { 0 };
+    IMDPROXY_ALLOCATION_EXTENT extents[256];
+    int max_extents = (int)(sizeof(extents) / sizeof(*extents));
+    int count = 0;
+    off_t_64 offset;
+    off_t_64 end;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    offset = image_offset + (off_t_64)req_block.offset;
+    end = offset + (off_t_64)req_block.length;
+
+    if (end > image_offset + (off_t_64)devio_info.file_size)
+        end = image_offset + (off_t_64)devio_info.file_size;
+
+    while (offset < end)
+    {
+        off_t_64 run_end;
+        int state = image_allocation(offset, end, &run_end);
+
+        if (state == -1)
+        {
+            resp_block.errorno = errno != 0 ? errno : EIO;
+            break;
+        }
+
+        if (count > 0 && extents[count - 1].state == (ULONGLONG)state)
+            extents[count - 1].length += run_end - offset;
+        else if (count == max_extents)
+            break;
+        else
+        {
+            extents[count].offset = offset - image_offset;
+            extents[count].length = run_end - offset;
+            extents[count].state = state;
+            ++count;
+        }
+
+        offset = run_end;
+    }
+
+    if (resp_block.errorno == 0)
+    {
+        resp_block.next_offset = offset - image_offset;
+        resp_block.length = count * sizeof(*extents);
+    }
+
+    if (!comm_write(&resp_block, sizeof resp_block) ||
+        (resp_block.length > 0 &&
+            !comm_write(extents, (safeio_size_t)resp_block.length)))
+    {
+        syslog(LOG_ERR, "Error sending allocation response to caller.\n");
+
+        return 0;
+    }
 
     if (!comm_flush())
     {
@@ -1078,81 +3304,68 @@ read_data()
 }
 
 int
-write_data()
+cbt_request()
 {
-    IMDPROXY_WRITE_REQ req_block = { 0 };
-    IMDPROXY_WRITE_RESP resp_block = { 0 };
+    IMDPROXY_CBT_REQ req_block = { 0 };
+    IMDPROXY_CBT_RESP resp_block = { 0 };
+    uint64_t extents[512];
+    int count = 0;
 
-    if (!comm_read(&req_block.offset,
+    if (!comm_read(&req_block.operation_code,
         sizeof(req_block) - sizeof(req_block.request_code)))
         return 0;
 
-    dbglog((LOG_ERR, "write request " ULL_FMT " bytes at " ULL_FMT " + "
-        ULL_FMT " = " ULL_FMT ".\n",
-        req_block.length, req_block.offset, image_offset,
-        req_block.offset + image_offset));
+    if (!cbt_enabled)
+        resp_block.errorno = ENODEV;
+    else
+        count = cbt_control(&req_block, &resp_block, extents,
+            (int)(sizeof(extents) / sizeof(*extents) / 2));
 
-    if (req_block.length > buffer_size)
+    if (!comm_write(&resp_block, sizeof resp_block) ||
+        (count > 0 && !comm_write(extents, (safeio_size_t)resp_block.length)))
     {
-        syslog(LOG_ERR, "Too big block write requested: %u bytes.\n",
-            (int)req_block.length);
+        syslog(LOG_ERR, "Error sending changed block response to caller.\n");
+
         return 0;
     }
 
-    if (!comm_read(buf, (safeio_size_t)req_block.length))
+    if (!comm_flush())
     {
-        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
-
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
         return 0;
     }
 
-    if (devio_info.flags & IMDPROXY_FLAG_RO)
-    {
-        resp_block.errorno = EBADF;
-        resp_block.length = 0;
-        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
-    }
-    else
-    {
-        safeio_ssize_t writedone = logical_write(buf, (safeio_size_t)req_block.length,
-            (off_t_64)(image_offset + req_block.offset));
-        if (writedone == -1)
-        {
-            resp_block.errorno = errno;
-            resp_block.length = writedone;
-#ifdef _WIN32
-            perror("Device write");
-#else
-            syslog(LOG_ERR, "Device write: %m\n");
-#endif
-        }
-        else
-        {
-            resp_block.errorno = 0;
-            resp_block.length = writedone;
-        }
+    return 1;
+}
 
-        if (req_block.length != resp_block.length)
-        {
-            if (writedone < 0)
-            {
-                syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req " ULL_FMT ".\n",
-                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
-            }
-            else
-            {
-                syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " ULL_FMT ", req " ULL_FMT ".\n",
-                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
-            }
-        }
+int
+snapshot_request()
+{
+    IMDPROXY_SNAPSHOT_REQ req_block = { 0 };
+    IMDPROXY_SNAPSHOT_RESP resp_block = { 0 };
+    SNAPSHOT_INFO info = { 0 };
 
-        dbglog((LOG_ERR, "write done reporting/sending " ULL_FMT " bytes.\n",
-            resp_block.length));
+    if (!comm_read(&req_block.operation_code,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    if (!snapshot_enabled)
+        resp_block.errorno = ENODEV;
+    else
+        resp_block.errorno = snapshot_control(req_block.operation_code,
+            req_block.snapshot_id, &info);
+
+    if (resp_block.errorno == 0)
+    {
+        resp_block.snapshot_id = info.id;
+        resp_block.create_time = info.create_time;
+        resp_block.changed_bytes = info.changed_bytes;
+        resp_block.exclusive_bytes = info.exclusive_bytes;
     }
 
     if (!comm_write(&resp_block, sizeof resp_block))
     {
-        syslog(LOG_ERR, "Error sending write response to caller.\n");
+        syslog(LOG_ERR, "Error sending snapshot response to caller.\n");
 
         return 0;
     }
@@ -1169,6 +3382,16 @@ write_data()
 int
 do_comm(char *comm_device);
 
+#ifdef DEVIO_NO_MAIN
+// Built into other programs, such as devbench. They call devio_main() with
+// devio command line arguments to open an image the same way as devio, and
+// get control in devio_comm instead of a client connection.
+int (*devio_comm)(char *comm_device) = do_comm;
+#define main devio_main
+#else
+#define devio_comm do_comm
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -1275,6 +3498,86 @@ main(int argc, char **argv)
         return -1;
     }
 
+    if (argc > 1 && _stricmp(argv[1], "--backends") == 0)
+    {
+        fprintf(stderr,
+            "devio built-in backends\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "A built-in backend is selected by a prefix to the diskdev parameter:\n"
+            "type[,option=value[,option=value...]]:parameters\n"
+            "\n"
+            "Backends that combine several images take a list of members separated by\n"
+            MULTI_CONTAINER_DELIMITER ". A member can be an image file, a device or another built-in\n"
+            "backend.\n"
+            "\n"
+            "stripe[,size=stripesize]:member1" MULTI_CONTAINER_DELIMITER "member2[" MULTI_CONTAINER_DELIMITER "member3...]\n"
+            "            Striped set (RAID-0). Consecutive stripes are stored on members in\n"
+            "            turn and requests that span several members are transferred\n"
+            "            in parallel. Default stripe size is 64K. Image size is the size\n"
+            "            of smallest member, rounded down to stripe size, times number of\n"
+            "            members.\n"
+            "\n"
+            "mirror[,read=balance|first|roundrobin][,hedge=percentile][,region=size]\n"
+            "      [,bitmap=file][,resync=full]:member1" MULTI_CONTAINER_DELIMITER "member2[" MULTI_CONTAINER_DELIMITER "member3...]\n"
+            "            Mirrored set (RAID-1). Writes go to all members in parallel.\n"
+            "            Reads go to one in-sync member: the one with fewest requests in\n"
+            "            progress and lowest recent latency (balance, default), the\n"
+            "            first one, or each one in turn (roundrobin).\n"
+            "            hedge=percentile issues a read to a second member as well when\n"
+            "            it takes longer than that percentile of recent read latencies.\n"
+            "            Regions, 1M by default, that could not be written to a member\n"
+            "            are copied from another member in the background. With a\n"
+            "            bitmap file, regions written while devio was stopped or crashed\n"
+            "            are resynchronized on next start. resync=full copies all data\n"
+            "            from first member to the others.\n"
+            "\n"
+            "erasure[,parity=m][,size=chunksize][,bitmap=file][,region=size]\n"
+            "       [,rebuild=member]:data1" MULTI_CONTAINER_DELIMITER "data2[...]" MULTI_CONTAINER_DELIMITER "parity1[...]\n"
+            "            Erasure coded set. Data is striped over all members but the last\n"
+            "            m, which hold Reed-Solomon parity. Default is one parity member\n"
+            "            and 64K chunks. Any m members can be missing or fail, their data\n"
+            "            is then reconstructed from the other members when read. Image\n"
+            "            size is the size of smallest member, rounded down to chunk size,\n"
+            "            times number of data members. A bitmap file records members\n"
+            "            that were missing or failed while the set was written to, per\n"
+            "            region of 1M by default. Such members are rebuilt from the\n"
+            "            others when the set is next opened for writing, and are not read\n"
+            "            until then. rebuild=member rebuilds a member completely, for\n"
+            "            instance a replaced member of a set without bitmap file.\n"
+            "\n"
+            "overlay,delta=file[,block=blocksize]:base\n"
+            "            Copy-on-write overlay. Base image is opened read-only. Written\n"
+            "            blocks are stored in a sparse delta file, created if it does not\n"
+            "            exist, and other blocks are read from base. Several devio\n"
+            "            instances can share one base image with one delta file each.\n"
+            "            Default block size for new delta files is 64K.\n"
+            "\n"
+            "null:size\n"
+            "            Image that stores nothing. Reads return zeroes and writes are\n"
+            "            discarded. For measuring transports and protocol overhead.\n"
+            "\n"
+            "pattern[,seed=n][,verify]:size\n"
+            "            Like null, but reads return deterministic data: the 64-bit\n"
+            "            little-endian word at offset 8*i is the splitmix64 output for\n"
+            "            seed + (i + 1) * 0x9E3779B97F4A7C15. With verify, writes that do\n"
+            "            not match the pattern fail.\n"
+            "\n"
+            "model[,latency=time][,jitter=time][,dist=fixed|uniform|normal|exp]\n"
+            "     [,bandwidth=size][,seed=n]:member\n"
+            "            Passes requests to member, for example null:64G, and completes\n"
+            "            them no sooner than a modeled time. Transfers queue at bandwidth\n"
+            "            bytes per second, then wait latency, spread by jitter within\n"
+            "            +/- jitter (uniform, default), as standard deviation (normal) or\n"
+            "            as mean of an added exponential tail (exp). Times are in\n"
+            "            microseconds or with suffix us, ms or s.\n"
+            "\n"
+            "Sizes can be suffixed with K, M, G or T for powers of 1024, or k, m, g or t for\n"
+            "powers of 1000.\n");
+
+        return -1;
+    }
+
     if (argc >= 3  && _strnicmp(argv[1], "--dll=", 6) == 0)
     {
 #ifdef _WIN32
@@ -1325,6 +3628,86 @@ main(int argc, char **argv)
         argc--;
     }
 
+    if (argc >= 4 && strcmp(argv[1], "--byteswap") == 0)
+    {
+        byteswap_mode = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && strncmp(argv[1], "--snapshots=", 12) == 0)
+    {
+        snapshot_spec = argv[1] + 12;
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && (strcmp(argv[1], "--cbt") == 0 ||
+        strncmp(argv[1], "--cbt=", 6) == 0))
+    {
+        cbt_mode = 1;
+        if (argv[1][5] == '=')
+            cbt_spec = argv[1] + 6;
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && (strcmp(argv[1], "--metrics") == 0 ||
+        strncmp(argv[1], "--metrics=", 10) == 0))
+    {
+        metrics_mode = 1;
+        if (argv[1][9] == '=')
+            metrics_spec = argv[1] + 10;
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && strncmp(argv[1], "--trace=", 8) == 0)
+    {
+        trace_spec = argv[1] + 8;
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && strncmp(argv[1], "--qos=", 6) == 0)
+    {
+        qos_spec = argv[1] + 6;
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && (strcmp(argv[1], "--sched") == 0 ||
+        strncmp(argv[1], "--sched=", 8) == 0))
+    {
+        sched_spec = argv[1][7] == '=' ? argv[1] + 8 : "";
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && (strcmp(argv[1], "--credits") == 0 ||
+        strncmp(argv[1], "--credits=", 10) == 0))
+    {
+        credits_spec = argv[1][9] == '=' ? argv[1] + 10 : "";
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && (strcmp(argv[1], "--placement") == 0 ||
+        strncmp(argv[1], "--placement=", 12) == 0))
+    {
+        placement_spec = argv[1][11] == '=' ? argv[1] + 12 : "";
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 4 && (strcmp(argv[1], "--workers") == 0 ||
+        strncmp(argv[1], "--workers=", 10) == 0))
+    {
+        workers_spec = argv[1][9] == '=' ? argv[1] + 10 : "";
+        argv++;
+        argc--;
+    }
+
     if (argc >= 4 && strcmp(argv[1], "-r") == 0)
     {
         devio_info.flags |= IMDPROXY_FLAG_RO;
@@ -1341,8 +3724,88 @@ main(int argc, char **argv)
             "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
             "\n"
             "Usage:\n"
-            "devio [-r] tcp-port|commdev diskdev [blocks] [offset] [alignm] [buffersize]\n"
-            "devio [-r] tcp-port|commdev diskdev [partitionnumber] [alignm] [buffersize]\n"
+            "devio [--byteswap] [--snapshots=store[,options]] [--cbt[=file][,options]]\n"
+            "      [--metrics[=file][,options]] [--trace=file[,options]]\n"
+            "      [--qos=[file][,options]] [--sched[=depth][,options]]\n"
+            "      [--credits[=requests][,options]] [--placement[=options]]\n"
+            "      [--workers[=n][,options]] [-r]\n"
+            "      tcp-port|commdev diskdev [blocks] [offset] [alignm] [buffersize]\n"
+            "devio [--byteswap] [--snapshots=store[,options]] [--cbt[=file][,options]]\n"
+            "      [--metrics[=file][,options]] [--trace=file[,options]]\n"
+            "      [--qos=[file][,options]] [--sched[=depth][,options]]\n"
+            "      [--credits[=requests][,options]] [--placement[=options]]\n"
+            "      [--workers[=n][,options]] [-r]\n"
+            "      tcp-port|commdev diskdev [partitionnumber] [alignm] [buffersize]\n"
+            "\n"
+            "--byteswap\n"
+            "        Swap bytes in each 16-bit word of image data, for images of big-endian\n"
+            "        disks such as old disk dumps from other platforms.\n"
+            "\n"
+            "--snapshots=storefile[,block=blocksize][,port=exportport]\n"
+            "        Keep point-in-time snapshots of image in storefile. Clients create,\n"
+            "        delete and query snapshots with IMDPROXY_REQ_SNAPSHOT requests while\n"
+            "        writes continue. Snapshot data is only copied for blocks written after\n"
+            "        a snapshot is taken, blocksize defaults to 64K. With port, the latest\n"
+            "        snapshot at first read is served read-only to clients connecting to\n"
+            "        exportport. Snapshot requests are accepted there too, so that\n"
+            "        snapshots can be taken while a driver is connected.\n"
+            "\n"
+            "--cbt[=trackfile][,block=blocksize][,port=controlport]\n"
+            "        Track blocks changed by writes in trackfile, diskdev.cbt by default.\n"
+            "        Clients start new generations and list extents changed since a\n"
+            "        generation with IMDPROXY_REQ_CHANGED_BLOCKS requests, for example\n"
+            "        using the cbtlist tool for incremental backups. With port, these\n"
+            "        requests are also accepted on controlport, so that backups can\n"
+            "        run while a driver is connected.\n"
+            "\n"
+            "--metrics[=file][,port=n][,unix=path][,interval=seconds]\n"
+            "        Count requests and measure latency of receive, backend and send\n"
+            "        phases per request type. SIGUSR1 prints a summary, as does closing\n"
+            "        the connection. Prometheus text is written to file every interval\n"
+            "        seconds, 10 by default, and served on tcp port or UNIX socket.\n"
+            "\n"
+            "--trace=tracefile[,size=ringsize]\n"
+            "        Record time, type, offset, length, client and latency of each request\n"
+            "        in binary tracefile, through an in-memory ring of ringsize bytes, 4M\n"
+            "        by default. The devioreplay tool replays traces against any server.\n"
+            "\n"
+            "--qos=[limitsfile][,iops=n][,bw=bytes][,weight=w][,export_iops=n]\n"
+            "      [,export_bw=bytes][,export_weight=w][,total_iops=n][,total_bw=bytes]\n"
+            "      [,burst=msec]\n"
+            "        Token bucket limits on IOPS and bytes/s for the client connection and\n"
+            "        for snapshot export connections, saving up burst msec of tokens, 100\n"
+            "        by default. total limits are shared between them in proportion to\n"
+            "        weight. With limitsfile, options are read from it and read again on\n"
+            "        SIGHUP to adjust limits at runtime.\n"
+            "\n"
+            "--sched[=depth][,deadline=msec]\n"
+            "        Read up to depth pipelined read and write requests, 32 by default,\n"
+            "        run them in offset order and merge adjacent ones into single I/O\n"
+            "        calls. A request waiting longer than deadline msec, 10 by default,\n"
+            "        is run ahead of offset order. Responses are sent in request order.\n"
+            "\n"
+            "--credits[=requests][,bytes=n][,latency=msec]\n"
+            "        Let clients limit outstanding reads and writes to a window of up to\n"
+            "        requests, 64 by default, and bytes, buffer size by default. The window\n"
+            "        shrinks so that a full window is served in latency msec, 100 by\n"
+            "        default. With --sched deeper than the window, requests beyond it are\n"
+            "        failed with EBUSY.\n"
+            "\n"
+            "--placement[=pages=size][,node=n|image][,nic=ifname][,strict]\n"
+            "      [,pin=none|node|cpu]\n"
+            "        Allocate request buffers on 2m huge pages, the default, 1g pages, thp\n"
+            "        transparent huge pages or small pages, falling back to smaller ones\n"
+            "        when none are reserved. Prefer memory on NUMA node n, the node of the\n"
+            "        device image is on or of network interface ifname, strictly with\n"
+            "        strict. Threads run on processors of node, and with pin=cpu backend\n"
+            "        workers each on a processor of its own.\n"
+            "\n"
+            "--workers[=n][,grain=indexes][,push=spread|local]\n"
+            "        Run member I/O of stripe, mirror and erasure sets on a work stealing\n"
+            "        pool of n worker threads, each with its own task queue. Without n,\n"
+            "        workers are started as sets need them, up to 64. Each task covers\n"
+            "        grain members, 1 by default. spread queues tasks on all workers in\n"
+            "        turn, local on one worker for others to steal.\n"
             "\n"
             "-r      Open image file in read-only mode.\n"
             "\n"
@@ -1355,6 +3818,8 @@ main(int argc, char **argv)
             "commdev can also start with shm: followed by an section object name for using\n"
             "shared memory communication. Alternatively, drv: followed by a name for using\n"
             "DevIO Client Driver to expose a device object connected to this devio instance.\n"
+            "On other systems than Windows, commdev can start with unix: followed by a\n"
+            "path where this service should listen for a UNIX domain socket connection.\n"
             "\n"
             "Default number of blocks is 0. When running on Windows the program will try to\n"
             "get the size of the image file or partition automatically, otherwise the client\n"
@@ -1366,6 +3831,9 @@ main(int argc, char **argv)
             "Default alignment is %u bytes.\n"
             "Default buffer size is %i bytes.\n"
             "\n"
+            "For syntax help with built-in backends such as stripe sets, type:\n"
+            "devio --backends\n"
+            "\n"
             "For syntax help with custom I/O DLL under Windows, type:\n"
             "devio --dll\n",
             DEF_REQUIRED_ALIGNMENT,
@@ -1375,6 +3843,21 @@ main(int argc, char **argv)
 
     comm_device = argv[1];
 
+    // Before buffers are allocated and backends start threads
+    if (placement_spec != NULL && !placement_init(placement_spec, argv[2]))
+        return 1;
+
+    if (workers_spec != NULL && !parallel_configure(workers_spec))
+        return 1;
+
+    if (!dll_mode)
+    {
+        dll_open = backend_find(argv[2]);
+
+        if (dll_open != NULL)
+            dll_mode = 1;
+    }
+
     if (dll_mode)
     {
         if (devio_info.flags & IMDPROXY_FLAG_RO)
@@ -1406,6 +3889,17 @@ main(int argc, char **argv)
 
     printf("Successfully opened '%s'.\n", argv[2]);
 
+    if (byteswap_mode)
+    {
+        const char *impl_name = NULL;
+        byteswap16_proc impl_proc;
+        int i;
+
+        for (i = 0; byteswap16_get_impl(i, &impl_name, &impl_proc); i++);
+
+        printf("Byte-swapping image data (%s).\n", impl_name);
+    }
+
     // Autodetect Microsoft .vhd files
     readdone = physical_read(&vhd_info, (safeio_size_t) sizeof(vhd_info), 0);
 
@@ -1418,7 +3912,7 @@ main(int argc, char **argv)
         void *geometry = &vhd_info.Footer.DiskGeometry;
 
         // VHD I/O uses a secondary buffer
-        buf2 = (char*)malloc(buffer_size);
+        buf2 = (char*)placement_alloc(buffer_size);
         if (buf2 == NULL)
         {
             syslog(LOG_ERR, "malloc() failed: %m\n");
@@ -1846,7 +4340,63 @@ main(int argc, char **argv)
         devio_info.req_alignment,
         buffer_size);
 
-    retval = do_comm(comm_device);
+    if (snapshot_spec != NULL)
+    {
+        if (!snapshot_init(snapshot_spec, image_offset,
+            (off_t_64)devio_info.file_size,
+            (devio_info.flags & IMDPROXY_FLAG_RO) != 0, image_read,
+            image_write))
+            return 1;
+
+        devio_info.flags |= IMDPROXY_FLAG_SUPPORTS_SNAPSHOT;
+    }
+
+    if (cbt_mode)
+    {
+        // Default tracking file name only for plain image files
+        if (!cbt_init(cbt_spec, dll_mode ? NULL : argv[2], image_offset,
+            (off_t_64)devio_info.file_size))
+            return 1;
+
+        devio_info.flags |= IMDPROXY_FLAG_SUPPORTS_CBT;
+    }
+
+    devio_info.flags |= IMDPROXY_FLAG_SUPPORTS_ZERO |
+        IMDPROXY_FLAG_SUPPORTS_UNMAP | IMDPROXY_FLAG_SUPPORTS_ALLOCATION |
+        IMDPROXY_FLAG_SUPPORTS_SPARSE_READ |
+        IMDPROXY_FLAG_SUPPORTS_COMPRESSION | IMDPROXY_FLAG_SUPPORTS_CRC32C;
+
+    if (metrics_mode && !metrics_init(metrics_spec))
+        return 1;
+
+    if (trace_spec != NULL &&
+        !trace_init(trace_spec, devio_info.file_size))
+        return 1;
+
+    if (qos_spec != NULL && !qos_init(qos_spec))
+        return 1;
+
+    if (sched_spec != NULL && !sched_init(sched_spec))
+        return 1;
+
+    if (credits_spec != NULL)
+    {
+        if (!credits_init(credits_spec, buffer_size))
+            return 1;
+
+        devio_info.flags |= IMDPROXY_FLAG_SUPPORTS_CREDITS;
+    }
+
+    retval = devio_comm(comm_device);
+
+    credits_close();
+    qos_close();
+    trace_close();
+    metrics_close();
+    cbt_close();
+    snapshot_close();
+    parallel_close();
+    placement_close();
 
     printf("Image close result: %i\n", physical_close(image_fd));
 
@@ -1930,8 +4480,8 @@ do_comm_shm(char *comm_device)
         buffer_size = detected_buffer_size;
         if (buf2 != NULL)
         {
-            free(buf2);
-            buf2 = (char*)malloc(buffer_size);
+            placement_free(buf2);
+            buf2 = (char*)placement_alloc(buffer_size);
             if (buf2 == NULL)
             {
                 syslog(LOG_ERR, "malloc() failed: %m\n");
@@ -2075,6 +4625,7 @@ int
 do_comm(char *comm_device)
 {
     ULONGLONG req = 0;
+    uint64_t busy_start = 0;
     u_short port = (u_short)strtoul(comm_device, NULL, 0);
 
     if (_strnicmp(comm_device, "shm:", 4) == 0)
@@ -2101,7 +4652,7 @@ do_comm(char *comm_device)
     }
     else
     {
-        buf = (char*)malloc(buffer_size);
+        buf = (char*)placement_alloc(buffer_size);
         if (buf == NULL)
         {
             syslog(LOG_ERR, "malloc() failed: %m\n");
@@ -2111,6 +4662,62 @@ do_comm(char *comm_device)
 
     if (shm_mode || drv_mode)
     {
+    }
+    else if (_strnicmp(comm_device, "unix:", 5) == 0)
+    {
+#ifdef _WIN32
+        fprintf(stderr, "UNIX domain sockets not supported on Windows.\n");
+        return 2;
+#else
+        struct sockaddr_un saddr = { 0 };
+        const char *path = comm_device + 5;
+        SOCKET ssd;
+
+        if (strlen(path) >= sizeof(saddr.sun_path))
+        {
+            fprintf(stderr, "Socket path too long: '%s'\n", path);
+            return 2;
+        }
+
+        ssd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (ssd == -1)
+        {
+            syslog(LOG_ERR, "socket() failed: %m\n");
+            return 2;
+        }
+
+        saddr.sun_family = AF_UNIX;
+        strcpy(saddr.sun_path, path);
+
+        unlink(path);
+
+        if (bind(ssd, (struct sockaddr*)&saddr, sizeof saddr) == -1)
+        {
+            syslog(LOG_ERR, "bind() failed '%s': %m\n", path);
+            return 2;
+        }
+
+        if (listen(ssd, 1) == -1)
+        {
+            syslog(LOG_ERR, "listen() failed '%s': %m\n", path);
+            return 2;
+        }
+
+        printf("Waiting for connection on socket '%s'. Press Ctrl+C to cancel.\n",
+            path);
+
+        sd = accept(ssd, NULL, NULL);
+        if (sd == -1)
+        {
+            syslog(LOG_ERR, "accept() failed '%s': %m\n", path);
+            return 2;
+        }
+
+        closesocket(ssd);
+        unlink(path);
+
+        printf("Got connection on socket '%s'.\n", path);
+#endif
     }
     else if (port != 0)
     {
@@ -2202,15 +4809,37 @@ do_comm(char *comm_device)
         printf("Waiting for I/O requests on device '%s'.\n", comm_device);
     }
 
+    trace_connection();
+
     for (;;)
     {
         if (!comm_read(&req, sizeof(req))
             || req == IMDPROXY_REQ_CLOSE)
         {
             puts("Connection closed.");
+            print_payload_stats();
+            print_sched_stats();
+            print_stream_stats();
+            print_comm_stats();
             return 0;
         }
 
+        if (sched_depth > 0 &&
+            (req == IMDPROXY_REQ_READ || req == IMDPROXY_REQ_WRITE) &&
+            !stream_pending(req))
+        {
+            if (!sched_requests(req))
+                return 1;
+            continue;
+        }
+
+        metrics_request_start(req);
+        trace_request_start(req);
+        devio_probe1(request__receive, req);
+
+        if (credits_enabled)
+            busy_start = backend_time_nsec();
+
         switch (req)
         {
         case IMDPROXY_REQ_INFO:
@@ -2223,16 +4852,55 @@ do_comm(char *comm_device)
                 return 1;
             break;
 
+        case IMDPROXY_REQ_READ_SPARSE:
+            if (!read_sparse_data())
+                return 1;
+            break;
+
         case IMDPROXY_REQ_WRITE:
             if (!write_data())
                 return 1;
             break;
 
+        case IMDPROXY_REQ_SNAPSHOT:
+            if (!snapshot_request())
+                return 1;
+            break;
+
+        case IMDPROXY_REQ_CHANGED_BLOCKS:
+            if (!cbt_request())
+                return 1;
+            break;
+
+        case IMDPROXY_REQ_GET_ALLOCATION:
+            if (!get_allocation())
+                return 1;
+            break;
+
+        case IMDPROXY_REQ_SET_OPTIONS:
+            if (!set_options())
+                return 1;
+            break;
+
+        case IMDPROXY_REQ_UNMAP:
+        case IMDPROXY_REQ_ZERO:
+            if (!unmap_or_zero_data(req))
+                return 1;
+            break;
+
         default:
             if (!send_failed())
                 return 1;
             break;
         }
+
+        metrics_request_end();
+        trace_request_end();
+        devio_probe1(response__sent, req);
+
+        if (credits_enabled &&
+            (req == IMDPROXY_REQ_READ || req == IMDPROXY_REQ_WRITE))
+            credits_served(backend_time_nsec() - busy_start, 1);
     }
 }
 
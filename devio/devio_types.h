@@ -62,6 +62,7 @@ typedef int SOCKET;
 #define _close          close
 #define _stricmp        strcasecmp
 #define _strnicmp       strncasecmp
+#define _strdup         strdup
 
 #ifndef O_BINARY
 #define O_BINARY       0
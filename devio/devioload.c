@@ -0,0 +1,618 @@
+/*
+Load generator and latency reporter for ImDisk proxy servers.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <unistd.h>
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "imdclient.h"
+#include "histogram.h"
+
+#define DEF_BLOCK_SIZE      4096
+#define DEF_DEPTH           16
+#define DEF_JOBS            1
+#define DEF_SECONDS         10.0
+#define DEF_READ_PERCENT    100
+
+typedef struct _LOAD_PARAMS
+{
+    const char *servers;
+    safeio_size_t block_size;
+    int read_percent;
+    int random;
+    int depth;
+    int jobs;
+    double seconds;
+    ULONGLONG options;
+    ULONGLONG range_start;
+    ULONGLONG range_size;       // Zero for whole image
+} LOAD_PARAMS, *PLOAD_PARAMS;
+
+typedef struct _LOAD_JOB
+{
+    PLOAD_PARAMS params;
+    int index;
+    pthread_t thread;
+    PIMDCLIENT_CONN conn;
+    char *buffers;
+    uint64_t random_state;
+    ULONGLONG first_block;
+    ULONGLONG blocks;
+    ULONGLONG next_block;
+    uint64_t deadline;
+    int failed;
+
+    // Results
+    HISTOGRAM read_latency;
+    HISTOGRAM write_latency;
+    uint64_t errors;
+} LOAD_JOB, *PLOAD_JOB;
+
+// Per request, context of IMDCLIENT_IO
+typedef struct _LOAD_SLOT
+{
+    PLOAD_JOB job;
+    IMDCLIENT_IO io;
+    struct iovec iov;
+    uint64_t start;
+    int busy;
+} LOAD_SLOT, *PLOAD_SLOT;
+
+static uint64_t
+now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, separate state per job
+static uint64_t
+next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 2685821657736338717ULL;
+}
+
+static int
+parse_size(const char *str, ULONGLONG *size)
+{
+    char *suffix;
+    ULONGLONG value = strtoull(str, &suffix, 0);
+
+    switch (*suffix)
+    {
+    case 'T': case 't':
+        value <<= 10;
+    case 'G': case 'g':
+        value <<= 10;
+    case 'M': case 'm':
+        value <<= 10;
+    case 'K': case 'k':
+        value <<= 10;
+        ++suffix;
+    }
+
+    if (suffix == str || *suffix != 0)
+        return 0;
+
+    *size = value;
+
+    return 1;
+}
+
+// Copies entry index, modulo number of entries, of comma separated list.
+static void
+select_server(const char *list, int index, char *server, size_t size)
+{
+    const char *entry = list;
+    const char *end;
+    int count = 1;
+    size_t len;
+
+    for (end = list; (end = strchr(end, ',')) != NULL; end++)
+        ++count;
+
+    for (index %= count; index > 0; index--)
+        entry = strchr(entry, ',') + 1;
+
+    end = strchr(entry, ',');
+    len = end != NULL ? (size_t)(end - entry) : strlen(entry);
+
+    if (len >= size)
+        len = size - 1;
+
+    memcpy(server, entry, len);
+    server[len] = 0;
+}
+
+static void
+io_done(PIMDCLIENT_IO io)
+{
+    PLOAD_SLOT slot = (PLOAD_SLOT)io->context;
+    PLOAD_JOB job = slot->job;
+    uint64_t latency = now_nsec() - slot->start;
+
+    slot->busy = 0;
+
+    if (io->errorno != 0 || io->length != slot->iov.iov_len)
+    {
+        if (job->errors++ == 0)
+            fprintf(stderr, "Job %i: %s failed at " ULL_FMT ": %s\n",
+                job->index,
+                io->request_code == IMDPROXY_REQ_READ ? "Read" : "Write",
+                io->offset,
+                io->errorno != 0 ? strerror((int)io->errorno) :
+                "Short transfer");
+
+        return;
+    }
+
+    if (io->request_code == IMDPROXY_REQ_READ)
+        histogram_add(&job->read_latency, latency);
+    else
+        histogram_add(&job->write_latency, latency);
+}
+
+static int
+submit_next(PLOAD_JOB job, PLOAD_SLOT slot)
+{
+    PLOAD_PARAMS params = job->params;
+    ULONGLONG block;
+
+    if (params->random)
+        block = next_random(&job->random_state) % job->blocks;
+    else
+    {
+        block = job->next_block;
+        job->next_block = (job->next_block + 1) % job->blocks;
+    }
+
+    slot->io.request_code =
+        (int)(next_random(&job->random_state) % 100) < params->read_percent ?
+        IMDPROXY_REQ_READ : IMDPROXY_REQ_WRITE;
+    slot->io.offset = params->range_start +
+        (job->first_block + block) * params->block_size;
+    slot->busy = 1;
+    slot->start = now_nsec();
+
+    return imdclient_submit(job->conn, &slot->io);
+}
+
+static void *
+run_job(void *arg)
+{
+    PLOAD_JOB job = (PLOAD_JOB)arg;
+    PLOAD_PARAMS params = job->params;
+    PLOAD_SLOT slots;
+    int i;
+
+    slots = (PLOAD_SLOT)calloc(params->depth, sizeof(*slots));
+
+    if (slots == NULL)
+    {
+        perror("calloc()");
+        job->failed = 1;
+        return NULL;
+    }
+
+    imdclient_set_depth(job->conn, params->depth);
+
+    for (i = 0; i < params->depth; i++)
+    {
+        slots[i].job = job;
+        slots[i].iov.iov_base = job->buffers + (size_t)i * params->block_size;
+        slots[i].iov.iov_len = params->block_size;
+        slots[i].io.iov = &slots[i].iov;
+        slots[i].io.iovcnt = 1;
+        slots[i].io.callback = io_done;
+        slots[i].io.context = slots + i;
+    }
+
+    while (now_nsec() < job->deadline)
+    {
+        for (i = 0; i < params->depth; i++)
+            if (!slots[i].busy && !submit_next(job, slots + i))
+            {
+                fprintf(stderr, "Job %i: Connection failed: %s\n",
+                    job->index, strerror(errno));
+                job->failed = 1;
+                free(slots);
+                return NULL;
+            }
+
+        if (imdclient_complete(job->conn, 1) == -1)
+        {
+            fprintf(stderr, "Job %i: Connection failed: %s\n", job->index,
+                strerror(errno));
+            job->failed = 1;
+            free(slots);
+            return NULL;
+        }
+    }
+
+    imdclient_complete(job->conn, imdclient_outstanding(job->conn));
+
+    free(slots);
+
+    return NULL;
+}
+
+static void
+print_text(const char *name, const HISTOGRAM *latency,
+    safeio_size_t block_size, double seconds)
+{
+    if (latency->count == 0)
+        return;
+
+    printf("%-6s IOPS %.0f, %.1f MB/s, latency usec avg %.1f, "
+        "p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        name,
+        latency->count / seconds,
+        latency->count * (double)block_size / seconds / 1e6,
+        histogram_mean(latency) / 1e3,
+        histogram_percentile(latency, 50) / 1e3,
+        histogram_percentile(latency, 99) / 1e3,
+        histogram_percentile(latency, 99.9) / 1e3,
+        latency->max / 1e3);
+}
+
+static void
+print_json(const char *name, const HISTOGRAM *latency,
+    safeio_size_t block_size, double seconds)
+{
+    printf("  \"%s\": {\n"
+        "    \"ops\": " ULL_FMT ",\n"
+        "    \"iops\": %.1f,\n"
+        "    \"bandwidth\": %.0f,\n"
+        "    \"latency_usec\": {\n"
+        "      \"avg\": %.2f,\n"
+        "      \"min\": %.2f,\n"
+        "      \"p50\": %.2f,\n"
+        "      \"p99\": %.2f,\n"
+        "      \"p99.9\": %.2f,\n"
+        "      \"max\": %.2f\n"
+        "    }\n"
+        "  },\n",
+        name,
+        (ULONGLONG)latency->count,
+        latency->count / seconds,
+        latency->count * (double)block_size / seconds,
+        histogram_mean(latency) / 1e3,
+        latency->min / 1e3,
+        histogram_percentile(latency, 50) / 1e3,
+        histogram_percentile(latency, 99) / 1e3,
+        histogram_percentile(latency, 99.9) / 1e3,
+        latency->max / 1e3);
+}
+
+static int
+usage()
+{
+    fprintf(stderr,
+        "devioload - devio load generator ver " DEVIO_VERSION "\n"
+        "\n"
+        "Usage:\n"
+        "devioload [options] server[,server...]\n"
+        "\n"
+        "server is [host:]port or unix:path of a devio or other proxy server.\n"
+        "Each job uses its own connection, to servers in the list in turn. A devio\n"
+        "process serves one connection, so start one per job.\n"
+        "\n"
+        "-b size    Block size. Default is %i.\n"
+        "-r pct     Percentage of requests that are reads. Default is %i.\n"
+        "-p pattern rand or seq. Default is rand.\n"
+        "-q depth   Outstanding requests per job. Default is %i.\n"
+        "-j jobs    Number of jobs, each with a connection and a thread.\n"
+        "           Default is %i.\n"
+        "-t seconds Run time. Default is %.0f.\n"
+        "-o offset  Start of range to use in image. Default is 0.\n"
+        "-s size    Size of range to use in image. Default is rest of image.\n"
+        "-c         Use CRC32C checksums on payloads.\n"
+        "-z         Use compression on payloads.\n"
+        "-w         Use credits, sending no more than the window server grants.\n"
+        "-J         Print results as JSON.\n"
+        "\n"
+        "Sizes can have K, M, G or T suffix. Sequential jobs each work on an equal\n"
+        "part of the range. Writes destroy data in the range.\n",
+        DEF_BLOCK_SIZE, DEF_READ_PERCENT, DEF_DEPTH, DEF_JOBS, DEF_SECONDS);
+
+    return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    LOAD_PARAMS params = { 0 };
+    PLOAD_JOB jobs;
+    HISTOGRAM read_latency;
+    HISTOGRAM write_latency;
+    ULONGLONG value;
+    ULONGLONG image_size;
+    ULONGLONG total_blocks;
+    uint64_t errors = 0;
+    uint64_t start;
+    double seconds;
+    int json = 0;
+    int failed = 0;
+    int opt;
+    int i;
+
+    params.block_size = DEF_BLOCK_SIZE;
+    params.read_percent = DEF_READ_PERCENT;
+    params.random = 1;
+    params.depth = DEF_DEPTH;
+    params.jobs = DEF_JOBS;
+    params.seconds = DEF_SECONDS;
+
+    while ((opt = getopt(argc, argv, "b:r:p:q:j:t:o:s:czwJ")) != -1)
+        switch (opt)
+        {
+        case 'b':
+            if (!parse_size(optarg, &value) || value == 0 ||
+                value > 64 << 20)
+                return usage();
+            params.block_size = (safeio_size_t)value;
+            break;
+
+        case 'r':
+            params.read_percent = atoi(optarg);
+            if (params.read_percent < 0 || params.read_percent > 100)
+                return usage();
+            break;
+
+        case 'p':
+            if (strcmp(optarg, "rand") == 0)
+                params.random = 1;
+            else if (strcmp(optarg, "seq") == 0)
+                params.random = 0;
+            else
+                return usage();
+            break;
+
+        case 'q':
+            params.depth = atoi(optarg);
+            if (params.depth < 1)
+                return usage();
+            break;
+
+        case 'j':
+            params.jobs = atoi(optarg);
+            if (params.jobs < 1)
+                return usage();
+            break;
+
+        case 't':
+            params.seconds = strtod(optarg, NULL);
+            if (params.seconds <= 0)
+                return usage();
+            break;
+
+        case 'o':
+            if (!parse_size(optarg, &params.range_start))
+                return usage();
+            break;
+
+        case 's':
+            if (!parse_size(optarg, &params.range_size))
+                return usage();
+            break;
+
+        case 'c':
+            params.options |= IMDPROXY_OPTION_CRC32C;
+            break;
+
+        case 'z':
+            params.options |= IMDPROXY_OPTION_COMPRESSION;
+            break;
+
+        case 'w':
+            params.options |= IMDPROXY_OPTION_CREDITS;
+            break;
+
+        case 'J':
+            json = 1;
+            break;
+
+        default:
+            return usage();
+        }
+
+    if (optind + 1 != argc)
+        return usage();
+
+    params.servers = argv[optind];
+
+    jobs = (PLOAD_JOB)calloc(params.jobs, sizeof(*jobs));
+
+    if (jobs == NULL)
+    {
+        perror("calloc()");
+        return 2;
+    }
+
+    for (i = 0; i < params.jobs; i++)
+    {
+        PLOAD_JOB job = jobs + i;
+        char server[256];
+
+        select_server(params.servers, i, server, sizeof(server));
+
+        job->params = &params;
+        job->index = i;
+        job->random_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+        job->conn = imdclient_connect(server, params.options);
+
+        if (job->conn == NULL)
+        {
+            fprintf(stderr, "Cannot connect to %s: %s\n", server,
+                strerror(errno));
+            return 1;
+        }
+
+        if ((imdclient_options(job->conn) & params.options) !=
+            params.options && i == 0)
+            fprintf(stderr, "Server %s does not support all requested "
+                "options.\n", server);
+
+        job->buffers = (char*)malloc((size_t)params.depth *
+            params.block_size);
+
+        if (job->buffers == NULL)
+        {
+            perror("malloc()");
+            return 2;
+        }
+
+        // Incompressible data for writes
+        {
+            size_t j;
+
+            for (j = 0; j < (size_t)params.depth * params.block_size; j++)
+                job->buffers[j] = (char)next_random(&job->random_state);
+        }
+    }
+
+    image_size = imdclient_info(jobs[0].conn)->file_size;
+
+    if (params.range_size == 0 && image_size > params.range_start)
+        params.range_size = image_size - params.range_start;
+
+    total_blocks = params.range_size / params.block_size;
+
+    if (total_blocks < (ULONGLONG)params.jobs)
+    {
+        fprintf(stderr, "Range too small for block size and jobs.\n");
+        return 1;
+    }
+
+    start = now_nsec();
+
+    for (i = 0; i < params.jobs; i++)
+    {
+        PLOAD_JOB job = jobs + i;
+
+        if (params.random)
+        {
+            job->first_block = 0;
+            job->blocks = total_blocks;
+        }
+        else
+        {
+            job->first_block = total_blocks / params.jobs * i;
+            job->blocks = total_blocks / params.jobs;
+        }
+
+        histogram_init(&job->read_latency);
+        histogram_init(&job->write_latency);
+
+        job->deadline = start + (uint64_t)(params.seconds * 1e9);
+
+        if (pthread_create(&job->thread, NULL, run_job, job) != 0)
+        {
+            perror("pthread_create()");
+            return 2;
+        }
+    }
+
+    histogram_init(&read_latency);
+    histogram_init(&write_latency);
+
+    for (i = 0; i < params.jobs; i++)
+    {
+        pthread_join(jobs[i].thread, NULL);
+
+        histogram_merge(&read_latency, &jobs[i].read_latency);
+        histogram_merge(&write_latency, &jobs[i].write_latency);
+        errors += jobs[i].errors;
+        failed |= jobs[i].failed;
+    }
+
+    seconds = (now_nsec() - start) / 1e9;
+
+    for (i = 0; i < params.jobs; i++)
+    {
+        imdclient_close(jobs[i].conn);
+        free(jobs[i].buffers);
+    }
+
+    free(jobs);
+
+    if (json)
+    {
+        printf("{\n"
+            "  \"jobs\": %i,\n"
+            "  \"depth\": %i,\n"
+            "  \"block_size\": " SIZ_FMT ",\n"
+            "  \"read_percent\": %i,\n"
+            "  \"pattern\": \"%s\",\n"
+            "  \"seconds\": %.3f,\n",
+            params.jobs, params.depth, params.block_size,
+            params.read_percent, params.random ? "rand" : "seq", seconds);
+
+        print_json("read", &read_latency, params.block_size, seconds);
+        print_json("write", &write_latency, params.block_size, seconds);
+
+        printf("  \"errors\": " ULL_FMT "\n"
+            "}\n", (ULONGLONG)errors);
+    }
+    else
+    {
+        printf("%i jobs, depth %i, " SIZ_FMT " bytes, %i%% read, %s, "
+            "%.1f s\n",
+            params.jobs, params.depth, params.block_size,
+            params.read_percent, params.random ? "random" : "sequential",
+            seconds);
+
+        print_text("read", &read_latency, params.block_size, seconds);
+        print_text("write", &write_latency, params.block_size, seconds);
+
+        if (errors != 0)
+            printf("errors " ULL_FMT "\n", (ULONGLONG)errors);
+    }
+
+    return failed || errors != 0 ? 1 : 0;
+}
@@ -0,0 +1,785 @@
+/*
+Replays request traces recorded by devio against proxy servers.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "imdclient.h"
+#include "histogram.h"
+#include "trace.h"
+
+#define DEF_DEPTH           32
+#define ALIGNMENT           512
+
+enum
+{
+    ReplayOpRead,
+    ReplayOpWrite,
+    ReplayOpUnmap,
+    ReplayOpZero,
+    ReplayOpSparse,
+    REPLAY_OPS
+};
+
+static const char *replay_op_names[] = {
+    "read", "write", "unmap", "zero", "sparse"
+};
+
+// Range in unmap and zero requests
+typedef struct _REPLAY_RANGE
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+} REPLAY_RANGE, *PREPLAY_RANGE;
+
+// Per request, context of IMDCLIENT_IO
+typedef struct _REPLAY_SLOT
+{
+    struct _REPLAY_SLOT *next_free;
+    IMDCLIENT_IO io;
+    struct iovec iov;
+    char *buffer;
+    size_t buffer_size;
+    int op;
+    uint64_t start;
+} REPLAY_SLOT, *PREPLAY_SLOT;
+
+static PREPLAY_SLOT free_slots = NULL;
+static char *sparse_buffer = NULL;
+static size_t sparse_buffer_size = 0;
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+// Results
+static HISTOGRAM trace_latency[REPLAY_OPS];
+static HISTOGRAM replay_latency[REPLAY_OPS];
+static uint64_t replay_bytes[REPLAY_OPS];
+static uint64_t errors = 0;
+
+static uint64_t
+now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, for incompressible write data
+static uint64_t
+next_random()
+{
+    uint64_t x = random_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random_state = x;
+
+    return x * 2685821657736338717ULL;
+}
+
+static int
+replay_op(uint32_t request_code)
+{
+    switch (request_code)
+    {
+    case IMDPROXY_REQ_READ:
+        return ReplayOpRead;
+    case IMDPROXY_REQ_READ_SPARSE:
+        return ReplayOpSparse;
+    case IMDPROXY_REQ_WRITE:
+        return ReplayOpWrite;
+    case IMDPROXY_REQ_UNMAP:
+        return ReplayOpUnmap;
+    case IMDPROXY_REQ_ZERO:
+        return ReplayOpZero;
+    default:
+        return -1;
+    }
+}
+
+// Sort by time request was received, records are in completion order.
+static int
+compare_records(const void *a, const void *b)
+{
+    const DEVIO_TRACE_RECORD *x = (const DEVIO_TRACE_RECORD*)a;
+    const DEVIO_TRACE_RECORD *y = (const DEVIO_TRACE_RECORD*)b;
+
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp ? -1 : 1;
+
+    return 0;
+}
+
+static PDEVIO_TRACE_RECORD
+load_trace(const char *path, PDEVIO_TRACE_HEADER header, size_t *count)
+{
+    FILE *stream = fopen(path, "rb");
+    PDEVIO_TRACE_RECORD records = NULL;
+    size_t allocated = 0;
+
+    *count = 0;
+
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(header, sizeof(*header), 1, stream) != 1 ||
+        memcmp(header->magic, DEVIO_TRACE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        fprintf(stderr, "'%s' is not a devio trace file.\n", path);
+        fclose(stream);
+        return NULL;
+    }
+
+    if (header->version != DEVIO_TRACE_VERSION ||
+        header->record_size != sizeof(DEVIO_TRACE_RECORD))
+    {
+        fprintf(stderr, "Unsupported trace version %u, record size %u.\n",
+            header->version, header->record_size);
+        fclose(stream);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        size_t done;
+
+        if (*count == allocated)
+        {
+            PDEVIO_TRACE_RECORD larger;
+
+            allocated = allocated == 0 ? 65536 : allocated * 2;
+            larger = (PDEVIO_TRACE_RECORD)realloc(records,
+                allocated * sizeof(*records));
+
+            if (larger == NULL)
+            {
+                perror("realloc()");
+                free(records);
+                fclose(stream);
+                return NULL;
+            }
+
+            records = larger;
+        }
+
+        done = fread(records + *count, sizeof(*records), allocated - *count,
+            stream);
+
+        *count += done;
+
+        if (done == 0)
+            break;
+    }
+
+    if (ferror(stream))
+    {
+        fprintf(stderr, "Error reading '%s': %s\n", path, strerror(errno));
+        free(records);
+        fclose(stream);
+        return NULL;
+    }
+
+    fclose(stream);
+
+    qsort(records, *count, sizeof(*records), compare_records);
+
+    return records;
+}
+
+static void
+io_done(PIMDCLIENT_IO io)
+{
+    PREPLAY_SLOT slot = (PREPLAY_SLOT)io->context;
+    uint64_t latency = now_nsec() - slot->start;
+
+    slot->next_free = free_slots;
+    free_slots = slot;
+
+    if (io->errorno != 0 || io->length != slot->iov.iov_len)
+    {
+        if (errors++ == 0)
+            fprintf(stderr, "%s failed at " ULL_FMT ": %s\n",
+                io->request_code == IMDPROXY_REQ_READ ? "Read" : "Write",
+                io->offset,
+                io->errorno != 0 ? strerror((int)io->errorno) :
+                "Short transfer");
+
+        return;
+    }
+
+    histogram_add(&replay_latency[slot->op], latency);
+    replay_bytes[slot->op] += io->length;
+}
+
+static int
+slot_buffer(PREPLAY_SLOT slot, size_t size)
+{
+    char *buffer;
+    size_t i;
+
+    if (slot->buffer_size >= size)
+        return 1;
+
+    buffer = (char*)realloc(slot->buffer, size);
+
+    if (buffer == NULL)
+        return 0;
+
+    for (i = slot->buffer_size; i < size; i++)
+        buffer[i] = (char)next_random();
+
+    slot->buffer = buffer;
+    slot->buffer_size = size;
+
+    return 1;
+}
+
+// Receives completions until target time, so that replay latency is
+// measured when responses arrive.
+static int
+wait_until(PIMDCLIENT_POOL pool, uint64_t target)
+{
+    for (;;)
+    {
+        uint64_t now = now_nsec();
+        struct timespec timeout;
+        fd_set fds;
+        int max_fd = -1;
+        int i;
+
+        if (now >= target)
+            return 1;
+
+        FD_ZERO(&fds);
+
+        for (i = 0; i < imdclient_pool_size(pool); i++)
+        {
+            PIMDCLIENT_CONN conn = imdclient_pool_conn(pool, i);
+            SOCKET sd = imdclient_socket(conn);
+
+            if (imdclient_outstanding(conn) > 0 && sd < FD_SETSIZE)
+            {
+                FD_SET(sd, &fds);
+
+                if (sd > max_fd)
+                    max_fd = sd;
+            }
+        }
+
+        timeout.tv_sec = (time_t)((target - now) / 1000000000);
+        timeout.tv_nsec = (long)((target - now) % 1000000000);
+
+        if (pselect(max_fd + 1, &fds, NULL, NULL, &timeout, NULL) > 0 &&
+            imdclient_pool_complete(pool, 0) == -1)
+            return 0;
+    }
+}
+
+static int
+replay_range(PIMDCLIENT_CONN conn, int op, ULONGLONG offset,
+    ULONGLONG length)
+{
+    struct
+    {
+        IMDPROXY_ZERO_REQ header;
+        REPLAY_RANGE range;
+    } req;
+    IMDPROXY_ZERO_RESP resp = { 0 };
+    uint64_t start = now_nsec();
+
+    req.header.request_code = op == ReplayOpUnmap ?
+        IMDPROXY_REQ_UNMAP : IMDPROXY_REQ_ZERO;
+    req.header.length = sizeof(req.range);
+    req.range.offset = offset;
+    req.range.length = length;
+
+    if (!imdclient_call(conn, &req, sizeof(req), NULL, 0, &resp,
+        sizeof(resp)))
+        return 0;
+
+    if (resp.errorno != 0)
+    {
+        if (errors++ == 0)
+            fprintf(stderr, "%s failed at " ULL_FMT ": %s\n",
+                op == ReplayOpUnmap ? "Unmap" : "Zero", offset,
+                strerror((int)resp.errorno));
+
+        return 1;
+    }
+
+    histogram_add(&replay_latency[op], now_nsec() - start);
+    replay_bytes[op] += length;
+
+    return 1;
+}
+
+static int
+replay_sparse(PIMDCLIENT_CONN conn, ULONGLONG offset, ULONGLONG length)
+{
+    uint64_t start = now_nsec();
+    safeio_ssize_t readdone;
+
+    if (sparse_buffer_size < length)
+    {
+        char *buffer = (char*)realloc(sparse_buffer, (size_t)length);
+
+        if (buffer == NULL)
+        {
+            perror("realloc()");
+            return 0;
+        }
+
+        sparse_buffer = buffer;
+        sparse_buffer_size = (size_t)length;
+    }
+
+    readdone = imdclient_read_sparse(conn, sparse_buffer,
+        (safeio_size_t)length, (off_t_64)offset, NULL, NULL);
+
+    if (readdone != (safeio_ssize_t)length)
+    {
+        if (readdone == -1 && imdclient_error(conn) != 0)
+            return 0;
+
+        if (errors++ == 0)
+            fprintf(stderr, "Sparse read failed at " ULL_FMT ": %s\n",
+                offset, readdone == -1 ? strerror(errno) : "Short transfer");
+
+        return 1;
+    }
+
+    histogram_add(&replay_latency[ReplayOpSparse], now_nsec() - start);
+    replay_bytes[ReplayOpSparse] += length;
+
+    return 1;
+}
+
+static int
+usage()
+{
+    fprintf(stderr,
+        "devioreplay - devio trace replay ver " DEVIO_VERSION "\n"
+        "\n"
+        "Usage:\n"
+        "devioreplay [options] tracefile server[,server...]\n"
+        "\n"
+        "Replays read, write, unmap, zero and read sparse requests in a trace\n"
+        "recorded with devio --trace against a devio or other proxy server, given\n"
+        "as [host:]port or unix:path. Requests are sent at their recorded times,\n"
+        "relative to start of replay, or as fast as possible with -a.\n"
+        "\n"
+        "Each client in the trace gets its own connection, to servers in the list\n"
+        "in turn. A devio process serves one connection, so start one per\n"
+        "connection, or use -n 1 to replay all clients on one connection.\n"
+        "\n"
+        "-a         As fast as possible, with up to depth requests outstanding.\n"
+        "-s factor  Speed up recorded timing by factor, 0.5 is half speed.\n"
+        "           Default is 1.\n"
+        "-q depth   Outstanding requests per connection. Default is %i.\n"
+        "-n conns   Number of connections, clients are spread over them.\n"
+        "-R         Only replay reads, for targets that must not be modified.\n"
+        "-c         Use CRC32C checksums on payloads.\n"
+        "-z         Use compression on payloads.\n"
+        "\n"
+        "Trace latency is measured by the server from request received until\n"
+        "response sent, replay latency by devioreplay from request sent until\n"
+        "response received.\n"
+        "\n"
+        "Read sparse requests are replayed as read sparse requests, or as reads\n"
+        "if the server does not support them. Like unmap and zero requests, they\n"
+        "wait for outstanding requests on the connection. Requests beyond end of\n"
+        "target image wrap around to its start. Writes send random data and\n"
+        "destroy data on target.\n",
+        DEF_DEPTH);
+
+    return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    DEVIO_TRACE_HEADER header;
+    PDEVIO_TRACE_RECORD records;
+    size_t count;
+    PREPLAY_SLOT slots;
+    PIMDCLIENT_POOL pool;
+    uint32_t *clients = NULL;
+    int client_count = 0;
+    ULONGLONG options = 0;
+    ULONGLONG image_size;
+    ULONGLONG server_flags;
+    uint64_t requests = 0;
+    uint64_t skipped = 0;
+    uint64_t wrapped = 0;
+    uint64_t lag_sum = 0;
+    uint64_t lag_max = 0;
+    uint64_t duration;
+    uint64_t start;
+    double speed = 1.0;
+    double seconds;
+    int asap = 0;
+    int read_only = 0;
+    int depth = DEF_DEPTH;
+    int connections = 0;
+    int failed = 0;
+    int opt;
+    int i;
+    size_t r;
+
+    while ((opt = getopt(argc, argv, "as:q:n:Rcz")) != -1)
+        switch (opt)
+        {
+        case 'a':
+            asap = 1;
+            break;
+
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (speed <= 0)
+                return usage();
+            break;
+
+        case 'q':
+            depth = atoi(optarg);
+            if (depth < 1)
+                return usage();
+            break;
+
+        case 'n':
+            connections = atoi(optarg);
+            if (connections < 1)
+                return usage();
+            break;
+
+        case 'R':
+            read_only = 1;
+            break;
+
+        case 'c':
+            options |= IMDPROXY_OPTION_CRC32C;
+            break;
+
+        case 'z':
+            options |= IMDPROXY_OPTION_COMPRESSION;
+            break;
+
+        default:
+            return usage();
+        }
+
+    if (optind + 2 != argc)
+        return usage();
+
+    records = load_trace(argv[optind], &header, &count);
+
+    if (records == NULL)
+        return 1;
+
+    duration = count > 0 ?
+        records[count - 1].timestamp - records[0].timestamp : 0;
+
+    {
+        time_t start_time = (time_t)(header.start_time / 1000000000);
+        char time_str[64] = "";
+
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S UTC",
+            gmtime(&start_time));
+
+        printf("Trace recorded %s, " SIZ_FMT " requests over %.3f s, "
+            ULL_FMT " dropped.\n", time_str, count, duration / 1e9,
+            (ULONGLONG)header.dropped);
+    }
+
+    if (header.dropped != 0)
+        fprintf(stderr, "Warning: Requests dropped while recording are "
+            "missing from replay.\n");
+
+    // Distinct clients, in order of first request
+    for (r = 0; r < count; r++)
+    {
+        for (i = 0; i < client_count; i++)
+            if (clients[i] == records[r].client)
+                break;
+
+        if (i == client_count)
+        {
+            uint32_t *larger = (uint32_t*)realloc(clients,
+                (client_count + 1) * sizeof(*clients));
+
+            if (larger == NULL)
+            {
+                perror("realloc()");
+                return 2;
+            }
+
+            clients = larger;
+            clients[client_count++] = records[r].client;
+        }
+
+        // Connection index instead of client number from here
+        records[r].client = (uint32_t)i;
+    }
+
+    if (connections == 0)
+        connections = client_count > 0 ? client_count : 1;
+
+    pool = imdclient_pool_open(argv[optind + 1], connections, options);
+
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Cannot connect to %s: %s\n", argv[optind + 1],
+            strerror(errno));
+        return 1;
+    }
+
+    if ((imdclient_options(imdclient_pool_conn(pool, 0)) & options) !=
+        options)
+        fprintf(stderr, "Server does not support all requested options.\n");
+
+    image_size = imdclient_info(imdclient_pool_conn(pool, 0))->file_size;
+    server_flags = imdclient_info(imdclient_pool_conn(pool, 0))->flags;
+
+    if (image_size < ALIGNMENT)
+    {
+        fprintf(stderr, "Target image too small.\n");
+        return 1;
+    }
+
+    if (image_size != header.image_size)
+        printf("Target image size " ULL_FMT " bytes, traced image "
+            ULL_FMT " bytes.\n", image_size, (ULONGLONG)header.image_size);
+
+    slots = (PREPLAY_SLOT)calloc((size_t)depth * connections,
+        sizeof(*slots));
+
+    if (slots == NULL)
+    {
+        perror("calloc()");
+        return 2;
+    }
+
+    for (i = 0; i < depth * connections; i++)
+    {
+        slots[i].io.iov = &slots[i].iov;
+        slots[i].io.iovcnt = 1;
+        slots[i].io.callback = io_done;
+        slots[i].io.context = slots + i;
+        slots[i].next_free = free_slots;
+        free_slots = slots + i;
+    }
+
+    for (i = 0; i < connections; i++)
+        imdclient_set_depth(imdclient_pool_conn(pool, i), depth);
+
+    for (i = 0; i < REPLAY_OPS; i++)
+    {
+        histogram_init(&trace_latency[i]);
+        histogram_init(&replay_latency[i]);
+    }
+
+#ifdef PR_SET_TIMERSLACK
+    // Default slack of 50 usec would skew recorded timing
+    prctl(PR_SET_TIMERSLACK, 1000UL, 0UL, 0UL, 0UL);
+#endif
+
+    start = now_nsec();
+
+    for (r = 0; r < count && !failed; r++)
+    {
+        PDEVIO_TRACE_RECORD record = records + r;
+        PIMDCLIENT_CONN conn;
+        PREPLAY_SLOT slot;
+        ULONGLONG offset = record->offset;
+        ULONGLONG length = record->length;
+        int op = replay_op(record->request_code);
+
+        if (op == ReplayOpSparse &&
+            !(server_flags & IMDPROXY_FLAG_SUPPORTS_SPARSE_READ))
+            op = ReplayOpRead;
+
+        if (op == -1 || length == 0 || length > image_size ||
+            (read_only && op != ReplayOpRead && op != ReplayOpSparse) ||
+            (op == ReplayOpUnmap &&
+                !(server_flags & IMDPROXY_FLAG_SUPPORTS_UNMAP)) ||
+            (op == ReplayOpZero &&
+                !(server_flags & IMDPROXY_FLAG_SUPPORTS_ZERO)) ||
+            (op != ReplayOpRead && op != ReplayOpSparse &&
+                (server_flags & IMDPROXY_FLAG_RO)))
+        {
+            ++skipped;
+            continue;
+        }
+
+        if (offset + length > image_size)
+        {
+            offset %= image_size;
+
+            if (offset + length > image_size)
+                offset = (image_size - length) / ALIGNMENT * ALIGNMENT;
+
+            ++wrapped;
+        }
+
+        if (!asap)
+        {
+            uint64_t target = start +
+                (uint64_t)((record->timestamp - records[0].timestamp) / speed);
+            uint64_t lag;
+
+            if (!wait_until(pool, target))
+            {
+                failed = 1;
+                break;
+            }
+
+            lag = now_nsec() - target;
+            lag_sum += lag;
+
+            if (lag > lag_max)
+                lag_max = lag;
+        }
+
+        histogram_add(&trace_latency[op], record->latency);
+        conn = imdclient_pool_conn(pool,
+            (int)(record->client % (uint32_t)connections));
+        ++requests;
+
+        if (op == ReplayOpUnmap || op == ReplayOpZero)
+        {
+            if (!replay_range(conn, op, offset, length))
+                failed = 1;
+
+            continue;
+        }
+
+        if (op == ReplayOpSparse)
+        {
+            if (!replay_sparse(conn, offset, length))
+                failed = 1;
+
+            continue;
+        }
+
+        while (free_slots == NULL)
+            if (imdclient_pool_complete(pool, 1) == -1)
+            {
+                failed = 1;
+                break;
+            }
+
+        if (failed)
+            break;
+
+        slot = free_slots;
+
+        if (!slot_buffer(slot, (size_t)length))
+        {
+            perror("realloc()");
+            return 2;
+        }
+
+        free_slots = slot->next_free;
+
+        slot->op = op;
+        slot->iov.iov_base = slot->buffer;
+        slot->iov.iov_len = (size_t)length;
+        slot->io.request_code = op == ReplayOpRead ?
+            IMDPROXY_REQ_READ : IMDPROXY_REQ_WRITE;
+        slot->io.offset = offset;
+        slot->start = now_nsec();
+
+        if (!imdclient_submit(conn, &slot->io))
+            failed = 1;
+    }
+
+    if (!failed)
+        while (imdclient_pool_complete(pool, 1) > 0);
+
+    seconds = (now_nsec() - start) / 1e9;
+
+    if (failed)
+        fprintf(stderr, "Connection failed: %s\n", strerror(errno));
+
+    imdclient_pool_close(pool);
+
+    printf("Replayed " ULL_FMT " requests on %i connections in %.3f s, "
+        ULL_FMT " skipped, " ULL_FMT " wrapped, " ULL_FMT " errors.\n",
+        (ULONGLONG)requests, connections, seconds, (ULONGLONG)skipped,
+        (ULONGLONG)wrapped, (ULONGLONG)errors);
+
+    if (!asap && requests > 0)
+        printf("Lag behind recorded timing usec avg %.1f, max %.1f\n",
+            lag_sum / 1e3 / requests, lag_max / 1e3);
+
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "Request", "Count", "MB",
+        "trace p50", "p99", "replay p50", "p99");
+
+    for (i = 0; i < REPLAY_OPS; i++)
+    {
+        if (trace_latency[i].count == 0)
+            continue;
+
+        printf("%-8s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            replay_op_names[i], trace_latency[i].count,
+            replay_bytes[i] / 1e6,
+            histogram_percentile(&trace_latency[i], 50) / 1e3,
+            histogram_percentile(&trace_latency[i], 99) / 1e3,
+            histogram_percentile(&replay_latency[i], 50) / 1e3,
+            histogram_percentile(&replay_latency[i], 99) / 1e3);
+    }
+
+    for (i = 0; i < depth * connections; i++)
+        free(slots[i].buffer);
+
+    free(slots);
+    free(sparse_buffer);
+    free(clients);
+    free(records);
+
+    return failed || errors != 0 ? 1 : 0;
+}
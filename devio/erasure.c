@@ -0,0 +1,1142 @@
+/*
+Erasure coded (Reed-Solomon) backend for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+#include "backend.h"
+#include "parallel.h"
+#include "gf256.h"
+
+#define DEF_CHUNK_SIZE      (64 << 10)
+#define DEF_REGION_SIZE     (1 << 20)
+
+// erasure[,parity=m][,size=chunksize][,bitmap=file][,region=size]
+//        [,rebuild=member]:data1:::data2[...]:::parity1[...]
+//
+// Data is striped over the first k members as in a stripe set, chunk n of
+// the image is stored on data member n % k at offset (n / k) * chunksize.
+// The last m members, one by default, hold Reed-Solomon parity computed
+// over the k chunks at the same offset. Any m members can be missing or
+// fail and data is still available. Chunks on missing members are
+// reconstructed on the fly when read.
+//
+// Parity is encoded with a Cauchy matrix, row i column j has coefficient
+// 1 / ((k + i) xor j) in GF(2^8). Together with the identity matrix for the
+// data members, any k rows form an invertible matrix.
+//
+// Writes that cover whole stripes compute parity from the new data only.
+// Other writes read the rest of the affected columns of the stripe first.
+//
+// Each member has a bitmap with one bit per region of member data, set
+// when the member is out of date for that region. A member that is missing
+// or fails gets all bits set, since it may come back with old data or as a
+// new empty disk. Members with bits set are not read until the regions are
+// rebuilt from the other members, which is done when the set is opened for
+// writing. With a bitmap file, bits are saved as soon as they are set, so
+// that a member that was missing or failed is rebuilt on later starts.
+// rebuild=member sets all bits for a member, for instance after it has
+// been replaced and no bitmap file was used.
+
+typedef struct _ERASURE_SET
+{
+    off_t_64 chunk_size;
+    off_t_64 member_size;
+    off_t_64 region_size;
+    off_t_64 regions;
+    size_t bitmap_bytes;
+    int bitmap_fd;
+    int data;
+    int parity;
+    int count;
+    int failed_count;
+    int failed[DEVIO_MAX_MEMBERS];
+    unsigned char coding[DEVIO_MAX_MEMBERS][DEVIO_MAX_MEMBERS];
+    uint64_t decode_survivors;
+    unsigned char decode[DEVIO_MAX_MEMBERS][DEVIO_MAX_MEMBERS];
+    char *stripe_buf;
+    unsigned char *stale[DEVIO_MAX_MEMBERS];
+    DEVIO_BACKEND members[DEVIO_MAX_MEMBERS];
+} ERASURE_SET, *PERASURE_SET;
+
+// One transfer per member, for parallel_run.
+typedef struct _ERASURE_IO
+{
+    PERASURE_SET set;
+    int write;
+    int count;
+    int member[DEVIO_MAX_MEMBERS];
+    char *buf[DEVIO_MAX_MEMBERS];
+    safeio_size_t size[DEVIO_MAX_MEMBERS];
+    off_t_64 offset[DEVIO_MAX_MEMBERS];
+    int error[DEVIO_MAX_MEMBERS];
+} ERASURE_IO, *PERASURE_IO;
+
+// Request spanning several chunks on a healthy set, same layout as a stripe
+// set over the data members.
+typedef struct _ERASURE_DIRECT_IO
+{
+    PERASURE_SET set;
+    char *buf;
+    safeio_size_t size;
+    off_t_64 offset;
+    int first_member;
+    int error[DEVIO_MAX_MEMBERS];
+} ERASURE_DIRECT_IO, *PERASURE_DIRECT_IO;
+
+#define erasure_chunk(set, index) \
+    ((set)->stripe_buf + (size_t)(index) * (size_t)(set)->chunk_size)
+
+#define bit_test(map, n)    ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define bit_clear(map, n)   ((map)[(n) >> 3] &= (unsigned char)~(1 << ((n) & 7)))
+
+static int
+erasure_save_bitmap(PERASURE_SET set, int index, size_t first_byte,
+    size_t last_byte)
+{
+    safeio_size_t len = (safeio_size_t)(last_byte - first_byte + 1);
+
+    if (set->bitmap_fd == -1)
+        return 1;
+
+    if (pwrite(set->bitmap_fd, set->stale[index] + first_byte, len,
+        (off_t_64)(set->bitmap_bytes * index + first_byte)) !=
+        (safeio_ssize_t)len)
+        return 0;
+
+    return 1;
+}
+
+static void
+erasure_sync_bitmap(PERASURE_SET set)
+{
+    if (set->bitmap_fd == -1)
+        return;
+
+#ifdef _WIN32
+    FlushFileBuffers((HANDLE)_get_osfhandle(set->bitmap_fd));
+#else
+    fsync(set->bitmap_fd);
+#endif
+}
+
+// Marks all regions of a member out of date and saves that before any more
+// writes go to the other members.
+static void
+erasure_stale_member(PERASURE_SET set, int index)
+{
+    if (set->stale[index] == NULL)
+        return;
+
+    memset(set->stale[index], 0xFF, set->bitmap_bytes);
+
+    if (!erasure_save_bitmap(set, index, 0, set->bitmap_bytes - 1))
+        fprintf(stderr, "Erasure set: Error updating bitmap file: %s\n",
+            strerror(errno));
+
+    erasure_sync_bitmap(set);
+}
+
+static void
+erasure_warn_rebuild(PERASURE_SET set, int index)
+{
+    if (set->bitmap_fd == -1)
+        fprintf(stderr, "Erasure set: No bitmap file, use rebuild=%i when "
+            "member %i is used again.\n", index, index);
+}
+
+static int
+erasure_member_stale(PERASURE_SET set, int index)
+{
+    off_t_64 r;
+
+    for (r = 0; r < set->regions; r++)
+        if (bit_test(set->stale[index], r))
+            return 1;
+
+    return 0;
+}
+
+// Errors that mean a member cannot be used, as opposed to errors caused by
+// the request, such as EINVAL for an offset outside the member.
+static int
+erasure_member_error(int error)
+{
+    switch (error)
+    {
+    case EIO:
+    case ENXIO:
+    case ENODEV:
+    case ENOSPC:
+#ifdef ENOMEDIUM
+    case ENOMEDIUM:
+#endif
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+static void
+erasure_fail_member(PERASURE_SET set, int index, int error)
+{
+    if (set->failed[index])
+        return;
+
+    fprintf(stderr, "Erasure set: Member %i failed: %s\n", index,
+        strerror(error));
+
+    set->failed[index] = 1;
+    ++set->failed_count;
+
+    erasure_stale_member(set, index);
+    erasure_warn_rebuild(set, index);
+}
+
+static void __cdecl
+erasure_member_io(void *context, int index)
+{
+    PERASURE_IO io = (PERASURE_IO)context;
+    PDEVIO_BACKEND member = io->set->members + io->member[index];
+    safeio_ssize_t done;
+
+    io->error[index] = 0;
+
+    if (io->write)
+        done = member->write(member->handle, io->buf[index], io->size[index],
+            io->offset[index]);
+    else
+        done = member->read(member->handle, io->buf[index], io->size[index],
+            io->offset[index]);
+
+    if (done == -1)
+        io->error[index] = errno != 0 ? errno : EIO;
+    else if (done < (safeio_ssize_t)io->size[index])
+    {
+        if (io->write)
+            io->error[index] = ENOSPC;
+        else
+            memset(io->buf[index] + done, 0, io->size[index] - done);
+    }
+}
+
+// Runs queued transfers and marks members that failed. Returns 1 if all
+// transfers succeeded, zero if members failed and -1 with errno set if a
+// transfer failed with an error that is not a member failure.
+static int
+erasure_run(PERASURE_IO io)
+{
+    int rc = 1;
+    int i;
+
+    parallel_run(erasure_member_io, io, io->count);
+
+    for (i = 0; i < io->count; i++)
+        if (io->error[i] == 0)
+            continue;
+        else if (erasure_member_error(io->error[i]))
+        {
+            erasure_fail_member(io->set, io->member[i], io->error[i]);
+
+            if (rc == 1)
+                rc = 0;
+        }
+        else
+        {
+            errno = io->error[i];
+            rc = -1;
+        }
+
+    io->count = 0;
+
+    return rc;
+}
+
+static void
+erasure_queue(PERASURE_IO io, int member, char *buf, safeio_size_t size,
+    off_t_64 offset)
+{
+    io->member[io->count] = member;
+    io->buf[io->count] = buf;
+    io->size[io->count] = size;
+    io->offset[io->count] = offset;
+    ++io->count;
+}
+
+// Inverts a size x size matrix in place by Gauss-Jordan elimination.
+// Returns zero if the matrix is singular.
+static int
+erasure_invert(unsigned char matrix[DEVIO_MAX_MEMBERS][DEVIO_MAX_MEMBERS],
+    int size)
+{
+    unsigned char work[DEVIO_MAX_MEMBERS][DEVIO_MAX_MEMBERS];
+    int row, col, i;
+
+    memcpy(work, matrix, sizeof(work));
+    memset(matrix, 0, sizeof(work));
+
+    for (i = 0; i < size; i++)
+        matrix[i][i] = 1;
+
+    for (col = 0; col < size; col++)
+    {
+        unsigned char factor;
+
+        row = col;
+        while (row < size && work[row][col] == 0)
+            ++row;
+
+        if (row == size)
+            return 0;
+
+        if (row != col)
+            for (i = 0; i < size; i++)
+            {
+                unsigned char t = work[row][i];
+                work[row][i] = work[col][i];
+                work[col][i] = t;
+                t = matrix[row][i];
+                matrix[row][i] = matrix[col][i];
+                matrix[col][i] = t;
+            }
+
+        factor = gf256_inv(work[col][col]);
+
+        for (i = 0; i < size; i++)
+        {
+            work[col][i] = gf256_mul(work[col][i], factor);
+            matrix[col][i] = gf256_mul(matrix[col][i], factor);
+        }
+
+        for (row = 0; row < size; row++)
+        {
+            if (row == col || work[row][col] == 0)
+                continue;
+
+            factor = work[row][col];
+
+            for (i = 0; i < size; i++)
+            {
+                work[row][i] ^= gf256_mul(work[col][i], factor);
+                matrix[row][i] ^= gf256_mul(matrix[col][i], factor);
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Builds matrix that computes data chunks from chunks on the k members in
+// survivors, in member order. The matrix for the last set of survivors is
+// kept since members rarely change.
+static int
+erasure_build_decode(PERASURE_SET set, const int *survivors)
+{
+    uint64_t mask = 0;
+    int i, j;
+
+    for (i = 0; i < set->data; i++)
+        mask |= (uint64_t)1 << survivors[i];
+
+    if (mask == set->decode_survivors)
+        return 1;
+
+    memset(set->decode, 0, sizeof(set->decode));
+
+    for (i = 0; i < set->data; i++)
+        if (survivors[i] < set->data)
+            set->decode[i][survivors[i]] = 1;
+        else
+            for (j = 0; j < set->data; j++)
+                set->decode[i][j] = set->coding[survivors[i] - set->data][j];
+
+    if (!erasure_invert(set->decode, set->data))
+    {
+        set->decode_survivors = 0;
+        return 0;
+    }
+
+    set->decode_survivors = mask;
+
+    return 1;
+}
+
+// Computes parity chunks in stripe buffer for columns from data chunks.
+static void
+erasure_encode(PERASURE_SET set, safeio_size_t col, safeio_size_t len)
+{
+    int p, j;
+
+    for (p = 0; p < set->parity; p++)
+    {
+        char *parity = erasure_chunk(set, set->data + p) + col;
+
+        memset(parity, 0, len);
+
+        for (j = 0; j < set->data; j++)
+            gf256_muladd(parity, erasure_chunk(set, j) + col,
+                set->coding[p][j], len);
+    }
+}
+
+// Loads columns of data chunks in wanted mask for a stripe into stripe
+// buffer. Chunks on failed members are reconstructed from k other members.
+static int
+erasure_load_stripe(PERASURE_SET set, off_t_64 stripe, uint64_t wanted,
+    safeio_size_t col, safeio_size_t len)
+{
+    ERASURE_IO io;
+    off_t_64 offset = stripe * set->chunk_size + col;
+    int rc;
+
+    io.set = set;
+    io.write = 0;
+    io.count = 0;
+
+    while (set->failed_count <= set->parity)
+    {
+        int survivors[DEVIO_MAX_MEMBERS];
+        int found = 0;
+        int degraded = 0;
+        int i, j;
+
+        for (i = 0; i < set->data; i++)
+            if ((wanted & ((uint64_t)1 << i)) && set->failed[i])
+                degraded = 1;
+
+        if (!degraded)
+        {
+            for (i = 0; i < set->data; i++)
+                if (wanted & ((uint64_t)1 << i))
+                    erasure_queue(&io, i, erasure_chunk(set, i) + col, len,
+                        offset);
+
+            rc = erasure_run(&io);
+
+            if (rc == 1)
+                return 1;
+
+            if (rc == -1)
+                return 0;
+
+            continue;
+        }
+
+        // Data members first, they need no decoding
+        for (i = 0; i < set->count && found < set->data; i++)
+            if (!set->failed[i])
+            {
+                survivors[found++] = i;
+                erasure_queue(&io, i, erasure_chunk(set, i) + col, len,
+                    offset);
+            }
+
+        if (found < set->data)
+            break;
+
+        rc = erasure_run(&io);
+
+        if (rc == -1)
+            return 0;
+
+        if (rc == 0)
+            continue;
+
+        if (!erasure_build_decode(set, survivors))
+        {
+            fprintf(stderr, "Erasure set: Cannot decode stripe " SLL_FMT
+                ".\n", (int64_t)stripe);
+            errno = EIO;
+            return 0;
+        }
+
+        for (j = 0; j < set->data; j++)
+        {
+            char *chunk = erasure_chunk(set, j) + col;
+
+            if (!(wanted & ((uint64_t)1 << j)) || !set->failed[j])
+                continue;
+
+            memset(chunk, 0, len);
+
+            for (i = 0; i < set->data; i++)
+                gf256_muladd(chunk, erasure_chunk(set, survivors[i]) + col,
+                    set->decode[j][i], len);
+        }
+
+        return 1;
+    }
+
+    errno = EIO;
+    return 0;
+}
+
+// Column range and data chunks of a stripe touched by bytes start to end,
+// relative to data in the stripe.
+static uint64_t
+erasure_columns(PERASURE_SET set, off_t_64 start, off_t_64 end,
+    safeio_size_t *col, safeio_size_t *len)
+{
+    off_t_64 first = start / set->chunk_size;
+    off_t_64 last = (end - 1) / set->chunk_size;
+    uint64_t chunks = 0;
+    off_t_64 j;
+
+    if (first == last)
+    {
+        *col = (safeio_size_t)(start % set->chunk_size);
+        *len = (safeio_size_t)(end - start);
+    }
+    else
+    {
+        *col = 0;
+        *len = (safeio_size_t)set->chunk_size;
+    }
+
+    for (j = first; j <= last; j++)
+        chunks |= (uint64_t)1 << j;
+
+    return chunks;
+}
+
+static void __cdecl
+erasure_direct_io(void *context, int index)
+{
+    PERASURE_DIRECT_IO io = (PERASURE_DIRECT_IO)context;
+    PERASURE_SET set = io->set;
+    PDEVIO_BACKEND member =
+        set->members + (io->first_member + index) % set->data;
+    off_t_64 end = io->offset + io->size;
+    off_t_64 unit = io->offset / set->chunk_size + index;
+
+    io->error[index] = 0;
+
+    for (; unit * set->chunk_size < end; unit += set->data)
+    {
+        off_t_64 unit_start = unit * set->chunk_size;
+        off_t_64 start = unit_start > io->offset ? unit_start : io->offset;
+        off_t_64 stop = unit_start + set->chunk_size;
+        char *ptr;
+        safeio_size_t len;
+        safeio_ssize_t done;
+
+        if (stop > end)
+            stop = end;
+
+        ptr = io->buf + (start - io->offset);
+        len = (safeio_size_t)(stop - start);
+
+        done = member->read(member->handle, ptr, len,
+            (unit / set->data) * set->chunk_size + (start - unit_start));
+
+        if (done == -1)
+        {
+            io->error[index] = errno != 0 ? errno : EIO;
+            return;
+        }
+
+        if (done < (safeio_ssize_t)len)
+            memset(ptr + done, 0, len - done);
+    }
+}
+
+safeio_ssize_t __cdecl
+erasure_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PERASURE_SET set = (PERASURE_SET)handle;
+    off_t_64 stripe_data = set->chunk_size * set->data;
+    off_t_64 pos;
+
+    if (!backend_clip_range(offset, &size, set->member_size * set->data))
+        return -1;
+
+    if (size == 0)
+        return 0;
+
+    // All data members available, read directly into request buffer
+    if (set->failed_count == 0)
+    {
+        ERASURE_DIRECT_IO io;
+        off_t_64 first_unit = offset / set->chunk_size;
+        off_t_64 units = (offset + size - 1) / set->chunk_size - first_unit + 1;
+        int members = units < set->data ? (int)units : set->data;
+        int ok = 1;
+        int i;
+
+        io.set = set;
+        io.buf = (char*)buf;
+        io.size = size;
+        io.offset = offset;
+        io.first_member = (int)(first_unit % set->data);
+
+        parallel_run(erasure_direct_io, &io, members);
+
+        for (i = 0; i < members; i++)
+            if (io.error[i] == 0)
+                continue;
+            else if (erasure_member_error(io.error[i]))
+            {
+                erasure_fail_member(set, (io.first_member + i) % set->data,
+                    io.error[i]);
+                ok = 0;
+            }
+            else
+            {
+                errno = io.error[i];
+                return -1;
+            }
+
+        if (ok)
+            return size;
+    }
+
+    for (pos = offset; pos < offset + (off_t_64)size;)
+    {
+        off_t_64 stripe = pos / stripe_data;
+        off_t_64 start = pos - stripe * stripe_data;
+        off_t_64 end = offset + size - stripe * stripe_data;
+        safeio_size_t col, len;
+        uint64_t chunks;
+
+        if (end > stripe_data)
+            end = stripe_data;
+
+        chunks = erasure_columns(set, start, end, &col, &len);
+
+        if (!erasure_load_stripe(set, stripe, chunks, col, len))
+            return -1;
+
+        // Data chunks are contiguous in stripe buffer, in image order
+        memcpy((char*)buf + (pos - offset), set->stripe_buf + start,
+            (size_t)(end - start));
+
+        pos = stripe * stripe_data + end;
+    }
+
+    return size;
+}
+
+safeio_ssize_t __cdecl
+erasure_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PERASURE_SET set = (PERASURE_SET)handle;
+    off_t_64 stripe_data = set->chunk_size * set->data;
+    ERASURE_IO io;
+    safeio_size_t len = size;
+    off_t_64 pos;
+
+    if (!backend_clip_range(offset, &len, set->member_size * set->data))
+        return -1;
+
+    if (len < size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (size == 0)
+        return 0;
+
+    io.set = set;
+    io.write = 1;
+    io.count = 0;
+
+    for (pos = offset; pos < offset + (off_t_64)size;)
+    {
+        off_t_64 stripe = pos / stripe_data;
+        off_t_64 start = pos - stripe * stripe_data;
+        off_t_64 end = offset + size - stripe * stripe_data;
+        off_t_64 member_offset = stripe * set->chunk_size;
+        safeio_size_t col, len;
+        uint64_t wanted = 0;
+        int j;
+
+        if (end > stripe_data)
+            end = stripe_data;
+
+        erasure_columns(set, start, end, &col, &len);
+
+        // Chunks not completely replaced in the column range are needed to
+        // compute parity. For whole stripe writes there are none.
+        for (j = 0; j < set->data; j++)
+            if (start > j * set->chunk_size + col ||
+                end < j * set->chunk_size + col + len)
+                wanted |= (uint64_t)1 << j;
+
+        if (wanted != 0 &&
+            !erasure_load_stripe(set, stripe, wanted, col, len))
+            return -1;
+
+        memcpy(set->stripe_buf + start, (char*)buf + (pos - offset),
+            (size_t)(end - start));
+
+        erasure_encode(set, col, len);
+
+        for (j = 0; j < set->data; j++)
+        {
+            off_t_64 chunk_start = j * set->chunk_size;
+            off_t_64 a = start > chunk_start ? start : chunk_start;
+            off_t_64 b = end < chunk_start + set->chunk_size ?
+                end : chunk_start + set->chunk_size;
+
+            if (a < b && !set->failed[j])
+                erasure_queue(&io, j, set->stripe_buf + a,
+                    (safeio_size_t)(b - a), member_offset + a - chunk_start);
+        }
+
+        for (j = set->data; j < set->count; j++)
+            if (!set->failed[j])
+                erasure_queue(&io, j, erasure_chunk(set, j) + col, len,
+                    member_offset + col);
+
+        if (erasure_run(&io) == -1)
+            return -1;
+
+        if (set->failed_count > set->parity)
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        pos = stripe * stripe_data + end;
+    }
+
+    return size;
+}
+
+// Rebuilds out of date regions of members in mask from the other members
+// and clears their bits. Returns zero if a region could not be rebuilt, the
+// members are then left failed.
+static int
+erasure_rebuild(PERASURE_SET set, uint64_t members)
+{
+    off_t_64 region_stripes = set->region_size / set->chunk_size;
+    uint64_t data_mask = ((uint64_t)1 << set->data) - 1;
+    ERASURE_IO io;
+    off_t_64 r;
+    int i;
+
+    io.set = set;
+    io.write = 1;
+    io.count = 0;
+
+    for (r = 0; r < set->regions; r++)
+    {
+        uint64_t stale = 0;
+        off_t_64 stripe;
+
+        for (i = 0; i < set->count; i++)
+            if ((members & ((uint64_t)1 << i)) && bit_test(set->stale[i], r))
+                stale |= (uint64_t)1 << i;
+
+        if (stale == 0)
+            continue;
+
+        for (stripe = r * region_stripes;
+            stripe < (r + 1) * region_stripes &&
+            stripe * set->chunk_size < set->member_size; stripe++)
+        {
+            if (!erasure_load_stripe(set, stripe, data_mask, 0,
+                (safeio_size_t)set->chunk_size))
+                return 0;
+
+            erasure_encode(set, 0, (safeio_size_t)set->chunk_size);
+
+            for (i = 0; i < set->count; i++)
+                if (stale & ((uint64_t)1 << i))
+                    erasure_queue(&io, i, erasure_chunk(set, i),
+                        (safeio_size_t)set->chunk_size,
+                        stripe * set->chunk_size);
+
+            if (erasure_run(&io) != 1)
+                return 0;
+        }
+
+        for (i = 0; i < set->count; i++)
+            if (stale & ((uint64_t)1 << i))
+            {
+                bit_clear(set->stale[i], r);
+
+                if (!erasure_save_bitmap(set, i, (size_t)(r >> 3),
+                    (size_t)(r >> 3)))
+                {
+                    fprintf(stderr, "Erasure set: Error updating bitmap "
+                        "file: %s\n", strerror(errno));
+                    return 0;
+                }
+            }
+    }
+
+    erasure_sync_bitmap(set);
+
+    for (i = 0; i < set->count; i++)
+        if (members & ((uint64_t)1 << i))
+        {
+            set->failed[i] = 0;
+            --set->failed_count;
+        }
+
+    return 1;
+}
+
+static int
+erasure_load_bitmap(PERASURE_SET set, const char *file)
+{
+    off_t_64 file_size;
+    int i;
+
+    set->bitmap_fd = _open(file, O_BINARY | O_RDWR | O_CREAT, 0644);
+
+    if (set->bitmap_fd == -1)
+    {
+        fprintf(stderr, "Cannot open bitmap file '%s': %s\n", file,
+            strerror(errno));
+        return 0;
+    }
+
+    file_size = _lseeki64(set->bitmap_fd, 0, SEEK_END);
+
+    if (file_size == 0)
+    {
+        // New bitmap file. Members are assumed to be up to date.
+        for (i = 0; i < set->count; i++)
+            if (!erasure_save_bitmap(set, i, 0, set->bitmap_bytes - 1))
+            {
+                fprintf(stderr, "Cannot write bitmap file '%s': %s\n", file,
+                    strerror(errno));
+                return 0;
+            }
+
+        erasure_sync_bitmap(set);
+    }
+    else if (file_size != (off_t_64)(set->bitmap_bytes * set->count))
+    {
+        fprintf(stderr, "Bitmap file '%s' does not match this erasure set.\n",
+            file);
+        return 0;
+    }
+    else
+    {
+        for (i = 0; i < set->count; i++)
+            if (pread(set->bitmap_fd, set->stale[i],
+                (safeio_size_t)set->bitmap_bytes,
+                (off_t_64)(set->bitmap_bytes * i)) !=
+                (safeio_ssize_t)set->bitmap_bytes)
+            {
+                fprintf(stderr, "Cannot read bitmap file '%s': %s\n", file,
+                    strerror(errno));
+                return 0;
+            }
+    }
+
+    return 1;
+}
+
+int __cdecl
+erasure_close(void *handle)
+{
+    PERASURE_SET set = (PERASURE_SET)handle;
+    int i;
+
+    backend_close_members(set->members, set->count);
+
+    if (set->bitmap_fd != -1)
+        _close(set->bitmap_fd);
+
+    for (i = 0; i < DEVIO_MAX_MEMBERS; i++)
+        free(set->stale[i]);
+
+    free(set->stripe_buf);
+    free(set);
+
+    return 0;
+}
+
+void * __cdecl
+erasure_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    char options[512];
+    char value[260];
+    const char *list = backend_parameters(file, options, sizeof(options));
+    size_t delimiter_length = strlen(MULTI_CONTAINER_DELIMITER);
+    PERASURE_SET set = (PERASURE_SET)calloc(1, sizeof(ERASURE_SET));
+    char *list_copy = _strdup(list);
+    char *member = list_copy;
+    off_t_64 member_size = 0;
+    uint64_t missing = 0;
+    uint64_t rebuild = 0;
+    int i, j;
+
+    if (set == NULL || list_copy == NULL)
+    {
+        free(set);
+        free(list_copy);
+        return NULL;
+    }
+
+    gf256_init();
+
+    set->bitmap_fd = -1;
+    set->chunk_size = DEF_CHUNK_SIZE;
+    set->region_size = DEF_REGION_SIZE;
+    set->parity = 1;
+
+    if (backend_get_option(options, "size", value, sizeof(value)) &&
+        (!backend_parse_size(value, &set->chunk_size) ||
+            set->chunk_size < 512 || set->chunk_size > (64 << 20)))
+    {
+        fprintf(stderr, "Invalid chunk size: '%s'\n", value);
+        free(list_copy);
+        free(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "region", value, sizeof(value)) &&
+        (!backend_parse_size(value, &set->region_size) ||
+            set->region_size < 4096))
+    {
+        fprintf(stderr, "Invalid region size: '%s'\n", value);
+        free(list_copy);
+        free(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "parity", value, sizeof(value)))
+        set->parity = atoi(value);
+
+    // Missing members are allowed, as long as there are no more than
+    // number of parity members.
+    while (member != NULL)
+    {
+        char *next = strstr(member, MULTI_CONTAINER_DELIMITER);
+
+        if (next != NULL)
+        {
+            *next = 0;
+            next += delimiter_length;
+        }
+
+        if (set->count >= DEVIO_MAX_MEMBERS)
+        {
+            fprintf(stderr, "Too many members, max %i supported.\n",
+                DEVIO_MAX_MEMBERS);
+            free(list_copy);
+            erasure_close(set);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if (!backend_open(set->members + set->count, member, read_only))
+        {
+            fprintf(stderr, "Erasure set: Member %i missing: %s\n",
+                set->count, strerror(errno));
+
+            missing |= (uint64_t)1 << set->count;
+        }
+
+        ++set->count;
+
+        member = next;
+    }
+
+    free(list_copy);
+
+    set->data = set->count - set->parity;
+
+    if (set->parity < 1 || set->data < 1)
+    {
+        fprintf(stderr, "Invalid number of parity members: %i of %i\n",
+            set->parity, set->count);
+        erasure_close(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "rebuild", value, sizeof(value)))
+    {
+        i = atoi(value);
+
+        if (i < 0 || i >= set->count)
+        {
+            fprintf(stderr, "Invalid member to rebuild: '%s'\n", value);
+            erasure_close(set);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        rebuild = (uint64_t)1 << i;
+    }
+
+    // Usable size is limited by smallest member
+    for (i = 0; i < set->count; i++)
+        if (!(missing & ((uint64_t)1 << i)) &&
+            (member_size == 0 || set->members[i].size < member_size))
+            member_size = set->members[i].size;
+
+    member_size -= member_size % set->chunk_size;
+
+    if (member_size == 0)
+    {
+        fprintf(stderr, "Cannot determine size of erasure set members.\n");
+        erasure_close(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Regions hold whole chunks
+    set->member_size = member_size;
+    set->region_size += set->chunk_size - 1;
+    set->region_size -= set->region_size % set->chunk_size;
+    set->regions = (member_size + set->region_size - 1) / set->region_size;
+    set->bitmap_bytes = (size_t)((set->regions + 7) >> 3);
+
+    for (i = 0; i < set->count; i++)
+    {
+        set->stale[i] = (unsigned char*)calloc(1, set->bitmap_bytes);
+
+        if (set->stale[i] == NULL)
+        {
+            erasure_close(set);
+            return NULL;
+        }
+    }
+
+    if (backend_get_option(options, "bitmap", value, sizeof(value)) &&
+        !erasure_load_bitmap(set, value))
+    {
+        erasure_close(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Members that are missing now are rebuilt when they return, if the set
+    // is written to. Members that are present but out of date are not read
+    // until rebuilt.
+    for (i = 0; i < set->count; i++)
+    {
+        uint64_t bit = (uint64_t)1 << i;
+
+        if (!(missing & bit) && !(rebuild & bit))
+        {
+            if (!erasure_member_stale(set, i))
+                continue;
+
+            rebuild |= bit;
+        }
+
+        set->failed[i] = 1;
+        ++set->failed_count;
+    }
+
+    if (set->failed_count > set->parity)
+    {
+        fprintf(stderr, "Too many members missing or out of date, %i of "
+            "%i.\n", set->failed_count, set->count);
+        erasure_close(set);
+        errno = EIO;
+        return NULL;
+    }
+
+    for (i = 0; i < set->count; i++)
+        if (missing & ((uint64_t)1 << i))
+        {
+            if (!read_only)
+            {
+                erasure_stale_member(set, i);
+                erasure_warn_rebuild(set, i);
+            }
+        }
+        else if (set->failed[i] && !erasure_member_stale(set, i))
+            erasure_stale_member(set, i);
+
+    for (i = 0; i < set->parity; i++)
+        for (j = 0; j < set->data; j++)
+            set->coding[i][j] =
+                gf256_inv((unsigned char)((set->data + i) ^ j));
+
+    set->stripe_buf = (char*)malloc((size_t)set->chunk_size * set->count);
+
+    if (set->stripe_buf == NULL)
+    {
+        erasure_close(set);
+        return NULL;
+    }
+
+    parallel_reserve(set->count - 1);
+
+    if (rebuild != 0 && read_only)
+        fprintf(stderr, "Erasure set: Out of date members will be rebuilt "
+            "when opened for writing.\n");
+    else if (rebuild != 0)
+    {
+        printf("Erasure set: Rebuilding out of date members.\n");
+
+        if (!erasure_rebuild(set, rebuild))
+            fprintf(stderr, "Erasure set: Rebuild failed.\n");
+    }
+
+    printf("Erasure set of %i data and %i parity members, chunk size "
+        SLL_FMT " bytes.\n", set->data, set->parity,
+        (int64_t)set->chunk_size);
+
+    if (set->failed_count > 0)
+        printf("Erasure set degraded, %i members missing or out of date.\n",
+            set->failed_count);
+
+    *dllread = erasure_read;
+    *dllwrite = erasure_write;
+    *dllclose = erasure_close;
+
+    if (size != NULL)
+        *size = member_size * set->data;
+
+    return set;
+}
@@ -0,0 +1,440 @@
+/*
+Galois field GF(2^8) arithmetic for erasure coding in devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "devio_types.h"
+#include "cpufeature.h"
+#include "gf256.h"
+
+#define GF256_POLY  0x11D
+
+static unsigned char gf256_log[256];
+static unsigned char gf256_exp[512];
+
+void
+gf256_init()
+{
+    unsigned int x = 1;
+    int i;
+
+    if (gf256_exp[0] != 0)
+        return;
+
+    for (i = 0; i < 255; i++)
+    {
+        gf256_exp[i] = (unsigned char)x;
+        gf256_exp[i + 255] = (unsigned char)x;
+        gf256_log[x] = (unsigned char)i;
+
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF256_POLY;
+    }
+
+    gf256_exp[510] = gf256_exp[0];
+}
+
+unsigned char
+gf256_mul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0)
+        return 0;
+
+    return gf256_exp[gf256_log[a] + gf256_log[b]];
+}
+
+unsigned char
+gf256_inv(unsigned char a)
+{
+    if (a == 0)
+        return 0;
+
+    return gf256_exp[255 - gf256_log[a]];
+}
+
+// Products of coef with each possible low and high nibble. Since
+// multiplication distributes over addition, coef * x is the XOR of the two
+// table entries selected by the nibbles of x. Vector kernels look up 16 or
+// 32 bytes at a time in these tables with byte shuffle instructions.
+static void
+gf256_nibble_tables(unsigned char coef, unsigned char low[16],
+    unsigned char high[16])
+{
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        low[i] = gf256_mul(coef, (unsigned char)i);
+        high[i] = gf256_mul(coef, (unsigned char)(i << 4));
+    }
+}
+
+static void
+gf256_xor(uint8_t *dst, const uint8_t *src, safeio_size_t size)
+{
+    const uint8_t *end = src + (size & ~(safeio_size_t)7);
+
+    for (; src < end; src += 8, dst += 8)
+    {
+        uint64_t d, s;
+
+        memcpy(&d, dst, sizeof(d));
+        memcpy(&s, src, sizeof(s));
+        d ^= s;
+        memcpy(dst, &d, sizeof(d));
+    }
+
+    for (end = src + (size & 7); src < end; src++, dst++)
+        *dst ^= *src;
+}
+
+// Portable version, full 256 byte product table.
+static void __cdecl
+gf256_muladd_generic(void *dst, const void *src, unsigned char coef,
+    safeio_size_t size)
+{
+    unsigned char table[256];
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+    const uint8_t *end = s + size;
+    int i;
+
+    if (coef == 0)
+        return;
+
+    if (coef == 1)
+    {
+        gf256_xor(d, s, size);
+        return;
+    }
+
+    for (i = 0; i < 256; i++)
+        table[i] = gf256_mul(coef, (unsigned char)i);
+
+    for (; s < end; s++, d++)
+        *d ^= table[*s];
+}
+
+#ifdef CPU_X86
+
+static CPU_TARGET("ssse3") void __cdecl
+gf256_muladd_ssse3(void *dst, const void *src, unsigned char coef,
+    safeio_size_t size)
+{
+    unsigned char low[16], high[16];
+    __m128i tlow, thigh;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+    const uint8_t *end = s + (size & ~(safeio_size_t)31);
+
+    if (coef <= 1)
+    {
+        gf256_muladd_generic(dst, src, coef, size);
+        return;
+    }
+
+    gf256_nibble_tables(coef, low, high);
+    tlow = _mm_loadu_si128((const __m128i*)low);
+    thigh = _mm_loadu_si128((const __m128i*)high);
+
+    for (; s < end; s += 32, d += 32)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)s);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i p0 = _mm_xor_si128(
+            _mm_shuffle_epi8(tlow, _mm_and_si128(v0, mask)),
+            _mm_shuffle_epi8(thigh, _mm_and_si128(_mm_srli_epi64(v0, 4), mask)));
+        __m128i p1 = _mm_xor_si128(
+            _mm_shuffle_epi8(tlow, _mm_and_si128(v1, mask)),
+            _mm_shuffle_epi8(thigh, _mm_and_si128(_mm_srli_epi64(v1, 4), mask)));
+
+        _mm_storeu_si128((__m128i*)d,
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)d), p0));
+        _mm_storeu_si128((__m128i*)(d + 16),
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)(d + 16)), p1));
+    }
+
+    gf256_muladd_generic(d, s, coef, size & 31);
+}
+
+#ifdef CPU_AVX2
+
+static CPU_TARGET("avx2") void __cdecl
+gf256_muladd_avx2(void *dst, const void *src, unsigned char coef,
+    safeio_size_t size)
+{
+    unsigned char low[16], high[16];
+    __m256i tlow, thigh;
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+    const uint8_t *end = s + (size & ~(safeio_size_t)63);
+
+    if (coef <= 1)
+    {
+        gf256_muladd_generic(dst, src, coef, size);
+        return;
+    }
+
+    gf256_nibble_tables(coef, low, high);
+    tlow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+    thigh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+
+    for (; s < end; s += 64, d += 64)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)s);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(s + 32));
+        __m256i p0 = _mm256_xor_si256(
+            _mm256_shuffle_epi8(tlow, _mm256_and_si256(v0, mask)),
+            _mm256_shuffle_epi8(thigh,
+                _mm256_and_si256(_mm256_srli_epi64(v0, 4), mask)));
+        __m256i p1 = _mm256_xor_si256(
+            _mm256_shuffle_epi8(tlow, _mm256_and_si256(v1, mask)),
+            _mm256_shuffle_epi8(thigh,
+                _mm256_and_si256(_mm256_srli_epi64(v1, 4), mask)));
+
+        _mm256_storeu_si256((__m256i*)d,
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)d), p0));
+        _mm256_storeu_si256((__m256i*)(d + 32),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(d + 32)), p1));
+    }
+
+    _mm256_zeroupper();
+
+    gf256_muladd_generic(d, s, coef, size & 63);
+}
+
+#endif
+
+#ifdef CPU_GFNI
+
+// Multiplication by a constant is a linear map over GF(2), so it can be
+// done as an 8x8 bit matrix multiplication by the affine instruction.
+// Column j of the matrix is coef * 2^j. Row i, the bits that contribute to
+// bit i of the product, is stored in byte 7 - i.
+static uint64_t
+gf256_affine_matrix(unsigned char coef)
+{
+    uint64_t matrix = 0;
+    int i, j;
+
+    for (i = 0; i < 8; i++)
+    {
+        unsigned int row = 0;
+
+        for (j = 0; j < 8; j++)
+            if (gf256_mul(coef, (unsigned char)(1 << j)) & (1 << i))
+                row |= 1 << j;
+
+        matrix |= (uint64_t)row << (8 * (7 - i));
+    }
+
+    return matrix;
+}
+
+static CPU_TARGET("avx2,gfni") void __cdecl
+gf256_muladd_gfni(void *dst, const void *src, unsigned char coef,
+    safeio_size_t size)
+{
+    __m256i matrix;
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+    const uint8_t *end = s + (size & ~(safeio_size_t)127);
+
+    if (coef <= 1)
+    {
+        gf256_muladd_generic(dst, src, coef, size);
+        return;
+    }
+
+    matrix = _mm256_set1_epi64x((long long)gf256_affine_matrix(coef));
+
+    for (; s < end; s += 128, d += 128)
+    {
+        __m256i p0 = _mm256_gf2p8affine_epi64_epi8(
+            _mm256_loadu_si256((const __m256i*)s), matrix, 0);
+        __m256i p1 = _mm256_gf2p8affine_epi64_epi8(
+            _mm256_loadu_si256((const __m256i*)(s + 32)), matrix, 0);
+        __m256i p2 = _mm256_gf2p8affine_epi64_epi8(
+            _mm256_loadu_si256((const __m256i*)(s + 64)), matrix, 0);
+        __m256i p3 = _mm256_gf2p8affine_epi64_epi8(
+            _mm256_loadu_si256((const __m256i*)(s + 96)), matrix, 0);
+
+        _mm256_storeu_si256((__m256i*)d,
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)d), p0));
+        _mm256_storeu_si256((__m256i*)(d + 32),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(d + 32)), p1));
+        _mm256_storeu_si256((__m256i*)(d + 64),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(d + 64)), p2));
+        _mm256_storeu_si256((__m256i*)(d + 96),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(d + 96)), p3));
+    }
+
+    end = s + ((size & 127) & ~(safeio_size_t)31);
+
+    for (; s < end; s += 32, d += 32)
+    {
+        __m256i p = _mm256_gf2p8affine_epi64_epi8(
+            _mm256_loadu_si256((const __m256i*)s), matrix, 0);
+
+        _mm256_storeu_si256((__m256i*)d,
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)d), p));
+    }
+
+    _mm256_zeroupper();
+
+    gf256_muladd_generic(d, s, coef, size & 31);
+}
+
+static int
+cpu_has_avx2_gfni()
+{
+    return cpu_has_avx2() && cpu_has_gfni();
+}
+
+#endif
+
+#endif
+
+#ifdef CPU_NEON64
+
+static void __cdecl
+gf256_muladd_neon(void *dst, const void *src, unsigned char coef,
+    safeio_size_t size)
+{
+    unsigned char low[16], high[16];
+    uint8x16_t tlow, thigh;
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+    const uint8_t *end = s + (size & ~(safeio_size_t)31);
+
+    if (coef <= 1)
+    {
+        gf256_muladd_generic(dst, src, coef, size);
+        return;
+    }
+
+    gf256_nibble_tables(coef, low, high);
+    tlow = vld1q_u8(low);
+    thigh = vld1q_u8(high);
+
+    for (; s < end; s += 32, d += 32)
+    {
+        uint8x16_t v0 = vld1q_u8(s);
+        uint8x16_t v1 = vld1q_u8(s + 16);
+        uint8x16_t p0 = veorq_u8(vqtbl1q_u8(tlow, vandq_u8(v0, mask)),
+            vqtbl1q_u8(thigh, vshrq_n_u8(v0, 4)));
+        uint8x16_t p1 = veorq_u8(vqtbl1q_u8(tlow, vandq_u8(v1, mask)),
+            vqtbl1q_u8(thigh, vshrq_n_u8(v1, 4)));
+
+        vst1q_u8(d, veorq_u8(vld1q_u8(d), p0));
+        vst1q_u8(d + 16, veorq_u8(vld1q_u8(d + 16), p1));
+    }
+
+    gf256_muladd_generic(d, s, coef, size & 31);
+}
+
+#endif
+
+static int
+cpu_has_always()
+{
+    return 1;
+}
+
+// Ordered from slowest to fastest
+static const struct _GF256_MULADD_IMPL
+{
+    const char *name;
+    gf256_muladd_proc proc;
+    int(*supported)();
+} gf256_muladd_impls[] = {
+    { "generic", gf256_muladd_generic, cpu_has_always },
+#ifdef CPU_X86
+    { "ssse3", gf256_muladd_ssse3, cpu_has_ssse3 },
+#ifdef CPU_AVX2
+    { "avx2", gf256_muladd_avx2, cpu_has_avx2 },
+#endif
+#ifdef CPU_GFNI
+    { "gfni", gf256_muladd_gfni, cpu_has_avx2_gfni },
+#endif
+#endif
+#ifdef CPU_NEON64
+    { "neon", gf256_muladd_neon, cpu_has_always },
+#endif
+};
+
+int
+gf256_get_impl(int index, const char **name, gf256_muladd_proc *proc)
+{
+    size_t i;
+
+    for (i = 0;
+        i < sizeof(gf256_muladd_impls) / sizeof(*gf256_muladd_impls);
+        i++)
+    {
+        if (!gf256_muladd_impls[i].supported())
+            continue;
+
+        if (index-- == 0)
+        {
+            *name = gf256_muladd_impls[i].name;
+            *proc = gf256_muladd_impls[i].proc;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void __cdecl
+gf256_muladd_resolve(void *dst, const void *src, unsigned char coef,
+    safeio_size_t size)
+{
+    gf256_muladd_proc best = gf256_muladd_generic;
+    gf256_muladd_proc proc;
+    const char *name;
+    int i;
+
+    for (i = 0; gf256_get_impl(i, &name, &proc); i++)
+        best = proc;
+
+    gf256_muladd = best;
+
+    best(dst, src, coef, size);
+}
+
+gf256_muladd_proc gf256_muladd = gf256_muladd_resolve;
@@ -0,0 +1,65 @@
+/*
+Galois field GF(2^8) arithmetic for erasure coding in devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_GF256_
+#define _INC_GF256_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Field generated by x^8 + x^4 + x^3 + x^2 + 1 (0x11D), the polynomial
+    // commonly used for Reed-Solomon codes in storage systems.
+
+    // Builds log and exponent tables. Must be called before any other
+    // function here. Safe to call more than once.
+    void gf256_init();
+
+    unsigned char gf256_mul(unsigned char a, unsigned char b);
+
+    // Multiplicative inverse. Zero has none and yields zero.
+    unsigned char gf256_inv(unsigned char a);
+
+    typedef void (__cdecl gf256_muladd_decl)(void *dst, const void *src,
+        unsigned char coef, safeio_size_t size);
+
+    typedef gf256_muladd_decl *gf256_muladd_proc;
+
+    // Multiplies each byte in src by coef and adds (XORs) the product to the
+    // corresponding byte in dst. Points to the fastest implementation
+    // supported by the processor, selected on first call.
+    extern gf256_muladd_proc gf256_muladd;
+
+    // Enumerates implementations supported by the current processor, for
+    // benchmarking and diagnostics. Returns zero when index is out of range.
+    int gf256_get_impl(int index, const char **name, gf256_muladd_proc *proc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_GF256_
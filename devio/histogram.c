@@ -0,0 +1,156 @@
+/*
+Latency histograms for devio tools and statistics.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "devio_types.h"
+#include "histogram.h"
+
+static int
+histogram_bucket(uint64_t value)
+{
+    int exponent = 0;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+
+    while ((value >> exponent) >= 2 * HISTOGRAM_SUB_BUCKETS)
+        ++exponent;
+
+    // Top bit of value >> exponent is implied by exponent
+    return ((exponent + 1) << HISTOGRAM_SUB_BITS) +
+        (int)((value >> exponent) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t
+histogram_bucket_value(int bucket)
+{
+    int exponent = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+
+    if (exponent < 0)
+        return (uint64_t)bucket;
+
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS +
+        (bucket & (HISTOGRAM_SUB_BUCKETS - 1))) << exponent;
+}
+
+void
+histogram_init(PHISTOGRAM histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void
+histogram_add(PHISTOGRAM histogram, uint64_t value)
+{
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+
+    if (value > histogram->max)
+        histogram->max = value;
+
+    ++histogram->count;
+    histogram->sum += value;
+    ++histogram->buckets[histogram_bucket(value)];
+}
+
+void
+histogram_merge(PHISTOGRAM dst, const HISTOGRAM *src)
+{
+    int i;
+
+    if (src->count == 0)
+        return;
+
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+uint64_t
+histogram_percentile(const HISTOGRAM *histogram, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    int i;
+
+    if (histogram->count == 0)
+        return 0;
+
+    rank = (uint64_t)(histogram->count * percentile / 100.0);
+
+    if (rank >= histogram->count)
+        rank = histogram->count - 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+
+        if (seen > rank)
+        {
+            uint64_t low = histogram_bucket_value(i);
+            uint64_t high = i + 1 < HISTOGRAM_BUCKETS ?
+                histogram_bucket_value(i + 1) - 1 : histogram->max;
+            uint64_t value = low + (high - low) / 2;
+
+            // Exact values at the edges are known
+            if (value < histogram->min)
+                value = histogram->min;
+
+            if (value > histogram->max)
+                value = histogram->max;
+
+            return value;
+        }
+    }
+
+    return histogram->max;
+}
+
+double
+histogram_mean(const HISTOGRAM *histogram)
+{
+    if (histogram->count == 0)
+        return 0.0;
+
+    return (double)histogram->sum / histogram->count;
+}
@@ -0,0 +1,75 @@
+/*
+Latency histograms for devio tools and statistics.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_HISTOGRAM_
+#define _INC_HISTOGRAM_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Log-linear histogram: values below 2^HISTOGRAM_SUB_BITS get a
+    // bucket each, larger values are grouped by power of two with
+    // 2^HISTOGRAM_SUB_BITS buckets per power, so that relative error of
+    // percentiles is at most 1/2^HISTOGRAM_SUB_BITS over the full 64 bit
+    // range.
+
+#define HISTOGRAM_SUB_BITS      4
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+    typedef struct _HISTOGRAM
+    {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+    } HISTOGRAM, *PHISTOGRAM;
+
+    void histogram_init(PHISTOGRAM histogram);
+
+    void histogram_add(PHISTOGRAM histogram, uint64_t value);
+
+    void histogram_merge(PHISTOGRAM dst, const HISTOGRAM *src);
+
+    // Value at percentile, 0 to 100, as middle of bucket containing it.
+    // Zero for empty histogram.
+    uint64_t histogram_percentile(const HISTOGRAM *histogram,
+        double percentile);
+
+    double histogram_mean(const HISTOGRAM *histogram);
+
+    // Smallest value in bucket, for printing buckets.
+    uint64_t histogram_bucket_value(int bucket);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_HISTOGRAM_
@@ -0,0 +1,1488 @@
+/*
+Client library for the ImDisk proxy protocol.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "safeio.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "imdclient.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+
+// Largest number of iovec entries passed in one system call
+#define IMDCLIENT_MAX_IOV   64
+
+// Parts of a response, received in this order
+typedef enum _IMDCLIENT_STAGE
+{
+    StageResponse,      // IMDPROXY_READ_RESP or IMDPROXY_WRITE_RESP
+    StagePayload,       // IMDPROXY_PAYLOAD_HEADER, with compression
+    StageData,          // Uncompressed read data
+    StagePacked,        // Compressed read data
+    StageTrailer,       // IMDPROXY_PAYLOAD_TRAILER, with checksums
+    StageCredits        // IMDPROXY_CREDITS, with credits
+} IMDCLIENT_STAGE;
+
+struct _IMDCLIENT_CONN
+{
+    SOCKET sd;
+    int error;                  // Set when connection has failed
+    IMDPROXY_INFO_RESP info;
+    ULONGLONG options;
+    int depth;
+    int outstanding;
+    ULONGLONG outstanding_bytes;
+    IMDPROXY_CREDITS credits;   // Window granted, with credits
+    PIMDCLIENT_IO head;
+    PIMDCLIENT_IO tail;
+
+    // State for response to head request
+    IMDCLIENT_STAGE stage;
+    safeio_size_t done;
+    IMDPROXY_READ_RESP resp;
+    IMDPROXY_PAYLOAD_HEADER payload;
+    IMDPROXY_PAYLOAD_TRAILER trailer;
+    IMDPROXY_CREDITS grant;
+    ULONGLONG result_errorno;   // Result to complete with after credits
+    ULONGLONG result_length;
+
+    // Compressed data, followed by room for decompressed data
+    char *lz_buf;
+    safeio_size_t lz_buf_size;
+};
+
+struct _IMDCLIENT_POOL
+{
+    int count;
+    int next;
+    struct pollfd *fds;
+    PIMDCLIENT_CONN conns[1];
+};
+
+static SOCKET
+connect_unix(const char *path)
+{
+    struct sockaddr_un saddr = { 0 };
+    SOCKET sd;
+    int error;
+
+    if (strlen(path) >= sizeof(saddr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return INVALID_SOCKET;
+    }
+
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, path);
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sd == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (connect(sd, (struct sockaddr*)&saddr, sizeof saddr) == 0)
+        return sd;
+
+    error = errno;
+    closesocket(sd);
+    errno = error;
+
+    return INVALID_SOCKET;
+}
+
+static SOCKET
+connect_server(const char *server)
+{
+    struct addrinfo hints = { 0 };
+    struct addrinfo *result;
+    struct addrinfo *ai;
+    char host[256] = "127.0.0.1";
+    const char *port = strrchr(server, ':');
+    SOCKET sd = INVALID_SOCKET;
+    int rc;
+
+    if (_strnicmp(server, "unix:", 5) == 0)
+        return connect_unix(server + 5);
+
+    if (port != NULL)
+    {
+        size_t len = port - server;
+
+        if (len >= sizeof(host))
+            len = sizeof(host) - 1;
+
+        memcpy(host, server, len);
+        host[len] = 0;
+        ++port;
+    }
+    else
+        port = server;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(host, port, &hints, &result);
+
+    if (rc != 0)
+    {
+        errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return INVALID_SOCKET;
+    }
+
+    for (ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+        if (sd == INVALID_SOCKET)
+            continue;
+
+        if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        rc = errno;
+        closesocket(sd);
+        errno = rc;
+        sd = INVALID_SOCKET;
+    }
+
+    freeaddrinfo(result);
+
+    return sd;
+}
+
+// Copies part of an iovec array, starting skip bytes in. Returns number
+// of entries stored in out.
+static int
+iov_slice(const struct iovec *iov, int iovcnt, safeio_size_t skip,
+    struct iovec *out, int max_out)
+{
+    int count = 0;
+
+    for (; iovcnt > 0 && skip >= iov->iov_len; iov++, iovcnt--)
+        skip -= iov->iov_len;
+
+    for (; iovcnt > 0 && count < max_out; iov++, iovcnt--)
+    {
+        out[count].iov_base = (char*)iov->iov_base + skip;
+        out[count].iov_len = iov->iov_len - skip;
+        skip = 0;
+
+        if (out[count].iov_len > 0)
+            ++count;
+    }
+
+    return count;
+}
+
+static safeio_size_t
+iov_size(const struct iovec *iov, int iovcnt)
+{
+    safeio_size_t size = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    return size;
+}
+
+static uint32_t
+iov_crc32c(const struct iovec *iov, int iovcnt, safeio_size_t size)
+{
+    uint32_t crc = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && size > 0; i++)
+    {
+        safeio_size_t len = iov[i].iov_len < size ? iov[i].iov_len : size;
+
+        crc = crc32c(crc, iov[i].iov_base, len);
+        size -= len;
+    }
+
+    return crc;
+}
+
+static void
+iov_scatter(const struct iovec *iov, int iovcnt, const char *data,
+    safeio_size_t size)
+{
+    int i;
+
+    for (i = 0; i < iovcnt && size > 0; i++)
+    {
+        safeio_size_t len = iov[i].iov_len < size ? iov[i].iov_len : size;
+
+        memcpy(iov[i].iov_base, data, len);
+        data += len;
+        size -= len;
+    }
+}
+
+static void
+io_complete(PIMDCLIENT_IO io, ULONGLONG errorno, ULONGLONG length)
+{
+    io->errorno = errorno;
+    io->length = length;
+    io->completed = 1;
+
+    if (io->callback != NULL)
+        io->callback(io);
+}
+
+static PIMDCLIENT_IO
+conn_dequeue(PIMDCLIENT_CONN conn)
+{
+    PIMDCLIENT_IO io = conn->head;
+
+    conn->head = io->next;
+
+    if (conn->head == NULL)
+        conn->tail = NULL;
+
+    --conn->outstanding;
+    conn->outstanding_bytes -= io->size;
+
+    conn->stage = StageResponse;
+    conn->done = 0;
+
+    return io;
+}
+
+// Completes all outstanding requests with an error. The connection cannot
+// be used after this.
+static int
+conn_fail(PIMDCLIENT_CONN conn, int error)
+{
+    int count = 0;
+
+    if (conn->error == 0)
+        conn->error = error != 0 ? error : ECONNRESET;
+
+    while (conn->head != NULL)
+    {
+        io_complete(conn_dequeue(conn), ECONNRESET, 0);
+        ++count;
+    }
+
+    errno = conn->error;
+
+    return count;
+}
+
+static int
+conn_wait(PIMDCLIENT_CONN conn, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = conn->sd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    while (poll(&pfd, 1, -1) == -1)
+        if (errno != EINTR)
+            return -1;
+
+    return pfd.revents;
+}
+
+static int
+lz_buf_alloc(PIMDCLIENT_CONN conn, safeio_size_t size)
+{
+    safeio_size_t new_size = LZ_COMPRESS_BOUND(size) + size;
+    char *new_buf;
+
+    if (new_size <= conn->lz_buf_size)
+        return 1;
+
+    new_buf = (char*)realloc(conn->lz_buf, new_size);
+
+    if (new_buf == NULL)
+        return 0;
+
+    conn->lz_buf = new_buf;
+    conn->lz_buf_size = new_size;
+
+    return 1;
+}
+
+// Receives into fixed size part of a response. Returns 1 when complete,
+// zero if more data is needed and -1 on failure.
+static int
+conn_receive_part(PIMDCLIENT_CONN conn, void *part, safeio_size_t size)
+{
+    while (conn->done < size)
+    {
+        ssize_t rc = recv(conn->sd, (char*)part + conn->done,
+            size - conn->done, 0);
+
+        if (rc > 0)
+            conn->done += rc;
+        else if (rc == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        else if (errno != EINTR)
+            return -1;
+    }
+
+    conn->done = 0;
+
+    return 1;
+}
+
+static int
+conn_receive_data(PIMDCLIENT_CONN conn, PIMDCLIENT_IO io)
+{
+    while (conn->done < conn->resp.length)
+    {
+        struct iovec iov[IMDCLIENT_MAX_IOV];
+        int iovcnt = iov_slice(io->iov, io->iovcnt, conn->done,
+            iov, IMDCLIENT_MAX_IOV);
+        ssize_t rc;
+
+        // Response can be shorter than request
+        if (iovcnt > 0 &&
+            iov_size(iov, iovcnt) > conn->resp.length - conn->done)
+        {
+            safeio_size_t left = (safeio_size_t)
+                (conn->resp.length - conn->done);
+            int i;
+
+            for (i = 0; iov[i].iov_len < left; i++)
+                left -= iov[i].iov_len;
+
+            iov[i].iov_len = left;
+            iovcnt = i + 1;
+        }
+
+        rc = readv(conn->sd, iov, iovcnt);
+
+        if (rc > 0)
+            conn->done += rc;
+        else if (rc == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        else if (errno != EINTR)
+            return -1;
+    }
+
+    conn->done = 0;
+
+    return 1;
+}
+
+// Completes head request, or waits for credits that end the response if
+// enabled. Returns number of completed requests.
+static int
+conn_response_done(PIMDCLIENT_CONN conn, ULONGLONG errorno,
+    ULONGLONG length)
+{
+    if (conn->options & IMDPROXY_OPTION_CREDITS)
+    {
+        conn->result_errorno = errorno;
+        conn->result_length = length;
+        conn->stage = StageCredits;
+        return 0;
+    }
+
+    io_complete(conn_dequeue(conn), errorno, length);
+
+    return 1;
+}
+
+// Receives as much of pending responses as possible without blocking.
+// Returns number of completed requests, or -1 if connection failed.
+static int
+conn_receive(PIMDCLIENT_CONN conn)
+{
+    int count = 0;
+
+    while (conn->head != NULL)
+    {
+        PIMDCLIENT_IO io = conn->head;
+        int rc;
+
+        switch (conn->stage)
+        {
+        case StageResponse:
+            rc = conn_receive_part(conn, &conn->resp, sizeof(conn->resp));
+
+            if (rc != 1)
+                break;
+
+            if (io->request_code != IMDPROXY_REQ_READ ||
+                conn->resp.errorno != 0)
+            {
+                count += conn_response_done(conn, conn->resp.errorno,
+                    conn->resp.length);
+                continue;
+            }
+
+            if (conn->resp.length > io->size)
+            {
+                errno = EPROTO;
+                rc = -1;
+                break;
+            }
+
+            if (conn->options & IMDPROXY_OPTION_COMPRESSION)
+                conn->stage = StagePayload;
+            else
+                conn->stage = StageData;
+
+            continue;
+
+        case StagePayload:
+            rc = conn_receive_part(conn, &conn->payload,
+                sizeof(conn->payload));
+
+            if (rc != 1)
+                break;
+
+            if (conn->payload.stored_length == conn->resp.length)
+                conn->stage = StageData;
+            else if (conn->payload.stored_length >
+                LZ_COMPRESS_BOUND(conn->resp.length) ||
+                !lz_buf_alloc(conn, (safeio_size_t)conn->resp.length))
+            {
+                errno = EPROTO;
+                rc = -1;
+                break;
+            }
+            else
+                conn->stage = StagePacked;
+
+            continue;
+
+        case StagePacked:
+            rc = conn_receive_part(conn, conn->lz_buf,
+                (safeio_size_t)conn->payload.stored_length);
+
+            if (rc != 1)
+                break;
+
+            if (lz_decompress(conn->lz_buf,
+                (safeio_size_t)conn->payload.stored_length,
+                conn->lz_buf + LZ_COMPRESS_BOUND(conn->resp.length),
+                (safeio_size_t)conn->resp.length) !=
+                (safeio_ssize_t)conn->resp.length)
+            {
+                errno = EPROTO;
+                rc = -1;
+                break;
+            }
+
+            iov_scatter(io->iov, io->iovcnt,
+                conn->lz_buf + LZ_COMPRESS_BOUND(conn->resp.length),
+                (safeio_size_t)conn->resp.length);
+
+            goto data_done;
+
+        case StageData:
+            rc = conn_receive_data(conn, io);
+
+            if (rc != 1)
+                break;
+
+        data_done:
+            if (conn->options & IMDPROXY_OPTION_CRC32C)
+            {
+                conn->stage = StageTrailer;
+                continue;
+            }
+
+            count += conn_response_done(conn, 0, conn->resp.length);
+            continue;
+
+        case StageTrailer:
+            rc = conn_receive_part(conn, &conn->trailer,
+                sizeof(conn->trailer));
+
+            if (rc != 1)
+                break;
+
+            if (conn->trailer.crc32c != iov_crc32c(io->iov, io->iovcnt,
+                (safeio_size_t)conn->resp.length))
+                count += conn_response_done(conn, EIO, 0);
+            else
+                count += conn_response_done(conn, 0, conn->resp.length);
+
+            continue;
+
+        case StageCredits:
+            rc = conn_receive_part(conn, &conn->grant, sizeof(conn->grant));
+
+            if (rc != 1)
+                break;
+
+            conn->credits = conn->grant;
+
+            io_complete(conn_dequeue(conn), conn->result_errorno,
+                conn->result_length);
+            ++count;
+            continue;
+
+        default:
+            errno = EPROTO;
+            rc = -1;
+        }
+
+        if (rc == -1)
+        {
+            conn_fail(conn, errno);
+            return -1;
+        }
+
+        break;
+    }
+
+    return count;
+}
+
+// Sends an iovec array, receiving responses to earlier requests while
+// waiting for room in the socket buffer. Otherwise both ends could block
+// sending while neither receives.
+static int
+conn_send(PIMDCLIENT_CONN conn, const struct iovec *iov, int iovcnt,
+    int *completed)
+{
+    safeio_size_t total = iov_size(iov, iovcnt);
+    safeio_size_t sent = 0;
+
+    while (sent < total)
+    {
+        struct iovec part[IMDCLIENT_MAX_IOV];
+        struct msghdr msg = { 0 };
+        ssize_t rc;
+
+        msg.msg_iov = part;
+        msg.msg_iovlen = iov_slice(iov, iovcnt, sent, part,
+            IMDCLIENT_MAX_IOV);
+
+        rc = sendmsg(conn->sd, &msg, MSG_NOSIGNAL);
+
+        if (rc >= 0)
+        {
+            sent += rc;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return 0;
+
+        rc = conn_wait(conn, conn->head != NULL ? POLLIN | POLLOUT : POLLOUT);
+
+        if (rc == -1)
+            return 0;
+
+        if (rc & POLLIN)
+        {
+            int count = conn_receive(conn);
+
+            if (count == -1)
+                return 0;
+
+            *completed += count;
+        }
+    }
+
+    return 1;
+}
+
+// Blocking receive for responses outside of the request queue.
+static int
+conn_receive_all(PIMDCLIENT_CONN conn, void *data, safeio_size_t size)
+{
+    char *ptr = (char*)data;
+
+    while (size > 0)
+    {
+        ssize_t rc = recv(conn->sd, ptr, size, 0);
+
+        if (rc > 0)
+        {
+            ptr += rc;
+            size -= rc;
+        }
+        else if (rc == 0)
+        {
+            errno = ECONNRESET;
+            return 0;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (conn_wait(conn, POLLIN) == -1)
+                return 0;
+        }
+        else if (errno != EINTR)
+            return 0;
+    }
+
+    return 1;
+}
+
+PIMDCLIENT_CONN
+imdclient_connect(const char *server, ULONGLONG options)
+{
+    PIMDCLIENT_CONN conn;
+    ULONGLONG req = IMDPROXY_REQ_INFO;
+    int flag = 1;
+    int error;
+
+    conn = (PIMDCLIENT_CONN)calloc(1, sizeof(*conn));
+
+    if (conn == NULL)
+        return NULL;
+
+    conn->depth = IMDCLIENT_DEFAULT_DEPTH;
+    conn->sd = connect_server(server);
+
+    if (conn->sd == INVALID_SOCKET)
+    {
+        error = errno;
+        free(conn);
+        errno = error;
+        return NULL;
+    }
+
+    if (_strnicmp(server, "unix:", 5) != 0)
+        setsockopt(conn->sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+
+    if (!safe_write(conn->sd, &req, sizeof req) ||
+        !safe_read(conn->sd, &conn->info, sizeof conn->info))
+        goto failed;
+
+    // Servers that do not know IMDPROXY_REQ_SET_OPTIONS do not consume
+    // the request correctly, only ask for options they advertise.
+    if (!(conn->info.flags & IMDPROXY_FLAG_SUPPORTS_COMPRESSION))
+        options &= ~(ULONGLONG)IMDPROXY_OPTION_COMPRESSION;
+
+    if (!(conn->info.flags & IMDPROXY_FLAG_SUPPORTS_CRC32C))
+        options &= ~(ULONGLONG)IMDPROXY_OPTION_CRC32C;
+
+    if (!(conn->info.flags & IMDPROXY_FLAG_SUPPORTS_CREDITS))
+        options &= ~(ULONGLONG)IMDPROXY_OPTION_CREDITS;
+
+    if (options != 0)
+    {
+        IMDPROXY_OPTIONS_REQ options_req = { 0 };
+        IMDPROXY_OPTIONS_RESP options_resp = { 0 };
+
+        options_req.request_code = IMDPROXY_REQ_SET_OPTIONS;
+        options_req.options = options;
+
+        if (!safe_write(conn->sd, &options_req, sizeof options_req) ||
+            !safe_read(conn->sd, &options_resp, sizeof options_resp))
+            goto failed;
+
+        if (options_resp.errorno == 0)
+            conn->options = options_resp.options;
+
+        if ((conn->options & IMDPROXY_OPTION_CREDITS) &&
+            !safe_read(conn->sd, &conn->credits, sizeof conn->credits))
+            goto failed;
+    }
+
+    if (fcntl(conn->sd, F_SETFL, fcntl(conn->sd, F_GETFL) | O_NONBLOCK) == -1)
+        goto failed;
+
+    return conn;
+
+failed:
+    error = errno != 0 ? errno : ECONNRESET;
+    closesocket(conn->sd);
+    free(conn);
+    errno = error;
+    return NULL;
+}
+
+void
+imdclient_close(PIMDCLIENT_CONN conn)
+{
+    if (conn == NULL)
+        return;
+
+    while (conn->error == 0 && conn->head != NULL)
+        if (imdclient_complete(conn, conn->outstanding) == -1)
+            break;
+
+    if (conn->error == 0)
+    {
+        struct iovec iov;
+        ULONGLONG req = IMDPROXY_REQ_CLOSE;
+        int completed = 0;
+
+        iov.iov_base = &req;
+        iov.iov_len = sizeof req;
+
+        conn_send(conn, &iov, 1, &completed);
+    }
+
+    closesocket(conn->sd);
+    free(conn->lz_buf);
+    free(conn);
+}
+
+const IMDPROXY_INFO_RESP *
+imdclient_info(PIMDCLIENT_CONN conn)
+{
+    return &conn->info;
+}
+
+ULONGLONG
+imdclient_options(PIMDCLIENT_CONN conn)
+{
+    return conn->options;
+}
+
+SOCKET
+imdclient_socket(PIMDCLIENT_CONN conn)
+{
+    return conn->sd;
+}
+
+void
+imdclient_set_depth(PIMDCLIENT_CONN conn, int depth)
+{
+    conn->depth = depth > 0 ? depth : 1;
+}
+
+int
+imdclient_outstanding(PIMDCLIENT_CONN conn)
+{
+    return conn->outstanding;
+}
+
+int
+imdclient_error(PIMDCLIENT_CONN conn)
+{
+    return conn->error;
+}
+
+const IMDPROXY_CREDITS *
+imdclient_credits(PIMDCLIENT_CONN conn)
+{
+    if (!(conn->options & IMDPROXY_OPTION_CREDITS))
+        return NULL;
+
+    return &conn->credits;
+}
+
+// Whether a request of size bytes has to wait for completions, for queue
+// depth or window granted by server.
+static int
+conn_window_full(PIMDCLIENT_CONN conn, ULONGLONG size)
+{
+    if (conn->outstanding >= conn->depth)
+        return 1;
+
+    if (!(conn->options & IMDPROXY_OPTION_CREDITS) || conn->outstanding == 0)
+        return 0;
+
+    return (ULONGLONG)conn->outstanding >= conn->credits.requests ||
+        conn->outstanding_bytes + size > conn->credits.bytes;
+}
+
+int
+imdclient_submit(PIMDCLIENT_CONN conn, PIMDCLIENT_IO io)
+{
+    struct iovec small_iov[IMDCLIENT_MAX_IOV];
+    struct iovec *iov = small_iov;
+    IMDPROXY_WRITE_REQ req;
+    IMDPROXY_PAYLOAD_HEADER payload;
+    IMDPROXY_PAYLOAD_TRAILER trailer;
+    int iovcnt = 0;
+    int completed = 0;
+    int rc;
+
+    io->completed = 0;
+    io->errorno = 0;
+    io->length = 0;
+    io->next = NULL;
+    io->size = iov_size(io->iov, io->iovcnt);
+
+    if (conn->error != 0 ||
+        (io->request_code != IMDPROXY_REQ_READ &&
+            io->request_code != IMDPROXY_REQ_WRITE))
+    {
+        int error = conn->error != 0 ? conn->error : EINVAL;
+
+        io_complete(io, error, 0);
+        errno = error;
+        return 0;
+    }
+
+    while (conn_window_full(conn, io->size))
+        if (imdclient_complete(conn, 1) == -1)
+        {
+            io_complete(io, ECONNRESET, 0);
+            return 0;
+        }
+
+    req.request_code = io->request_code;
+    req.offset = io->offset;
+    req.length = io->size;
+
+    if (io->request_code == IMDPROXY_REQ_WRITE &&
+        io->iovcnt + 3 > IMDCLIENT_MAX_IOV)
+    {
+        iov = (struct iovec*)malloc((io->iovcnt + 3) * sizeof(*iov));
+
+        if (iov == NULL)
+        {
+            io_complete(io, ENOMEM, 0);
+            errno = ENOMEM;
+            return 0;
+        }
+    }
+
+    iov[iovcnt].iov_base = &req;
+    iov[iovcnt++].iov_len = sizeof req;
+
+    if (io->request_code == IMDPROXY_REQ_WRITE)
+    {
+        // Write data is sent uncompressed, which the payload header allows
+        // even when compression is enabled.
+        if (conn->options & IMDPROXY_OPTION_COMPRESSION)
+        {
+            payload.stored_length = io->size;
+            iov[iovcnt].iov_base = &payload;
+            iov[iovcnt++].iov_len = sizeof payload;
+        }
+
+        memcpy(iov + iovcnt, io->iov, io->iovcnt * sizeof(*iov));
+        iovcnt += io->iovcnt;
+
+        if (conn->options & IMDPROXY_OPTION_CRC32C)
+        {
+            trailer.crc32c = iov_crc32c(io->iov, io->iovcnt,
+                (safeio_size_t)io->size);
+            iov[iovcnt].iov_base = &trailer;
+            iov[iovcnt++].iov_len = sizeof trailer;
+        }
+    }
+
+    rc = conn_send(conn, iov, iovcnt, &completed);
+
+    if (iov != small_iov)
+        free(iov);
+
+    if (!rc)
+    {
+        int error = errno;
+
+        conn_fail(conn, error);
+        io_complete(io, ECONNRESET, 0);
+        errno = error;
+        return 0;
+    }
+
+    if (conn->tail != NULL)
+        conn->tail->next = io;
+    else
+        conn->head = io;
+
+    conn->tail = io;
+    ++conn->outstanding;
+    conn->outstanding_bytes += io->size;
+
+    return 1;
+}
+
+int
+imdclient_complete(PIMDCLIENT_CONN conn, int min_complete)
+{
+    int count = 0;
+
+    for (;;)
+    {
+        int rc;
+
+        if (conn->error != 0)
+        {
+            errno = conn->error;
+            return -1;
+        }
+
+        rc = conn_receive(conn);
+
+        if (rc == -1)
+            return -1;
+
+        count += rc;
+
+        if (count >= min_complete || conn->head == NULL)
+            return count;
+
+        if (conn_wait(conn, POLLIN) == -1)
+        {
+            conn_fail(conn, errno);
+            return -1;
+        }
+    }
+}
+
+static safeio_ssize_t
+imdclient_sync_io(PIMDCLIENT_CONN conn, ULONGLONG request_code, void *buf,
+    safeio_size_t size, off_t_64 offset)
+{
+    IMDCLIENT_IO io = { 0 };
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    io.request_code = request_code;
+    io.offset = offset;
+    io.iov = &iov;
+    io.iovcnt = 1;
+
+    if (!imdclient_submit(conn, &io))
+        return -1;
+
+    while (!io.completed)
+        if (imdclient_complete(conn, 1) == -1)
+            break;
+
+    if (io.errorno != 0)
+    {
+        errno = (int)io.errorno;
+        return -1;
+    }
+
+    return (safeio_ssize_t)io.length;
+}
+
+safeio_ssize_t
+imdclient_read(PIMDCLIENT_CONN conn, void *buf, safeio_size_t size,
+    off_t_64 offset)
+{
+    return imdclient_sync_io(conn, IMDPROXY_REQ_READ, buf, size, offset);
+}
+
+safeio_ssize_t
+imdclient_write(PIMDCLIENT_CONN conn, const void *buf, safeio_size_t size,
+    off_t_64 offset)
+{
+    return imdclient_sync_io(conn, IMDPROXY_REQ_WRITE, (void*)buf, size,
+        offset);
+}
+
+int
+imdclient_call(PIMDCLIENT_CONN conn,
+    const void *req, safeio_size_t req_size,
+    const void *data, safeio_size_t data_size,
+    void *resp, safeio_size_t resp_size)
+{
+    struct iovec iov[2];
+    int completed = 0;
+
+    while (conn->head != NULL)
+        if (imdclient_complete(conn, conn->outstanding) == -1)
+            return 0;
+
+    if (conn->error != 0)
+    {
+        errno = conn->error;
+        return 0;
+    }
+
+    iov[0].iov_base = (void*)req;
+    iov[0].iov_len = req_size;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = data != NULL ? data_size : 0;
+
+    if (!conn_send(conn, iov, 2, &completed) ||
+        !conn_receive_all(conn, resp, resp_size))
+    {
+        conn_fail(conn, errno);
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+imdclient_receive(PIMDCLIENT_CONN conn, void *data, safeio_size_t size)
+{
+    if (conn->error != 0)
+    {
+        errno = conn->error;
+        return 0;
+    }
+
+    if (!conn_receive_all(conn, data, size))
+    {
+        conn_fail(conn, errno);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Receives length bytes of extent_size byte entries following a response.
+// Up to max_extents are stored in extents, the rest are discarded. Returns
+// number stored, or -1 with errno set.
+static int
+conn_receive_extents(PIMDCLIENT_CONN conn, void *extents,
+    safeio_size_t extent_size, int max_extents, ULONGLONG length)
+{
+    char discard[512];
+    ULONGLONG stored = (ULONGLONG)max_extents * extent_size;
+
+    if (length % extent_size != 0)
+    {
+        conn_fail(conn, EPROTO);
+        return -1;
+    }
+
+    if (stored > length)
+        stored = length;
+
+    if (stored > 0 &&
+        !imdclient_receive(conn, extents, (safeio_size_t)stored))
+        return -1;
+
+    for (length -= stored; length > 0;)
+    {
+        safeio_size_t part = length < sizeof(discard) ?
+            (safeio_size_t)length : (safeio_size_t)sizeof(discard);
+
+        if (!imdclient_receive(conn, discard, part))
+            return -1;
+
+        length -= part;
+    }
+
+    return (int)(stored / extent_size);
+}
+
+safeio_ssize_t
+imdclient_read_sparse(PIMDCLIENT_CONN conn, void *buf, safeio_size_t size,
+    off_t_64 offset, PIMDPROXY_ZERO_EXTENT extents, int *extent_count)
+{
+    IMDPROXY_READ_REQ req;
+    IMDPROXY_SPARSE_READ_RESP resp = { 0 };
+    IMDPROXY_PAYLOAD_TRAILER trailer;
+    PIMDPROXY_ZERO_EXTENT zero;
+    ULONGLONG zero_bytes = 0;
+    ULONGLONG pos = 0;
+    ULONGLONG i;
+    int max_extents = 0;
+
+    if (extents != NULL)
+    {
+        max_extents = *extent_count;
+        *extent_count = 0;
+    }
+
+    req.request_code = IMDPROXY_REQ_READ_SPARSE;
+    req.offset = offset;
+    req.length = size;
+
+    if (!imdclient_call(conn, &req, sizeof req, NULL, 0, &resp, sizeof resp))
+        return -1;
+
+    if (resp.errorno != 0)
+    {
+        errno = (int)resp.errorno;
+        return -1;
+    }
+
+    if (resp.length > size || resp.zero_extents > resp.length ||
+        resp.data_length > resp.length)
+    {
+        conn_fail(conn, EPROTO);
+        return -1;
+    }
+
+    zero = (PIMDPROXY_ZERO_EXTENT)malloc(
+        (size_t)resp.zero_extents * sizeof(*zero) + 1);
+
+    if (zero == NULL)
+    {
+        conn_fail(conn, ENOMEM);
+        return -1;
+    }
+
+    if (resp.zero_extents > 0 && !imdclient_receive(conn, zero,
+        (safeio_size_t)(resp.zero_extents * sizeof(*zero))))
+    {
+        free(zero);
+        return -1;
+    }
+
+    // Extents are in order and do not overlap, data fills the gaps
+    for (i = 0; i < resp.zero_extents; i++)
+    {
+        if (zero[i].offset < pos || zero[i].offset > resp.length ||
+            zero[i].length > resp.length - zero[i].offset)
+            break;
+
+        pos = zero[i].offset + zero[i].length;
+        zero_bytes += zero[i].length;
+    }
+
+    if (i < resp.zero_extents ||
+        resp.data_length != resp.length - zero_bytes)
+    {
+        free(zero);
+        conn_fail(conn, EPROTO);
+        return -1;
+    }
+
+    for (i = 0, pos = 0; i <= resp.zero_extents; i++)
+    {
+        ULONGLONG end = i < resp.zero_extents ? zero[i].offset : resp.length;
+
+        if (end > pos &&
+            !imdclient_receive(conn, (char*)buf + pos, (safeio_size_t)
+                (end - pos)))
+        {
+            free(zero);
+            return -1;
+        }
+
+        if (i == resp.zero_extents)
+            break;
+
+        memset((char*)buf + zero[i].offset, 0, (size_t)zero[i].length);
+        pos = zero[i].offset + zero[i].length;
+
+        if (extents != NULL && *extent_count < max_extents)
+            extents[(*extent_count)++] = zero[i];
+    }
+
+    free(zero);
+
+    if (conn->options & IMDPROXY_OPTION_CRC32C)
+    {
+        if (!imdclient_receive(conn, &trailer, sizeof trailer))
+            return -1;
+
+        if (trailer.crc32c != crc32c(0, buf, (safeio_size_t)resp.length))
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return (safeio_ssize_t)resp.length;
+}
+
+int
+imdclient_get_allocation(PIMDCLIENT_CONN conn, ULONGLONG offset,
+    ULONGLONG length, PIMDPROXY_ALLOCATION_EXTENT extents, int max_extents,
+    ULONGLONG *next_offset)
+{
+    IMDPROXY_ALLOCATION_REQ req;
+    IMDPROXY_ALLOCATION_RESP resp = { 0 };
+    int count;
+
+    req.request_code = IMDPROXY_REQ_GET_ALLOCATION;
+    req.offset = offset;
+    req.length = length;
+
+    if (!imdclient_call(conn, &req, sizeof req, NULL, 0, &resp, sizeof resp))
+        return -1;
+
+    if (resp.errorno != 0)
+    {
+        errno = (int)resp.errorno;
+        return -1;
+    }
+
+    count = conn_receive_extents(conn, extents, sizeof(*extents),
+        max_extents, resp.length);
+
+    if (count == -1)
+        return -1;
+
+    // Continue after last stored extent if some were left out
+    if (count * sizeof(*extents) < resp.length)
+        *next_offset = count > 0 ?
+            extents[count - 1].offset + extents[count - 1].length : offset;
+    else
+        *next_offset = resp.next_offset;
+
+    return count;
+}
+
+int
+imdclient_changed_blocks(PIMDCLIENT_CONN conn, ULONGLONG generation,
+    ULONGLONG offset, ULONGLONG length, PIMDPROXY_CBT_EXTENT extents,
+    int max_extents, ULONGLONG *next_offset, ULONGLONG *current_generation)
+{
+    IMDPROXY_CBT_REQ req;
+    IMDPROXY_CBT_RESP resp = { 0 };
+    int count;
+
+    req.request_code = IMDPROXY_REQ_CHANGED_BLOCKS;
+    req.operation_code = CbtQuery;
+    req.generation = generation;
+    req.offset = offset;
+    req.length = length;
+
+    if (!imdclient_call(conn, &req, sizeof req, NULL, 0, &resp, sizeof resp))
+        return -1;
+
+    if (resp.errorno != 0)
+    {
+        errno = (int)resp.errorno;
+        return -1;
+    }
+
+    count = conn_receive_extents(conn, extents, sizeof(*extents),
+        max_extents, resp.length);
+
+    if (count == -1)
+        return -1;
+
+    if (count * sizeof(*extents) < resp.length)
+        *next_offset = count > 0 ?
+            extents[count - 1].offset + extents[count - 1].length : offset;
+    else
+        *next_offset = resp.next_offset;
+
+    if (current_generation != NULL)
+        *current_generation = resp.generation;
+
+    return count;
+}
+
+int
+imdclient_new_generation(PIMDCLIENT_CONN conn, ULONGLONG *generation)
+{
+    IMDPROXY_CBT_REQ req = { 0 };
+    IMDPROXY_CBT_RESP resp = { 0 };
+
+    req.request_code = IMDPROXY_REQ_CHANGED_BLOCKS;
+    req.operation_code = CbtNewGeneration;
+
+    if (!imdclient_call(conn, &req, sizeof req, NULL, 0, &resp, sizeof resp))
+        return 0;
+
+    if (resp.errorno != 0)
+    {
+        errno = (int)resp.errorno;
+        return 0;
+    }
+
+    *generation = resp.generation;
+
+    return 1;
+}
+
+PIMDCLIENT_POOL
+imdclient_pool_open(const char *servers, int connections, ULONGLONG options)
+{
+    PIMDCLIENT_POOL pool;
+    char *list = _strdup(servers);
+    char *server;
+    int server_count = 1;
+    int i;
+
+    if (list == NULL)
+        return NULL;
+
+    if (connections < 1)
+        connections = 1;
+
+    for (server = list; (server = strchr(server, ',')) != NULL; server++)
+        ++server_count;
+
+    pool = (PIMDCLIENT_POOL)calloc(1, sizeof(*pool) +
+        (connections - 1) * sizeof(PIMDCLIENT_CONN));
+
+    if (pool != NULL)
+        pool->fds = (struct pollfd*)calloc(connections,
+            sizeof(struct pollfd));
+
+    if (pool == NULL || pool->fds == NULL)
+    {
+        free(pool);
+        free(list);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < connections; i++)
+    {
+        int s = i % server_count;
+        char *end;
+
+        for (server = list; s > 0; s--)
+            server = strchr(server, ',') + 1;
+
+        end = strchr(server, ',');
+
+        if (end != NULL)
+            *end = 0;
+
+        pool->conns[i] = imdclient_connect(server, options);
+
+        if (end != NULL)
+            *end = ',';
+
+        if (pool->conns[i] == NULL)
+        {
+            int error = errno;
+
+            pool->count = i;
+            imdclient_pool_close(pool);
+            free(list);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    pool->count = connections;
+
+    free(list);
+
+    return pool;
+}
+
+void
+imdclient_pool_close(PIMDCLIENT_POOL pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    for (i = 0; i < pool->count; i++)
+        imdclient_close(pool->conns[i]);
+
+    free(pool->fds);
+    free(pool);
+}
+
+int
+imdclient_pool_size(PIMDCLIENT_POOL pool)
+{
+    return pool->count;
+}
+
+PIMDCLIENT_CONN
+imdclient_pool_conn(PIMDCLIENT_POOL pool, int index)
+{
+    return pool->conns[index];
+}
+
+PIMDCLIENT_CONN
+imdclient_pool_get(PIMDCLIENT_POOL pool)
+{
+    PIMDCLIENT_CONN best = NULL;
+    int i;
+
+    // Start after last choice, so that idle connections are used in turn
+    for (i = 0; i < pool->count; i++)
+    {
+        PIMDCLIENT_CONN conn = pool->conns[(pool->next + i) % pool->count];
+
+        if (conn->error == 0 &&
+            (best == NULL || conn->outstanding < best->outstanding))
+            best = conn;
+    }
+
+    pool->next = (pool->next + 1) % pool->count;
+
+    return best;
+}
+
+int
+imdclient_pool_complete(PIMDCLIENT_POOL pool, int min_complete)
+{
+    int count = 0;
+
+    for (;;)
+    {
+        int waiting = 0;
+        int i;
+
+        for (i = 0; i < pool->count; i++)
+        {
+            PIMDCLIENT_CONN conn = pool->conns[i];
+            int rc;
+
+            if (conn->error != 0 || conn->head == NULL)
+                continue;
+
+            rc = conn_receive(conn);
+
+            if (rc > 0)
+                count += rc;
+
+            if (conn->error == 0 && conn->head != NULL)
+            {
+                pool->fds[waiting].fd = conn->sd;
+                pool->fds[waiting].events = POLLIN;
+                pool->fds[waiting].revents = 0;
+                ++waiting;
+            }
+        }
+
+        if (count >= min_complete || waiting == 0)
+            return count;
+
+        if (poll(pool->fds, waiting, -1) == -1 && errno != EINTR)
+            return -1;
+    }
+}
@@ -0,0 +1,209 @@
+/*
+Client library for the ImDisk proxy protocol.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_IMDCLIENT_
+#define _INC_IMDCLIENT_
+
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Client side of the IMDPROXY protocol over TCP or UNIX domain sockets,
+    // for tools and tests that drive devio or other proxy servers from
+    // Linux and other Unix systems.
+    //
+    // Requests on a connection are pipelined: several can be sent before
+    // responses arrive, and the server answers them in order. Read and
+    // write data is sent and received directly from and to caller iovec
+    // arrays, without intermediate copies unless the connection uses
+    // compression. Completions are delivered by imdclient_complete(),
+    // through an optional callback per request. Connections are not
+    // thread safe, use one connection per thread or a pool with external
+    // locking.
+
+    typedef struct _IMDCLIENT_CONN IMDCLIENT_CONN, *PIMDCLIENT_CONN;
+    typedef struct _IMDCLIENT_POOL IMDCLIENT_POOL, *PIMDCLIENT_POOL;
+    typedef struct _IMDCLIENT_IO IMDCLIENT_IO, *PIMDCLIENT_IO;
+
+    typedef void (*imdclient_callback)(PIMDCLIENT_IO io);
+
+    // Read or write request. Owned by caller, and must stay valid together
+    // with the buffers it refers to until the request has completed.
+    struct _IMDCLIENT_IO
+    {
+        ULONGLONG request_code;     // IMDPROXY_REQ_READ or IMDPROXY_REQ_WRITE
+        ULONGLONG offset;
+        const struct iovec *iov;
+        int iovcnt;
+        imdclient_callback callback;    // Optional
+        void *context;              // For use by caller
+
+        // Set on completion. Failed requests have an errno value in
+        // errorno, EIO for checksum mismatch and ECONNRESET for requests
+        // still outstanding when the connection failed.
+        int completed;
+        ULONGLONG errorno;
+        ULONGLONG length;
+
+        // Private
+        PIMDCLIENT_IO next;
+        ULONGLONG size;
+    };
+
+#define IMDCLIENT_DEFAULT_DEPTH     64
+
+    // Connects to a server given as [host:]port or unix:path and queries
+    // size and flags. Options are IMDPROXY_OPTION_* flags requested with
+    // IMDPROXY_REQ_SET_OPTIONS, if any, of which the server may enable
+    // fewer. Returns NULL with errno set on failure.
+    PIMDCLIENT_CONN imdclient_connect(const char *server, ULONGLONG options);
+
+    // Completes outstanding requests, sends IMDPROXY_REQ_CLOSE and closes
+    // the connection.
+    void imdclient_close(PIMDCLIENT_CONN conn);
+
+    const IMDPROXY_INFO_RESP *imdclient_info(PIMDCLIENT_CONN conn);
+
+    // Options enabled by the server.
+    ULONGLONG imdclient_options(PIMDCLIENT_CONN conn);
+
+    // Socket, for poll() together with other descriptors. POLLIN means
+    // that imdclient_complete() can make progress without blocking.
+    SOCKET imdclient_socket(PIMDCLIENT_CONN conn);
+
+    // Maximum number of outstanding requests. imdclient_submit() waits
+    // for completions when the limit is reached. Default is
+    // IMDCLIENT_DEFAULT_DEPTH.
+    void imdclient_set_depth(PIMDCLIENT_CONN conn, int depth);
+
+    int imdclient_outstanding(PIMDCLIENT_CONN conn);
+
+    // Error that made connection fail, or zero while it can be used.
+    int imdclient_error(PIMDCLIENT_CONN conn);
+
+    // Window granted by the server with IMDPROXY_OPTION_CREDITS, or NULL
+    // if not enabled. imdclient_submit() also waits for completions while
+    // the window is full.
+    const IMDPROXY_CREDITS *imdclient_credits(PIMDCLIENT_CONN conn);
+
+    // Sends a request. Callbacks for earlier requests can be called before
+    // this returns. Returns zero with errno set if the connection failed,
+    // in which case io and all other outstanding requests have completed.
+    int imdclient_submit(PIMDCLIENT_CONN conn, PIMDCLIENT_IO io);
+
+    // Receives responses until at least min_complete requests have
+    // completed, or until no more responses are available without blocking
+    // if min_complete is zero. Returns number of completed requests, or -1
+    // with errno set if the connection failed.
+    int imdclient_complete(PIMDCLIENT_CONN conn, int min_complete);
+
+    // Synchronous read and write. Return number of bytes transferred, or -1
+    // with errno set.
+    safeio_ssize_t imdclient_read(PIMDCLIENT_CONN conn, void *buf,
+        safeio_size_t size, off_t_64 offset);
+
+    safeio_ssize_t imdclient_write(PIMDCLIENT_CONN conn, const void *buf,
+        safeio_size_t size, off_t_64 offset);
+
+    // Sends a request that has a fixed size response, such as
+    // IMDPROXY_REQ_UNMAP, IMDPROXY_REQ_SNAPSHOT or
+    // IMDPROXY_REQ_CHANGED_BLOCKS, after completing outstanding requests.
+    // Data of data_size bytes, if any, is sent directly after the request
+    // structure. Receives response, then extra_size bytes of extra data if
+    // extra is not NULL. Returns zero with errno set on connection failure.
+    // Errors reported by the server are left in the response structure.
+    int imdclient_call(PIMDCLIENT_CONN conn,
+        const void *req, safeio_size_t req_size,
+        const void *data, safeio_size_t data_size,
+        void *resp, safeio_size_t resp_size);
+
+    // Receives additional response data after imdclient_call(), such as
+    // extents following IMDPROXY_CBT_RESP.
+    int imdclient_receive(PIMDCLIENT_CONN conn, void *data,
+        safeio_size_t size);
+
+    // Synchronous typed requests below complete outstanding requests first,
+    // like imdclient_call(). Errors reported by the server are returned
+    // with errno set, and leave the connection usable.
+
+    // IMDPROXY_REQ_READ_SPARSE. Data is stored in buf with zero extents
+    // filled in, as from imdclient_read(). If extents is not NULL,
+    // *extent_count is number of entries it has room for, and is set to
+    // number of zero extents stored, with offsets relative to buf. Further
+    // extents are left out. Returns number of bytes read, or -1 with errno
+    // set.
+    safeio_ssize_t imdclient_read_sparse(PIMDCLIENT_CONN conn, void *buf,
+        safeio_size_t size, off_t_64 offset,
+        PIMDPROXY_ZERO_EXTENT extents, int *extent_count);
+
+    // IMDPROXY_REQ_GET_ALLOCATION for length bytes at offset. Stores up to
+    // max_extents extents and sets next_offset to where to continue.
+    // Returns number of extents stored, or -1 with errno set.
+    int imdclient_get_allocation(PIMDCLIENT_CONN conn, ULONGLONG offset,
+        ULONGLONG length, PIMDPROXY_ALLOCATION_EXTENT extents,
+        int max_extents, ULONGLONG *next_offset);
+
+    // IMDPROXY_REQ_CHANGED_BLOCKS query for extents changed in generation
+    // or later, in length bytes at offset, zero for rest of image. Like
+    // imdclient_get_allocation(), and sets current_generation if not NULL.
+    int imdclient_changed_blocks(PIMDCLIENT_CONN conn, ULONGLONG generation,
+        ULONGLONG offset, ULONGLONG length, PIMDPROXY_CBT_EXTENT extents,
+        int max_extents, ULONGLONG *next_offset,
+        ULONGLONG *current_generation);
+
+    // Starts a new changed block tracking generation and stores its
+    // number. Returns zero with errno set on failure.
+    int imdclient_new_generation(PIMDCLIENT_CONN conn, ULONGLONG *generation);
+
+    // Pool of connections to one or more servers, separated by commas.
+    // Connections are spread over servers in turn. Note that devio serves
+    // a single connection per process, so a pool of devio servers needs
+    // one server per connection.
+    PIMDCLIENT_POOL imdclient_pool_open(const char *servers,
+        int connections, ULONGLONG options);
+
+    void imdclient_pool_close(PIMDCLIENT_POOL pool);
+
+    int imdclient_pool_size(PIMDCLIENT_POOL pool);
+
+    PIMDCLIENT_CONN imdclient_pool_conn(PIMDCLIENT_POOL pool, int index);
+
+    // Connection with fewest outstanding requests.
+    PIMDCLIENT_CONN imdclient_pool_get(PIMDCLIENT_POOL pool);
+
+    // Like imdclient_complete() for all connections in pool, waiting for
+    // responses on any of them.
+    int imdclient_pool_complete(PIMDCLIENT_POOL pool, int min_complete);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_IMDCLIENT_
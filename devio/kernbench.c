@@ -0,0 +1,399 @@
+/*
+Micro-benchmarks for devio data processing kernels.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "devio.h"
+#include "byteswap.h"
+#include "gf256.h"
+#include "lz.h"
+#include "crc32c.h"
+
+#define DEF_BENCH_SIZE      (16 << 20)
+#define DEF_BENCH_SECONDS   1.0
+
+static double
+now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+fill_random(unsigned char *data, size_t size)
+{
+    uint32_t x = 2463534242U;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = (unsigned char)x;
+    }
+}
+
+// Data with repeated fragments, compresses to roughly half its size
+static void
+fill_compressible(unsigned char *data, size_t size)
+{
+    uint32_t x = 88675123U;
+    size_t i = 0;
+
+    fill_random(data, size < 256 ? size : 256);
+
+    for (i = 256; i < size;)
+    {
+        size_t len;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        len = 16 + (x & 63);
+        if (len > size - i)
+            len = size - i;
+
+        if (x & 0x80000000U)
+        {
+            memcpy(data + i, data + i - 1 - ((x >> 8) & 0xFFF) % i, len);
+            i += len;
+        }
+        else
+            for (len += i; i < len; i++)
+            {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                data[i] = (unsigned char)x;
+            }
+    }
+}
+
+static void
+print_rate(const char *kernel, const char *impl, size_t size,
+    double bytes, double seconds)
+{
+    printf("%-10s %-10s %5u%s%10.2f GB/s\n",
+        kernel, impl,
+        (unsigned int)(size >= (1 << 20) ? size >> 20 : size >> 10),
+        size >= (1 << 20) ? " MB " : " KB ",
+        bytes / seconds / 1e9);
+}
+
+static int
+bench_byteswap(unsigned char *data, unsigned char *ref, size_t size,
+    double min_seconds)
+{
+    const char *name;
+    byteswap16_proc proc;
+    int i;
+
+    for (i = 0; byteswap16_get_impl(i, &name, &proc); i++)
+    {
+        double start, elapsed;
+        double bytes = 0;
+
+        // Verify against plain byte-by-byte swap, including an odd tail
+        memcpy(data, ref, size);
+        proc(data + 1, size - 2);
+        {
+            size_t j;
+            for (j = 1; j + 1 < size - 1; j += 2)
+                if (data[j] != ref[j + 1] || data[j + 1] != ref[j])
+                {
+                    fprintf(stderr, "byteswap16 %s: mismatch at " SIZ_FMT ".\n",
+                        name, j);
+                    return 0;
+                }
+        }
+
+        start = now_seconds();
+        do
+        {
+            proc(data, size);
+            bytes += size;
+            elapsed = now_seconds() - start;
+        } while (elapsed < min_seconds);
+
+        print_rate("byteswap16", name, size, bytes, elapsed);
+    }
+
+    return 1;
+}
+
+static int
+bench_gf256(unsigned char *data, unsigned char *ref, size_t size,
+    double min_seconds)
+{
+    static const unsigned char coefs[] = { 0, 1, 2, 0x57, 0x8E, 0xFF };
+    const char *name;
+    gf256_muladd_proc proc;
+    int i;
+
+    for (i = 0; gf256_get_impl(i, &name, &proc); i++)
+    {
+        double start, elapsed;
+        double bytes = 0;
+        size_t c;
+
+        // Verify against table multiplication, with unaligned odd sizes
+        for (c = 0; c < sizeof(coefs); c++)
+        {
+            size_t len = size - 3;
+            size_t j;
+
+            memcpy(data, ref + 1, len);
+            proc(data, ref + 2, coefs[c], len);
+
+            for (j = 0; j < len; j++)
+                if (data[j] != (ref[j + 1] ^ gf256_mul(coefs[c], ref[j + 2])))
+                {
+                    fprintf(stderr, "gf256_muladd %s: mismatch at " SIZ_FMT
+                        " for coefficient %i.\n", name, j, coefs[c]);
+                    return 0;
+                }
+        }
+
+        start = now_seconds();
+        do
+        {
+            proc(data, ref, 0x8E, size);
+            bytes += size;
+            elapsed = now_seconds() - start;
+        } while (elapsed < min_seconds);
+
+        print_rate("gf256", name, size, bytes, elapsed);
+    }
+
+    return 1;
+}
+
+static int
+bench_crc32c(unsigned char *data, unsigned char *ref, size_t size,
+    double min_seconds)
+{
+    const char *name;
+    crc32c_proc proc;
+    crc32c_proc generic;
+    int i;
+
+    if (!crc32c_get_impl(0, &name, &generic))
+        return 0;
+
+    for (i = 0; crc32c_get_impl(i, &name, &proc); i++)
+    {
+        double start, elapsed;
+        double bytes = 0;
+        volatile uint32_t sink = 0;
+
+        // Verify against check value and generic implementation, with
+        // unaligned odd sizes split in two calls
+        if (proc(0, "123456789", 9) != 0xE3069283)
+        {
+            fprintf(stderr, "crc32c %s: wrong check value.\n", name);
+            return 0;
+        }
+
+        if (proc(proc(0, ref + 1, (safeio_size_t)(size / 3)),
+            ref + 1 + size / 3, (safeio_size_t)(size - size / 3 - 2)) !=
+            generic(0, ref + 1, (safeio_size_t)(size - 2)))
+        {
+            fprintf(stderr, "crc32c %s: mismatch.\n", name);
+            return 0;
+        }
+
+        start = now_seconds();
+        do
+        {
+            sink ^= proc(0, ref, (safeio_size_t)size);
+            bytes += size;
+            elapsed = now_seconds() - start;
+        } while (elapsed < min_seconds);
+
+        print_rate("crc32c", name, size, bytes, elapsed);
+    }
+
+    (void)data;
+
+    return 1;
+}
+
+static int
+bench_lz(unsigned char *data, unsigned char *ref, size_t size,
+    double min_seconds)
+{
+    size_t bound = LZ_COMPRESS_BOUND(size);
+    unsigned char *packed = (unsigned char*)malloc(bound);
+    safeio_size_t packed_size;
+    double start, elapsed;
+    double bytes = 0;
+
+    if (packed == NULL)
+    {
+        perror("malloc()");
+        return 0;
+    }
+
+    packed_size = lz_compress(ref, (safeio_size_t)size, packed,
+        (safeio_size_t)bound);
+
+    if (packed_size == 0 ||
+        lz_decompress(packed, packed_size, data, (safeio_size_t)size) !=
+        (safeio_ssize_t)size || memcmp(data, ref, size) != 0)
+    {
+        fprintf(stderr, "lz: round trip mismatch.\n");
+        free(packed);
+        return 0;
+    }
+
+    start = now_seconds();
+    do
+    {
+        lz_compress(ref, (safeio_size_t)size, packed, (safeio_size_t)bound);
+        bytes += size;
+        elapsed = now_seconds() - start;
+    } while (elapsed < min_seconds);
+
+    print_rate("lz", "compress", size, bytes, elapsed);
+
+    bytes = 0;
+    start = now_seconds();
+    do
+    {
+        lz_decompress(packed, packed_size, data, (safeio_size_t)size);
+        bytes += size;
+        elapsed = now_seconds() - start;
+    } while (elapsed < min_seconds);
+
+    print_rate("lz", "decompress", size, bytes, elapsed);
+
+    printf("%-10s %-10s %5u%s%10.1f %%\n", "lz", "ratio",
+        (unsigned int)(size >= (1 << 20) ? size >> 20 : size >> 10),
+        size >= (1 << 20) ? " MB " : " KB ",
+        100.0 * packed_size / size);
+
+    free(packed);
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 4 << 10, 64 << 10, 1 << 20, 0 };
+    size_t max_size = DEF_BENCH_SIZE;
+    double min_seconds = DEF_BENCH_SECONDS;
+    unsigned char *data;
+    unsigned char *ref;
+    size_t s;
+
+    if (argc > 3 || (argc > 1 && argv[1][0] == '-'))
+    {
+        fprintf(stderr,
+            "kernbench - devio data kernel benchmark ver " DEVIO_VERSION "\n"
+            "\n"
+            "Usage:\n"
+            "kernbench [megabytes] [seconds]\n"
+            "\n"
+            "megabytes   Largest buffer size to test. Default is %i.\n"
+            "seconds     Minimum time to run each test. Default is %.1f.\n",
+            DEF_BENCH_SIZE >> 20, DEF_BENCH_SECONDS);
+        return -1;
+    }
+
+    if (argc > 1)
+        max_size = (size_t)strtoul(argv[1], NULL, 0) << 20;
+
+    if (argc > 2)
+        min_seconds = strtod(argv[2], NULL);
+
+    if (max_size < (1 << 20))
+        max_size = 1 << 20;
+
+    data = (unsigned char*)malloc(max_size);
+    ref = (unsigned char*)malloc(max_size);
+    if (data == NULL || ref == NULL)
+    {
+        perror("malloc()");
+        return 2;
+    }
+
+    fill_random(ref, max_size);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        size_t size = sizes[s] != 0 ? sizes[s] : max_size;
+
+        if (!bench_byteswap(data, ref, size, min_seconds))
+            return 1;
+    }
+
+    gf256_init();
+
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        size_t size = sizes[s] != 0 ? sizes[s] : max_size;
+
+        if (!bench_gf256(data, ref, size, min_seconds))
+            return 1;
+    }
+
+    crc32c_init();
+
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        size_t size = sizes[s] != 0 ? sizes[s] : max_size;
+
+        if (!bench_crc32c(data, ref, size, min_seconds))
+            return 1;
+    }
+
+    fill_compressible(ref, max_size);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        size_t size = sizes[s] != 0 ? sizes[s] : max_size;
+
+        if (!bench_lz(data, ref, size, min_seconds))
+            return 1;
+    }
+
+    free(data);
+    free(ref);
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+/*
+Fast LZ compression for devio payloads.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "devio.h"
+#include "lz.h"
+
+// LZ4 block format: a sequence is a token byte with literal count in high
+// and match length - 4 in low nibble, where 15 means more length bytes
+// follow, then literals, then a 16 bit little-endian match offset and
+// extra match length bytes. Last sequence has literals only. Last match
+// must start at least 12 bytes before end and last 5 bytes are always
+// literals.
+
+#define LZ_HASH_LOG         12
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5
+#define LZ_MF_LIMIT         12
+#define LZ_MAX_OFFSET       65535
+
+static uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static uint32_t
+lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static uint8_t *
+put_length(uint8_t *op, safeio_size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+
+    *op++ = (uint8_t)len;
+
+    return op;
+}
+
+safeio_size_t
+lz_compress(const void *src, safeio_size_t size, void *dst,
+    safeio_size_t dst_size)
+{
+    uint32_t table[1 << LZ_HASH_LOG];
+    const uint8_t *base = (const uint8_t*)src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + size;
+    uint8_t *op = (uint8_t*)dst;
+    uint8_t *oend = op + dst_size;
+    safeio_size_t lit;
+
+    if (size > LZ_MF_LIMIT)
+    {
+        const uint8_t *mflimit = end - LZ_MF_LIMIT;
+        const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+        unsigned int misses = 0;
+
+        memset(table, 0, sizeof(table));
+
+        while (ip < mflimit)
+        {
+            uint32_t seq = read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = base + table[h];
+            const uint8_t *m;
+            safeio_size_t offset;
+            safeio_size_t mlen;
+            uint8_t *token;
+
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq)
+            {
+                // Skip faster through data that does not compress
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            misses = 0;
+
+            // Extend match backwards into pending literals
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                --ip;
+                --ref;
+            }
+
+            offset = (safeio_size_t)(ip - ref);
+
+            for (m = ip + LZ_MIN_MATCH, ref += LZ_MIN_MATCH;
+                m < matchlimit && *m == *ref; m++, ref++);
+
+            lit = (safeio_size_t)(ip - anchor);
+            mlen = (safeio_size_t)(m - ip) - LZ_MIN_MATCH;
+
+            if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend)
+                return 0;
+
+            token = op++;
+
+            if (lit >= 15)
+            {
+                *token = 15 << 4;
+                op = put_length(op, lit - 15);
+            }
+            else
+                *token = (uint8_t)(lit << 4);
+
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            if (mlen >= 15)
+            {
+                *token |= 15;
+                op = put_length(op, mlen - 15);
+            }
+            else
+                *token |= (uint8_t)mlen;
+
+            ip = m;
+            anchor = ip;
+
+            // Index a position within the match, helps with repetitive data
+            if (ip - 2 > base)
+                table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    lit = (safeio_size_t)(end - anchor);
+
+    if (op + 1 + lit + lit / 255 + 1 > oend)
+        return 0;
+
+    if (lit >= 15)
+    {
+        *op++ = 15 << 4;
+        op = put_length(op, lit - 15);
+    }
+    else
+        *op++ = (uint8_t)(lit << 4);
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return (safeio_size_t)(op - (uint8_t*)dst);
+}
+
+safeio_ssize_t
+lz_decompress(const void *src, safeio_size_t size, void *dst,
+    safeio_size_t dst_size)
+{
+    const uint8_t *ip = (const uint8_t*)src;
+    const uint8_t *iend = ip + size;
+    uint8_t *op = (uint8_t*)dst;
+    uint8_t *oend = op + dst_size;
+
+    while (ip < iend)
+    {
+        unsigned int token = *ip++;
+        safeio_size_t lit = token >> 4;
+        safeio_size_t mlen = token & 15;
+        safeio_size_t offset;
+        const uint8_t *match;
+
+        if (lit == 15)
+        {
+            unsigned int b;
+
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+
+        if (lit > (safeio_size_t)(iend - ip) ||
+            lit > (safeio_size_t)(oend - op))
+            return -1;
+
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+
+        offset = ip[0] | ((safeio_size_t)ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (safeio_size_t)(op - (uint8_t*)dst))
+            return -1;
+
+        if (mlen == 15)
+        {
+            unsigned int b;
+
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+
+        mlen += LZ_MIN_MATCH;
+
+        if (mlen > (safeio_size_t)(oend - op))
+            return -1;
+
+        match = op - offset;
+
+        if (offset >= mlen)
+        {
+            memcpy(op, match, mlen);
+            op += mlen;
+        }
+        else
+        {
+            // Overlapping copy repeats a pattern, copy in growing pieces
+            while (mlen > 0)
+            {
+                safeio_size_t n = (safeio_size_t)(op - match);
+
+                if (n > mlen)
+                    n = mlen;
+
+                memcpy(op, match, n);
+                op += n;
+                mlen -= n;
+            }
+        }
+    }
+
+    return (safeio_ssize_t)(op - (uint8_t*)dst);
+}
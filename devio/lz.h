@@ -0,0 +1,57 @@
+/*
+Fast LZ compression for devio payloads.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_LZ_
+#define _INC_LZ_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Compressed data uses the LZ4 block format, so that other
+    // implementations of proxy clients can use any LZ4 library.
+
+    // Largest compressed size for size bytes of input.
+#define LZ_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+    // Compresses size bytes at src to dst, which has room for dst_size
+    // bytes. Returns compressed size, or zero if data does not fit in
+    // dst_size bytes.
+    safeio_size_t lz_compress(const void *src, safeio_size_t size,
+        void *dst, safeio_size_t dst_size);
+
+    // Decompresses size bytes at src to dst. Returns decompressed size, or
+    // -1 if data is invalid or would decompress to more than dst_size
+    // bytes.
+    safeio_ssize_t lz_decompress(const void *src, safeio_size_t size,
+        void *dst, safeio_size_t dst_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_LZ_
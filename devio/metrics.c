@@ -0,0 +1,840 @@
+/*
+Request metrics for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "histogram.h"
+#include "metrics.h"
+
+#define DEF_INTERVAL            10
+
+// --metrics[=file][,port=n][,unix=path][,interval=seconds]
+//
+// Each thread that handles requests gets a shard with its own counters and
+// histograms, created on first request and linked in a list. Exporters
+// merge all shards. Shards are read without locking while requests run, so
+// series in one export can be a few requests apart.
+//
+// With file, Prometheus text is written to file.tmp and renamed to file
+// every interval seconds and at close, suitable for the node_exporter
+// textfile collector. With port or unix, the same text is served to each
+// connection, with HTTP headers when the client sends an HTTP request.
+// SIGUSR1 prints a summary to stdout. Exporting runs on a separate thread,
+// on Windows only the file is written at close.
+
+enum
+{
+    MetricsOpRead,
+    MetricsOpReadSparse,
+    MetricsOpWrite,
+    MetricsOpUnmap,
+    MetricsOpZero,
+    MetricsOpInfo,
+    MetricsOpOther,
+    METRICS_OPS
+};
+
+static const char *metrics_op_names[] = {
+    "read", "read_sparse", "write", "unmap", "zero", "info", "other"
+};
+
+static const char *metrics_phase_names[] = {
+    "receive", "backend", "send", "total"
+};
+
+typedef struct _METRICS_SHARD
+{
+    struct _METRICS_SHARD *next;
+
+    // Request in progress on this thread
+    int op;
+    uint64_t start;
+    uint64_t backend_start;
+    uint64_t backend_end;
+    uint64_t bytes;
+    ULONGLONG errorno;
+
+    uint64_t requests[METRICS_OPS];
+    uint64_t errors[METRICS_OPS];
+    uint64_t transferred[METRICS_OPS];
+    HISTOGRAM latency[METRICS_OPS][METRICS_PHASES];
+} METRICS_SHARD, *PMETRICS_SHARD;
+
+int metrics_enabled = 0;
+
+static PMETRICS_SHARD shards = NULL;
+static char metrics_file[260] = "";
+
+#ifdef _MSC_VER
+static __declspec(thread) PMETRICS_SHARD current_shard = NULL;
+#else
+static __thread PMETRICS_SHARD current_shard = NULL;
+#endif
+
+#ifdef _WIN32
+
+#define metrics_lock()
+#define metrics_unlock()
+
+#else
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t export_thread;
+static int export_running = 0;
+static int wake_pipe[2] = { -1, -1 };
+static SOCKET listen_sd = INVALID_SOCKET;
+static char listen_path[108] = "";
+static int interval = DEF_INTERVAL;
+
+#define metrics_lock()          pthread_mutex_lock(&lock)
+#define metrics_unlock()        pthread_mutex_unlock(&lock)
+
+#endif
+
+static uint64_t
+metrics_time_nsec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000000 /
+        frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int
+metrics_op(ULONGLONG request_code)
+{
+    switch (request_code)
+    {
+    case IMDPROXY_REQ_READ:
+        return MetricsOpRead;
+    case IMDPROXY_REQ_READ_SPARSE:
+        return MetricsOpReadSparse;
+    case IMDPROXY_REQ_WRITE:
+        return MetricsOpWrite;
+    case IMDPROXY_REQ_UNMAP:
+        return MetricsOpUnmap;
+    case IMDPROXY_REQ_ZERO:
+        return MetricsOpZero;
+    case IMDPROXY_REQ_INFO:
+        return MetricsOpInfo;
+    default:
+        return MetricsOpOther;
+    }
+}
+
+static PMETRICS_SHARD
+metrics_shard()
+{
+    PMETRICS_SHARD shard = current_shard;
+
+    if (shard != NULL)
+        return shard;
+
+    shard = (PMETRICS_SHARD)calloc(1, sizeof(METRICS_SHARD));
+
+    if (shard == NULL)
+        return NULL;
+
+    metrics_lock();
+    shard->next = shards;
+    shards = shard;
+    metrics_unlock();
+
+    current_shard = shard;
+
+    return shard;
+}
+
+void
+metrics_request_start(ULONGLONG request_code)
+{
+    PMETRICS_SHARD shard;
+
+    if (!metrics_enabled || (shard = metrics_shard()) == NULL)
+        return;
+
+    shard->op = metrics_op(request_code);
+    shard->start = metrics_time_nsec();
+    shard->backend_start = 0;
+    shard->bytes = 0;
+    shard->errorno = 0;
+}
+
+void
+metrics_backend_start()
+{
+    PMETRICS_SHARD shard = current_shard;
+
+    if (!metrics_enabled || shard == NULL)
+        return;
+
+    shard->backend_start = metrics_time_nsec();
+}
+
+void
+metrics_backend_end(uint64_t bytes, ULONGLONG errorno)
+{
+    PMETRICS_SHARD shard = current_shard;
+
+    if (!metrics_enabled || shard == NULL)
+        return;
+
+    shard->backend_end = metrics_time_nsec();
+    shard->bytes = bytes;
+    shard->errorno = errorno;
+}
+
+void
+metrics_request_end()
+{
+    PMETRICS_SHARD shard = current_shard;
+    HISTOGRAM *latency;
+    uint64_t end;
+
+    if (!metrics_enabled || shard == NULL)
+        return;
+
+    end = metrics_time_nsec();
+    latency = shard->latency[shard->op];
+
+    ++shard->requests[shard->op];
+    shard->transferred[shard->op] += shard->bytes;
+
+    if (shard->errorno != 0)
+        ++shard->errors[shard->op];
+
+    if (shard->backend_start != 0)
+    {
+        histogram_add(latency + MetricsReceive,
+            shard->backend_start - shard->start);
+        histogram_add(latency + MetricsBackend,
+            shard->backend_end - shard->backend_start);
+        histogram_add(latency + MetricsSend, end - shard->backend_end);
+    }
+
+    histogram_add(latency + MetricsTotal, end - shard->start);
+}
+
+void
+metrics_request_record(ULONGLONG request_code, uint64_t start,
+    uint64_t backend_start, uint64_t backend_end, uint64_t bytes,
+    ULONGLONG errorno)
+{
+    PMETRICS_SHARD shard;
+
+    if (!metrics_enabled || (shard = metrics_shard()) == NULL)
+        return;
+
+    shard->op = metrics_op(request_code);
+    shard->start = start;
+    shard->backend_start = backend_start;
+    shard->backend_end = backend_end;
+    shard->bytes = bytes;
+    shard->errorno = errorno;
+
+    metrics_request_end();
+}
+
+// Merges all shards into one, allocated by caller.
+static void
+metrics_collect(PMETRICS_SHARD total)
+{
+    PMETRICS_SHARD shard;
+    int op;
+    int phase;
+
+    memset(total, 0, sizeof(*total));
+
+    metrics_lock();
+
+    for (shard = shards; shard != NULL; shard = shard->next)
+        for (op = 0; op < METRICS_OPS; op++)
+        {
+            total->requests[op] += shard->requests[op];
+            total->errors[op] += shard->errors[op];
+            total->transferred[op] += shard->transferred[op];
+
+            for (phase = 0; phase < METRICS_PHASES; phase++)
+                histogram_merge(&total->latency[op][phase],
+                    &shard->latency[op][phase]);
+        }
+
+    metrics_unlock();
+}
+
+void
+metrics_dump(FILE *stream)
+{
+    PMETRICS_SHARD total = (PMETRICS_SHARD)malloc(sizeof(METRICS_SHARD));
+    int op;
+    int phase;
+
+    if (total == NULL)
+        return;
+
+    metrics_collect(total);
+
+    fprintf(stream, "%-12s %12s %8s %16s\n",
+        "Request", "Count", "Errors", "Bytes");
+
+    for (op = 0; op < METRICS_OPS; op++)
+        if (total->requests[op] != 0)
+            fprintf(stream, "%-12s %12" PRIu64 " %8" PRIu64 " %16" PRIu64 "\n",
+                metrics_op_names[op], total->requests[op], total->errors[op],
+                total->transferred[op]);
+
+    fprintf(stream, "%-12s %-8s %10s %10s %10s %10s %10s\n",
+        "Request", "Phase", "avg usec", "p50 usec", "p99 usec", "p99.9 usec",
+        "max usec");
+
+    for (op = 0; op < METRICS_OPS; op++)
+        for (phase = 0; phase < METRICS_PHASES; phase++)
+        {
+            HISTOGRAM *latency = &total->latency[op][phase];
+
+            if (latency->count == 0)
+                continue;
+
+            fprintf(stream, "%-12s %-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                metrics_op_names[op], metrics_phase_names[phase],
+                histogram_mean(latency) / 1e3,
+                histogram_percentile(latency, 50) / 1e3,
+                histogram_percentile(latency, 99) / 1e3,
+                histogram_percentile(latency, 99.9) / 1e3,
+                latency->max / 1e3);
+        }
+
+    fflush(stream);
+
+    free(total);
+}
+
+// Bucket bounds in 1-2-5 steps from 1 usec to 10 s, in nanoseconds
+static const uint64_t metrics_bounds[] = {
+    1000, 2000, 5000,
+    10000, 20000, 50000,
+    100000, 200000, 500000,
+    1000000, 2000000, 5000000,
+    10000000, 20000000, 50000000,
+    100000000, 200000000, 500000000,
+    1000000000, 2000000000, 5000000000ULL,
+    10000000000ULL
+};
+
+void
+metrics_write_prometheus(FILE *stream)
+{
+    PMETRICS_SHARD total = (PMETRICS_SHARD)malloc(sizeof(METRICS_SHARD));
+    int op;
+    int phase;
+
+    if (total == NULL)
+        return;
+
+    metrics_collect(total);
+
+    fputs("# HELP devio_requests_total Requests handled.\n"
+        "# TYPE devio_requests_total counter\n", stream);
+
+    for (op = 0; op < METRICS_OPS; op++)
+        fprintf(stream, "devio_requests_total{op=\"%s\"} %" PRIu64 "\n",
+            metrics_op_names[op], total->requests[op]);
+
+    fputs("# HELP devio_request_errors_total Requests that failed.\n"
+        "# TYPE devio_request_errors_total counter\n", stream);
+
+    for (op = 0; op < METRICS_OPS; op++)
+        fprintf(stream, "devio_request_errors_total{op=\"%s\"} %" PRIu64 "\n",
+            metrics_op_names[op], total->errors[op]);
+
+    fputs("# HELP devio_request_bytes_total Image data bytes transferred.\n"
+        "# TYPE devio_request_bytes_total counter\n", stream);
+
+    for (op = 0; op < METRICS_OPS; op++)
+        fprintf(stream, "devio_request_bytes_total{op=\"%s\"} %" PRIu64 "\n",
+            metrics_op_names[op], total->transferred[op]);
+
+    fputs("# HELP devio_request_duration_seconds Request latency by phase.\n"
+        "# TYPE devio_request_duration_seconds histogram\n", stream);
+
+    for (op = 0; op < METRICS_OPS; op++)
+        for (phase = 0; phase < METRICS_PHASES; phase++)
+        {
+            HISTOGRAM *latency = &total->latency[op][phase];
+            uint64_t count = 0;
+            size_t b;
+            int i = 0;
+
+            if (latency->count == 0)
+                continue;
+
+            // Buckets of fine histogram that end at or below each bound.
+            // Bound is an approximation within histogram resolution.
+            for (b = 0; b < sizeof(metrics_bounds) / sizeof(*metrics_bounds);
+                b++)
+            {
+                for (; i + 1 < HISTOGRAM_BUCKETS &&
+                    histogram_bucket_value(i + 1) <= metrics_bounds[b] + 1;
+                    i++)
+                    count += latency->buckets[i];
+
+                fprintf(stream, "devio_request_duration_seconds_bucket{"
+                    "op=\"%s\",phase=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                    metrics_op_names[op], metrics_phase_names[phase],
+                    metrics_bounds[b] / 1e9, count);
+            }
+
+            fprintf(stream, "devio_request_duration_seconds_bucket{"
+                "op=\"%s\",phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+                "devio_request_duration_seconds_sum{"
+                "op=\"%s\",phase=\"%s\"} %.9f\n"
+                "devio_request_duration_seconds_count{"
+                "op=\"%s\",phase=\"%s\"} %" PRIu64 "\n",
+                metrics_op_names[op], metrics_phase_names[phase],
+                latency->count,
+                metrics_op_names[op], metrics_phase_names[phase],
+                latency->sum / 1e9,
+                metrics_op_names[op], metrics_phase_names[phase],
+                latency->count);
+        }
+
+    free(total);
+}
+
+// Writes to a temporary file renamed over the old one, so that readers
+// never see a partial file.
+static void
+metrics_write_file()
+{
+    char tmp_file[sizeof(metrics_file) + 4];
+    FILE *stream;
+
+    if (metrics_file[0] == 0)
+        return;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", metrics_file);
+
+    stream = fopen(tmp_file, "w");
+
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Metrics: Cannot write '%s': %s\n", tmp_file,
+            strerror(errno));
+        return;
+    }
+
+    metrics_write_prometheus(stream);
+
+    if (fclose(stream) != 0)
+    {
+        remove(tmp_file);
+        return;
+    }
+
+#ifdef _WIN32
+    remove(metrics_file);
+#endif
+
+    if (rename(tmp_file, metrics_file) != 0)
+        fprintf(stderr, "Metrics: Cannot write '%s': %s\n", metrics_file,
+            strerror(errno));
+}
+
+#ifndef _WIN32
+
+static void
+metrics_signal(int sig)
+{
+    char c = (char)sig;
+    int saved_errno = errno;
+
+    if (write(wake_pipe[1], &c, 1) < 0)
+    {
+        // Pipe full, a dump is already pending
+    }
+
+    errno = saved_errno;
+}
+
+static void
+metrics_serve(SOCKET sd)
+{
+    struct pollfd pfd;
+    char request[1024];
+    ssize_t len = 0;
+    FILE *stream;
+
+    // Plain connections that send nothing get metrics without headers
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 200) == 1)
+        len = recv(sd, request, sizeof(request) - 1, 0);
+
+    stream = fdopen(sd, "w");
+
+    if (stream == NULL)
+    {
+        closesocket(sd);
+        return;
+    }
+
+    if (len >= 4 && memcmp(request, "GET ", 4) == 0)
+        fputs("HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Connection: close\r\n"
+            "\r\n", stream);
+
+    metrics_write_prometheus(stream);
+
+    fclose(stream);
+}
+
+static void *
+metrics_export_thread(void *arg)
+{
+    uint64_t next_write = metrics_time_nsec() +
+        (uint64_t)interval * 1000000000;
+
+    for (;;)
+    {
+        struct pollfd fds[2];
+        int count = 1;
+        uint64_t now = metrics_time_nsec();
+        int timeout = -1;
+
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+
+        if (listen_sd != INVALID_SOCKET)
+        {
+            fds[1].fd = listen_sd;
+            fds[1].events = POLLIN;
+            ++count;
+        }
+
+        if (metrics_file[0] != 0)
+            timeout = next_write > now ?
+            (int)((next_write - now) / 1000000) : 0;
+
+        if (poll(fds, count, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            char c;
+
+            if (read(wake_pipe[0], &c, 1) != 1 || c == 0)
+                break;
+
+            puts("Metrics:");
+            metrics_dump(stdout);
+        }
+
+        if (count > 1 && (fds[1].revents & POLLIN))
+        {
+            SOCKET sd = accept(listen_sd, NULL, NULL);
+
+            if (sd != INVALID_SOCKET)
+                metrics_serve(sd);
+        }
+
+        if (metrics_file[0] != 0 && metrics_time_nsec() >= next_write)
+        {
+            metrics_write_file();
+            next_write = metrics_time_nsec() +
+                (uint64_t)interval * 1000000000;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+metrics_listen(const char *port_spec, const char *path)
+{
+    if (path[0] != 0)
+    {
+        struct sockaddr_un saddr = { 0 };
+
+        if (strlen(path) >= sizeof(saddr.sun_path))
+        {
+            fprintf(stderr, "Metrics: Socket path too long: '%s'\n", path);
+            return 0;
+        }
+
+        listen_sd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (listen_sd == INVALID_SOCKET)
+        {
+            fprintf(stderr, "Metrics: socket() failed: %s\n",
+                strerror(errno));
+            return 0;
+        }
+
+        saddr.sun_family = AF_UNIX;
+        strcpy(saddr.sun_path, path);
+
+        unlink(path);
+
+        if (bind(listen_sd, (struct sockaddr*)&saddr, sizeof saddr) == -1 ||
+            listen(listen_sd, 4) == -1)
+        {
+            fprintf(stderr, "Metrics: Cannot listen on '%s': %s\n", path,
+                strerror(errno));
+            closesocket(listen_sd);
+            listen_sd = INVALID_SOCKET;
+            return 0;
+        }
+
+        strcpy(listen_path, path);
+
+        printf("Metrics served on socket '%s'.\n", path);
+    }
+    else if (port_spec[0] != 0)
+    {
+        struct sockaddr_in saddr = { 0 };
+        u_short port = (u_short)strtoul(port_spec, NULL, 0);
+        int reuse = 1;
+
+        listen_sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        if (listen_sd == INVALID_SOCKET)
+        {
+            fprintf(stderr, "Metrics: socket() failed: %s\n",
+                strerror(errno));
+            return 0;
+        }
+
+        // Scrapes are short-lived connections
+        setsockopt(listen_sd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse,
+            sizeof reuse);
+
+        saddr.sin_family = AF_INET;
+        saddr.sin_addr.s_addr = INADDR_ANY;
+        saddr.sin_port = htons(port);
+
+        if (port == 0 ||
+            bind(listen_sd, (struct sockaddr*)&saddr, sizeof saddr) == -1 ||
+            listen(listen_sd, 4) == -1)
+        {
+            fprintf(stderr, "Metrics: Cannot listen on port '%s': %s\n",
+                port_spec, strerror(errno));
+            closesocket(listen_sd);
+            listen_sd = INVALID_SOCKET;
+            return 0;
+        }
+
+        printf("Metrics served on port %u.\n", (unsigned int)port);
+    }
+
+    return 1;
+}
+
+#endif
+
+int
+metrics_init(const char *spec)
+{
+    char options[256];
+    const char *opts = spec != NULL ? strchr(spec, ',') : NULL;
+    size_t file_len;
+
+    if (spec == NULL)
+        spec = "";
+
+    file_len = opts != NULL ? (size_t)(opts - spec) : strlen(spec);
+
+    if (file_len >= sizeof(metrics_file) - 4)
+    {
+        fprintf(stderr, "Invalid metrics file name.\n");
+        return 0;
+    }
+
+    memcpy(metrics_file, spec, file_len);
+    metrics_file[file_len] = 0;
+
+    options[0] = 0;
+    if (opts != NULL)
+    {
+        strncpy(options, opts + 1, sizeof(options) - 1);
+        options[sizeof(options) - 1] = 0;
+    }
+
+#ifdef _WIN32
+    if (backend_get_option(options, "port", NULL, 0) ||
+        backend_get_option(options, "unix", NULL, 0) ||
+        backend_get_option(options, "interval", NULL, 0))
+        fprintf(stderr, "Metrics: Only file written at close supported on "
+            "Windows.\n");
+#else
+    {
+        char value[64];
+        char port_spec[16] = "";
+        char path[108] = "";
+        struct sigaction action = { 0 };
+
+        if (backend_get_option(options, "interval", value, sizeof(value)) &&
+            (interval = atoi(value)) <= 0)
+        {
+            fprintf(stderr, "Invalid metrics interval: '%s'\n", value);
+            return 0;
+        }
+
+        backend_get_option(options, "port", port_spec, sizeof(port_spec));
+        backend_get_option(options, "unix", path, sizeof(path));
+
+        if (!metrics_listen(port_spec, path))
+            return 0;
+
+        if (pipe(wake_pipe) == -1)
+        {
+            fprintf(stderr, "Metrics: pipe() failed: %s\n", strerror(errno));
+            return 0;
+        }
+
+        fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+        if (pthread_create(&export_thread, NULL, metrics_export_thread,
+            NULL) != 0)
+        {
+            fprintf(stderr, "Metrics: Cannot start export thread.\n");
+            return 0;
+        }
+
+        export_running = 1;
+
+        // Restart interrupted calls so request handling is not disturbed
+        action.sa_handler = metrics_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+    }
+#endif
+
+    metrics_enabled = 1;
+
+    if (metrics_file[0] != 0)
+        printf("Metrics written to '%s'.\n", metrics_file);
+
+    return 1;
+}
+
+void
+metrics_close()
+{
+    PMETRICS_SHARD shard;
+
+    if (!metrics_enabled)
+        return;
+
+#ifndef _WIN32
+    if (export_running)
+    {
+        char c = 0;
+
+        signal(SIGUSR1, SIG_DFL);
+
+        if (write(wake_pipe[1], &c, 1) == 1)
+            pthread_join(export_thread, NULL);
+
+        export_running = 0;
+    }
+
+    if (listen_sd != INVALID_SOCKET)
+    {
+        closesocket(listen_sd);
+        listen_sd = INVALID_SOCKET;
+
+        if (listen_path[0] != 0)
+            unlink(listen_path);
+    }
+#endif
+
+    metrics_write_file();
+
+    puts("Metrics:");
+    metrics_dump(stdout);
+
+    metrics_enabled = 0;
+
+    metrics_lock();
+
+    while (shards != NULL)
+    {
+        shard = shards;
+        shards = shard->next;
+        free(shard);
+    }
+
+    metrics_unlock();
+
+    current_shard = NULL;
+}
@@ -0,0 +1,92 @@
+/*
+Request metrics for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_METRICS_
+#define _INC_METRICS_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Request counters and latency histograms, kept per thread so that
+    // request handling never contends on them. Latency is split in phases:
+    //
+    // receive  From request code received until backend I/O starts, that
+    //          is reading rest of request and any write payload.
+    // backend  Image I/O through translation layers and backends.
+    // send     Sending response and payload, including compression and
+    //          checksums.
+    // total    Request code received until response flushed.
+    //
+    // Requests that do no image I/O, such as INFO, only count in total.
+
+    enum
+    {
+        MetricsReceive,
+        MetricsBackend,
+        MetricsSend,
+        MetricsTotal,
+        METRICS_PHASES
+    };
+
+    extern int metrics_enabled;
+
+    // Starts collecting according to [file][,port=n][,unix=path]
+    // [,interval=seconds]. Spec can be NULL or empty to only collect and
+    // dump on SIGUSR1 and at close. Returns zero on failure.
+    int metrics_init(const char *spec);
+
+    // Called by request handlers, do nothing unless metrics_enabled.
+    void metrics_request_start(ULONGLONG request_code);
+
+    void metrics_backend_start();
+
+    void metrics_backend_end(uint64_t bytes, ULONGLONG errorno);
+
+    void metrics_request_end();
+
+    // Records a request handled together with others, where phases of
+    // several requests overlap. Times are from backend_time_nsec() and the
+    // request ends now.
+    void metrics_request_record(ULONGLONG request_code, uint64_t start,
+        uint64_t backend_start, uint64_t backend_end, uint64_t bytes,
+        ULONGLONG errorno);
+
+    // Human readable summary.
+    void metrics_dump(FILE *stream);
+
+    // Prometheus text exposition format.
+    void metrics_write_prometheus(FILE *stream);
+
+    void metrics_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_METRICS_
@@ -0,0 +1,1314 @@
+/*
+Mirrored (RAID-1) backend for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+#include "backend.h"
+#include "parallel.h"
+
+#define DEF_REGION_SIZE         (1 << 20)
+
+#define MIRROR_LATENCY_SAMPLES  256
+#define MIRROR_HEDGE_INTERVAL   64
+#define MIRROR_FLUSH_WRITES     4096
+
+// mirror[,read=balance|first|roundrobin][,hedge=percentile]
+//       [,bitmap=file][,region=size][,resync=full]:member1:::member2[...]
+//
+// Writes go to all members in parallel. Reads go to one member, selected
+// by read policy among members that are in sync for the range read.
+//
+// Each member has a bitmap with one bit per region, set when the member
+// may be out of date for that region. Bits are set before writes start and
+// stay set for members where a write failed. A background thread copies
+// such regions from an in-sync member. With a bitmap file, bits are saved
+// before writes to a clean region start and cleared lazily, so that regions
+// with writes in progress at a crash are resynchronized on next start.
+//
+// With hedge=percentile, a read that takes longer than that percentile of
+// recent read latencies is issued to a second member as well, and the first
+// one to complete is used. Hedged reads run on per-member threads with
+// private buffers so that a late completion never touches caller memory.
+
+enum
+{
+    MIRROR_READ_BALANCE,
+    MIRROR_READ_FIRST,
+    MIRROR_READ_ROUNDROBIN
+};
+
+typedef struct _MIRROR_MEMBER
+{
+    DEVIO_BACKEND backend;
+    unsigned char *stale;
+    unsigned char *dirty;
+    int failed;
+    int inflight;
+    uint64_t avg_latency;
+
+#ifndef _WIN32
+    pthread_t thread;
+    pthread_cond_t wake;
+    int busy;
+    int pending;
+    int done;
+    int abandoned;
+    char *bounce;
+    safeio_size_t bounce_size;
+    safeio_size_t req_size;
+    off_t_64 req_offset;
+    safeio_ssize_t result;
+    int error;
+#endif
+} MIRROR_MEMBER, *PMIRROR_MEMBER;
+
+typedef struct _MIRROR_SET
+{
+    int count;
+    int read_policy;
+    int hedge_percentile;
+    int next_member;
+    off_t_64 size;
+    off_t_64 region_size;
+    off_t_64 regions;
+    size_t bitmap_bytes;
+    int bitmap_fd;
+    int writes_since_flush;
+    uint32_t latency[MIRROR_LATENCY_SAMPLES];
+    unsigned int latency_count;
+    uint64_t hedge_threshold;
+    uint64_t hedged_reads;
+    off_t_64 stale_regions;
+    char *resync_buf;
+
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_mutex_t region_lock;
+    pthread_cond_t done;
+    pthread_cond_t resync_wake;
+    pthread_t resync_thread;
+    int resync_running;
+    int closing;
+#endif
+
+    MIRROR_MEMBER members[DEVIO_MAX_MEMBERS];
+} MIRROR_SET, *PMIRROR_SET;
+
+#ifdef _WIN32
+#define mirror_lock(set)
+#define mirror_unlock(set)
+#define mirror_region_lock(set)
+#define mirror_region_unlock(set)
+#define mirror_wake_resync(set)
+#else
+#define mirror_lock(set)            pthread_mutex_lock(&(set)->lock)
+#define mirror_unlock(set)          pthread_mutex_unlock(&(set)->lock)
+#define mirror_region_lock(set)     pthread_mutex_lock(&(set)->region_lock)
+#define mirror_region_unlock(set)   pthread_mutex_unlock(&(set)->region_lock)
+#define mirror_wake_resync(set)     pthread_cond_signal(&(set)->resync_wake)
+#endif
+
+#define bit_test(map, n)    ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define bit_set(map, n)     ((map)[(n) >> 3] |= (unsigned char)(1 << ((n) & 7)))
+#define bit_clear(map, n)   ((map)[(n) >> 3] &= (unsigned char)~(1 << ((n) & 7)))
+
+static int
+mirror_range_stale(PMIRROR_SET set, int index, off_t_64 first, off_t_64 last)
+{
+    off_t_64 r;
+
+    for (r = first; r <= last; r++)
+        if (bit_test(set->members[index].stale, r))
+            return 1;
+
+    return 0;
+}
+
+// Called with lock held. Selects an in-sync member for a read of regions
+// first to last, not in exclude mask. Returns -1 if there is none.
+static int
+mirror_choose(PMIRROR_SET set, off_t_64 first, off_t_64 last,
+    uint64_t exclude, int idle_only)
+{
+    int best = -1;
+    int n;
+
+    for (n = 0; n < set->count; n++)
+    {
+        int i = n;
+        PMIRROR_MEMBER member;
+
+        if (set->read_policy == MIRROR_READ_ROUNDROBIN)
+            i = (set->next_member + n) % set->count;
+
+        member = set->members + i;
+
+        if (member->failed || (exclude & ((uint64_t)1 << i)) ||
+            mirror_range_stale(set, i, first, last))
+            continue;
+
+#ifndef _WIN32
+        if (idle_only && member->busy)
+            continue;
+#endif
+
+        if (set->read_policy != MIRROR_READ_BALANCE)
+        {
+            best = i;
+            break;
+        }
+
+        if (best == -1 ||
+            member->inflight < set->members[best].inflight ||
+            (member->inflight == set->members[best].inflight &&
+                member->avg_latency < set->members[best].avg_latency))
+            best = i;
+    }
+
+    if (best >= 0 && set->read_policy == MIRROR_READ_ROUNDROBIN)
+        set->next_member = (best + 1) % set->count;
+
+    return best;
+}
+
+static int
+compare_latency(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t*)a;
+    uint32_t lb = *(const uint32_t*)b;
+
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+// Called with lock held.
+static void
+mirror_record_latency(PMIRROR_SET set, PMIRROR_MEMBER member,
+    uint64_t latency)
+{
+    int64_t diff = (int64_t)latency - (int64_t)member->avg_latency;
+
+    member->avg_latency = (uint64_t)((int64_t)member->avg_latency + diff / 8);
+
+    set->latency[set->latency_count % MIRROR_LATENCY_SAMPLES] =
+        latency > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)latency;
+
+    ++set->latency_count;
+
+    if (set->hedge_percentile > 0 &&
+        set->latency_count % MIRROR_HEDGE_INTERVAL == 0)
+    {
+        uint32_t sorted[MIRROR_LATENCY_SAMPLES];
+        int samples = set->latency_count < MIRROR_LATENCY_SAMPLES ?
+            (int)set->latency_count : MIRROR_LATENCY_SAMPLES;
+
+        memcpy(sorted, set->latency, samples * sizeof(*sorted));
+        qsort(sorted, samples, sizeof(*sorted), compare_latency);
+
+        set->hedge_threshold =
+            sorted[(samples - 1) * set->hedge_percentile / 100];
+    }
+}
+
+static void
+mirror_mark_stale(PMIRROR_SET set, int index, off_t_64 first, off_t_64 last)
+{
+    off_t_64 r;
+
+    for (r = first; r <= last; r++)
+        if (!bit_test(set->members[index].stale, r))
+        {
+            bit_set(set->members[index].stale, r);
+            ++set->stale_regions;
+        }
+}
+
+static int
+mirror_save_bitmap(PMIRROR_SET set, int index, size_t first_byte,
+    size_t last_byte)
+{
+    safeio_size_t len = (safeio_size_t)(last_byte - first_byte + 1);
+
+    if (pwrite(set->bitmap_fd, set->members[index].dirty + first_byte, len,
+        (off_t_64)(set->bitmap_bytes * index + first_byte)) !=
+        (safeio_ssize_t)len)
+        return 0;
+
+    return 1;
+}
+
+static void
+mirror_sync_bitmap(PMIRROR_SET set)
+{
+#ifdef _WIN32
+    FlushFileBuffers((HANDLE)_get_osfhandle(set->bitmap_fd));
+#else
+    fsync(set->bitmap_fd);
+#endif
+}
+
+// Called with lock held. Takes a member offline until next start, when it
+// is resynchronized completely.
+static void
+mirror_fail_member(PMIRROR_SET set, int index)
+{
+    PMIRROR_MEMBER member = set->members + index;
+    off_t_64 r;
+
+    if (member->failed)
+        return;
+
+    for (r = 0; r < set->regions; r++)
+        if (bit_test(member->stale, r))
+            --set->stale_regions;
+
+    member->failed = 1;
+
+    memset(member->dirty, 0xFF, set->bitmap_bytes);
+
+    // Saved now, a crash before next flush must not leave member in sync
+    if (set->bitmap_fd != -1)
+    {
+        if (!mirror_save_bitmap(set, index, 0, set->bitmap_bytes - 1))
+            fprintf(stderr, "Mirror: Error saving bitmap for member %i: "
+                "%s\n", index, strerror(errno));
+
+        mirror_sync_bitmap(set);
+    }
+}
+
+// Called with region lock held, before data is written. Sets dirty bits in
+// bitmap file for regions first to last on all members.
+static int
+mirror_begin_write(PMIRROR_SET set, off_t_64 first, off_t_64 last)
+{
+    int changed = 0;
+    int i;
+
+    if (set->bitmap_fd == -1)
+        return 1;
+
+    for (i = 0; i < set->count; i++)
+    {
+        PMIRROR_MEMBER member = set->members + i;
+        int member_changed = 0;
+        off_t_64 r;
+
+        if (member->failed)
+            continue;
+
+        for (r = first; r <= last; r++)
+            if (!bit_test(member->dirty, r))
+            {
+                bit_set(member->dirty, r);
+                member_changed = 1;
+            }
+
+        if (member_changed)
+        {
+            if (!mirror_save_bitmap(set, i, (size_t)(first >> 3),
+                (size_t)(last >> 3)))
+                return 0;
+
+            changed = 1;
+        }
+    }
+
+    if (changed)
+        mirror_sync_bitmap(set);
+
+    return 1;
+}
+
+// Called with region lock held. Clears dirty bits in bitmap file for
+// regions that are in sync.
+static void
+mirror_flush_bitmap(PMIRROR_SET set)
+{
+    int i;
+
+    if (set->bitmap_fd == -1)
+        return;
+
+    mirror_lock(set);
+
+    for (i = 0; i < set->count; i++)
+        if (!set->members[i].failed)
+            memcpy(set->members[i].dirty, set->members[i].stale,
+                set->bitmap_bytes);
+
+    mirror_unlock(set);
+
+    for (i = 0; i < set->count; i++)
+        mirror_save_bitmap(set, i, 0, set->bitmap_bytes - 1);
+
+    mirror_sync_bitmap(set);
+
+    set->writes_since_flush = 0;
+}
+
+// Copies one region from an in-sync member to members that are stale for
+// it. Called with region lock held. Returns zero if no member has current
+// data for the region.
+static int
+mirror_resync_region(PMIRROR_SET set, off_t_64 region)
+{
+    off_t_64 offset = region * set->region_size;
+    safeio_size_t len = (safeio_size_t)set->region_size;
+    safeio_ssize_t done;
+    int source;
+    int i;
+
+    if (offset + len > set->size)
+        len = (safeio_size_t)(set->size - offset);
+
+    mirror_lock(set);
+    source = mirror_choose(set, region, region, 0, 0);
+    mirror_unlock(set);
+
+    if (source == -1)
+        return 0;
+
+    done = set->members[source].backend.read(
+        set->members[source].backend.handle, set->resync_buf, len, offset);
+
+    if (done < (safeio_ssize_t)len)
+    {
+        fprintf(stderr, "Mirror resync: Read error on member %i at "
+            SLL_FMT ".\n", source, (int64_t)offset);
+
+        mirror_lock(set);
+        mirror_fail_member(set, source);
+        mirror_unlock(set);
+
+        return 1;
+    }
+
+    for (i = 0; i < set->count; i++)
+    {
+        PMIRROR_MEMBER member = set->members + i;
+
+        if (member->failed || !bit_test(member->stale, region))
+            continue;
+
+        done = member->backend.write(member->backend.handle, set->resync_buf,
+            len, offset);
+
+        mirror_lock(set);
+
+        if (done == (safeio_ssize_t)len)
+        {
+            bit_clear(member->stale, region);
+            --set->stale_regions;
+        }
+        else
+        {
+            fprintf(stderr, "Mirror resync: Write error on member %i at "
+                SLL_FMT ", member taken offline.\n", i, (int64_t)offset);
+
+            mirror_fail_member(set, i);
+        }
+
+        mirror_unlock(set);
+    }
+
+    return 1;
+}
+
+// Resynchronizes all stale regions. Returns number of regions that could
+// not be resynchronized because no member has current data.
+static off_t_64
+mirror_resync_all(PMIRROR_SET set)
+{
+    off_t_64 lost = 0;
+    off_t_64 region;
+
+    for (region = 0; region < set->regions; region++)
+    {
+        int stale = 0;
+        int i;
+
+        mirror_lock(set);
+
+        for (i = 0; i < set->count; i++)
+            if (!set->members[i].failed &&
+                bit_test(set->members[i].stale, region))
+                stale = 1;
+
+#ifndef _WIN32
+        if (set->closing)
+            stale = 0;
+#endif
+
+        mirror_unlock(set);
+
+        if (!stale)
+            continue;
+
+        mirror_region_lock(set);
+
+        if (!mirror_resync_region(set, region))
+            ++lost;
+
+        mirror_region_unlock(set);
+    }
+
+    return lost;
+}
+
+#ifndef _WIN32
+
+static void *
+mirror_resync_thread(void *arg)
+{
+    PMIRROR_SET set = (PMIRROR_SET)arg;
+
+    mirror_lock(set);
+
+    while (!set->closing)
+    {
+        if (set->stale_regions == 0)
+        {
+            pthread_cond_wait(&set->resync_wake, &set->lock);
+            continue;
+        }
+
+        mirror_unlock(set);
+
+        printf("Mirror resync started, " SLL_FMT " stale regions.\n",
+            (int64_t)set->stale_regions);
+
+        if (mirror_resync_all(set) > 0)
+            fprintf(stderr, "Mirror resync: Some regions have no in-sync "
+                "member.\n");
+
+        mirror_region_lock(set);
+        mirror_flush_bitmap(set);
+        mirror_region_unlock(set);
+
+        mirror_lock(set);
+
+        printf("Mirror resync done, " SLL_FMT " stale regions.\n",
+            (int64_t)set->stale_regions);
+
+        // Remaining stale regions cannot be resynchronized now
+        if (set->stale_regions > 0 && !set->closing)
+            pthread_cond_wait(&set->resync_wake, &set->lock);
+    }
+
+    mirror_unlock(set);
+
+    return NULL;
+}
+
+typedef struct _MIRROR_HEDGE_ARGS
+{
+    PMIRROR_SET set;
+    int index;
+} MIRROR_HEDGE_ARGS;
+
+static void *
+mirror_member_thread(void *arg)
+{
+    PMIRROR_SET set = ((MIRROR_HEDGE_ARGS*)arg)->set;
+    PMIRROR_MEMBER member = set->members + ((MIRROR_HEDGE_ARGS*)arg)->index;
+
+    free(arg);
+
+    mirror_lock(set);
+
+    for (;;)
+    {
+        uint64_t start;
+        safeio_ssize_t result;
+        int error;
+
+        while (!member->pending && !set->closing)
+            pthread_cond_wait(&member->wake, &set->lock);
+
+        if (set->closing)
+            break;
+
+        member->pending = 0;
+        ++member->inflight;
+
+        mirror_unlock(set);
+
+        start = backend_time_usec();
+
+        result = member->backend.read(member->backend.handle, member->bounce,
+            member->req_size, member->req_offset);
+
+        error = errno;
+
+        mirror_lock(set);
+
+        --member->inflight;
+
+        mirror_record_latency(set, member, backend_time_usec() - start);
+
+        member->result = result;
+        member->error = error;
+        member->done = 1;
+
+        if (member->abandoned)
+        {
+            member->abandoned = 0;
+            member->busy = 0;
+        }
+
+        pthread_cond_broadcast(&set->done);
+    }
+
+    mirror_unlock(set);
+
+    return NULL;
+}
+
+// Called with lock held. Hands a read to a member thread.
+static int
+mirror_submit(PMIRROR_SET set, int index, safeio_size_t size,
+    off_t_64 offset)
+{
+    PMIRROR_MEMBER member = set->members + index;
+
+    if (member->bounce_size < size)
+    {
+        char *bounce = (char*)realloc(member->bounce, size);
+
+        if (bounce == NULL)
+            return 0;
+
+        member->bounce = bounce;
+        member->bounce_size = size;
+    }
+
+    member->busy = 1;
+    member->done = 0;
+    member->abandoned = 0;
+    member->req_size = size;
+    member->req_offset = offset;
+    member->pending = 1;
+
+    pthread_cond_signal(&member->wake);
+
+    return 1;
+}
+
+// Returns -2 if no member thread was available or the read failed, in which
+// case caller should do a direct read instead.
+static safeio_ssize_t
+mirror_hedged_read(PMIRROR_SET set, char *buf, safeio_size_t size,
+    off_t_64 offset, off_t_64 first, off_t_64 last)
+{
+    int primary;
+    int secondary = -1;
+    int winner = -1;
+    uint64_t tried = 0;
+    safeio_ssize_t result = -1;
+
+    mirror_lock(set);
+
+    primary = mirror_choose(set, first, last, 0, 1);
+
+    if (primary == -1 || !mirror_submit(set, primary, size, offset))
+    {
+        mirror_unlock(set);
+        return -2;
+    }
+
+    tried |= (uint64_t)1 << primary;
+
+    if (set->hedge_threshold > 0)
+    {
+        uint64_t deadline = backend_time_usec() + set->hedge_threshold;
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t)(set->hedge_threshold / 1000000);
+        ts.tv_nsec += (long)(set->hedge_threshold % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        while (!set->members[primary].done &&
+            backend_time_usec() < deadline)
+            if (pthread_cond_timedwait(&set->done, &set->lock, &ts) ==
+                ETIMEDOUT)
+                break;
+
+        if (!set->members[primary].done)
+        {
+            secondary = mirror_choose(set, first, last, tried, 1);
+
+            if (secondary != -1 &&
+                mirror_submit(set, secondary, size, offset))
+            {
+                tried |= (uint64_t)1 << secondary;
+                ++set->hedged_reads;
+            }
+            else
+                secondary = -1;
+        }
+    }
+
+    for (;;)
+    {
+        if (set->members[primary].done &&
+            set->members[primary].result == (safeio_ssize_t)size)
+            winner = primary;
+        else if (secondary != -1 && set->members[secondary].done &&
+            set->members[secondary].result == (safeio_ssize_t)size)
+            winner = secondary;
+        else if (set->members[primary].done &&
+            (secondary == -1 || set->members[secondary].done))
+            break;
+
+        if (winner != -1)
+            break;
+
+        pthread_cond_wait(&set->done, &set->lock);
+    }
+
+    if (winner != -1)
+    {
+        memcpy(buf, set->members[winner].bounce, size);
+        result = size;
+    }
+    else
+    {
+        result = set->members[primary].result;
+
+        if (result >= 0)
+            memcpy(buf, set->members[primary].bounce, result);
+    }
+
+    // Member still reading is released by its thread when done
+    if (set->members[primary].done)
+        set->members[primary].busy = 0;
+    else
+        set->members[primary].abandoned = 1;
+
+    if (secondary != -1)
+    {
+        if (set->members[secondary].done)
+            set->members[secondary].busy = 0;
+        else
+            set->members[secondary].abandoned = 1;
+    }
+
+    mirror_unlock(set);
+
+    // Failed reads are retried on other members by caller
+    if (result == -1)
+        return -2;
+
+    return result;
+}
+
+#endif
+
+safeio_ssize_t __cdecl
+mirror_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PMIRROR_SET set = (PMIRROR_SET)handle;
+    off_t_64 first;
+    off_t_64 last;
+    uint64_t tried = 0;
+    int error = EIO;
+
+    if (!backend_clip_range(offset, &size, set->size))
+        return -1;
+
+    if (size == 0)
+        return 0;
+
+    first = offset / set->region_size;
+    last = (offset + size - 1) / set->region_size;
+
+#ifndef _WIN32
+    if (set->hedge_percentile > 0)
+    {
+        safeio_ssize_t result =
+            mirror_hedged_read(set, (char*)buf, size, offset, first, last);
+
+        if (result != -2)
+            return result;
+    }
+#endif
+
+    for (;;)
+    {
+        PMIRROR_MEMBER member;
+        safeio_ssize_t result;
+        uint64_t start;
+        int index;
+
+        mirror_lock(set);
+
+        index = mirror_choose(set, first, last, tried, 0);
+
+        if (index == -1)
+        {
+            mirror_unlock(set);
+
+            // Different members could be in sync for different regions
+            if (tried == 0 && first != last)
+            {
+                off_t_64 split = (first + 1) * set->region_size;
+                safeio_size_t first_size = (safeio_size_t)(split - offset);
+                safeio_ssize_t second;
+
+                result = mirror_read(set, buf, first_size, offset);
+                if (result != (safeio_ssize_t)first_size)
+                    return result;
+
+                second = mirror_read(set, (char*)buf + first_size,
+                    size - first_size, split);
+                if (second == -1)
+                    return -1;
+
+                return result + second;
+            }
+
+            errno = error;
+            return -1;
+        }
+
+        member = set->members + index;
+        tried |= (uint64_t)1 << index;
+        ++member->inflight;
+
+        mirror_unlock(set);
+
+        start = backend_time_usec();
+
+        result = member->backend.read(member->backend.handle, buf, size,
+            offset);
+
+        if (result == -1)
+            error = errno;
+
+        mirror_lock(set);
+
+        --member->inflight;
+
+        if (result >= 0)
+            mirror_record_latency(set, member, backend_time_usec() - start);
+
+        mirror_unlock(set);
+
+        if (result >= 0)
+            return result;
+    }
+}
+
+typedef struct _MIRROR_WRITE
+{
+    PMIRROR_SET set;
+    void *buf;
+    safeio_size_t size;
+    off_t_64 offset;
+    int active[DEVIO_MAX_MEMBERS];
+    safeio_ssize_t result[DEVIO_MAX_MEMBERS];
+    int error[DEVIO_MAX_MEMBERS];
+} MIRROR_WRITE, *PMIRROR_WRITE;
+
+static void __cdecl
+mirror_member_write(void *context, int index)
+{
+    PMIRROR_WRITE io = (PMIRROR_WRITE)context;
+    PDEVIO_BACKEND backend = &io->set->members[io->active[index]].backend;
+
+    io->result[index] = backend->write(backend->handle, io->buf, io->size,
+        io->offset);
+
+    io->error[index] = io->result[index] == -1 ? errno : ENOSPC;
+}
+
+safeio_ssize_t __cdecl
+mirror_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PMIRROR_SET set = (PMIRROR_SET)handle;
+    MIRROR_WRITE io;
+    off_t_64 first;
+    off_t_64 last;
+    int count = 0;
+    int succeeded = 0;
+    int error = EIO;
+    safeio_size_t len = size;
+    int i;
+
+    if (!backend_clip_range(offset, &len, set->size))
+        return -1;
+
+    if (len < size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (size == 0)
+        return 0;
+
+    first = offset / set->region_size;
+    last = (offset + size - 1) / set->region_size;
+
+    io.set = set;
+    io.buf = buf;
+    io.size = size;
+    io.offset = offset;
+
+    mirror_region_lock(set);
+
+    if (!mirror_begin_write(set, first, last))
+    {
+        error = errno;
+        mirror_region_unlock(set);
+        fprintf(stderr, "Mirror: Error updating bitmap file: %s\n",
+            strerror(error));
+        errno = error;
+        return -1;
+    }
+
+    mirror_lock(set);
+
+    for (i = 0; i < set->count; i++)
+        if (!set->members[i].failed)
+            io.active[count++] = i;
+
+    mirror_unlock(set);
+
+    parallel_run(mirror_member_write, &io, count);
+
+    mirror_lock(set);
+
+    for (i = 0; i < count; i++)
+    {
+        if (io.result[i] == (safeio_ssize_t)size)
+        {
+            ++succeeded;
+            continue;
+        }
+
+        error = io.error[i];
+
+        if (!mirror_range_stale(set, io.active[i], first, last))
+            fprintf(stderr, "Mirror: Write error on member %i at " SLL_FMT
+                ": %s\n", io.active[i], (int64_t)offset, strerror(error));
+
+        mirror_mark_stale(set, io.active[i], first, last);
+    }
+
+    // Data just written is current on members that succeeded
+    if (succeeded > 0)
+        for (i = 0; i < count; i++)
+            if (io.result[i] == (safeio_ssize_t)size)
+            {
+                off_t_64 r;
+
+                for (r = first; r <= last; r++)
+                    if (bit_test(set->members[io.active[i]].stale, r) &&
+                        (offset <= r * set->region_size) &&
+                        (offset + size >= (r + 1) * set->region_size))
+                    {
+                        bit_clear(set->members[io.active[i]].stale, r);
+                        --set->stale_regions;
+                    }
+            }
+
+    if (set->stale_regions > 0)
+        mirror_wake_resync(set);
+
+    mirror_unlock(set);
+
+    if (++set->writes_since_flush >= MIRROR_FLUSH_WRITES)
+        mirror_flush_bitmap(set);
+
+    mirror_region_unlock(set);
+
+    if (succeeded == 0)
+    {
+        errno = error;
+        return -1;
+    }
+
+    return size;
+}
+
+int __cdecl
+mirror_close(void *handle)
+{
+    PMIRROR_SET set = (PMIRROR_SET)handle;
+    int i;
+
+#ifndef _WIN32
+    mirror_lock(set);
+    set->closing = 1;
+    pthread_cond_broadcast(&set->resync_wake);
+    for (i = 0; i < set->count; i++)
+        if (set->members[i].thread != 0)
+            pthread_cond_signal(&set->members[i].wake);
+    mirror_unlock(set);
+
+    if (set->resync_running)
+        pthread_join(set->resync_thread, NULL);
+
+    for (i = 0; i < set->count; i++)
+        if (set->members[i].thread != 0)
+        {
+            pthread_join(set->members[i].thread, NULL);
+            free(set->members[i].bounce);
+        }
+
+    if (set->hedged_reads > 0)
+        printf("Mirror: " ULL_FMT " hedged reads.\n", set->hedged_reads);
+#endif
+
+    if (set->bitmap_fd != -1)
+    {
+        mirror_flush_bitmap(set);
+        _close(set->bitmap_fd);
+    }
+
+    for (i = 0; i < set->count; i++)
+    {
+        backend_close(&set->members[i].backend);
+        free(set->members[i].stale);
+        free(set->members[i].dirty);
+    }
+
+    free(set->resync_buf);
+    free(set);
+
+    return 0;
+}
+
+static int
+mirror_load_bitmap(PMIRROR_SET set, const char *file, int full_resync)
+{
+    off_t_64 file_size;
+    int i;
+
+    set->bitmap_fd = _open(file, O_BINARY | O_RDWR | O_CREAT, 0644);
+
+    if (set->bitmap_fd == -1)
+    {
+        fprintf(stderr, "Cannot open bitmap file '%s': %s\n", file,
+            strerror(errno));
+        return 0;
+    }
+
+    file_size = _lseeki64(set->bitmap_fd, 0, SEEK_END);
+
+    if (file_size == 0 || full_resync)
+    {
+        // New bitmap file. Members are assumed to be in sync unless a full
+        // resync is requested, in which case first member is the source.
+        for (i = 0; i < set->count; i++)
+        {
+            if (full_resync && i > 0)
+                memset(set->members[i].dirty, 0xFF, set->bitmap_bytes);
+
+            if (!mirror_save_bitmap(set, i, 0, set->bitmap_bytes - 1))
+            {
+                fprintf(stderr, "Cannot write bitmap file '%s': %s\n", file,
+                    strerror(errno));
+                return 0;
+            }
+        }
+
+        mirror_sync_bitmap(set);
+    }
+    else if (file_size != (off_t_64)(set->bitmap_bytes * set->count))
+    {
+        fprintf(stderr, "Bitmap file '%s' does not match this mirror set.\n",
+            file);
+        return 0;
+    }
+    else
+    {
+        for (i = 0; i < set->count; i++)
+            if (pread(set->bitmap_fd, set->members[i].dirty,
+                (safeio_size_t)set->bitmap_bytes,
+                (off_t_64)(set->bitmap_bytes * i)) !=
+                (safeio_ssize_t)set->bitmap_bytes)
+            {
+                fprintf(stderr, "Cannot read bitmap file '%s': %s\n", file,
+                    strerror(errno));
+                return 0;
+            }
+    }
+
+    // Regions dirty on all members, for instance writes in progress at a
+    // crash, are copied from first member.
+    for (i = 0; i < set->count; i++)
+    {
+        off_t_64 r;
+
+        for (r = 0; r < set->regions; r++)
+        {
+            int j;
+
+            if (!bit_test(set->members[i].dirty, r))
+                continue;
+
+            if (i == 0)
+            {
+                for (j = 1; j < set->count; j++)
+                    if (!bit_test(set->members[j].dirty, r))
+                        break;
+
+                if (j == set->count)
+                    continue;
+            }
+
+            bit_set(set->members[i].stale, r);
+            ++set->stale_regions;
+        }
+    }
+
+    return 1;
+}
+
+void * __cdecl
+mirror_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    char options[512];
+    char value[260];
+    const char *members = backend_parameters(file, options, sizeof(options));
+    PMIRROR_SET set = (PMIRROR_SET)calloc(1, sizeof(MIRROR_SET));
+    DEVIO_BACKEND backends[DEVIO_MAX_MEMBERS];
+    int i;
+
+    if (set == NULL)
+        return NULL;
+
+#ifndef _WIN32
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_mutex_init(&set->region_lock, NULL);
+    pthread_cond_init(&set->done, NULL);
+    pthread_cond_init(&set->resync_wake, NULL);
+#endif
+
+    set->bitmap_fd = -1;
+    set->region_size = DEF_REGION_SIZE;
+
+    if (backend_get_option(options, "read", value, sizeof(value)))
+    {
+        if (_stricmp(value, "balance") == 0)
+            set->read_policy = MIRROR_READ_BALANCE;
+        else if (_stricmp(value, "first") == 0)
+            set->read_policy = MIRROR_READ_FIRST;
+        else if (_stricmp(value, "roundrobin") == 0)
+            set->read_policy = MIRROR_READ_ROUNDROBIN;
+        else
+        {
+            fprintf(stderr, "Invalid read policy: '%s'\n", value);
+            free(set);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    if (backend_get_option(options, "hedge", value, sizeof(value)))
+    {
+        set->hedge_percentile = atoi(value);
+
+        if (set->hedge_percentile <= 0 || set->hedge_percentile >= 100)
+        {
+            fprintf(stderr, "Invalid hedge percentile: '%s'\n", value);
+            free(set);
+            errno = EINVAL;
+            return NULL;
+        }
+
+#ifdef _WIN32
+        fprintf(stderr, "Hedged reads not supported on Windows.\n");
+        set->hedge_percentile = 0;
+#endif
+    }
+
+    if (backend_get_option(options, "region", value, sizeof(value)) &&
+        (!backend_parse_size(value, &set->region_size) ||
+            set->region_size < 4096))
+    {
+        fprintf(stderr, "Invalid region size: '%s'\n", value);
+        free(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    set->count = backend_open_members(members, read_only, backends,
+        DEVIO_MAX_MEMBERS);
+
+    for (i = 0; i < set->count; i++)
+        set->members[i].backend = backends[i];
+
+    if (set->count < 2)
+    {
+        fprintf(stderr, "A mirror set needs at least two members.\n");
+        mirror_close(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    for (i = 0; i < set->count; i++)
+        if (i == 0 || set->members[i].backend.size < set->size)
+            set->size = set->members[i].backend.size;
+
+    if (set->size == 0)
+    {
+        fprintf(stderr, "Cannot determine size of mirror set members.\n");
+        mirror_close(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    set->regions = (set->size + set->region_size - 1) / set->region_size;
+    set->bitmap_bytes = (size_t)((set->regions + 7) >> 3);
+    set->resync_buf = (char*)malloc((size_t)set->region_size);
+
+    if (set->resync_buf == NULL)
+    {
+        mirror_close(set);
+        return NULL;
+    }
+
+    for (i = 0; i < set->count; i++)
+    {
+        set->members[i].stale = (unsigned char*)calloc(1, set->bitmap_bytes);
+        set->members[i].dirty = (unsigned char*)calloc(1, set->bitmap_bytes);
+
+        if (set->members[i].stale == NULL || set->members[i].dirty == NULL)
+        {
+            mirror_close(set);
+            return NULL;
+        }
+    }
+
+    if (backend_get_option(options, "bitmap", value, sizeof(value)))
+    {
+        if (!mirror_load_bitmap(set, value,
+            backend_get_option(options, "resync", NULL, 0)))
+        {
+            mirror_close(set);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    else if (backend_get_option(options, "resync", NULL, 0))
+    {
+        for (i = 1; i < set->count; i++)
+            mirror_mark_stale(set, i, 0, set->regions - 1);
+    }
+
+    if (read_only && set->stale_regions > 0)
+    {
+        fprintf(stderr, "Mirror: Stale regions will be resynchronized when "
+            "opened for writing.\n");
+
+        set->stale_regions = 0;
+    }
+
+#ifdef _WIN32
+    if (set->stale_regions > 0)
+    {
+        printf("Mirror resync, " SLL_FMT " stale regions.\n",
+            (int64_t)set->stale_regions);
+
+        mirror_resync_all(set);
+        mirror_flush_bitmap(set);
+    }
+#else
+    if (!read_only &&
+        pthread_create(&set->resync_thread, NULL, mirror_resync_thread,
+            set) == 0)
+        set->resync_running = 1;
+
+    if (set->hedge_percentile > 0)
+        for (i = 0; i < set->count; i++)
+        {
+            MIRROR_HEDGE_ARGS *args =
+                (MIRROR_HEDGE_ARGS*)malloc(sizeof(MIRROR_HEDGE_ARGS));
+
+            if (args == NULL)
+                break;
+
+            args->set = set;
+            args->index = i;
+
+            pthread_cond_init(&set->members[i].wake, NULL);
+
+            if (pthread_create(&set->members[i].thread, NULL,
+                mirror_member_thread, args) != 0)
+            {
+                free(args);
+                set->members[i].busy = 1;
+            }
+        }
+#endif
+
+    parallel_reserve(set->count - 1);
+
+    printf("Mirror set of %i members, region size " SLL_FMT " bytes.\n",
+        set->count, (int64_t)set->region_size);
+
+    *dllread = mirror_read;
+    *dllwrite = mirror_write;
+    *dllclose = mirror_close;
+
+    if (size != NULL)
+        *size = set->size;
+
+    return set;
+}
@@ -0,0 +1,529 @@
+/*
+Copy-on-write overlay backend for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+#include "backend.h"
+
+#define DEF_BLOCK_SIZE          (64 << 10)
+
+#define OVERLAY_MAGIC           "DEVIOCOW"
+#define OVERLAY_VERSION         1
+#define OVERLAY_HEADER_SIZE     4096
+
+// overlay,delta=file[,block=blocksize]:base
+//
+// Base image, or another built-in backend, is opened read-only. Written
+// blocks are stored in the delta file and read from there, other blocks
+// are read from base. Several devio instances can share one base image,
+// each with its own delta file. The delta file is created when it does
+// not exist. Block size is set when the file is created.
+//
+// Delta file layout:
+//
+// 0                    OVERLAY_HEADER
+// OVERLAY_HEADER_SIZE  Allocation bitmap, one bit per block
+// data_offset          Blocks at same offset as in image
+//
+// Blocks never written take no disk space where the file system supports
+// sparse files. Block data is written and flushed before the bitmap bit
+// that makes it visible is saved, and the delta file is flushed at close.
+
+#pragma pack(push, 1)
+typedef struct _OVERLAY_HEADER
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t image_size;
+    uint64_t data_offset;
+} OVERLAY_HEADER, *POVERLAY_HEADER;
+#pragma pack(pop)
+
+typedef struct _OVERLAY
+{
+    DEVIO_BACKEND base;
+    int delta_fd;
+    int read_only;
+    off_t_64 block_size;
+    off_t_64 blocks;
+    off_t_64 size;
+    off_t_64 data_offset;
+    off_t_64 allocated;
+    size_t bitmap_bytes;
+    unsigned char *bitmap;
+    char *block_buf;
+} OVERLAY, *POVERLAY;
+
+#define block_allocated(ov, n) \
+    ((ov)->bitmap[(n) >> 3] & (1 << ((n) & 7)))
+
+// Reads from base, with zeros past end of base.
+static safeio_ssize_t
+overlay_read_base(POVERLAY overlay, char *buf, safeio_size_t size,
+    off_t_64 offset)
+{
+    safeio_ssize_t done = overlay->base.read(overlay->base.handle, buf, size,
+        offset);
+
+    if (done == -1)
+        return -1;
+
+    if (done < (safeio_ssize_t)size)
+        memset(buf + done, 0, size - done);
+
+    return size;
+}
+
+safeio_ssize_t __cdecl
+overlay_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    POVERLAY overlay = (POVERLAY)handle;
+    off_t_64 end;
+    off_t_64 pos = offset;
+
+    if (!backend_clip_range(offset, &size, overlay->size))
+        return -1;
+
+    end = offset + size;
+
+    // Runs of blocks with the same allocation state in one read each
+    while (pos < end)
+    {
+        off_t_64 block = pos / overlay->block_size;
+        int allocated = block_allocated(overlay, block) != 0;
+        off_t_64 run_end;
+        safeio_size_t len;
+        char *ptr = (char*)buf + (pos - offset);
+
+        ++block;
+        while (block < overlay->blocks &&
+            (block_allocated(overlay, block) != 0) == allocated)
+            ++block;
+
+        run_end = block * overlay->block_size;
+        if (run_end > end)
+            run_end = end;
+
+        len = (safeio_size_t)(run_end - pos);
+
+        if (allocated)
+        {
+            safeio_ssize_t done = pread(overlay->delta_fd, ptr, len,
+                overlay->data_offset + pos);
+
+            if (done == -1)
+                return -1;
+
+            if (done < (safeio_ssize_t)len)
+                memset(ptr + done, 0, len - done);
+        }
+        else if (overlay_read_base(overlay, ptr, len, pos) == -1)
+            return -1;
+
+        pos = run_end;
+    }
+
+    return (safeio_ssize_t)(end > offset ? end - offset : 0);
+}
+
+// Flushes block data written to the delta file, so that bitmap bits saved
+// after it never point to blocks that did not reach the disk.
+static int
+overlay_data_sync(POVERLAY overlay)
+{
+#if defined(_WIN32)
+    return FlushFileBuffers((HANDLE)_get_osfhandle(overlay->delta_fd)) ?
+        0 : -1;
+#elif defined(__linux__)
+    return fdatasync(overlay->delta_fd);
+#else
+    return fsync(overlay->delta_fd);
+#endif
+}
+
+// Saves bitmap bytes for blocks first to last.
+static int
+overlay_save_bitmap(POVERLAY overlay, off_t_64 first, off_t_64 last)
+{
+    size_t first_byte = (size_t)(first >> 3);
+    safeio_size_t len = (safeio_size_t)((last >> 3) - first_byte + 1);
+
+    return pwrite(overlay->delta_fd, overlay->bitmap + first_byte, len,
+        OVERLAY_HEADER_SIZE + (off_t_64)first_byte) == (safeio_ssize_t)len;
+}
+
+safeio_ssize_t __cdecl
+overlay_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    POVERLAY overlay = (POVERLAY)handle;
+    safeio_size_t len = size;
+    off_t_64 end = offset + size;
+    off_t_64 first;
+    off_t_64 last;
+    off_t_64 block;
+    int new_blocks = 0;
+
+    if (!backend_clip_range(offset, &len, overlay->size))
+        return -1;
+
+    if (len < size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (size == 0)
+        return 0;
+
+    if (overlay->read_only)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    first = offset / overlay->block_size;
+    last = (end - 1) / overlay->block_size;
+
+    // Blocks partially written for the first time get the rest of their
+    // contents from base
+    for (block = first; block <= last; block++)
+    {
+        off_t_64 block_start = block * overlay->block_size;
+        off_t_64 block_end = block_start + overlay->block_size;
+        off_t_64 a;
+        off_t_64 b;
+
+        if (block_allocated(overlay, block))
+            continue;
+
+        new_blocks = 1;
+
+        if (offset <= block_start && end >= block_end)
+            continue;
+
+        if (block_end > overlay->size)
+            block_end = overlay->size;
+
+        if (overlay_read_base(overlay, overlay->block_buf,
+            (safeio_size_t)(block_end - block_start), block_start) == -1)
+            return -1;
+
+        a = offset > block_start ? offset : block_start;
+        b = end < block_end ? end : block_end;
+
+        memcpy(overlay->block_buf + (a - block_start),
+            (char*)buf + (a - offset), (size_t)(b - a));
+
+        if (pwrite(overlay->delta_fd, overlay->block_buf,
+            (safeio_size_t)(block_end - block_start),
+            overlay->data_offset + block_start) !=
+            (safeio_ssize_t)(block_end - block_start))
+            return -1;
+    }
+
+    if (pwrite(overlay->delta_fd, buf, size, overlay->data_offset + offset) !=
+        (safeio_ssize_t)size)
+        return -1;
+
+    if (new_blocks)
+    {
+        if (overlay_data_sync(overlay) != 0)
+            return -1;
+
+        for (block = first; block <= last; block++)
+            if (!block_allocated(overlay, block))
+            {
+                overlay->bitmap[block >> 3] |=
+                    (unsigned char)(1 << (block & 7));
+                ++overlay->allocated;
+            }
+
+        if (!overlay_save_bitmap(overlay, first, last))
+            return -1;
+    }
+
+    return size;
+}
+
+int __cdecl
+overlay_close(void *handle)
+{
+    POVERLAY overlay = (POVERLAY)handle;
+    int rc = 0;
+
+    if (overlay->delta_fd != -1)
+    {
+        if (!overlay->read_only)
+        {
+#ifdef _WIN32
+            FlushFileBuffers((HANDLE)_get_osfhandle(overlay->delta_fd));
+#else
+            fsync(overlay->delta_fd);
+#endif
+        }
+
+        rc = _close(overlay->delta_fd);
+    }
+
+    backend_close(&overlay->base);
+
+    free(overlay->bitmap);
+    free(overlay->block_buf);
+    free(overlay);
+
+    return rc;
+}
+
+// Creates header and empty bitmap in a new delta file.
+static int
+overlay_create(POVERLAY overlay)
+{
+    OVERLAY_HEADER header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+    header.version = OVERLAY_VERSION;
+    header.block_size = (uint32_t)overlay->block_size;
+    header.image_size = (uint64_t)overlay->size;
+    header.data_offset = (uint64_t)overlay->data_offset;
+
+    if (pwrite(overlay->delta_fd, &header, sizeof(header), 0) !=
+        (safeio_ssize_t)sizeof(header))
+        return 0;
+
+    if (pwrite(overlay->delta_fd, overlay->bitmap,
+        (safeio_size_t)overlay->bitmap_bytes, OVERLAY_HEADER_SIZE) !=
+        (safeio_ssize_t)overlay->bitmap_bytes)
+        return 0;
+
+    return 1;
+}
+
+static int
+overlay_load(POVERLAY overlay, const char *file)
+{
+    OVERLAY_HEADER header;
+    off_t_64 bitmap_bytes;
+
+    if (pread(overlay->delta_fd, &header, sizeof(header), 0) !=
+        (safeio_ssize_t)sizeof(header) ||
+        memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != OVERLAY_VERSION)
+    {
+        fprintf(stderr, "'%s' is not a valid delta file.\n", file);
+        return 0;
+    }
+
+    // Same limits as for new delta files
+    if (header.block_size < 512 || header.block_size > (64 << 20) ||
+        (header.block_size & (header.block_size - 1)) != 0)
+    {
+        fprintf(stderr, "Delta file '%s' has invalid block size %u.\n",
+            file, (unsigned int)header.block_size);
+        return 0;
+    }
+
+    if ((off_t_64)header.image_size != overlay->size)
+    {
+        fprintf(stderr, "Delta file '%s' was created for an image of "
+            ULL_FMT " bytes, base image is " SLL_FMT " bytes.\n", file,
+            header.image_size, (int64_t)overlay->size);
+        return 0;
+    }
+
+    // Data blocks must be aligned and follow header and bitmap
+    bitmap_bytes = ((overlay->size + header.block_size - 1) /
+        header.block_size + 7) >> 3;
+
+    if (header.data_offset < OVERLAY_HEADER_SIZE + (uint64_t)bitmap_bytes ||
+        header.data_offset % header.block_size != 0 ||
+        header.data_offset > (uint64_t)1 << 62)
+    {
+        fprintf(stderr, "Delta file '%s' has invalid data offset " ULL_FMT
+            ".\n", file, header.data_offset);
+        return 0;
+    }
+
+    overlay->block_size = header.block_size;
+    overlay->data_offset = (off_t_64)header.data_offset;
+
+    return 1;
+}
+
+void * __cdecl
+overlay_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    char options[512];
+    char delta[260];
+    char value[64];
+    const char *base = backend_parameters(file, options, sizeof(options));
+    POVERLAY overlay = (POVERLAY)calloc(1, sizeof(OVERLAY));
+    off_t_64 delta_size;
+    off_t_64 b;
+
+    if (overlay == NULL)
+        return NULL;
+
+    overlay->delta_fd = -1;
+    overlay->read_only = read_only;
+    overlay->block_size = DEF_BLOCK_SIZE;
+
+    if (!backend_get_option(options, "delta", delta, sizeof(delta)) ||
+        delta[0] == 0)
+    {
+        fprintf(stderr, "Overlay needs a delta file, delta=file.\n");
+        free(overlay);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "block", value, sizeof(value)) &&
+        (!backend_parse_size(value, &overlay->block_size) ||
+            overlay->block_size < 512 ||
+            overlay->block_size > (64 << 20) ||
+            (overlay->block_size & (overlay->block_size - 1)) != 0))
+    {
+        fprintf(stderr, "Invalid block size: '%s'\n", value);
+        free(overlay);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!backend_open(&overlay->base, base, 1))
+    {
+        fprintf(stderr, "Failed to open base image '%s': %s\n", base,
+            strerror(errno));
+        free(overlay);
+        return NULL;
+    }
+
+    overlay->size = overlay->base.size;
+
+    if (overlay->size == 0)
+    {
+        fprintf(stderr, "Cannot determine size of base image.\n");
+        overlay_close(overlay);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    overlay->delta_fd = _open(delta,
+        O_BINARY | (read_only ? O_RDONLY : O_RDWR | O_CREAT), 0644);
+
+    if (overlay->delta_fd == -1)
+    {
+        fprintf(stderr, "Cannot open delta file '%s': %s\n", delta,
+            strerror(errno));
+        overlay_close(overlay);
+        return NULL;
+    }
+
+    delta_size = _lseeki64(overlay->delta_fd, 0, SEEK_END);
+
+    if (delta_size > 0 && !overlay_load(overlay, delta))
+    {
+        overlay_close(overlay);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    overlay->blocks =
+        (overlay->size + overlay->block_size - 1) / overlay->block_size;
+    overlay->bitmap_bytes = (size_t)((overlay->blocks + 7) >> 3);
+
+    if (delta_size <= 0)
+        overlay->data_offset = (OVERLAY_HEADER_SIZE + overlay->bitmap_bytes +
+            overlay->block_size - 1) & ~(overlay->block_size - 1);
+
+    overlay->bitmap = (unsigned char*)calloc(1, overlay->bitmap_bytes);
+    overlay->block_buf = (char*)malloc((size_t)overlay->block_size);
+
+    if (overlay->bitmap == NULL || overlay->block_buf == NULL)
+    {
+        overlay_close(overlay);
+        return NULL;
+    }
+
+    if (delta_size <= 0)
+    {
+        if (read_only || !overlay_create(overlay))
+        {
+            fprintf(stderr, "Cannot create delta file '%s': %s\n", delta,
+                read_only ? "Read-only mode" : strerror(errno));
+            overlay_close(overlay);
+            return NULL;
+        }
+    }
+    else if (pread(overlay->delta_fd, overlay->bitmap,
+        (safeio_size_t)overlay->bitmap_bytes, OVERLAY_HEADER_SIZE) !=
+        (safeio_ssize_t)overlay->bitmap_bytes)
+    {
+        fprintf(stderr, "Cannot read delta file '%s'.\n", delta);
+        overlay_close(overlay);
+        return NULL;
+    }
+
+    for (b = 0; b < overlay->blocks; b++)
+        if (block_allocated(overlay, b))
+            ++overlay->allocated;
+
+    printf("Overlay block size " SLL_FMT " bytes, " SLL_FMT " of " SLL_FMT
+        " blocks in delta file.\n", (int64_t)overlay->block_size,
+        (int64_t)overlay->allocated, (int64_t)overlay->blocks);
+
+    *dllread = overlay_read;
+    *dllwrite = overlay_write;
+    *dllclose = overlay_close;
+
+    if (size != NULL)
+        *size = overlay->size;
+
+    return overlay;
+}
@@ -0,0 +1,496 @@
+/*
+Parallel execution of backend I/O for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "parallel.h"
+#include "placement.h"
+
+#ifdef _WIN32
+
+// Windows builds run jobs sequentially on the calling thread. The pread()
+// and pwrite() emulations in safeio.h move a shared file pointer and are
+// not safe to call from several threads at once.
+
+int
+parallel_configure(const char *spec)
+{
+    UNREFERENCED_PARAMETER(spec);
+
+    puts("Worker threads are not used on this system.");
+
+    return 1;
+}
+
+int
+parallel_reserve(int workers)
+{
+    UNREFERENCED_PARAMETER(workers);
+
+    return 0;
+}
+
+void
+parallel_run(parallel_job_proc job, void *context, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        job(context, i);
+}
+
+void
+parallel_close()
+{
+}
+
+#else
+
+#define PARALLEL_MAX_WORKERS    64
+#define PARALLEL_DEQUE_SIZE     256
+
+// Work stealing pool. Each worker has a deque of tasks, ranges of job
+// indexes, that it takes from the bottom while idle workers steal from the
+// top. Batches from threads outside the pool are spread over the deques,
+// batches from jobs running on a worker go to its own deque for others to
+// steal. A submitting thread runs the first task itself and then only
+// other tasks of its own batch, never unrelated jobs, while it waits for
+// the batch to complete. Deques have locks of their own; the pool lock
+// only guards sleeping and waking workers. Tasks and batches live in the
+// deques and on the stack of the submitting thread, so nothing is
+// allocated per batch.
+//
+// --workers=[n][,grain=indexes][,push=spread|local]
+//
+// n        Number of worker threads, started at once. Without it, workers
+//          are started as backends ask for them, up to 64.
+// grain    Job indexes per task, 1 by default.
+// push     spread puts tasks from outside the pool on the deques of all
+//          workers in turn, local puts all tasks of a batch on one deque
+//          and leaves the rest to stealing.
+
+typedef struct _PARALLEL_BATCH
+{
+    parallel_job_proc job;
+    void *context;
+    int pending;                // Tasks not completed
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} PARALLEL_BATCH, *PPARALLEL_BATCH;
+
+typedef struct _PARALLEL_TASK
+{
+    PPARALLEL_BATCH batch;
+    int first;
+    int count;
+} PARALLEL_TASK, *PPARALLEL_TASK;
+
+typedef struct _PARALLEL_DEQUE
+{
+    pthread_mutex_t lock;
+    unsigned int top;
+    unsigned int bottom;
+    PARALLEL_TASK tasks[PARALLEL_DEQUE_SIZE];
+    uint64_t run;               // Tasks run by owner
+    uint64_t stolen;            // Tasks owner stole from others
+} PARALLEL_DEQUE, *PPARALLEL_DEQUE;
+
+static PARALLEL_DEQUE deques[PARALLEL_MAX_WORKERS];
+
+static pthread_mutex_t parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parallel_work = PTHREAD_COND_INITIALIZER;
+static pthread_key_t parallel_self;
+
+static int parallel_workers = 0;
+static int parallel_sleepers = 0;
+static unsigned int parallel_generation = 0;
+static int parallel_next = 0;
+
+static int max_workers = PARALLEL_MAX_WORKERS;
+static int grain = 1;
+static int push_local = 0;
+
+static int
+deque_push(PPARALLEL_DEQUE deque, PPARALLEL_TASK task)
+{
+    int pushed = 0;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top < PARALLEL_DEQUE_SIZE)
+    {
+        deque->tasks[deque->bottom++ % PARALLEL_DEQUE_SIZE] = *task;
+        pushed = 1;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return pushed;
+}
+
+// Takes newest task of owner, or oldest task of another worker. With
+// batch, takes the oldest task of that batch wherever it is, so that a
+// thread waiting for its batch never depends on other tasks completing.
+static int
+deque_take(PPARALLEL_DEQUE deque, int owner, PPARALLEL_BATCH batch,
+    PPARALLEL_TASK task)
+{
+    int taken = 0;
+    unsigned int i;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (batch != NULL)
+    {
+        for (i = deque->top; i != deque->bottom; i++)
+            if (deque->tasks[i % PARALLEL_DEQUE_SIZE].batch == batch)
+            {
+                *task = deque->tasks[i % PARALLEL_DEQUE_SIZE];
+
+                for (; i + 1 != deque->bottom; i++)
+                    deque->tasks[i % PARALLEL_DEQUE_SIZE] =
+                    deque->tasks[(i + 1) % PARALLEL_DEQUE_SIZE];
+
+                --deque->bottom;
+                taken = 1;
+                break;
+            }
+    }
+    else if (deque->bottom != deque->top)
+    {
+        if (owner)
+            *task = deque->tasks[--deque->bottom % PARALLEL_DEQUE_SIZE];
+        else
+            *task = deque->tasks[deque->top++ % PARALLEL_DEQUE_SIZE];
+
+        taken = 1;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return taken;
+}
+
+static void
+parallel_run_task(PPARALLEL_TASK task)
+{
+    PPARALLEL_BATCH batch = task->batch;
+    int i;
+
+    for (i = task->first; i < task->first + task->count; i++)
+        batch->job(batch->context, i);
+
+    // Batch is on the stack of the submitting thread, which returns as
+    // soon as it sees the last task completed
+    pthread_mutex_lock(&batch->lock);
+
+    if (--batch->pending == 0)
+        pthread_cond_signal(&batch->done);
+
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static int
+parallel_find_task(int self, int workers, PPARALLEL_TASK task)
+{
+    int i;
+
+    if (deque_take(deques + self, 1, NULL, task))
+        return 1;
+
+    for (i = 1; i < workers; i++)
+        if (deque_take(deques + (self + i) % workers, 0, NULL, task))
+        {
+            ++deques[self].stolen;
+            return 1;
+        }
+
+    return 0;
+}
+
+static void *
+parallel_worker(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    int workers = self + 1;
+    unsigned int seen;
+    PARALLEL_TASK task;
+
+    placement_pin_thread();
+
+    pthread_setspecific(parallel_self, deques + self);
+
+    for (;;)
+    {
+        if (parallel_find_task(self, workers, &task))
+        {
+            parallel_run_task(&task);
+            ++deques[self].run;
+            continue;
+        }
+
+        // Tasks pushed after generation is read are seen by the second
+        // search or change generation before sleeping
+        pthread_mutex_lock(&parallel_lock);
+        seen = parallel_generation;
+        workers = parallel_workers;
+        pthread_mutex_unlock(&parallel_lock);
+
+        if (parallel_find_task(self, workers, &task))
+        {
+            parallel_run_task(&task);
+            ++deques[self].run;
+            continue;
+        }
+
+        pthread_mutex_lock(&parallel_lock);
+
+        ++parallel_sleepers;
+
+        while (parallel_generation == seen)
+            pthread_cond_wait(&parallel_work, &parallel_lock);
+
+        --parallel_sleepers;
+
+        pthread_mutex_unlock(&parallel_lock);
+    }
+
+    return NULL;
+}
+
+int
+parallel_configure(const char *spec)
+{
+    const char *opts = strchr(spec, ',');
+    char value[32];
+    int start = 0;
+
+    if (*spec != 0 && *spec != ',')
+    {
+        max_workers = (int)strtoul(spec, NULL, 0);
+        start = 1;
+    }
+
+    if (max_workers < 1 || max_workers > PARALLEL_MAX_WORKERS)
+    {
+        fprintf(stderr, "Number of workers must be 1 - %i.\n",
+            PARALLEL_MAX_WORKERS);
+        return 0;
+    }
+
+    if (opts != NULL)
+    {
+        if (backend_get_option(opts + 1, "grain", value, sizeof(value)))
+        {
+            grain = (int)strtoul(value, NULL, 0);
+
+            if (grain < 1)
+            {
+                fprintf(stderr, "Invalid task grain: '%s'\n", value);
+                return 0;
+            }
+        }
+
+        if (backend_get_option(opts + 1, "push", value, sizeof(value)))
+        {
+            if (_stricmp(value, "local") == 0)
+                push_local = 1;
+            else if (_stricmp(value, "spread") == 0)
+                push_local = 0;
+            else
+            {
+                fprintf(stderr, "Invalid task push policy: '%s'\n", value);
+                return 0;
+            }
+        }
+    }
+
+    if (start && parallel_reserve(max_workers) < max_workers)
+    {
+        fprintf(stderr, "Error starting worker threads.\n");
+        return 0;
+    }
+
+    printf("%s %i worker threads, %i job indexes per task, %s tasks.\n",
+        start ? "Started" : "Up to", max_workers, grain,
+        push_local ? "local" : "spread");
+
+    return 1;
+}
+
+int
+parallel_reserve(int workers)
+{
+    if (workers > max_workers)
+        workers = max_workers;
+
+    pthread_mutex_lock(&parallel_lock);
+
+    if (parallel_workers == 0 && pthread_key_create(&parallel_self, NULL))
+        workers = 0;
+
+    while (parallel_workers < workers)
+    {
+        PPARALLEL_DEQUE deque = deques + parallel_workers;
+        pthread_t thread;
+
+        pthread_mutex_init(&deque->lock, NULL);
+
+        if (pthread_create(&thread, NULL, parallel_worker,
+            (void*)(intptr_t)parallel_workers) != 0)
+            break;
+
+        pthread_detach(thread);
+
+        ++parallel_workers;
+    }
+
+    workers = parallel_workers;
+
+    pthread_mutex_unlock(&parallel_lock);
+
+    return workers;
+}
+
+void
+parallel_run(parallel_job_proc job, void *context, int count)
+{
+    PPARALLEL_DEQUE self;
+    PARALLEL_BATCH batch;
+    PARALLEL_TASK task;
+    int workers;
+    int start;
+    int tasks;
+    int i;
+
+    if (count <= 1 || parallel_workers == 0)
+    {
+        for (i = 0; i < count; i++)
+            job(context, i);
+
+        return;
+    }
+
+    self = (PPARALLEL_DEQUE)pthread_getspecific(parallel_self);
+    tasks = (count + grain - 1) / grain;
+
+    batch.job = job;
+    batch.context = context;
+    batch.pending = tasks;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+
+    pthread_mutex_lock(&parallel_lock);
+    workers = parallel_workers;
+    start = parallel_next;
+    parallel_next = (parallel_next + 1) % workers;
+    pthread_mutex_unlock(&parallel_lock);
+
+    task.batch = &batch;
+
+    // First task is run by this thread, tasks that do not fit are too
+    for (i = 1; i < tasks; i++)
+    {
+        PPARALLEL_DEQUE deque = self;
+
+        if (deque == NULL)
+            deque = deques + (push_local ? start : (start + i) % workers);
+
+        task.first = i * grain;
+        task.count = count - task.first < grain ? count - task.first : grain;
+
+        if (!deque_push(deque, &task))
+            parallel_run_task(&task);
+    }
+
+    pthread_mutex_lock(&parallel_lock);
+
+    ++parallel_generation;
+
+    for (i = 1; i < tasks && i <= parallel_sleepers; i++)
+        pthread_cond_signal(&parallel_work);
+
+    pthread_mutex_unlock(&parallel_lock);
+
+    task.first = 0;
+    task.count = count < grain ? count : grain;
+
+    parallel_run_task(&task);
+
+    // Help with tasks of this batch not yet taken by workers
+    for (i = 0; i < workers; i++)
+        while (deque_take(deques + (start + i) % workers, 0, &batch, &task))
+            parallel_run_task(&task);
+
+    pthread_mutex_lock(&batch.lock);
+
+    while (batch.pending > 0)
+        pthread_cond_wait(&batch.done, &batch.lock);
+
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+}
+
+void
+parallel_close()
+{
+    uint64_t run = 0;
+    uint64_t stolen = 0;
+    int i;
+
+    if (parallel_workers == 0)
+        return;
+
+    for (i = 0; i < parallel_workers; i++)
+    {
+        run += deques[i].run;
+        stolen += deques[i].stolen;
+    }
+
+    printf("Workers: %i threads ran " ULL_FMT " tasks, " ULL_FMT
+        " of them stolen.\n", parallel_workers, (ULONGLONG)run,
+        (ULONGLONG)stolen);
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+Parallel execution of backend I/O for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_PARALLEL_
+#define _INC_PARALLEL_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef void (__cdecl parallel_job_decl)(void *context, int index);
+
+    typedef parallel_job_decl *parallel_job_proc;
+
+    // Sets pool size and task policies from [workers][,options], before
+    // any workers are reserved. Returns zero on failure.
+    int parallel_configure(const char *spec);
+
+    // Makes sure at least this number of worker threads are running.
+    // Returns number of available workers, zero where threads are not
+    // supported.
+    int parallel_reserve(int workers);
+
+    // Calls job once for each index from zero to count - 1, in parallel on
+    // worker threads and the calling thread, and returns when all calls
+    // have returned. May be called from several threads and from jobs.
+    void parallel_run(parallel_job_proc job, void *context, int count);
+
+    // Prints statistics.
+    void parallel_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_PARALLEL_
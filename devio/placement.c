@@ -0,0 +1,757 @@
+/*
+NUMA node and page size placement of devio buffers and threads.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "placement.h"
+
+// --placement[=pages=size][,node=n|image][,nic=ifname][,strict]
+//      [,pin=none|node|cpu]
+//
+// pages  2m for 2 MB huge pages, the default, 1g for 1 GB pages, thp for
+//        transparent huge pages or small. Buffers fall back to the next
+//        smaller kind when no huge pages are reserved, such as in
+//        /proc/sys/vm/nr_hugepages, or on Windows without the lock pages in
+//        memory privilege.
+// node   NUMA node for memory and threads, or image for the node of the
+//        device the image is on.
+// nic    Use the node of network interface ifname instead.
+// strict Bind memory to node instead of preferring it, Linux only.
+// pin    node runs threads on processors of node, the default with a node.
+//        cpu also pins each backend worker thread to a processor of its own.
+//
+// Memory policy and processor affinity are set for the process before other
+// threads start, so memory and threads of all modules follow them. Request
+// buffers additionally come from huge pages.
+
+#define PLACEMENT_MAX_BUFFERS   64
+#define PLACEMENT_MAX_NODES     1024
+#define PLACEMENT_MAX_CPUS      1024
+
+#define LARGE_PAGE_SIZE         ((size_t)2 << 20)
+#define HUGE_PAGE_SIZE          ((size_t)1 << 30)
+
+enum
+{
+    PagesSmall,
+    PagesThp,
+    Pages2M,
+    Pages1G,
+    PAGE_KINDS
+};
+
+static const char *const page_names[] = {
+    "small pages",
+    "transparent huge pages",
+    "2 MB pages",
+    "1 GB pages"
+};
+
+enum
+{
+    PinNone,
+    PinNode,
+    PinCpu
+};
+
+typedef struct _PLACEMENT_BUFFER
+{
+    void *ptr;
+    size_t length;
+} PLACEMENT_BUFFER, *PPLACEMENT_BUFFER;
+
+int placement_enabled = 0;
+
+static int pages = Pages2M;
+static int node = -1;
+static int strict = 0;
+static int pin = PinNone;
+
+static PLACEMENT_BUFFER buffers[PLACEMENT_MAX_BUFFERS];
+
+static uint64_t kind_buffers[PAGE_KINDS];
+static uint64_t kind_bytes[PAGE_KINDS];
+
+// Processors for pin=cpu, handed out in turn
+static int cpus[PLACEMENT_MAX_CPUS];
+static int cpu_count = 0;
+static int cpu_next = 0;
+static uint64_t pinned_threads = 0;
+
+#ifndef _WIN32
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#if defined(__linux__)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED          1
+#define MPOL_BIND               2
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT          26
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB            (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB            (30 << MAP_HUGE_SHIFT)
+#endif
+
+static int
+read_sys_int(const char *path, int *value)
+{
+    FILE *stream = fopen(path, "r");
+    int found;
+
+    if (stream == NULL)
+        return 0;
+
+    found = fscanf(stream, "%i", value) == 1;
+
+    fclose(stream);
+
+    return found;
+}
+
+// Node of the device a file is on, or of a block device itself. Partitions
+// and NVMe namespaces have the node on a parent device.
+static int
+find_image_node(const char *image)
+{
+    static const char *const attrs[] = {
+        "device/numa_node",
+        "device/device/numa_node",
+        "../device/numa_node",
+        "../device/device/numa_node"
+    };
+    struct stat st;
+    dev_t dev;
+    char path[128];
+    int value;
+    int i;
+
+    if (stat(image, &st) != 0)
+        return -1;
+
+    dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+    for (i = 0; i < (int)(sizeof(attrs) / sizeof(*attrs)); i++)
+    {
+        sprintf(path, "/sys/dev/block/%u:%u/%s", (unsigned int)major(dev),
+            (unsigned int)minor(dev), attrs[i]);
+
+        if (read_sys_int(path, &value) && value >= 0)
+            return value;
+    }
+
+    return -1;
+}
+
+static int
+find_nic_node(const char *ifname)
+{
+    char path[128];
+    int value;
+
+    if (strlen(ifname) > 64)
+        return -1;
+
+    sprintf(path, "/sys/class/net/%s/device/numa_node", ifname);
+
+    if (read_sys_int(path, &value) && value >= 0)
+        return value;
+
+    return -1;
+}
+
+static int
+node_cpus(cpu_set_t *set)
+{
+    char path[64];
+    char list[4096];
+    char *ptr = list;
+    FILE *stream;
+
+    CPU_ZERO(set);
+
+    sprintf(path, "/sys/devices/system/node/node%i/cpulist", node);
+
+    stream = fopen(path, "r");
+
+    if (stream == NULL)
+        return 0;
+
+    if (fgets(list, sizeof(list), stream) == NULL)
+        list[0] = 0;
+
+    fclose(stream);
+
+    while (*ptr >= '0' && *ptr <= '9')
+    {
+        long first = strtol(ptr, &ptr, 10);
+        long last = first;
+
+        if (*ptr == '-')
+            last = strtol(ptr + 1, &ptr, 10);
+
+        for (; first <= last && first < CPU_SETSIZE; first++)
+            CPU_SET((int)first, set);
+
+        if (*ptr == ',')
+            ++ptr;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+// Sets memory policy and processor affinity of the process, inherited by
+// threads started later.
+static int
+apply_node()
+{
+    cpu_set_t set;
+    int i;
+
+    if (node >= 0)
+    {
+        unsigned long mask[PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))];
+
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] |=
+            1UL << (node % (8 * sizeof(unsigned long)));
+
+        if (syscall(SYS_set_mempolicy, strict ? MPOL_BIND : MPOL_PREFERRED,
+            mask, (unsigned long)(sizeof(mask) * 8)) != 0)
+        {
+            perror("set_mempolicy()");
+            return 0;
+        }
+    }
+
+    if (pin == PinNone)
+        return 1;
+
+    if (node >= 0)
+    {
+        if (!node_cpus(&set))
+        {
+            fprintf(stderr, "No processors found on NUMA node %i.\n", node);
+            return 0;
+        }
+
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            perror("sched_setaffinity()");
+            return 0;
+        }
+    }
+    else if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        perror("sched_getaffinity()");
+        return 0;
+    }
+
+    for (i = 0; i < CPU_SETSIZE && cpu_count < PLACEMENT_MAX_CPUS; i++)
+        if (CPU_ISSET(i, &set))
+            cpus[cpu_count++] = i;
+
+    return 1;
+}
+
+static int
+pin_thread_to(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void *
+map_buffer(size_t size, int kind, size_t *length)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char *ptr;
+
+    switch (kind)
+    {
+    case Pages1G:
+        *length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+        break;
+
+    case Pages2M:
+        *length = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+        flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+        break;
+
+    case PagesThp:
+        *length = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+        break;
+
+    default:
+        *length = size;
+    }
+
+    // Transparent huge pages need aligned addresses, trimmed from a larger
+    // mapping
+    if (kind == PagesThp)
+    {
+        size_t head;
+
+        ptr = (char*)mmap(NULL, *length + LARGE_PAGE_SIZE,
+            PROT_READ | PROT_WRITE, flags, -1, 0);
+
+        if (ptr == (char*)MAP_FAILED)
+            return NULL;
+
+        head = (LARGE_PAGE_SIZE - ((uintptr_t)ptr & (LARGE_PAGE_SIZE - 1))) &
+            (LARGE_PAGE_SIZE - 1);
+
+        if (head > 0)
+            munmap(ptr, head);
+
+        munmap(ptr + head + *length, LARGE_PAGE_SIZE - head);
+
+        ptr += head;
+
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, *length, MADV_HUGEPAGE);
+#endif
+
+        return ptr;
+    }
+
+    ptr = (char*)mmap(NULL, *length, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+    if (ptr == (char*)MAP_FAILED)
+        return NULL;
+
+    return ptr;
+}
+
+static void
+unmap_buffer(void *ptr, size_t length)
+{
+    munmap(ptr, length);
+}
+
+#elif defined(_WIN32)
+
+static int
+find_image_node(const char *image)
+{
+    UNREFERENCED_PARAMETER(image);
+
+    return -1;
+}
+
+static int
+find_nic_node(const char *ifname)
+{
+    UNREFERENCED_PARAMETER(ifname);
+
+    return -1;
+}
+
+static int
+apply_node()
+{
+    ULONGLONG mask = 0;
+    DWORD_PTR process_mask;
+    DWORD_PTR system_mask;
+    int i;
+
+    if (pin == PinNone)
+        return 1;
+
+    if (node >= 0)
+    {
+        if (!GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0)
+        {
+            fprintf(stderr, "No processors found on NUMA node %i.\n", node);
+            return 0;
+        }
+
+        if (!SetProcessAffinityMask(GetCurrentProcess(), (DWORD_PTR)mask))
+        {
+            fprintf(stderr, "SetProcessAffinityMask() failed: %u\n",
+                (unsigned int)GetLastError());
+            return 0;
+        }
+    }
+    else if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+        &system_mask))
+        mask = process_mask;
+
+    for (i = 0; i < (int)(sizeof(mask) * 8); i++)
+        if (mask & ((ULONGLONG)1 << i))
+            cpus[cpu_count++] = i;
+
+    return 1;
+}
+
+static int
+pin_thread_to(int cpu)
+{
+    return SetThreadAffinityMask(GetCurrentThread(),
+        (DWORD_PTR)1 << cpu) != 0;
+}
+
+// Large pages need the lock pages in memory privilege. Memory is placed on
+// the preferred node per buffer.
+static void *
+map_buffer(size_t size, int kind, size_t *length)
+{
+    DWORD type = MEM_RESERVE | MEM_COMMIT;
+    DWORD preferred = node >= 0 ? (DWORD)node : NUMA_NO_PREFERRED_NODE;
+
+    *length = size;
+
+    if (kind >= Pages2M)
+    {
+        size_t page = GetLargePageMinimum();
+
+        if (page == 0 || kind == Pages1G)
+            return NULL;
+
+        *length = (size + page - 1) & ~(page - 1);
+        type |= MEM_LARGE_PAGES;
+    }
+    else if (kind == PagesThp)
+        return NULL;
+
+    return VirtualAllocExNuma(GetCurrentProcess(), NULL, *length, type,
+        PAGE_READWRITE, preferred);
+}
+
+static void
+unmap_buffer(void *ptr, size_t length)
+{
+    UNREFERENCED_PARAMETER(length);
+
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+#else
+
+static int
+find_image_node(const char *image)
+{
+    (void)image;
+
+    return -1;
+}
+
+static int
+find_nic_node(const char *ifname)
+{
+    (void)ifname;
+
+    return -1;
+}
+
+static int
+apply_node()
+{
+    if (node >= 0 || pin != PinNone)
+    {
+        fprintf(stderr, "NUMA placement is not supported on this system.\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+pin_thread_to(int cpu)
+{
+    (void)cpu;
+
+    return 0;
+}
+
+static void *
+map_buffer(size_t size, int kind, size_t *length)
+{
+    *length = size;
+
+    if (kind != PagesSmall)
+        return NULL;
+
+    return malloc(size);
+}
+
+static void
+unmap_buffer(void *ptr, size_t length)
+{
+    (void)length;
+
+    free(ptr);
+}
+
+#endif
+
+int
+placement_init(const char *spec, const char *image)
+{
+    char value[80];
+
+    if (backend_get_option(spec, "pages", value, sizeof(value)))
+    {
+        if (_stricmp(value, "small") == 0)
+            pages = PagesSmall;
+        else if (_stricmp(value, "thp") == 0)
+            pages = PagesThp;
+        else if (_stricmp(value, "2m") == 0)
+            pages = Pages2M;
+        else if (_stricmp(value, "1g") == 0)
+            pages = Pages1G;
+        else
+        {
+            fprintf(stderr, "Invalid page size: '%s'\n", value);
+            return 0;
+        }
+    }
+
+    if (backend_get_option(spec, "nic", value, sizeof(value)))
+    {
+        node = find_nic_node(value);
+
+        if (node < 0)
+            fprintf(stderr, "No NUMA node known for interface '%s'.\n",
+                value);
+    }
+    else if (backend_get_option(spec, "node", value, sizeof(value)))
+    {
+        if (_stricmp(value, "image") == 0)
+        {
+            node = find_image_node(image);
+
+            if (node < 0)
+                fprintf(stderr, "No NUMA node known for device of '%s'.\n",
+                    image);
+        }
+        else
+        {
+            char *end;
+
+            node = (int)strtol(value, &end, 0);
+
+            if (*end != 0 || node < 0 || node >= PLACEMENT_MAX_NODES)
+            {
+                fprintf(stderr, "Invalid NUMA node: '%s'\n", value);
+                return 0;
+            }
+        }
+    }
+
+    strict = backend_get_option(spec, "strict", NULL, 0);
+
+    if (node >= 0)
+        pin = PinNode;
+
+    if (backend_get_option(spec, "pin", value, sizeof(value)))
+    {
+        if (value[0] == 0 || _stricmp(value, "node") == 0)
+            pin = PinNode;
+        else if (_stricmp(value, "cpu") == 0)
+            pin = PinCpu;
+        else if (_stricmp(value, "none") == 0)
+            pin = PinNone;
+        else
+        {
+            fprintf(stderr, "Invalid pinning: '%s'\n", value);
+            return 0;
+        }
+    }
+
+    if (!apply_node())
+        return 0;
+
+    placement_enabled = 1;
+
+    printf("Allocating buffers on %s", page_names[pages]);
+
+    if (node >= 0)
+        printf(", %s NUMA node %i", strict ? "bound to" : "preferring", node);
+
+    if (pin == PinCpu)
+        printf(", workers pinned to %i processors", cpu_count);
+    else if (pin == PinNode && node >= 0)
+        printf(", threads on %i processors of node", cpu_count);
+
+    puts(".");
+
+    return 1;
+}
+
+void *
+placement_alloc(size_t size)
+{
+    void *ptr = NULL;
+    size_t length = 0;
+    int kind;
+    int slot;
+
+    if (!placement_enabled || size == 0)
+        return malloc(size);
+
+#ifndef _WIN32
+    pthread_mutex_lock(&placement_lock);
+#endif
+
+    for (slot = 0; slot < PLACEMENT_MAX_BUFFERS; slot++)
+        if (buffers[slot].ptr == NULL)
+            break;
+
+    if (slot < PLACEMENT_MAX_BUFFERS)
+        for (kind = pages; ptr == NULL && kind >= PagesSmall; kind--)
+        {
+            ptr = map_buffer(size, kind, &length);
+
+            if (ptr != NULL)
+            {
+                buffers[slot].ptr = ptr;
+                buffers[slot].length = length;
+
+                ++kind_buffers[kind];
+                kind_bytes[kind] += length;
+            }
+        }
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&placement_lock);
+#endif
+
+    if (ptr == NULL)
+        ptr = malloc(size);
+
+    return ptr;
+}
+
+void
+placement_free(void *ptr)
+{
+    int slot;
+
+    if (ptr == NULL)
+        return;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&placement_lock);
+#endif
+
+    for (slot = 0; slot < PLACEMENT_MAX_BUFFERS; slot++)
+        if (buffers[slot].ptr == ptr)
+        {
+            unmap_buffer(ptr, buffers[slot].length);
+            buffers[slot].ptr = NULL;
+            break;
+        }
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&placement_lock);
+#endif
+
+    if (slot == PLACEMENT_MAX_BUFFERS)
+        free(ptr);
+}
+
+void
+placement_pin_thread()
+{
+    int cpu;
+
+    if (!placement_enabled || pin != PinCpu || cpu_count == 0)
+        return;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&placement_lock);
+#endif
+
+    cpu = cpus[cpu_next];
+    cpu_next = (cpu_next + 1) % cpu_count;
+
+    if (pin_thread_to(cpu))
+        ++pinned_threads;
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&placement_lock);
+#endif
+}
+
+void
+placement_close()
+{
+    int kind;
+
+    if (!placement_enabled)
+        return;
+
+    for (kind = PAGE_KINDS - 1; kind >= PagesSmall; kind--)
+        if (kind_buffers[kind] != 0)
+            printf("Placement: " ULL_FMT " buffers, " ULL_FMT " bytes on %s.\n",
+                (ULONGLONG)kind_buffers[kind], (ULONGLONG)kind_bytes[kind],
+                page_names[kind]);
+
+    if (pinned_threads != 0)
+        printf("Placement: " ULL_FMT " worker threads pinned.\n",
+            (ULONGLONG)pinned_threads);
+}
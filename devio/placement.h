@@ -0,0 +1,62 @@
+/*
+NUMA node and page size placement of devio buffers and threads.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_PLACEMENT_
+#define _INC_PLACEMENT_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern int placement_enabled;
+
+    // Applies [options] for page size, NUMA node and thread pinning. image
+    // is the image path, used to find the node of the device it is on.
+    // Called before buffers are allocated and threads are started, which
+    // then inherit node and processor affinity. Returns zero on failure.
+    int placement_init(const char *spec, const char *image);
+
+    // Allocates an I/O buffer on large pages where possible when enabled,
+    // and with malloc() otherwise. Returns NULL on failure.
+    void *placement_alloc(size_t size);
+
+    // Frees a buffer from placement_alloc().
+    void placement_free(void *ptr);
+
+    // With pin=cpu, pins calling worker thread to a processor of its own
+    // among those of the node, in turn.
+    void placement_pin_thread();
+
+    // Prints statistics.
+    void placement_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_PLACEMENT_
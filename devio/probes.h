@@ -0,0 +1,73 @@
+/*
+Static tracing probes for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_PROBES_
+#define _INC_PROBES_
+
+// USDT probes in provider devio, for bpftrace, perf and systemtap. When
+// built with sys/sdt.h from systemtap, each probe is a single nop
+// instruction and an ELF note describing where its arguments are, so
+// probes cost nothing until a tracer attaches. Without sys/sdt.h, or when
+// built with -DDEVIO_NO_PROBES, probes compile to nothing.
+//
+// request__receive     request_code
+// backend__submit      request_code, offset, length
+// backend__complete    request_code, bytes, errorno
+// response__sent       request_code
+// vhd__block__lookup   block_number, allocated
+// vhd__block__alloc    block_number, file_offset
+//
+// Offsets are relative to start of served image. Unmap and zero requests
+// submit with offset and length of their first range. Sample scripts are
+// in the bpftrace directory.
+
+#if !defined(DEVIO_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DEVIO_PROBES 1
+#endif
+#endif
+
+#ifdef DEVIO_PROBES
+
+#define devio_probe1(name, a) \
+    DTRACE_PROBE1(devio, name, a)
+#define devio_probe2(name, a, b) \
+    DTRACE_PROBE2(devio, name, a, b)
+#define devio_probe3(name, a, b, c) \
+    DTRACE_PROBE3(devio, name, a, b, c)
+
+#else
+
+#define devio_probe1(name, a)
+#define devio_probe2(name, a, b)
+#define devio_probe3(name, a, b, c)
+
+#endif
+
+#endif // _INC_PROBES_
@@ -0,0 +1,582 @@
+/*
+Per-client quality of service limits for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "qos.h"
+
+#define DEF_BURST_MSEC          100
+#define MAX_OPTIONS             4096
+
+// --qos=[file][,options]
+//
+// iops=n, bw=bytes, weight=w
+//          Limits for main connection.
+// export_iops=n, export_bw=bytes, export_weight=w
+//          Limits for snapshot export connections, such as backup jobs.
+// total_iops=n, total_bw=bytes
+//          Limits for the volume, shared by all classes in proportion to
+//          their weights, 1 by default.
+// burst=msec
+//          Tokens a bucket can save up, in time at its rate, 100 by
+//          default.
+//
+// Each limit is a token bucket. A request waits until the buckets of its
+// class have tokens, then takes one IOPS token and its length in bandwidth
+// tokens, which can leave a bucket in debt for large requests. With volume
+// limits, requests that passed their class limits are then admitted in
+// start-time fair queuing order: each request gets a tag of its class'
+// previous tag, or the current virtual time if later, and the class'
+// next tag advances by request cost divided by weight. Waiting requests are
+// admitted lowest tag first, as the volume buckets allow. Unmap and zero
+// requests only count against IOPS limits.
+//
+// Waiting requests hold back the connection they arrived on, so pipelined
+// requests queue up in the socket and throttle the client. With a file,
+// options are read from it, separated by commas or whitespace, and read
+// again on SIGHUP so limits can be adjusted at runtime.
+
+typedef struct _QOS_BUCKET
+{
+    double rate;                // Tokens per second, zero for unlimited
+    double capacity;
+    double tokens;
+    uint64_t updated;
+} QOS_BUCKET, *PQOS_BUCKET;
+
+typedef struct _QOS_CLASS
+{
+    QOS_BUCKET iops;
+    QOS_BUCKET bandwidth;
+    double weight;
+    double next_tag;
+
+    uint64_t requests;
+    uint64_t delayed;
+    uint64_t delay_nsec;
+} QOS_CLASS, *PQOS_CLASS;
+
+// Request waiting for volume limits
+typedef struct _QOS_WAITER
+{
+    struct _QOS_WAITER *next;
+    double tag;
+} QOS_WAITER, *PQOS_WAITER;
+
+static const char *qos_class_names[] = {
+    "client", "export"
+};
+
+static const char *qos_class_prefixes[] = {
+    "", "export_"
+};
+
+int qos_enabled = 0;
+
+static QOS_CLASS classes[QOS_CLASSES];
+static QOS_BUCKET total_iops;
+static QOS_BUCKET total_bandwidth;
+static PQOS_WAITER waiters = NULL;
+static double virtual_time = 0;
+static char qos_file[260] = "";
+
+#ifdef _MSC_VER
+static __declspec(thread) int current_class = QosClassClient;
+#else
+static __thread int current_class = QosClassClient;
+#endif
+
+#ifdef _WIN32
+
+#define qos_lock()
+#define qos_unlock()
+
+#else
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t reload_pending = 0;
+
+#define qos_lock()              pthread_mutex_lock(&lock)
+#define qos_unlock()            pthread_mutex_unlock(&lock)
+
+#endif
+
+static uint64_t
+qos_time_nsec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000000 /
+        frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Waits for nsec, or indefinitely if zero, or until woken by another
+// request. Called with lock held.
+static void
+qos_wait(uint64_t nsec)
+{
+#ifdef _WIN32
+    Sleep(nsec != 0 ? (DWORD)((nsec + 999999) / 1000000) : 1);
+#else
+    if (nsec == 0)
+        pthread_cond_wait(&wake, &lock);
+    else
+    {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        nsec += deadline.tv_nsec;
+        deadline.tv_sec += (time_t)(nsec / 1000000000);
+        deadline.tv_nsec = (long)(nsec % 1000000000);
+
+        pthread_cond_timedwait(&wake, &lock, &deadline);
+    }
+#endif
+}
+
+static void
+bucket_set(PQOS_BUCKET bucket, double rate, double burst_msec)
+{
+    bucket->rate = rate;
+    bucket->capacity = rate * burst_msec / 1000;
+
+    if (bucket->capacity < 1)
+        bucket->capacity = 1;
+
+    // New buckets start full, adjusted buckets keep any debt
+    if (bucket->updated == 0 || bucket->tokens > bucket->capacity)
+        bucket->tokens = bucket->capacity;
+
+    bucket->updated = qos_time_nsec();
+}
+
+// Time in nsec until bucket has tokens, zero if it has now.
+static uint64_t
+bucket_wait(PQOS_BUCKET bucket, uint64_t now)
+{
+    if (bucket->rate == 0)
+        return 0;
+
+    bucket->tokens += (now - bucket->updated) * bucket->rate / 1e9;
+    bucket->updated = now;
+
+    if (bucket->tokens > bucket->capacity)
+        bucket->tokens = bucket->capacity;
+
+    if (bucket->tokens > 0)
+        return 0;
+
+    return (uint64_t)(-bucket->tokens / bucket->rate * 1e9) + 1;
+}
+
+static void
+bucket_take(PQOS_BUCKET bucket, double cost)
+{
+    if (bucket->rate != 0)
+        bucket->tokens -= cost;
+}
+
+static uint64_t
+max_wait(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+static int
+qos_get_rate(const char *options, const char *prefix, const char *name,
+    double *rate)
+{
+    char option[32];
+    char value[64];
+    off_t_64 number;
+
+    strcpy(option, prefix);
+    strcat(option, name);
+
+    *rate = 0;
+
+    if (!backend_get_option(options, option, value, sizeof(value)))
+        return 1;
+
+    if (!backend_parse_size(value, &number) || number < 0)
+    {
+        fprintf(stderr, "QoS: Invalid %s: '%s'\n", option, value);
+        return 0;
+    }
+
+    *rate = (double)number;
+
+    return 1;
+}
+
+// Parses options and sets new limits. Keeps old limits on error. Called
+// with lock held.
+static int
+qos_apply(const char *options)
+{
+    double iops[QOS_CLASSES];
+    double bandwidth[QOS_CLASSES];
+    double weight[QOS_CLASSES];
+    double volume_iops;
+    double volume_bandwidth;
+    double burst = DEF_BURST_MSEC;
+    char value[64];
+    int i;
+
+    for (i = 0; i < QOS_CLASSES; i++)
+    {
+        char option[32];
+
+        if (!qos_get_rate(options, qos_class_prefixes[i], "iops", iops + i) ||
+            !qos_get_rate(options, qos_class_prefixes[i], "bw",
+                bandwidth + i))
+            return 0;
+
+        strcpy(option, qos_class_prefixes[i]);
+        strcat(option, "weight");
+
+        weight[i] = 1;
+
+        if (backend_get_option(options, option, value, sizeof(value)) &&
+            (weight[i] = strtod(value, NULL)) <= 0)
+        {
+            fprintf(stderr, "QoS: Invalid %s: '%s'\n", option, value);
+            return 0;
+        }
+    }
+
+    if (!qos_get_rate(options, "total_", "iops", &volume_iops) ||
+        !qos_get_rate(options, "total_", "bw", &volume_bandwidth))
+        return 0;
+
+    if (backend_get_option(options, "burst", value, sizeof(value)) &&
+        (burst = strtod(value, NULL)) <= 0)
+    {
+        fprintf(stderr, "QoS: Invalid burst: '%s'\n", value);
+        return 0;
+    }
+
+    for (i = 0; i < QOS_CLASSES; i++)
+    {
+        bucket_set(&classes[i].iops, iops[i], burst);
+        bucket_set(&classes[i].bandwidth, bandwidth[i], burst);
+        classes[i].weight = weight[i];
+
+        printf("QoS %s: ", qos_class_names[i]);
+
+        if (iops[i] != 0)
+            printf("%.0f IOPS, ", iops[i]);
+
+        if (bandwidth[i] != 0)
+            printf("%.0f bytes/s, ", bandwidth[i]);
+
+        printf("weight %g.\n", weight[i]);
+    }
+
+    bucket_set(&total_iops, volume_iops, burst);
+    bucket_set(&total_bandwidth, volume_bandwidth, burst);
+
+    if (volume_iops != 0 || volume_bandwidth != 0)
+        printf("QoS total: %.0f IOPS, %.0f bytes/s, burst %g msec.\n",
+            volume_iops, volume_bandwidth, burst);
+
+#ifndef _WIN32
+    // Waiting requests recalculate with new limits
+    pthread_cond_broadcast(&wake);
+#endif
+
+    return 1;
+}
+
+// Reads options from file, separated by commas, whitespace or newlines,
+// with # comments.
+static int
+qos_load(const char *file)
+{
+    char options[MAX_OPTIONS];
+    FILE *stream = fopen(file, "r");
+    size_t length = 0;
+    int comment = 0;
+    int c;
+
+    if (stream == NULL)
+    {
+        fprintf(stderr, "QoS: Cannot open '%s': %s\n", file, strerror(errno));
+        return 0;
+    }
+
+    while ((c = getc(stream)) != EOF && length < sizeof(options) - 1)
+    {
+        if (c == '#')
+            comment = 1;
+        else if (c == '\n')
+            comment = 0;
+
+        if (comment)
+            continue;
+
+        if (isspace(c) || c == ',')
+        {
+            if (length > 0 && options[length - 1] != ',')
+                options[length++] = ',';
+        }
+        else
+            options[length++] = (char)c;
+    }
+
+    fclose(stream);
+
+    options[length] = 0;
+
+    return qos_apply(options);
+}
+
+#ifndef _WIN32
+
+static void
+qos_signal(int sig)
+{
+    (void)sig;
+
+    reload_pending = 1;
+}
+
+#endif
+
+void
+qos_set_class(int qos_class)
+{
+    current_class = qos_class;
+}
+
+void
+qos_admit(uint64_t bytes)
+{
+    PQOS_CLASS qos_class;
+    uint64_t start;
+    uint64_t now;
+    uint64_t wait;
+
+    if (!qos_enabled)
+        return;
+
+    qos_class = classes + current_class;
+    start = now = qos_time_nsec();
+
+    qos_lock();
+
+#ifndef _WIN32
+    if (reload_pending)
+    {
+        reload_pending = 0;
+
+        if (qos_load(qos_file))
+            printf("QoS: Limits reloaded from '%s'.\n", qos_file);
+    }
+#endif
+
+    while ((wait = max_wait(bucket_wait(&qos_class->iops, now),
+        bucket_wait(&qos_class->bandwidth, now))) != 0)
+    {
+        qos_wait(wait);
+        now = qos_time_nsec();
+    }
+
+    bucket_take(&qos_class->iops, 1);
+    bucket_take(&qos_class->bandwidth, (double)bytes);
+
+    if (total_iops.rate != 0 || total_bandwidth.rate != 0)
+    {
+        QOS_WAITER waiter;
+        double cost = total_bandwidth.rate != 0 ? (double)bytes : 1;
+
+        waiter.tag = qos_class->next_tag > virtual_time ?
+            qos_class->next_tag : virtual_time;
+        qos_class->next_tag = waiter.tag + cost / qos_class->weight;
+
+        waiter.next = waiters;
+        waiters = &waiter;
+
+        for (;;)
+        {
+            PQOS_WAITER other;
+            int first = 1;
+
+            for (other = waiters; other != NULL; other = other->next)
+                if (other->tag < waiter.tag)
+                    first = 0;
+
+            wait = 0;
+
+            if (first && (wait = max_wait(bucket_wait(&total_iops, now),
+                bucket_wait(&total_bandwidth, now))) == 0)
+                break;
+
+            qos_wait(wait);
+            now = qos_time_nsec();
+        }
+
+        if (waiters == &waiter)
+            waiters = waiter.next;
+        else
+        {
+            PQOS_WAITER prev;
+
+            for (prev = waiters; prev->next != &waiter; prev = prev->next);
+
+            prev->next = waiter.next;
+        }
+
+        virtual_time = waiter.tag;
+
+        bucket_take(&total_iops, 1);
+        bucket_take(&total_bandwidth, (double)bytes);
+
+#ifndef _WIN32
+        pthread_cond_broadcast(&wake);
+#endif
+    }
+
+    ++qos_class->requests;
+
+    if (now != start)
+    {
+        ++qos_class->delayed;
+        qos_class->delay_nsec += now - start;
+    }
+
+    qos_unlock();
+}
+
+int
+qos_init(const char *spec)
+{
+    const char *opts = strchr(spec, ',');
+    size_t file_len = opts != NULL ? (size_t)(opts - spec) : strlen(spec);
+    int i;
+
+    if (file_len >= sizeof(qos_file))
+    {
+        fprintf(stderr, "Invalid QoS file name.\n");
+        return 0;
+    }
+
+    memcpy(qos_file, spec, file_len);
+    qos_file[file_len] = 0;
+
+    for (i = 0; i < QOS_CLASSES; i++)
+        classes[i].weight = 1;
+
+    if (qos_file[0] != 0)
+    {
+        if (opts != NULL)
+            fprintf(stderr, "QoS: Options in '%s' used instead of command "
+                "line.\n", qos_file);
+
+        if (!qos_load(qos_file))
+            return 0;
+
+#ifndef _WIN32
+        {
+            struct sigaction action = { 0 };
+
+            // Restart interrupted calls so request handling is not disturbed
+            action.sa_handler = qos_signal;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGHUP, &action, NULL);
+        }
+#endif
+    }
+    else if (!qos_apply(opts != NULL ? opts + 1 : ""))
+        return 0;
+
+    qos_enabled = 1;
+
+    return 1;
+}
+
+void
+qos_close()
+{
+    int i;
+
+    if (!qos_enabled)
+        return;
+
+    qos_enabled = 0;
+
+#ifndef _WIN32
+    if (qos_file[0] != 0)
+        signal(SIGHUP, SIG_DFL);
+#endif
+
+    for (i = 0; i < QOS_CLASSES; i++)
+        if (classes[i].requests != 0)
+            printf("QoS %s: " ULL_FMT " requests, " ULL_FMT " delayed, "
+                "average delay %.0f usec.\n", qos_class_names[i],
+                (ULONGLONG)classes[i].requests,
+                (ULONGLONG)classes[i].delayed,
+                classes[i].delayed != 0 ?
+                classes[i].delay_nsec / 1e3 / classes[i].delayed : 0.0);
+}
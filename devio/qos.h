@@ -0,0 +1,66 @@
+/*
+Per-client quality of service limits for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_QOS_
+#define _INC_QOS_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Clients are grouped in classes, each with its own IOPS and bandwidth
+    // token buckets, and a weight for sharing volume wide limits.
+    enum
+    {
+        QosClassClient,         // Main connection
+        QosClassExport,         // Snapshot export connections
+        QOS_CLASSES
+    };
+
+    extern int qos_enabled;
+
+    // Starts limiting according to [file][,options]. With file, options
+    // are read from file instead, and read again on SIGHUP. Returns zero
+    // on failure.
+    int qos_init(const char *spec);
+
+    // Sets class of requests on calling thread, QosClassClient by default.
+    void qos_set_class(int qos_class);
+
+    // Waits until a request of given size may start on calling thread,
+    // does nothing unless qos_enabled.
+    void qos_admit(uint64_t bytes);
+
+    // Prints statistics.
+    void qos_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_QOS_
@@ -26,6 +26,7 @@
 */
 
 #include <unistd.h>
+#include <sys/uio.h>
 #include <syslog.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -83,3 +84,53 @@ safe_write(int fd, const void *pdata, size_t size)
 
   return 1;
 }
+
+safeio_ssize_t
+safe_read_some(int fd, void *pdata, size_t size)
+{
+  ssize_t sizedone = read(fd, pdata, size);
+  if (sizedone == -1)
+    syslog(LOG_ERR, "safe_read_some(): %m\n");
+
+  return sizedone;
+}
+
+int
+safe_write_pair(int fd, const void *pdata1, size_t size1,
+		const void *pdata2, size_t size2)
+{
+  struct iovec iov[2];
+  int count = 2;
+
+  iov[0].iov_base = (void*) pdata1;
+  iov[0].iov_len = size1;
+  iov[1].iov_base = (void*) pdata2;
+  iov[1].iov_len = size2;
+
+  while (count > 0)
+    {
+      ssize_t sizedone = writev(fd, iov + 2 - count, count);
+      if (sizedone == -1)
+	{
+	  syslog(LOG_ERR, "safe_write_pair(): %m\n");
+	  return 0;
+	}
+
+      if (sizedone == 0)
+	return 0;
+
+      while (count > 0 && (size_t) sizedone >= iov[2 - count].iov_len)
+	{
+	  sizedone -= iov[2 - count].iov_len;
+	  --count;
+	}
+
+      if (count > 0)
+	{
+	  iov[2 - count].iov_base = (char*) iov[2 - count].iov_base + sizedone;
+	  iov[2 - count].iov_len -= sizedone;
+	}
+    }
+
+  return 1;
+}
@@ -96,6 +96,14 @@ extern "C" {
 
     int safe_write(SOCKET fd, const void *pdata, safeio_size_t size);
 
+    // One read of at most size bytes. Returns bytes read, 0 at end of
+    // stream or -1 on error.
+    safeio_ssize_t safe_read_some(SOCKET fd, void *pdata, safeio_size_t size);
+
+    // Writes both buffers, in one gathered write where supported.
+    int safe_write_pair(SOCKET fd, const void *pdata1, safeio_size_t size1,
+        const void *pdata2, safeio_size_t size2);
+
 #ifdef __cplusplus
 }
 #endif
@@ -52,3 +52,30 @@ safe_write(SOCKET fd, const void *pdata, safeio_size_t size)
 {
   return Overlapped.BufSend((HANDLE) fd, pdata, size);
 }
+
+extern "C"
+safeio_ssize_t
+safe_read_some(SOCKET fd, void *pdata, safeio_size_t size)
+{
+  if (!Overlapped.Read((HANDLE) fd, pdata, size))
+    if (GetLastError() != ERROR_IO_PENDING)
+      return GetLastError() == ERROR_HANDLE_EOF ||
+	GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+
+  DWORD dwReadLen;
+  if (!Overlapped.GetResult((HANDLE) fd, &dwReadLen))
+    return GetLastError() == ERROR_HANDLE_EOF ||
+      GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+
+  return (safeio_ssize_t) dwReadLen;
+}
+
+// No gathered write for handles, sent as two writes
+extern "C"
+int
+safe_write_pair(SOCKET fd, const void *pdata1, safeio_size_t size1,
+		const void *pdata2, safeio_size_t size2)
+{
+  return (size1 == 0 || Overlapped.BufSend((HANDLE) fd, pdata1, size1)) &&
+    Overlapped.BufSend((HANDLE) fd, pdata2, size2);
+}
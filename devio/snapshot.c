@@ -0,0 +1,1422 @@
+/*
+Redirect-on-write snapshots for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "safeio.h"
+#include "devio.h"
+#include "backend.h"
+#include "snapshot.h"
+#include "qos.h"
+
+#define DEF_BLOCK_SIZE          (64 << 10)
+
+#define SNAPSHOT_MAGIC          "DEVIOSNP"
+#define SNAPSHOT_VERSION        1
+#define SNAPSHOT_MAX            16
+#define SNAPSHOT_MAP_OFFSET     4096
+
+// --snapshots=storefile[,block=blocksize][,port=exportport]
+//
+// Image data is divided in blocks. For each block, a map tells where the
+// current data is stored, either in the image itself or in a slot in the
+// store file. A snapshot is a frozen copy of the map for the current image.
+//
+// Writes to a block that is referenced by a snapshot are redirected to a
+// new slot, leaving data seen by the snapshot in place. Writes to blocks
+// not referenced by any snapshot go directly to where the block is. When a
+// snapshot is deleted, blocks that have been redirected and are no longer
+// referenced by any snapshot are moved back to the image in the
+// background, so that the image is complete again when all snapshots are
+// gone.
+//
+// With port=exportport, the latest snapshot at connection time is served
+// read-only on that tcp port, while the image is in use on the main
+// connection. A snapshot cannot be deleted while it is exported. Snapshot
+// requests are accepted on exportport as well, so that snapshots can be
+// taken of an image that a driver holds the main connection to. A
+// connection is bound to the latest snapshot at its first read, so a
+// client can create a snapshot and then read it on the same connection.
+//
+// Store file layout:
+//
+// 0                    SNAPSHOT_HEADER
+// SNAPSHOT_MAP_OFFSET  Map for current image, then one map for each entry
+//                      in snapshot table. Map entries are 32 bit slot
+//                      numbers, zero for data in image.
+// data_offset          Slots, slot n at data_offset + (n - 1) * block size
+//
+// Slot data is written before map entries that reference it. Maps are
+// loaded at start and slot reference counts recalculated from them.
+
+#pragma pack(push, 1)
+typedef struct _SNAPSHOT_ENTRY
+{
+    uint64_t id;
+    uint64_t create_time;
+    uint32_t in_use;
+    uint32_t reserved;
+    uint64_t reserved2;
+} SNAPSHOT_ENTRY, *PSNAPSHOT_ENTRY;
+
+typedef struct _SNAPSHOT_HEADER
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t image_size;
+    uint64_t next_id;
+    uint64_t map_bytes;
+    uint64_t data_offset;
+    SNAPSHOT_ENTRY entries[SNAPSHOT_MAX];
+} SNAPSHOT_HEADER, *PSNAPSHOT_HEADER;
+#pragma pack(pop)
+
+int snapshot_enabled = 0;
+
+static int store_fd = -1;
+static SNAPSHOT_HEADER header;
+static off_t_64 base_offset;
+static off_t_64 image_size;
+static int image_read_only;
+static off_t_64 block_size;
+static off_t_64 blocks;
+static snapshot_io_proc base_read;
+static snapshot_io_proc base_write;
+static char *block_buf = NULL;
+
+// Map 0 is current image, map n + 1 belongs to header.entries[n]
+static uint32_t *maps[SNAPSHOT_MAX + 1];
+static int pinned[SNAPSHOT_MAX];
+
+// Number of maps referencing each slot, index 0 unused
+static uint16_t *refs = NULL;
+static uint32_t slot_count = 0;
+static uint32_t slot_capacity = 0;
+static uint32_t slot_hint = 1;
+
+#ifdef _WIN32
+
+#define snapshot_lock()
+#define snapshot_unlock()
+#define snapshot_wake_merge()   snapshot_merge_all()
+
+static void snapshot_merge_all();
+
+#else
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t merge_thread;
+static int merge_running = 0;
+static int merge_pending = 0;
+static int closing = 0;
+
+static SOCKET export_sd = INVALID_SOCKET;
+static SOCKET export_client = INVALID_SOCKET;
+static pthread_t export_thread;
+static int export_running = 0;
+
+#define snapshot_lock()         pthread_mutex_lock(&lock)
+#define snapshot_unlock()       pthread_mutex_unlock(&lock)
+#define snapshot_wake_merge() \
+    (merge_pending = 1, pthread_cond_signal(&merge_wake))
+
+#endif
+
+static off_t_64
+map_offset(int map, off_t_64 block)
+{
+    return SNAPSHOT_MAP_OFFSET + (off_t_64)header.map_bytes * map +
+        block * (off_t_64)sizeof(uint32_t);
+}
+
+static off_t_64
+slot_offset(uint32_t slot)
+{
+    return (off_t_64)header.data_offset + (off_t_64)(slot - 1) * block_size;
+}
+
+static off_t_64
+block_length(off_t_64 block)
+{
+    off_t_64 len = image_size - block * block_size;
+
+    return len < block_size ? len : block_size;
+}
+
+static void
+store_sync()
+{
+#ifdef _WIN32
+    FlushFileBuffers((HANDLE)_get_osfhandle(store_fd));
+#else
+    fsync(store_fd);
+#endif
+}
+
+// Makes slot data durable before map entries that reference it are saved.
+static int
+store_data_sync()
+{
+#if defined(_WIN32)
+    return FlushFileBuffers((HANDLE)_get_osfhandle(store_fd)) ? 0 : -1;
+#elif defined(__linux__)
+    return fdatasync(store_fd);
+#else
+    return fsync(store_fd);
+#endif
+}
+
+static int
+save_header()
+{
+    if (pwrite(store_fd, &header, sizeof(header), 0) !=
+        (safeio_ssize_t)sizeof(header))
+        return errno != 0 ? errno : EIO;
+
+    store_sync();
+
+    return 0;
+}
+
+static int
+save_map_entry(int map, off_t_64 block)
+{
+    if (pwrite(store_fd, maps[map] + block, sizeof(uint32_t),
+        map_offset(map, block)) != (safeio_ssize_t)sizeof(uint32_t))
+        return 0;
+
+    return 1;
+}
+
+static int
+find_entry(uint64_t id)
+{
+    int i;
+
+    for (i = 0; i < SNAPSHOT_MAX; i++)
+        if (header.entries[i].in_use && header.entries[i].id == id)
+            return i;
+
+    return -1;
+}
+
+// Non-zero if a snapshot sees the image data for block.
+static int
+base_shared(off_t_64 block)
+{
+    int i;
+
+    for (i = 0; i < SNAPSHOT_MAX; i++)
+        if (header.entries[i].in_use && maps[i + 1][block] == 0)
+            return 1;
+
+    return 0;
+}
+
+static uint32_t
+slot_alloc()
+{
+    uint32_t slot;
+
+    for (slot = slot_hint; slot <= slot_count; slot++)
+        if (refs[slot] == 0)
+        {
+            slot_hint = slot + 1;
+            return slot;
+        }
+
+    if (slot_count + 1 >= slot_capacity)
+    {
+        uint32_t capacity = slot_capacity < 1024 ? 1024 : slot_capacity * 2;
+        uint16_t *new_refs =
+            (uint16_t*)realloc(refs, capacity * sizeof(uint16_t));
+
+        if (new_refs == NULL)
+            return 0;
+
+        memset(new_refs + slot_capacity, 0,
+            (capacity - slot_capacity) * sizeof(uint16_t));
+
+        refs = new_refs;
+        slot_capacity = capacity;
+    }
+
+    slot_hint = ++slot_count + 1;
+
+    return slot_count;
+}
+
+static void
+slot_release(uint32_t slot)
+{
+    if (--refs[slot] == 0 && slot < slot_hint)
+        slot_hint = slot;
+}
+
+// Reads part of a block from image or slot, zero filled past end of data.
+static int
+read_location(uint32_t slot, char *io_ptr, safeio_size_t size,
+    off_t_64 offset)
+{
+    safeio_ssize_t done;
+
+    if (slot == 0)
+        done = base_read(io_ptr, size, base_offset + offset);
+    else
+        done = pread(store_fd, io_ptr, size,
+            slot_offset(slot) + offset % block_size);
+
+    if (done == -1)
+        return 0;
+
+    if (done < (safeio_ssize_t)size)
+        memset(io_ptr + done, 0, size - done);
+
+    return 1;
+}
+
+safeio_ssize_t
+snapshot_read(uint64_t id, char *io_ptr, safeio_size_t size,
+    off_t_64 offset)
+{
+    uint32_t *map;
+    off_t_64 pos;
+    off_t_64 end;
+    off_t_64 start;
+
+    if (offset < base_offset)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pos = offset - base_offset;
+
+    if (!backend_clip_range(pos, &size, image_size))
+        return -1;
+
+    end = pos + size;
+    start = pos;
+
+    snapshot_lock();
+
+    if (id == 0)
+        map = maps[0];
+    else
+    {
+        int entry = find_entry(id);
+
+        if (entry == -1)
+        {
+            snapshot_unlock();
+            errno = ENOENT;
+            return -1;
+        }
+
+        map = maps[entry + 1];
+    }
+
+    // Runs of blocks stored contiguously are read with one request
+    while (pos < end)
+    {
+        off_t_64 block = pos / block_size;
+        uint32_t slot = map[block];
+        off_t_64 run_end;
+
+        for (++block; block * block_size < end; ++block)
+            if (slot == 0 ? map[block] != 0 :
+                map[block] != slot + (block - pos / block_size))
+                break;
+
+        run_end = block * block_size;
+        if (run_end > end)
+            run_end = end;
+
+        if (!read_location(slot, io_ptr + (pos - start),
+            (safeio_size_t)(run_end - pos), pos))
+        {
+            snapshot_unlock();
+            return -1;
+        }
+
+        pos = run_end;
+    }
+
+    snapshot_unlock();
+
+    return (safeio_ssize_t)(end > start ? end - start : 0);
+}
+
+// Called with lock held. Writes part of a block that is shared with a
+// snapshot to a new slot.
+static int
+redirect_block(off_t_64 block, const char *io_ptr, off_t_64 pos,
+    safeio_size_t len)
+{
+    uint32_t old_slot = maps[0][block];
+    uint32_t new_slot = slot_alloc();
+    off_t_64 block_start = block * block_size;
+    safeio_size_t block_len = (safeio_size_t)block_length(block);
+
+    if (new_slot == 0)
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    ++refs[new_slot];
+
+    if (len < block_len &&
+        !read_location(old_slot, block_buf, block_len, block_start))
+    {
+        slot_release(new_slot);
+        return 0;
+    }
+
+    memcpy(block_buf + (pos - block_start), io_ptr, len);
+
+    if (pwrite(store_fd, block_buf, block_len, slot_offset(new_slot)) !=
+        (safeio_ssize_t)block_len || store_data_sync() != 0)
+    {
+        slot_release(new_slot);
+        return 0;
+    }
+
+    maps[0][block] = new_slot;
+
+    if (!save_map_entry(0, block))
+    {
+        maps[0][block] = old_slot;
+        slot_release(new_slot);
+        return 0;
+    }
+
+    if (old_slot != 0)
+        slot_release(old_slot);
+
+    return 1;
+}
+
+safeio_ssize_t
+snapshot_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t avail = size;
+    off_t_64 pos;
+    off_t_64 start;
+    off_t_64 end;
+
+    if (offset < base_offset)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pos = offset - base_offset;
+
+    if (!backend_clip_range(pos, &avail, image_size))
+        return -1;
+
+    if (avail < size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    start = pos;
+    end = pos + size;
+
+    snapshot_lock();
+
+    while (pos < end)
+    {
+        off_t_64 block = pos / block_size;
+        uint32_t slot = maps[0][block];
+        off_t_64 run_end;
+        safeio_size_t len;
+        safeio_ssize_t done;
+
+        if (slot == 0 && !base_shared(block))
+        {
+            // Blocks in image not seen by any snapshot, written in place
+            for (++block; block * block_size < end; ++block)
+                if (maps[0][block] != 0 || base_shared(block))
+                    break;
+
+            run_end = block * block_size;
+            if (run_end > end)
+                run_end = end;
+
+            len = (safeio_size_t)(run_end - pos);
+
+            done = base_write(io_ptr + (pos - start), len, base_offset + pos);
+        }
+        else
+        {
+            run_end = (block + 1) * block_size;
+            if (run_end > end)
+                run_end = end;
+
+            len = (safeio_size_t)(run_end - pos);
+
+            if (slot != 0 && refs[slot] == 1)
+                done = pwrite(store_fd, io_ptr + (pos - start), len,
+                    slot_offset(slot) + pos % block_size);
+            else if (redirect_block(block, io_ptr + (pos - start), pos, len))
+                done = len;
+            else
+                done = -1;
+        }
+
+        if (done != (safeio_ssize_t)len)
+        {
+            snapshot_unlock();
+
+            if (done >= 0)
+                errno = ENOSPC;
+
+            return -1;
+        }
+
+        pos = run_end;
+    }
+
+    snapshot_unlock();
+
+    return size;
+}
+
+// Called with lock held. Moves a redirected block back to image when no
+// snapshot references either copy.
+static void
+merge_block(off_t_64 block)
+{
+    uint32_t slot = maps[0][block];
+    safeio_size_t block_len;
+
+    if (slot == 0 || refs[slot] != 1 || base_shared(block))
+        return;
+
+    block_len = (safeio_size_t)block_length(block);
+
+    if (!read_location(slot, block_buf, block_len, block * block_size) ||
+        base_write(block_buf, block_len, base_offset + block * block_size) !=
+        (safeio_ssize_t)block_len)
+    {
+        fprintf(stderr, "Snapshot store: Error moving block " SLL_FMT
+            " back to image: %s\n", (int64_t)block, strerror(errno));
+        return;
+    }
+
+    maps[0][block] = 0;
+
+    if (!save_map_entry(0, block))
+    {
+        maps[0][block] = slot;
+        return;
+    }
+
+    slot_release(slot);
+}
+
+#ifdef _WIN32
+
+static void
+snapshot_merge_all()
+{
+    off_t_64 block;
+
+    for (block = 0; block < blocks; block++)
+        merge_block(block);
+}
+
+#else
+
+// One block at a time so that requests are not held up for long.
+static void *
+snapshot_merge_thread(void *arg)
+{
+    snapshot_lock();
+
+    while (!closing)
+    {
+        off_t_64 block;
+
+        if (!merge_pending)
+        {
+            pthread_cond_wait(&merge_wake, &lock);
+            continue;
+        }
+
+        merge_pending = 0;
+
+        for (block = 0; block < blocks && !closing; block++)
+        {
+            merge_block(block);
+
+            snapshot_unlock();
+            snapshot_lock();
+        }
+    }
+
+    snapshot_unlock();
+
+    return NULL;
+}
+
+#endif
+
+static void
+fill_info(int entry, PSNAPSHOT_INFO info)
+{
+    uint32_t *map = maps[entry + 1];
+    off_t_64 block;
+
+    info->id = header.entries[entry].id;
+    info->create_time = header.entries[entry].create_time;
+    info->changed_bytes = 0;
+    info->exclusive_bytes = 0;
+
+    for (block = 0; block < blocks; block++)
+    {
+        uint32_t slot = map[block];
+        int exclusive;
+
+        if (slot == maps[0][block])
+            continue;
+
+        info->changed_bytes += block_length(block);
+
+        if (slot != 0)
+            exclusive = refs[slot] == 1;
+        else
+        {
+            int i;
+
+            exclusive = 1;
+
+            for (i = 0; i < SNAPSHOT_MAX; i++)
+                if (i != entry && header.entries[i].in_use &&
+                    maps[i + 1][block] == 0)
+                    exclusive = 0;
+        }
+
+        if (exclusive)
+            info->exclusive_bytes += block_length(block);
+    }
+}
+
+int
+snapshot_create(PSNAPSHOT_INFO info)
+{
+    safeio_size_t map_size = (safeio_size_t)(blocks * sizeof(uint32_t));
+    uint32_t *map;
+    off_t_64 block;
+    int entry;
+    int rc;
+
+    snapshot_lock();
+
+    for (entry = 0; entry < SNAPSHOT_MAX; entry++)
+        if (!header.entries[entry].in_use)
+            break;
+
+    if (entry == SNAPSHOT_MAX)
+    {
+        snapshot_unlock();
+        return ENOSPC;
+    }
+
+    map = (uint32_t*)malloc(map_size);
+
+    if (map == NULL)
+    {
+        snapshot_unlock();
+        return ENOMEM;
+    }
+
+    memcpy(map, maps[0], map_size);
+
+    if (pwrite(store_fd, map, map_size, map_offset(entry + 1, 0)) !=
+        (safeio_ssize_t)map_size)
+    {
+        rc = errno != 0 ? errno : EIO;
+        free(map);
+        snapshot_unlock();
+        return rc;
+    }
+
+    header.entries[entry].id = header.next_id++;
+    header.entries[entry].create_time = (uint64_t)time(NULL);
+    header.entries[entry].in_use = 1;
+
+    rc = save_header();
+
+    if (rc != 0)
+    {
+        header.entries[entry].in_use = 0;
+        free(map);
+        snapshot_unlock();
+        return rc;
+    }
+
+    maps[entry + 1] = map;
+
+    for (block = 0; block < blocks; block++)
+        if (map[block] != 0)
+            ++refs[map[block]];
+
+    if (info != NULL)
+        fill_info(entry, info);
+
+    snapshot_unlock();
+
+    return 0;
+}
+
+int
+snapshot_delete(uint64_t id)
+{
+    off_t_64 block;
+    int entry;
+    int rc;
+
+    snapshot_lock();
+
+    entry = find_entry(id);
+
+    if (entry == -1)
+    {
+        snapshot_unlock();
+        return ENOENT;
+    }
+
+    if (pinned[entry])
+    {
+        snapshot_unlock();
+        return EBUSY;
+    }
+
+    header.entries[entry].in_use = 0;
+
+    rc = save_header();
+
+    if (rc != 0)
+    {
+        header.entries[entry].in_use = 1;
+        snapshot_unlock();
+        return rc;
+    }
+
+    for (block = 0; block < blocks; block++)
+        if (maps[entry + 1][block] != 0)
+            slot_release(maps[entry + 1][block]);
+
+    free(maps[entry + 1]);
+    maps[entry + 1] = NULL;
+
+    snapshot_wake_merge();
+
+    snapshot_unlock();
+
+    return 0;
+}
+
+int
+snapshot_query(uint64_t id, PSNAPSHOT_INFO info)
+{
+    int found = -1;
+    int i;
+
+    snapshot_lock();
+
+    for (i = 0; i < SNAPSHOT_MAX; i++)
+        if (header.entries[i].in_use && header.entries[i].id >= id &&
+            (found == -1 ||
+                header.entries[i].id < header.entries[found].id))
+            found = i;
+
+    if (found == -1)
+    {
+        snapshot_unlock();
+        return ENOENT;
+    }
+
+    fill_info(found, info);
+
+    snapshot_unlock();
+
+    return 0;
+}
+
+int
+snapshot_control(uint64_t operation, uint64_t id, PSNAPSHOT_INFO info)
+{
+    int rc;
+
+    switch (operation)
+    {
+    case SnapshotCreate:
+        if (image_read_only)
+            return EBADF;
+
+        rc = snapshot_create(info);
+
+        if (rc == 0)
+            printf("Created snapshot " ULL_FMT ".\n", info->id);
+
+        return rc;
+
+    case SnapshotDelete:
+        rc = snapshot_delete(id);
+        info->id = id;
+
+        if (rc == 0)
+            printf("Deleted snapshot " ULL_FMT ".\n", id);
+
+        return rc;
+
+    case SnapshotQuery:
+        return snapshot_query(id, info);
+
+    default:
+        return EINVAL;
+    }
+}
+
+#ifndef _WIN32
+
+// Binds a connection to the latest snapshot, which cannot be deleted until
+// the connection is closed. Returns -1 if there are no snapshots.
+static int
+export_pin(uint64_t *id)
+{
+    int entry = -1;
+    int i;
+
+    snapshot_lock();
+
+    for (i = 0; i < SNAPSHOT_MAX; i++)
+        if (header.entries[i].in_use &&
+            (entry == -1 ||
+                header.entries[i].id > header.entries[entry].id))
+            entry = i;
+
+    if (entry != -1)
+    {
+        *id = header.entries[entry].id;
+        ++pinned[entry];
+    }
+
+    snapshot_unlock();
+
+    return entry;
+}
+
+static void
+export_serve(SOCKET sd)
+{
+    char *export_buf = NULL;
+    safeio_size_t export_buf_size = 0;
+    uint64_t id = 0;
+    int entry = -1;
+
+    for (;;)
+    {
+        ULONGLONG req;
+
+        if (!safe_read(sd, &req, sizeof(req)) || req == IMDPROXY_REQ_CLOSE)
+            break;
+
+        if (req == IMDPROXY_REQ_INFO)
+        {
+            IMDPROXY_INFO_RESP info;
+
+            info.file_size = (ULONGLONG)image_size;
+            info.req_alignment = 1;
+            info.flags = IMDPROXY_FLAG_RO | IMDPROXY_FLAG_SUPPORTS_SNAPSHOT;
+
+            if (!safe_write(sd, &info, sizeof(info)))
+                break;
+        }
+        else if (req == IMDPROXY_REQ_READ)
+        {
+            IMDPROXY_READ_REQ req_block;
+            IMDPROXY_READ_RESP resp_block = { 0 };
+            safeio_ssize_t done;
+
+            if (!safe_read(sd, &req_block.offset,
+                sizeof(req_block) - sizeof(req_block.request_code)))
+                break;
+
+            if (req_block.length > export_buf_size)
+            {
+                char *new_buf = (char*)realloc(export_buf,
+                    (size_t)req_block.length);
+
+                if (new_buf == NULL)
+                    break;
+
+                export_buf = new_buf;
+                export_buf_size = (safeio_size_t)req_block.length;
+            }
+
+            qos_admit(req_block.length);
+
+            if (entry == -1 && (entry = export_pin(&id)) != -1)
+                printf("Snapshot export: Serving snapshot " ULL_FMT ".\n",
+                    id);
+
+            if (entry == -1)
+            {
+                errno = ENOENT;
+                done = -1;
+            }
+            else
+                done = snapshot_read(id, export_buf,
+                    (safeio_size_t)req_block.length,
+                    base_offset + (off_t_64)req_block.offset);
+
+            if (done == -1)
+                resp_block.errorno = errno;
+            else
+            {
+                // Past end of image reads as zeros, as on main connection
+                memset(export_buf + done, 0,
+                    (size_t)req_block.length - done);
+                resp_block.length = req_block.length;
+            }
+
+            if (!safe_write(sd, &resp_block, sizeof(resp_block)) ||
+                (resp_block.errorno == 0 &&
+                    !safe_write(sd, export_buf,
+                        (safeio_size_t)resp_block.length)))
+                break;
+        }
+        else if (req == IMDPROXY_REQ_SNAPSHOT)
+        {
+            IMDPROXY_SNAPSHOT_REQ req_block;
+            IMDPROXY_SNAPSHOT_RESP resp_block = { 0 };
+            SNAPSHOT_INFO info = { 0 };
+
+            if (!safe_read(sd, &req_block.operation_code,
+                sizeof(req_block) - sizeof(req_block.request_code)))
+                break;
+
+            resp_block.errorno = snapshot_control(req_block.operation_code,
+                req_block.snapshot_id, &info);
+
+            if (resp_block.errorno == 0)
+            {
+                resp_block.snapshot_id = info.id;
+                resp_block.create_time = info.create_time;
+                resp_block.changed_bytes = info.changed_bytes;
+                resp_block.exclusive_bytes = info.exclusive_bytes;
+            }
+
+            if (!safe_write(sd, &resp_block, sizeof(resp_block)))
+                break;
+        }
+        else
+        {
+            ULONGLONG resp = ENODEV;
+
+            if (!safe_write(sd, &resp, sizeof(resp)))
+                break;
+        }
+    }
+
+    free(export_buf);
+
+    if (entry != -1)
+    {
+        snapshot_lock();
+        --pinned[entry];
+        snapshot_unlock();
+    }
+}
+
+static void *
+snapshot_export_thread(void *arg)
+{
+    qos_set_class(QosClassExport);
+
+    for (;;)
+    {
+        struct sockaddr_in saddr;
+        socklen_t len = sizeof(saddr);
+        SOCKET sd = accept(export_sd, (struct sockaddr*)&saddr, &len);
+        int i;
+
+        if (sd == INVALID_SOCKET)
+        {
+            if (closing)
+                break;
+
+            continue;
+        }
+
+        // Lets snapshot_close() interrupt the connection
+        snapshot_lock();
+
+        if (closing)
+        {
+            snapshot_unlock();
+            closesocket(sd);
+            break;
+        }
+
+        export_client = sd;
+
+        snapshot_unlock();
+
+        printf("Snapshot export: Connection from %s:%u.\n",
+            inet_ntoa(saddr.sin_addr), (unsigned int)ntohs(saddr.sin_port));
+
+        i = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (const char*)&i, sizeof i);
+
+        export_serve(sd);
+
+        snapshot_lock();
+        export_client = INVALID_SOCKET;
+        snapshot_unlock();
+
+        closesocket(sd);
+
+        printf("Snapshot export: Connection closed.\n");
+    }
+
+    return NULL;
+}
+
+static int
+export_start(u_short port)
+{
+    struct sockaddr_in saddr = { 0 };
+    int reuse = 1;
+
+    export_sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (export_sd == INVALID_SOCKET)
+    {
+        fprintf(stderr, "Snapshot export: socket() failed: %s\n",
+            strerror(errno));
+        return 0;
+    }
+
+    // Connections to exported snapshots are typically short-lived, allow
+    // restarting while old ones are in TIME_WAIT
+    setsockopt(export_sd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse,
+        sizeof reuse);
+
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    saddr.sin_port = htons(port);
+
+    if (bind(export_sd, (struct sockaddr*)&saddr, sizeof saddr) == -1 ||
+        listen(export_sd, 1) == -1)
+    {
+        fprintf(stderr, "Snapshot export: Cannot listen on port %u: %s\n",
+            (unsigned int)port, strerror(errno));
+        closesocket(export_sd);
+        export_sd = INVALID_SOCKET;
+        return 0;
+    }
+
+    if (pthread_create(&export_thread, NULL, snapshot_export_thread,
+        NULL) != 0)
+    {
+        closesocket(export_sd);
+        export_sd = INVALID_SOCKET;
+        return 0;
+    }
+
+    export_running = 1;
+
+    printf("Snapshots exported read-only on port %u.\n", (unsigned int)port);
+
+    return 1;
+}
+
+#endif
+
+static int
+store_create(const char *file)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.block_size = (uint32_t)block_size;
+    header.image_size = (uint64_t)image_size;
+    header.next_id = 1;
+    header.map_bytes = (blocks * sizeof(uint32_t) + 4095) & ~(uint64_t)4095;
+    header.data_offset = (SNAPSHOT_MAP_OFFSET +
+        header.map_bytes * (SNAPSHOT_MAX + 1) + block_size - 1) &
+        ~(uint64_t)(block_size - 1);
+
+    if (pwrite(store_fd, maps[0], (safeio_size_t)(blocks * sizeof(uint32_t)),
+        SNAPSHOT_MAP_OFFSET) != (safeio_ssize_t)(blocks * sizeof(uint32_t)) ||
+        save_header() != 0)
+    {
+        fprintf(stderr, "Cannot write snapshot store '%s': %s\n", file,
+            strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+store_load(const char *file, off_t_64 store_size)
+{
+    safeio_size_t map_size;
+    uint64_t max_slot = 0;
+    int i;
+
+    if (pread(store_fd, &header, sizeof(header), 0) !=
+        (safeio_ssize_t)sizeof(header) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION)
+    {
+        fprintf(stderr, "'%s' is not a valid snapshot store.\n", file);
+        return 0;
+    }
+
+    // Same limits as for new stores
+    if (header.block_size < 512 || header.block_size > (64 << 20) ||
+        (header.block_size & (header.block_size - 1)) != 0)
+    {
+        fprintf(stderr, "Snapshot store '%s' has invalid block size %u.\n",
+            file, (unsigned int)header.block_size);
+        return 0;
+    }
+
+    if ((off_t_64)header.image_size != image_size)
+    {
+        fprintf(stderr, "Snapshot store '%s' was created for an image of "
+            ULL_FMT " bytes, image is " SLL_FMT " bytes.\n", file,
+            header.image_size, (int64_t)image_size);
+        return 0;
+    }
+
+    block_size = header.block_size;
+    blocks = (image_size + block_size - 1) / block_size;
+
+    if (blocks > 0x0FFFFFFF)
+    {
+        fprintf(stderr, "Too many blocks in snapshot store '%s'.\n", file);
+        return 0;
+    }
+
+    map_size = (safeio_size_t)(blocks * sizeof(uint32_t));
+
+    // Maps laid out as by store_create, with the current image map within
+    // the file and slots aligned after the last map
+    if (header.map_bytes != ((map_size + 4095) & ~(uint64_t)4095) ||
+        SNAPSHOT_MAP_OFFSET + (off_t_64)map_size > store_size ||
+        header.data_offset < SNAPSHOT_MAP_OFFSET +
+        header.map_bytes * (SNAPSHOT_MAX + 1) ||
+        header.data_offset % header.block_size != 0 ||
+        header.data_offset > (uint64_t)1 << 62)
+    {
+        fprintf(stderr, "Snapshot store '%s' has invalid map layout.\n",
+            file);
+        return 0;
+    }
+
+    // Slot data is written before map entries, so slots in use start
+    // within the file
+    if ((uint64_t)store_size > header.data_offset)
+        max_slot = ((uint64_t)store_size - header.data_offset +
+            block_size - 1) / block_size;
+
+    for (i = 0; i <= SNAPSHOT_MAX; i++)
+    {
+        off_t_64 block;
+
+        if (i > 0 && !header.entries[i - 1].in_use)
+            continue;
+
+        if (maps[i] == NULL)
+            maps[i] = (uint32_t*)malloc(map_size);
+
+        if (maps[i] == NULL ||
+            pread(store_fd, maps[i], map_size, map_offset(i, 0)) !=
+            (safeio_ssize_t)map_size)
+        {
+            fprintf(stderr, "Cannot read snapshot store '%s'.\n", file);
+            return 0;
+        }
+
+        for (block = 0; block < blocks; block++)
+        {
+            uint32_t slot = maps[i][block];
+
+            if (slot == 0)
+                continue;
+
+            if (slot > max_slot)
+            {
+                fprintf(stderr, "Snapshot store '%s' references slot %u "
+                    "beyond end of file.\n", file, (unsigned int)slot);
+                return 0;
+            }
+
+            while (slot >= slot_capacity)
+            {
+                uint32_t capacity = slot_capacity < 1024 ?
+                    1024 : slot_capacity * 2;
+                uint16_t *new_refs =
+                    (uint16_t*)realloc(refs, capacity * sizeof(uint16_t));
+
+                if (new_refs == NULL)
+                    return 0;
+
+                memset(new_refs + slot_capacity, 0,
+                    (capacity - slot_capacity) * sizeof(uint16_t));
+
+                refs = new_refs;
+                slot_capacity = capacity;
+            }
+
+            ++refs[slot];
+
+            if (slot > slot_count)
+                slot_count = slot;
+        }
+    }
+
+    return 1;
+}
+
+int
+snapshot_init(const char *spec, off_t_64 offset, off_t_64 size,
+    int read_only, snapshot_io_proc read_proc, snapshot_io_proc write_proc)
+{
+    char options[256];
+    char file[260];
+    char value[64];
+    const char *opts = strchr(spec, ',');
+    size_t file_len = opts != NULL ? (size_t)(opts - spec) : strlen(spec);
+    off_t_64 store_size;
+    int i;
+
+    if (file_len == 0 || file_len >= sizeof(file))
+    {
+        fprintf(stderr, "Invalid snapshot store file name.\n");
+        return 0;
+    }
+
+    memcpy(file, spec, file_len);
+    file[file_len] = 0;
+
+    options[0] = 0;
+    if (opts != NULL)
+    {
+        strncpy(options, opts + 1, sizeof(options) - 1);
+        options[sizeof(options) - 1] = 0;
+    }
+
+    if (size <= 0)
+    {
+        fprintf(stderr, "Snapshots need a known image size.\n");
+        return 0;
+    }
+
+    base_offset = offset;
+    image_size = size;
+    image_read_only = read_only;
+    base_read = read_proc;
+    base_write = write_proc;
+    block_size = DEF_BLOCK_SIZE;
+
+    if (backend_get_option(options, "block", value, sizeof(value)) &&
+        (!backend_parse_size(value, &block_size) || block_size < 512 ||
+            block_size > (64 << 20) || (block_size & (block_size - 1)) != 0))
+    {
+        fprintf(stderr, "Invalid snapshot block size: '%s'\n", value);
+        return 0;
+    }
+
+    store_fd = _open(file, O_BINARY | O_RDWR | O_CREAT, 0644);
+
+    if (store_fd == -1)
+    {
+        fprintf(stderr, "Cannot open snapshot store '%s': %s\n", file,
+            strerror(errno));
+        return 0;
+    }
+
+    store_size = _lseeki64(store_fd, 0, SEEK_END);
+
+    if (store_size > 0)
+    {
+        if (!store_load(file, store_size))
+            return 0;
+    }
+    else
+    {
+        blocks = (image_size + block_size - 1) / block_size;
+
+        if (blocks > 0x0FFFFFFF)
+        {
+            fprintf(stderr, "Too many blocks for snapshot store, use a "
+                "larger block size.\n");
+            return 0;
+        }
+
+        maps[0] = (uint32_t*)calloc((size_t)blocks, sizeof(uint32_t));
+
+        if (maps[0] == NULL || !store_create(file))
+            return 0;
+    }
+
+    block_buf = (char*)malloc((size_t)block_size);
+
+    if (block_buf == NULL)
+        return 0;
+
+    snapshot_enabled = 1;
+
+    printf("Snapshot store '%s', block size " SLL_FMT " bytes, "
+        "%u slots in use.\n", file, (int64_t)block_size,
+        (unsigned int)slot_count);
+
+    for (i = 0; i < SNAPSHOT_MAX; i++)
+        if (header.entries[i].in_use)
+        {
+            time_t create_time = (time_t)header.entries[i].create_time;
+
+            printf("Snapshot " ULL_FMT " created %s",
+                header.entries[i].id, ctime(&create_time));
+        }
+
+#ifdef _WIN32
+    snapshot_merge_all();
+
+    if (backend_get_option(options, "port", value, sizeof(value)))
+        fprintf(stderr, "Snapshot export not supported on Windows.\n");
+#else
+    if (pthread_create(&merge_thread, NULL, snapshot_merge_thread, NULL) ==
+        0)
+        merge_running = 1;
+
+    // Blocks left redirected by snapshots deleted before a restart
+    snapshot_lock();
+    snapshot_wake_merge();
+    snapshot_unlock();
+
+    if (backend_get_option(options, "port", value, sizeof(value)) &&
+        !export_start((u_short)strtoul(value, NULL, 0)))
+        return 0;
+#endif
+
+    return 1;
+}
+
+void
+snapshot_close()
+{
+    int i;
+
+    if (!snapshot_enabled)
+        return;
+
+#ifndef _WIN32
+    snapshot_lock();
+    closing = 1;
+    pthread_cond_signal(&merge_wake);
+
+    // Export thread may be blocked in a read on a connected client
+    if (export_client != INVALID_SOCKET)
+        shutdown(export_client, SHUT_RDWR);
+
+    snapshot_unlock();
+
+    // Maps are freed below, so exports must be done first
+    if (export_running)
+    {
+        shutdown(export_sd, SHUT_RDWR);
+        pthread_join(export_thread, NULL);
+        closesocket(export_sd);
+        export_sd = INVALID_SOCKET;
+        export_running = 0;
+    }
+
+    if (merge_running)
+        pthread_join(merge_thread, NULL);
+
+    snapshot_lock();
+#endif
+
+    store_sync();
+    _close(store_fd);
+    store_fd = -1;
+
+    snapshot_enabled = 0;
+
+    for (i = 0; i <= SNAPSHOT_MAX; i++)
+    {
+        free(maps[i]);
+        maps[i] = NULL;
+    }
+
+    free(refs);
+    refs = NULL;
+
+    free(block_buf);
+    block_buf = NULL;
+
+#ifndef _WIN32
+    snapshot_unlock();
+#endif
+}
@@ -0,0 +1,84 @@
+/*
+Redirect-on-write snapshots for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_SNAPSHOT_
+#define _INC_SNAPSHOT_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Reads or writes image data at offset, used by the snapshot layer to
+    // access the image below it.
+    typedef safeio_ssize_t(*snapshot_io_proc)(char *io_ptr,
+        safeio_size_t size, off_t_64 offset);
+
+    typedef struct _SNAPSHOT_INFO
+    {
+        uint64_t id;
+        uint64_t create_time;
+        uint64_t changed_bytes;
+        uint64_t exclusive_bytes;
+    } SNAPSHOT_INFO, *PSNAPSHOT_INFO;
+
+    extern int snapshot_enabled;
+
+    // Opens or creates snapshot store according to
+    // storefile[,block=blocksize][,port=exportport] for an image of size
+    // bytes starting at base_offset. Snapshots cannot be created if
+    // read_only is set. Returns zero on failure.
+    int snapshot_init(const char *spec, off_t_64 base_offset, off_t_64 size,
+        int read_only, snapshot_io_proc base_read,
+        snapshot_io_proc base_write);
+
+    // Reads from snapshot with id, or from current image if id is zero.
+    safeio_ssize_t snapshot_read(uint64_t id, char *io_ptr,
+        safeio_size_t size, off_t_64 offset);
+
+    safeio_ssize_t snapshot_write(char *io_ptr, safeio_size_t size,
+        off_t_64 offset);
+
+    // Functions below return zero on success or an errno code.
+    int snapshot_create(PSNAPSHOT_INFO info);
+
+    int snapshot_delete(uint64_t id);
+
+    // Gets information about first snapshot with id equal to or above id.
+    int snapshot_query(uint64_t id, PSNAPSHOT_INFO info);
+
+    // Runs an IMDPROXY_REQ_SNAPSHOT operation, from main connection or
+    // export port.
+    int snapshot_control(uint64_t operation, uint64_t id,
+        PSNAPSHOT_INFO info);
+
+    void snapshot_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_SNAPSHOT_
@@ -0,0 +1,274 @@
+/*
+Striped (RAID-0) backend for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "parallel.h"
+
+#define DEF_STRIPE_SIZE     (64 << 10)
+
+// stripe[,size=stripesize]:member1:::member2[:::member3...]
+//
+// Stripe unit n of the virtual image is stored on member n % count at
+// offset (n / count) * stripesize. Members are accessed in parallel.
+
+typedef struct _STRIPE_SET
+{
+    off_t_64 stripe_size;
+    off_t_64 size;
+    int count;
+    DEVIO_BACKEND members[DEVIO_MAX_MEMBERS];
+} STRIPE_SET, *PSTRIPE_SET;
+
+typedef struct _STRIPE_IO
+{
+    PSTRIPE_SET set;
+    char *buf;
+    safeio_size_t size;
+    off_t_64 offset;
+    int write;
+    int first_member;
+    int error[DEVIO_MAX_MEMBERS];
+} STRIPE_IO, *PSTRIPE_IO;
+
+// Transfers all stripe units of a request that belong to one member. Index
+// counts members from the one holding the first stripe unit of the request.
+static void __cdecl
+stripe_member_io(void *context, int index)
+{
+    PSTRIPE_IO io = (PSTRIPE_IO)context;
+    PSTRIPE_SET set = io->set;
+    int member_number = (io->first_member + index) % set->count;
+    PDEVIO_BACKEND member = set->members + member_number;
+    off_t_64 end = io->offset + io->size;
+    off_t_64 unit = io->offset / set->stripe_size;
+
+    io->error[index] = 0;
+
+    // First stripe unit of this request stored on this member
+    unit += index;
+
+    for (; unit * set->stripe_size < end; unit += set->count)
+    {
+        off_t_64 unit_start = unit * set->stripe_size;
+        off_t_64 start = unit_start > io->offset ? unit_start : io->offset;
+        off_t_64 stop = unit_start + set->stripe_size;
+        off_t_64 member_offset;
+        char *ptr;
+        safeio_size_t len;
+        safeio_ssize_t done;
+
+        if (stop > end)
+            stop = end;
+
+        member_offset = (unit / set->count) * set->stripe_size +
+            (start - unit_start);
+        ptr = io->buf + (start - io->offset);
+        len = (safeio_size_t)(stop - start);
+
+        if (io->write)
+            done = member->write(member->handle, ptr, len, member_offset);
+        else
+            done = member->read(member->handle, ptr, len, member_offset);
+
+        if (done == -1)
+        {
+            io->error[index] = errno != 0 ? errno : EIO;
+            return;
+        }
+
+        if (done < (safeio_ssize_t)len)
+        {
+            if (io->write)
+            {
+                io->error[index] = ENOSPC;
+                return;
+            }
+
+            memset(ptr + done, 0, len - done);
+        }
+    }
+}
+
+static safeio_ssize_t
+stripe_io(PSTRIPE_SET set, void *buf, safeio_size_t size, off_t_64 offset,
+    int write)
+{
+    STRIPE_IO io;
+    off_t_64 first_unit = offset / set->stripe_size;
+    off_t_64 units = (offset + size - 1) / set->stripe_size - first_unit + 1;
+    int members = units < set->count ? (int)units : set->count;
+    int i;
+
+    io.set = set;
+    io.buf = (char*)buf;
+    io.size = size;
+    io.offset = offset;
+    io.write = write;
+    io.first_member = (int)(first_unit % set->count);
+
+    parallel_run(stripe_member_io, &io, members);
+
+    for (i = 0; i < members; i++)
+        if (io.error[i] != 0)
+        {
+            errno = io.error[i];
+            return -1;
+        }
+
+    return size;
+}
+
+safeio_ssize_t __cdecl
+stripe_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PSTRIPE_SET set = (PSTRIPE_SET)handle;
+
+    if (!backend_clip_range(offset, &size, set->size))
+        return -1;
+
+    if (size == 0)
+        return 0;
+
+    return stripe_io(set, buf, size, offset, 0);
+}
+
+safeio_ssize_t __cdecl
+stripe_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PSTRIPE_SET set = (PSTRIPE_SET)handle;
+    safeio_size_t len = size;
+
+    if (!backend_clip_range(offset, &len, set->size))
+        return -1;
+
+    if (len < size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (size == 0)
+        return 0;
+
+    return stripe_io(set, buf, size, offset, 1);
+}
+
+int __cdecl
+stripe_close(void *handle)
+{
+    PSTRIPE_SET set = (PSTRIPE_SET)handle;
+
+    backend_close_members(set->members, set->count);
+
+    free(set);
+
+    return 0;
+}
+
+void * __cdecl
+stripe_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    char options[256];
+    char value[64];
+    const char *members = backend_parameters(file, options, sizeof(options));
+    PSTRIPE_SET set = (PSTRIPE_SET)calloc(1, sizeof(STRIPE_SET));
+    off_t_64 member_size = 0;
+    int i;
+
+    if (set == NULL)
+        return NULL;
+
+    set->stripe_size = DEF_STRIPE_SIZE;
+
+    if (backend_get_option(options, "size", value, sizeof(value)) &&
+        (!backend_parse_size(value, &set->stripe_size) ||
+            set->stripe_size < 512))
+    {
+        fprintf(stderr, "Invalid stripe size: '%s'\n", value);
+        free(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    set->count = backend_open_members(members, read_only, set->members,
+        DEVIO_MAX_MEMBERS);
+
+    if (set->count == 0)
+    {
+        free(set);
+        return NULL;
+    }
+
+    // Usable size is limited by smallest member
+    for (i = 0; i < set->count; i++)
+        if (i == 0 || set->members[i].size < member_size)
+            member_size = set->members[i].size;
+
+    member_size -= member_size % set->stripe_size;
+
+    if (member_size == 0)
+    {
+        fprintf(stderr, "Cannot determine size of stripe set members.\n");
+        stripe_close(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    set->size = member_size * set->count;
+
+    parallel_reserve(set->count - 1);
+
+    printf("Stripe set of %i members, stripe size " SLL_FMT " bytes.\n",
+        set->count, (int64_t)set->stripe_size);
+
+    *dllread = stripe_read;
+    *dllwrite = stripe_write;
+    *dllclose = stripe_close;
+
+    if (size != NULL)
+        *size = set->size;
+
+    return set;
+}
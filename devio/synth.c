@@ -0,0 +1,584 @@
+/*
+Synthetic storage backends for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+
+// Backends that do not store data, for measuring transports and protocol
+// overhead without storage in the way.
+//
+// null:size
+//
+// Reads return zeroes, writes are discarded.
+//
+// pattern[,seed=n][,verify]:size
+//
+// Reads return deterministic data. The little-endian 64-bit word at byte
+// offset 8 * i is pattern_word(seed, i), see below, so clients can check
+// what they read. Writes are discarded, or with verify, compared to the
+// pattern and failed with EIO on mismatch.
+//
+// model[,latency=time][,jitter=time][,dist=fixed|uniform|normal|exp]
+//      [,bandwidth=size][,seed=n]:member
+//
+// Passes requests to member, a file or another built-in backend such as
+// null or pattern, and completes them no sooner than a modeled service
+// time after they arrived. Transfers queue behind each other at bandwidth
+// bytes per second, then each request waits latency, varied by jitter
+// according to dist: fixed ignores jitter, uniform is within +/- jitter,
+// normal has standard deviation jitter and exp adds an exponentially
+// distributed tail with mean jitter. Times are in microseconds or with
+// suffix us, ms or s. Time spent in member counts toward the model time.
+
+enum
+{
+    MODEL_DIST_FIXED,
+    MODEL_DIST_UNIFORM,
+    MODEL_DIST_NORMAL,
+    MODEL_DIST_EXP
+};
+
+static const char *model_dist_names[] = {
+    "fixed", "uniform", "normal", "exp"
+};
+
+typedef struct _SYNTH_IMAGE
+{
+    uint64_t seed;
+    int verify;
+    uint64_t mismatches;
+} SYNTH_IMAGE, *PSYNTH_IMAGE;
+
+typedef struct _MODEL_DEVICE
+{
+    DEVIO_BACKEND member;
+    uint64_t latency;
+    uint64_t jitter;
+    uint64_t bandwidth;
+    int dist;
+    uint64_t random;
+    uint64_t busy_until;
+    uint64_t requests;
+    uint64_t delayed;
+    uint64_t total_delay;
+} MODEL_DEVICE, *PMODEL_DEVICE;
+
+// splitmix64 output function
+static uint64_t
+pattern_word(uint64_t seed, uint64_t index)
+{
+    uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+static void
+pattern_fill(uint64_t seed, unsigned char *buf, safeio_size_t size,
+    off_t_64 offset)
+{
+    uint64_t index = (uint64_t)offset >> 3;
+    unsigned int skip = (unsigned int)(offset & 7);
+
+    while (size > 0)
+    {
+        uint64_t word = pattern_word(seed, index++);
+        unsigned int i;
+
+        for (i = skip; i < 8 && size > 0; i++, size--)
+            *buf++ = (unsigned char)(word >> (i << 3));
+
+        skip = 0;
+    }
+}
+
+static int
+pattern_compare(uint64_t seed, const unsigned char *buf, safeio_size_t size,
+    off_t_64 offset)
+{
+    uint64_t index = (uint64_t)offset >> 3;
+    unsigned int skip = (unsigned int)(offset & 7);
+
+    while (size > 0)
+    {
+        uint64_t word = pattern_word(seed, index++);
+        unsigned int i;
+
+        for (i = skip; i < 8 && size > 0; i++, size--)
+            if (*buf++ != (unsigned char)(word >> (i << 3)))
+                return 0;
+
+        skip = 0;
+    }
+
+    return 1;
+}
+
+safeio_ssize_t __cdecl
+null_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    (void)handle;
+    (void)offset;
+
+    memset(buf, 0, size);
+
+    return size;
+}
+
+safeio_ssize_t __cdecl
+null_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    (void)handle;
+    (void)buf;
+    (void)offset;
+
+    return size;
+}
+
+safeio_ssize_t __cdecl
+pattern_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PSYNTH_IMAGE image = (PSYNTH_IMAGE)handle;
+
+    pattern_fill(image->seed, (unsigned char*)buf, size, offset);
+
+    return size;
+}
+
+safeio_ssize_t __cdecl
+pattern_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    PSYNTH_IMAGE image = (PSYNTH_IMAGE)handle;
+
+    if (image->verify &&
+        !pattern_compare(image->seed, (unsigned char*)buf, size, offset))
+    {
+        ++image->mismatches;
+        errno = EIO;
+        return -1;
+    }
+
+    return size;
+}
+
+int __cdecl
+synth_close(void *handle)
+{
+    PSYNTH_IMAGE image = (PSYNTH_IMAGE)handle;
+
+    if (image->verify)
+        printf("Pattern: " ULL_FMT " writes did not match.\n",
+            image->mismatches);
+
+    free(image);
+
+    return 0;
+}
+
+static void *
+synth_open(const char *file, int pattern,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    char options[256];
+    char value[64];
+    const char *params = backend_parameters(file, options, sizeof(options));
+    PSYNTH_IMAGE image;
+    off_t_64 image_size = 0;
+    off_t_64 seed = 0;
+
+    if (!backend_parse_size(params, &image_size) || image_size <= 0)
+    {
+        fprintf(stderr, "Invalid image size: '%s'\n", params);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "seed", value, sizeof(value)) &&
+        !backend_parse_size(value, &seed))
+    {
+        fprintf(stderr, "Invalid pattern seed: '%s'\n", value);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    image = (PSYNTH_IMAGE)calloc(1, sizeof(SYNTH_IMAGE));
+
+    if (image == NULL)
+        return NULL;
+
+    image->seed = (uint64_t)seed;
+    image->verify = backend_get_option(options, "verify", NULL, 0);
+
+    if (pattern)
+    {
+        printf("Pattern image, seed " ULL_FMT "%s.\n", image->seed,
+            image->verify ? ", writes verified" : "");
+
+        *dllread = pattern_read;
+        *dllwrite = pattern_write;
+    }
+    else
+    {
+        puts("Null image, reads return zeroes and writes are discarded.");
+
+        *dllread = null_read;
+        *dllwrite = null_write;
+    }
+
+    *dllclose = synth_close;
+
+    if (size != NULL)
+        *size = image_size;
+
+    return image;
+}
+
+void * __cdecl
+null_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    (void)read_only;
+
+    return synth_open(file, 0, dllread, dllwrite, dllclose, size);
+}
+
+void * __cdecl
+pattern_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    (void)read_only;
+
+    return synth_open(file, 1, dllread, dllwrite, dllclose, size);
+}
+
+// xorshift64*, uniform in [0, 1)
+static double
+model_random(PMODEL_DEVICE device)
+{
+    uint64_t x = device->random;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    device->random = x;
+
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static uint64_t
+model_latency(PMODEL_DEVICE device)
+{
+    double latency = (double)device->latency;
+    double jitter = (double)device->jitter;
+
+    switch (device->dist)
+    {
+    case MODEL_DIST_UNIFORM:
+        latency += (model_random(device) * 2 - 1) * jitter;
+        break;
+
+    case MODEL_DIST_NORMAL:
+    {
+        // Box-Muller
+        double u = 1 - model_random(device);
+        double v = model_random(device);
+
+        latency += sqrt(-2 * log(u)) * cos(6.283185307179586 * v) * jitter;
+        break;
+    }
+
+    case MODEL_DIST_EXP:
+        latency -= log(1 - model_random(device)) * jitter;
+        break;
+    }
+
+    if (latency < 0)
+        return 0;
+
+    return (uint64_t)latency;
+}
+
+static void
+model_sleep_until(uint64_t deadline)
+{
+#ifdef _WIN32
+    uint64_t now = backend_time_usec();
+
+    if (deadline > now)
+        Sleep((DWORD)((deadline - now + 999) / 1000));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(deadline / 1000000);
+    ts.tv_nsec = (long)(deadline % 1000000) * 1000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
+
+static safeio_ssize_t
+model_io(PMODEL_DEVICE device, void *buf, safeio_size_t size,
+    off_t_64 offset, int write)
+{
+    uint64_t arrival = backend_time_usec();
+    uint64_t start = arrival > device->busy_until ?
+        arrival : device->busy_until;
+    uint64_t complete;
+    safeio_ssize_t done;
+    int error;
+
+    if (device->bandwidth != 0)
+        device->busy_until = start + (uint64_t)size * 1000000 /
+        device->bandwidth;
+    else
+        device->busy_until = start;
+
+    complete = device->busy_until + model_latency(device);
+
+    if (write)
+        done = device->member.write(device->member.handle, buf, size, offset);
+    else
+        done = device->member.read(device->member.handle, buf, size, offset);
+
+    error = errno;
+
+    ++device->requests;
+    device->total_delay += complete - arrival;
+
+    if (backend_time_usec() < complete)
+    {
+        ++device->delayed;
+        model_sleep_until(complete);
+    }
+
+    errno = error;
+
+    return done;
+}
+
+safeio_ssize_t __cdecl
+model_read(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    return model_io((PMODEL_DEVICE)handle, buf, size, offset, 0);
+}
+
+safeio_ssize_t __cdecl
+model_write(void *handle, void *buf, safeio_size_t size, off_t_64 offset)
+{
+    return model_io((PMODEL_DEVICE)handle, buf, size, offset, 1);
+}
+
+int __cdecl
+model_close(void *handle)
+{
+    PMODEL_DEVICE device = (PMODEL_DEVICE)handle;
+    int rc;
+
+    if (device->requests > 0)
+        printf("Model: " ULL_FMT " requests, " ULL_FMT " delayed, average "
+            "modeled time " ULL_FMT " usec.\n", device->requests,
+            device->delayed, device->total_delay / device->requests);
+
+    rc = backend_close(&device->member);
+
+    free(device);
+
+    return rc;
+}
+
+// Microseconds, or with suffix us, ms or s
+static int
+model_parse_time(const char *str, uint64_t *usec)
+{
+    double value;
+    int n = 0;
+
+    if (sscanf(str, "%lf%n", &value, &n) != 1 || value < 0)
+        return 0;
+
+    str += n;
+
+    if (_stricmp(str, "ms") == 0)
+        value *= 1000;
+    else if (_stricmp(str, "s") == 0)
+        value *= 1000000;
+    else if (*str != 0 && _stricmp(str, "us") != 0)
+        return 0;
+
+    *usec = (uint64_t)value;
+
+    return 1;
+}
+
+void * __cdecl
+model_open(const char *file,
+    int read_only,
+    dllread_proc *dllread,
+    dllwrite_proc *dllwrite,
+    dllclose_proc *dllclose,
+    off_t_64 *size)
+{
+    char options[256];
+    char value[64];
+    const char *member = backend_parameters(file, options, sizeof(options));
+    PMODEL_DEVICE device = (PMODEL_DEVICE)calloc(1, sizeof(MODEL_DEVICE));
+    off_t_64 number = 0;
+
+    if (device == NULL)
+        return NULL;
+
+    device->dist = MODEL_DIST_UNIFORM;
+    device->random = 1;
+
+    if (backend_get_option(options, "latency", value, sizeof(value)) &&
+        !model_parse_time(value, &device->latency))
+    {
+        fprintf(stderr, "Invalid latency: '%s'\n", value);
+        free(device);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "jitter", value, sizeof(value)) &&
+        !model_parse_time(value, &device->jitter))
+    {
+        fprintf(stderr, "Invalid jitter: '%s'\n", value);
+        free(device);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (backend_get_option(options, "dist", value, sizeof(value)))
+    {
+        for (device->dist = 0;
+            device->dist < (int)(sizeof(model_dist_names) /
+                sizeof(*model_dist_names));
+            device->dist++)
+            if (_stricmp(value, model_dist_names[device->dist]) == 0)
+                break;
+
+        if (device->dist == (int)(sizeof(model_dist_names) /
+            sizeof(*model_dist_names)))
+        {
+            fprintf(stderr, "Invalid latency distribution: '%s'\n", value);
+            free(device);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    if (backend_get_option(options, "bandwidth", value, sizeof(value)))
+    {
+        if (!backend_parse_size(value, &number) || number <= 0)
+        {
+            fprintf(stderr, "Invalid bandwidth: '%s'\n", value);
+            free(device);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        device->bandwidth = (uint64_t)number;
+    }
+
+    if (backend_get_option(options, "seed", value, sizeof(value)))
+    {
+        if (!backend_parse_size(value, &number))
+        {
+            fprintf(stderr, "Invalid model seed: '%s'\n", value);
+            free(device);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        // xorshift state must not be zero
+        device->random = (uint64_t)number | 1;
+    }
+
+    if (!backend_open(&device->member, member, read_only))
+    {
+        fprintf(stderr, "Failed to open model member '%s': %s\n", member,
+            strerror(errno));
+        free(device);
+        return NULL;
+    }
+
+    printf("Model: latency " ULL_FMT " usec, %s jitter " ULL_FMT " usec, "
+        "bandwidth ", device->latency, model_dist_names[device->dist],
+        device->jitter);
+
+    if (device->bandwidth != 0)
+        printf(ULL_FMT " bytes/s.\n", device->bandwidth);
+    else
+        puts("unlimited.");
+
+#ifdef PR_SET_TIMERSLACK
+    // Default slack of 50 usec would dominate short modeled latencies
+    prctl(PR_SET_TIMERSLACK, 1000UL, 0UL, 0UL, 0UL);
+#endif
+
+    *dllread = model_read;
+    *dllwrite = model_write;
+    *dllclose = model_close;
+
+    if (size != NULL)
+        *size = device->member.size;
+
+    return device;
+}
@@ -0,0 +1,450 @@
+/*
+Request trace recording for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "../inc/imdproxy.h"
+#include "devio_types.h"
+#include "devio.h"
+#include "backend.h"
+#include "trace.h"
+
+#define DEF_RING_SIZE           (4 << 20)
+#define MIN_RING_RECORDS        64
+#define FLUSH_INTERVAL          1
+
+// --trace=file[,size=bytes]
+//
+// Request handlers fill in a record for the request in progress on their
+// thread and copy it to a ring of records when the response has been sent.
+// A writer thread appends records from the ring to the trace file when the
+// ring is half full and every FLUSH_INTERVAL seconds, so request handling
+// never waits for file I/O. If the writer cannot keep up and the ring is
+// full, records are dropped and counted in the file header. On Windows
+// records are instead written by the request handler when the ring is
+// full.
+
+int trace_enabled = 0;
+
+static FILE *trace_stream = NULL;
+static char trace_file[260] = "";
+static DEVIO_TRACE_HEADER header;
+static PDEVIO_TRACE_RECORD ring = NULL;
+static uint64_t ring_mask = 0;
+static uint64_t ring_head = 0;          // Next record to fill
+static uint64_t ring_tail = 0;          // Next record to write to file
+static uint64_t dropped = 0;
+static uint64_t start_nsec = 0;
+static uint32_t connections = 0;
+static int write_failed = 0;
+
+#ifdef _MSC_VER
+static __declspec(thread) DEVIO_TRACE_RECORD current;
+static __declspec(thread) uint32_t current_client = 0;
+#else
+static __thread DEVIO_TRACE_RECORD current;
+static __thread uint32_t current_client = 0;
+#endif
+
+#ifdef _WIN32
+
+#define trace_lock()
+#define trace_unlock()
+
+#else
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_running = 0;
+static int writer_stop = 0;
+
+#define trace_lock()            pthread_mutex_lock(&lock)
+#define trace_unlock()          pthread_mutex_unlock(&lock)
+
+#endif
+
+static uint64_t
+trace_time_nsec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000000 /
+        frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t
+trace_wall_time_nsec()
+{
+#ifdef _WIN32
+    FILETIME file_time;
+    ULARGE_INTEGER value;
+
+    GetSystemTimeAsFileTime(&file_time);
+
+    value.LowPart = file_time.dwLowDateTime;
+    value.HighPart = file_time.dwHighDateTime;
+
+    // 100 nsec units since 1601
+    return (value.QuadPart - 116444736000000000ULL) * 100;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Writes records from ring_tail up to head. Called by one thread at a
+// time, the writer thread or on Windows the request handler.
+static void
+trace_write(uint64_t head)
+{
+    uint64_t tail = ring_tail;
+
+    while (tail != head)
+    {
+        uint64_t index = tail & ring_mask;
+        uint64_t count = head - tail;
+
+        if (count > ring_mask + 1 - index)
+            count = ring_mask + 1 - index;
+
+        if (!write_failed &&
+            fwrite(ring + index, sizeof(*ring), (size_t)count,
+                trace_stream) != (size_t)count)
+        {
+            fprintf(stderr, "Trace write failed '%s': %s\n", trace_file,
+                strerror(errno));
+            write_failed = 1;
+        }
+
+        tail += count;
+    }
+
+    if (!write_failed)
+        fflush(trace_stream);
+
+    trace_lock();
+    ring_tail = tail;
+    trace_unlock();
+}
+
+#ifndef _WIN32
+
+static void *
+trace_writer_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+
+    for (;;)
+    {
+        uint64_t head;
+        int stop;
+
+        if (!writer_stop && ring_head - ring_tail < (ring_mask + 1) / 2)
+        {
+            struct timespec deadline;
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += FLUSH_INTERVAL;
+
+            pthread_cond_timedwait(&wake, &lock, &deadline);
+        }
+
+        head = ring_head;
+        stop = writer_stop;
+
+        pthread_mutex_unlock(&lock);
+
+        trace_write(head);
+
+        if (stop)
+            return NULL;
+
+        pthread_mutex_lock(&lock);
+    }
+}
+
+#endif
+
+uint32_t
+trace_connection()
+{
+    trace_lock();
+    current_client = ++connections;
+    trace_unlock();
+
+    return current_client;
+}
+
+void
+trace_request_start(ULONGLONG request_code)
+{
+    if (!trace_enabled)
+        return;
+
+    current.timestamp = trace_time_nsec() - start_nsec;
+    current.offset = 0;
+    current.length = 0;
+    current.request_code = (uint32_t)request_code;
+    current.client = current_client;
+    current.errorno = 0;
+}
+
+void
+trace_request_io(ULONGLONG offset, ULONGLONG length, ULONGLONG errorno)
+{
+    if (!trace_enabled)
+        return;
+
+    current.offset = offset;
+    current.length = length;
+    current.errorno = (uint32_t)errorno;
+}
+
+void
+trace_request_end()
+{
+    if (!trace_enabled)
+        return;
+
+    current.latency = trace_time_nsec() - start_nsec - current.timestamp;
+
+#ifdef _WIN32
+    if (ring_head - ring_tail > ring_mask)
+        trace_write(ring_head);
+#endif
+
+    trace_lock();
+
+    if (ring_head - ring_tail > ring_mask)
+        ++dropped;
+    else
+    {
+        ring[ring_head & ring_mask] = current;
+
+#ifndef _WIN32
+        if (++ring_head - ring_tail == (ring_mask + 1) / 2)
+            pthread_cond_signal(&wake);
+#else
+        ++ring_head;
+#endif
+    }
+
+    trace_unlock();
+}
+
+void
+trace_request_record(ULONGLONG request_code, uint64_t start,
+    ULONGLONG offset, ULONGLONG length, ULONGLONG errorno)
+{
+    if (!trace_enabled)
+        return;
+
+    trace_request_start(request_code);
+    current.timestamp = start - start_nsec;
+    trace_request_io(offset, length, errorno);
+    trace_request_end();
+}
+
+int
+trace_init(const char *spec, uint64_t image_size)
+{
+    char options[256];
+    char value[64];
+    const char *opts = strchr(spec, ',');
+    size_t file_len = opts != NULL ? (size_t)(opts - spec) : strlen(spec);
+    off_t_64 ring_size = DEF_RING_SIZE;
+    uint64_t records;
+
+    if (file_len == 0 || file_len >= sizeof(trace_file))
+    {
+        fprintf(stderr, "Invalid trace file name.\n");
+        return 0;
+    }
+
+    memcpy(trace_file, spec, file_len);
+    trace_file[file_len] = 0;
+
+    options[0] = 0;
+    if (opts != NULL)
+    {
+        strncpy(options, opts + 1, sizeof(options) - 1);
+        options[sizeof(options) - 1] = 0;
+    }
+
+    if (backend_get_option(options, "size", value, sizeof(value)) &&
+        !backend_parse_size(value, &ring_size))
+    {
+        fprintf(stderr, "Invalid trace ring size: '%s'\n", value);
+        return 0;
+    }
+
+    // Power of two number of records
+    for (records = MIN_RING_RECORDS;
+        records * 2 * sizeof(DEVIO_TRACE_RECORD) <= (uint64_t)ring_size;
+        records *= 2);
+
+    ring = (PDEVIO_TRACE_RECORD)malloc((size_t)records * sizeof(*ring));
+
+    if (ring == NULL)
+    {
+        fprintf(stderr, "Trace: Memory allocation failed.\n");
+        return 0;
+    }
+
+    ring_mask = records - 1;
+
+    trace_stream = fopen(trace_file, "wb");
+
+    if (trace_stream == NULL)
+    {
+        fprintf(stderr, "Cannot create trace file '%s': %s\n", trace_file,
+            strerror(errno));
+        free(ring);
+        ring = NULL;
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEVIO_TRACE_MAGIC, sizeof(header.magic));
+    header.version = DEVIO_TRACE_VERSION;
+    header.record_size = sizeof(DEVIO_TRACE_RECORD);
+    header.image_size = image_size;
+
+    start_nsec = trace_time_nsec();
+    header.start_time = trace_wall_time_nsec();
+
+    if (fwrite(&header, sizeof(header), 1, trace_stream) != 1)
+    {
+        fprintf(stderr, "Cannot write trace file '%s': %s\n", trace_file,
+            strerror(errno));
+        fclose(trace_stream);
+        trace_stream = NULL;
+        free(ring);
+        ring = NULL;
+        return 0;
+    }
+
+#ifndef _WIN32
+    writer_stop = 0;
+
+    if (pthread_create(&writer_thread, NULL, trace_writer_thread, NULL) != 0)
+    {
+        fprintf(stderr, "Trace: Cannot start writer thread.\n");
+        fclose(trace_stream);
+        trace_stream = NULL;
+        free(ring);
+        ring = NULL;
+        return 0;
+    }
+
+    writer_running = 1;
+#endif
+
+    trace_enabled = 1;
+
+    printf("Trace written to '%s', ring of " ULL_FMT " requests.\n",
+        trace_file, (ULONGLONG)records);
+
+    return 1;
+}
+
+void
+trace_close()
+{
+    if (!trace_enabled)
+        return;
+
+    trace_enabled = 0;
+
+#ifndef _WIN32
+    if (writer_running)
+    {
+        pthread_mutex_lock(&lock);
+        writer_stop = 1;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(writer_thread, NULL);
+
+        writer_running = 0;
+    }
+#endif
+
+    trace_write(ring_head);
+
+    header.dropped = dropped;
+
+    if (fseek(trace_stream, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, trace_stream) != 1)
+        write_failed = 1;
+
+    if (fclose(trace_stream) != 0)
+        write_failed = 1;
+
+    trace_stream = NULL;
+
+    printf("Trace: " ULL_FMT " requests recorded, " ULL_FMT " dropped%s.\n",
+        (ULONGLONG)ring_head, (ULONGLONG)dropped,
+        write_failed ? ", write failed" : "");
+
+    free(ring);
+    ring = NULL;
+}
@@ -0,0 +1,100 @@
+/*
+Request trace recording for devio.
+
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_TRACE_
+#define _INC_TRACE_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Trace file format, in host byte order like the proxy protocol. A
+    // header is followed by one record per request, in order of request
+    // completion. Records of requests handled concurrently by several
+    // threads can therefore be slightly out of timestamp order.
+
+#define DEVIO_TRACE_MAGIC       "DEVIOTRC"
+#define DEVIO_TRACE_VERSION     1
+
+    typedef struct _DEVIO_TRACE_HEADER
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;       // sizeof(DEVIO_TRACE_RECORD)
+        uint64_t start_time;        // Unix time in nsec at timestamp zero
+        uint64_t image_size;
+        uint64_t dropped;           // Updated at close
+        uint64_t reserved[3];
+    } DEVIO_TRACE_HEADER, *PDEVIO_TRACE_HEADER;
+
+    // Unmap and zero requests with several ranges are recorded with
+    // offset of first range and total length of all ranges. Requests
+    // without image I/O, such as INFO, have zero offset and length.
+    typedef struct _DEVIO_TRACE_RECORD
+    {
+        uint64_t timestamp;         // nsec since trace start, request received
+        uint64_t offset;            // Relative to start of served image
+        uint64_t length;
+        uint64_t latency;           // nsec until response flushed
+        uint32_t request_code;
+        uint32_t client;            // Connection number, starting at 1
+        uint32_t errorno;
+        uint32_t reserved;
+    } DEVIO_TRACE_RECORD, *PDEVIO_TRACE_RECORD;
+
+    extern int trace_enabled;
+
+    // Starts recording according to file[,size=ring bytes]. Returns zero
+    // on failure.
+    int trace_init(const char *spec, uint64_t image_size);
+
+    // New connection number for client field of following requests on
+    // calling thread.
+    uint32_t trace_connection();
+
+    // Called by request handlers, do nothing unless trace_enabled.
+    void trace_request_start(ULONGLONG request_code);
+
+    void trace_request_io(ULONGLONG offset, ULONGLONG length,
+        ULONGLONG errorno);
+
+    void trace_request_end();
+
+    // Records a request handled together with others, received at start
+    // from backend_time_nsec() and ending now.
+    void trace_request_record(ULONGLONG request_code, uint64_t start,
+        ULONGLONG offset, ULONGLONG length, ULONGLONG errorno);
+
+    // Writes remaining records and closes trace file.
+    void trace_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_TRACE_
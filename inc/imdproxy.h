@@ -52,6 +52,13 @@ typedef u_char UCHAR;
 #define IMDPROXY_FLAG_SUPPORTS_SCSI     0x08 // SCSI SRB operations
 #define IMDPROXY_FLAG_SUPPORTS_SHARED   0x10 // Shared image access with reservations
 #define IMDPROXY_FLAG_KEEP_OPEN         0x20 // DevIoDrv mode with persistent virtual file
+#define IMDPROXY_FLAG_SUPPORTS_SNAPSHOT 0x40 // Point-in-time snapshots
+#define IMDPROXY_FLAG_SUPPORTS_CBT      0x80 // Changed block tracking
+#define IMDPROXY_FLAG_SUPPORTS_ALLOCATION 0x100 // Allocation status query
+#define IMDPROXY_FLAG_SUPPORTS_SPARSE_READ 0x200 // Zero extents in read responses
+#define IMDPROXY_FLAG_SUPPORTS_COMPRESSION 0x400 // IMDPROXY_OPTION_COMPRESSION
+#define IMDPROXY_FLAG_SUPPORTS_CRC32C   0x800 // IMDPROXY_OPTION_CRC32C
+#define IMDPROXY_FLAG_SUPPORTS_CREDITS  0x1000 // IMDPROXY_OPTION_CREDITS
 
 typedef enum _IMDPROXY_REQ
 {
@@ -64,7 +71,12 @@ typedef enum _IMDPROXY_REQ
     IMDPROXY_REQ_UNMAP,
     IMDPROXY_REQ_ZERO,
     IMDPROXY_REQ_SCSI,
-    IMDPROXY_REQ_SHARED
+    IMDPROXY_REQ_SHARED,
+    IMDPROXY_REQ_SNAPSHOT,
+    IMDPROXY_REQ_CHANGED_BLOCKS,
+    IMDPROXY_REQ_GET_ALLOCATION,
+    IMDPROXY_REQ_READ_SPARSE,
+    IMDPROXY_REQ_SET_OPTIONS
 } IMDPROXY_REQ, *PIMDPROXY_REQ;
 
 typedef struct _IMDPROXY_CLOSE_REQ
@@ -105,6 +117,24 @@ typedef struct _IMDPROXY_READ_RESP
     ULONGLONG length;
 } IMDPROXY_READ_RESP, *PIMDPROXY_READ_RESP;
 
+// Response to IMDPROXY_REQ_READ_SPARSE, which takes an IMDPROXY_READ_REQ.
+// Followed by zero_extents IMDPROXY_ZERO_EXTENT entries, then data_length
+// bytes with data for the parts of the read range not covered by the zero
+// extents, in order.
+typedef struct _IMDPROXY_SPARSE_READ_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG length;           // Bytes read, including zero extents
+    ULONGLONG zero_extents;
+    ULONGLONG data_length;
+} IMDPROXY_SPARSE_READ_RESP, *PIMDPROXY_SPARSE_READ_RESP;
+
+typedef struct _IMDPROXY_ZERO_EXTENT
+{
+    ULONGLONG offset;           // Relative to offset in request
+    ULONGLONG length;
+} IMDPROXY_ZERO_EXTENT, *PIMDPROXY_ZERO_EXTENT;
+
 typedef struct _IMDPROXY_WRITE_REQ
 {
     ULONGLONG request_code;
@@ -197,6 +227,139 @@ typedef enum _IMDPROXY_SHARED_RESP_CODE
     IOError
 } IMDPROXY_SHARED_RESP_CODE, *PIMDPROXY_SHARED_RESP_CODE;
 
+typedef struct _IMDPROXY_SNAPSHOT_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG operation_code;
+    ULONGLONG snapshot_id;
+} IMDPROXY_SNAPSHOT_REQ, *PIMDPROXY_SNAPSHOT_REQ;
+
+typedef struct _IMDPROXY_SNAPSHOT_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG snapshot_id;
+    ULONGLONG create_time;      // Seconds since 1970-01-01 UTC
+    ULONGLONG changed_bytes;    // Data written to image since snapshot
+    ULONGLONG exclusive_bytes;  // Space freed if snapshot is deleted
+} IMDPROXY_SNAPSHOT_RESP, *PIMDPROXY_SNAPSHOT_RESP;
+
+typedef enum _IMDPROXY_SNAPSHOT_OP_CODE
+{
+    SnapshotCreate,
+    SnapshotDelete,
+    SnapshotQuery       // First snapshot with id equal to or above snapshot_id
+} IMDPROXY_SNAPSHOT_OP_CODE, *PIMDPROXY_SNAPSHOT_OP_CODE;
+
+typedef struct _IMDPROXY_CBT_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG operation_code;
+    ULONGLONG generation;       // List blocks changed in this or later generations
+    ULONGLONG offset;
+    ULONGLONG length;           // Range to list, zero for rest of image
+} IMDPROXY_CBT_REQ, *PIMDPROXY_CBT_REQ;
+
+typedef struct _IMDPROXY_CBT_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG generation;       // Current generation
+    ULONGLONG next_offset;      // Where to continue listing, end of range when done
+    ULONGLONG length;           // Bytes of IMDPROXY_CBT_EXTENT data that follows
+} IMDPROXY_CBT_RESP, *PIMDPROXY_CBT_RESP;
+
+typedef struct _IMDPROXY_CBT_EXTENT
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_CBT_EXTENT, *PIMDPROXY_CBT_EXTENT;
+
+typedef enum _IMDPROXY_CBT_OP_CODE
+{
+    CbtQuery,
+    CbtNewGeneration    // Start new generation, returned in generation field
+} IMDPROXY_CBT_OP_CODE, *PIMDPROXY_CBT_OP_CODE;
+
+typedef struct _IMDPROXY_ALLOCATION_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_ALLOCATION_REQ, *PIMDPROXY_ALLOCATION_REQ;
+
+typedef struct _IMDPROXY_ALLOCATION_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG next_offset;      // Where to continue, end of range when done
+    ULONGLONG length;           // Bytes of IMDPROXY_ALLOCATION_EXTENT data that follows
+} IMDPROXY_ALLOCATION_RESP, *PIMDPROXY_ALLOCATION_RESP;
+
+typedef struct _IMDPROXY_ALLOCATION_EXTENT
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONGLONG state;
+} IMDPROXY_ALLOCATION_EXTENT, *PIMDPROXY_ALLOCATION_EXTENT;
+
+// Similar to provisioning status in SCSI GET LBA STATUS. Extents that are
+// not mapped read as zeros.
+typedef enum _IMDPROXY_ALLOCATION_STATE
+{
+    AllocationMapped,       // Data stored in image
+    AllocationZero,         // Space allocated in image, known to read as zeros
+    AllocationUnmapped      // No space allocated in image
+} IMDPROXY_ALLOCATION_STATE, *PIMDPROXY_ALLOCATION_STATE;
+
+// Enables options for rest of connection. Response tells which of the
+// requested options the server enabled.
+typedef struct _IMDPROXY_OPTIONS_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG options;
+} IMDPROXY_OPTIONS_REQ, *PIMDPROXY_OPTIONS_REQ;
+
+typedef struct _IMDPROXY_OPTIONS_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG options;
+} IMDPROXY_OPTIONS_RESP, *PIMDPROXY_OPTIONS_RESP;
+
+// Data in read responses and write requests is preceded by an
+// IMDPROXY_PAYLOAD_HEADER and may be compressed in LZ4 block format.
+#define IMDPROXY_OPTION_COMPRESSION     0x01
+
+typedef struct _IMDPROXY_PAYLOAD_HEADER
+{
+    ULONGLONG stored_length;    // Same as length for uncompressed data
+} IMDPROXY_PAYLOAD_HEADER, *PIMDPROXY_PAYLOAD_HEADER;
+
+// Data in read, sparse read and write payloads is followed by an
+// IMDPROXY_PAYLOAD_TRAILER with CRC-32C (Castagnoli) of the data. The
+// checksum is calculated over uncompressed data, and for sparse reads over
+// all length bytes with zero extents filled in. Write requests with a
+// checksum that does not match are not written and fail with EIO.
+#define IMDPROXY_OPTION_CRC32C          0x02
+
+typedef struct _IMDPROXY_PAYLOAD_TRAILER
+{
+    ULONGLONG crc32c;
+} IMDPROXY_PAYLOAD_TRAILER, *PIMDPROXY_PAYLOAD_TRAILER;
+
+// Read and write requests outstanding on the connection are limited to a
+// window of requests and bytes of data granted by the server. The options
+// response is followed by an IMDPROXY_CREDITS with the initial window, and
+// responses to read and write requests end with one with the window from
+// then on, after any payload trailer. A request larger than the byte window
+// may be sent when nothing else is outstanding. The server lowers the window
+// when requests take long to serve, and may fail requests beyond the largest
+// window with EBUSY without doing any I/O.
+#define IMDPROXY_OPTION_CREDITS         0x04
+
+typedef struct _IMDPROXY_CREDITS
+{
+    ULONGLONG requests;
+    ULONGLONG bytes;
+} IMDPROXY_CREDITS, *PIMDPROXY_CREDITS;
+
 // For shared memory proxy communication only. Offset to data area in
 // shared memory.
 #define IMDPROXY_HEADER_SIZE 4096
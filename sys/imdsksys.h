@@ -451,10 +451,22 @@ VOID
 ImDiskByteSwapBuffer(IN OUT PUCHAR Buffer,
     IN ULONG_PTR Length)
 {
-    PUCHAR ptr;
+    PUCHAR ptr = Buffer;
+
+    // Swap four 16-bit words at a time in a 64-bit register
+    for (;
+        (ULONG_PTR)(ptr - Buffer) + sizeof(ULONGLONG) <= Length;
+        ptr += sizeof(ULONGLONG))
+    {
+        ULONGLONG w = *(ULONGLONG UNALIGNED*)ptr;
+
+        *(ULONGLONG UNALIGNED*)ptr =
+            ((w & 0x00FF00FF00FF00FFULL) << 8) |
+            ((w >> 8) & 0x00FF00FF00FF00FFULL);
+    }
 
-    for (ptr = Buffer;
-    (ULONG_PTR)(ptr - Buffer) < Length;
+    for (;
+        (ULONG_PTR)(ptr - Buffer) + 1 < Length;
         ptr += 2)
     {
         UCHAR b1 = ptr[1];